@@ -0,0 +1,569 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#if HAVE_ALSA
+
+#include <alsa/asoundlib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "audio_backend.h"
+#include "audio_util.h"
+#include "common.h"
+
+/*
+ * Direct ALSA backend using mmap access.
+ *
+ * Captured periods are passed to audio_process() at their address in the
+ * DMA buffer and played periods are written there, so the only copy is the
+ * one into or out of the ring buffer. With a capture stream, capture is the
+ * clock and the playback stream is serviced in the same iteration.
+ *
+ * The argument is <pcm>[/period=<frames>][/periods=<num>][/measure], e.g.
+ * alsa:hw:0,0/period=96/periods=3. The measurement mode prints the achieved
+ * sizes, the delay range of each stream, the longest time between wakeups
+ * and the xrun counts once per second.
+ */
+
+/* Default number of periods in the buffer */
+#define ALSA_PERIODS        4
+
+/* Default period duration */
+#define ALSA_PERIOD_US      5000
+
+/* Timeout while waiting for a period, so that the thread can be stopped */
+#define ALSA_WAIT_MS        100
+
+/* Interval between reports in the measurement mode */
+#define ALSA_REPORT_US      1000000
+
+/**
+ * One direction of the ALSA device.
+ *
+ * @pcm        The PCM handle, NULL if the direction is not used.
+ * @period     Achieved period size in frames.
+ * @buffer     Achieved buffer size in frames.
+ * @xruns      Number of overruns or underruns.
+ * @error      Set after an xrun until the next period is processed.
+ * @delay_min  Smallest delay seen since the last report.
+ * @delay_max  Largest delay seen since the last report.
+ */
+struct alsa_stream {
+    snd_pcm_t      *pcm;
+    snd_pcm_uframes_t period;
+    snd_pcm_uframes_t buffer;
+    uint32_t        xruns;
+    int             error;
+    snd_pcm_sframes_t delay_min;
+    snd_pcm_sframes_t delay_max;
+};
+
+/**
+ * ALSA backend state.
+ *
+ * @in            Capture stream.
+ * @out           Playback stream.
+ * @clock         The stream whose periods drive the thread.
+ * @period        Number of frames processed at a time.
+ * @measure       Print statistics periodically.
+ * @scratch       Output discarded when playback has no room.
+ * @thread        The thread calling audio_process().
+ * @running       Cleared to stop the thread.
+ * @wakeup_us     Time of the last wakeup.
+ * @wakeup_max    Longest time between wakeups since the last report.
+ * @report_us     Time of the last report.
+ */
+struct alsa_data {
+    struct alsa_stream in;
+    struct alsa_stream out;
+    struct alsa_stream *clock;
+    snd_pcm_uframes_t period;
+    int             measure;
+    int16_t        *scratch;
+    pthread_t       thread;
+    _Atomic int     running;
+    uint64_t        wakeup_us;
+    uint64_t        wakeup_max;
+    uint64_t        report_us;
+};
+
+
+/* Open one direction with mmap access and the requested sizes */
+static int open_stream(struct alsa_stream *s, const char *name,
+                       snd_pcm_stream_t dir, unsigned int *rate,
+                       snd_pcm_uframes_t period, unsigned int periods)
+{
+    snd_pcm_hw_params_t *hw;
+    snd_pcm_sw_params_t *sw;
+    const char     *what = dir == SND_PCM_STREAM_CAPTURE ?
+        "capture" : "playback";
+    int             err;
+
+    err = snd_pcm_open(&s->pcm, name, dir, 0);
+    if (err < 0)
+    {
+        fprintf(stderr, "Error opening ALSA %s device %s: %s\n", what,
+                name, snd_strerror(err));
+        s->pcm = NULL;
+        return -1;
+    }
+
+    snd_pcm_hw_params_alloca(&hw);
+    snd_pcm_sw_params_alloca(&sw);
+
+    if ((err = snd_pcm_hw_params_any(s->pcm, hw)) < 0 ||
+        (err = snd_pcm_hw_params_set_access(s->pcm, hw,
+                                            SND_PCM_ACCESS_MMAP_INTERLEAVED))
+        < 0 ||
+        (err = snd_pcm_hw_params_set_format(s->pcm, hw,
+                                            SND_PCM_FORMAT_S16)) < 0 ||
+        (err = snd_pcm_hw_params_set_channels(s->pcm, hw, CHANNELS)) < 0 ||
+        (err = snd_pcm_hw_params_set_rate_near(s->pcm, hw, rate, 0)) < 0 ||
+        (err = snd_pcm_hw_params_set_period_size_near(s->pcm, hw, &period,
+                                                      0)) < 0 ||
+        (err = snd_pcm_hw_params_set_periods_near(s->pcm, hw, &periods,
+                                                  0)) < 0 ||
+        (err = snd_pcm_hw_params(s->pcm, hw)) < 0)
+    {
+        fprintf(stderr, "Error configuring ALSA %s device %s: %s\n", what,
+                name, snd_strerror(err));
+        goto error;
+    }
+
+    snd_pcm_hw_params_get_period_size(hw, &s->period, 0);
+    snd_pcm_hw_params_get_buffer_size(hw, &s->buffer);
+
+    /* wake up once per period; the streams are started explicitly */
+    if ((err = snd_pcm_sw_params_current(s->pcm, sw)) < 0 ||
+        (err = snd_pcm_sw_params_set_avail_min(s->pcm, sw, s->period)) < 0 ||
+        (err = snd_pcm_sw_params_set_start_threshold(s->pcm, sw,
+                                                     s->buffer + 1)) < 0 ||
+        (err = snd_pcm_sw_params(s->pcm, sw)) < 0)
+    {
+        fprintf(stderr, "Error configuring ALSA %s device %s: %s\n", what,
+                name, snd_strerror(err));
+        goto error;
+    }
+
+    fprintf(stderr, "ALSA %s %s: %u Hz, period %lu frames (%.1f ms), "
+            "buffer %lu frames (%.1f ms)\n", what, name, *rate,
+            (unsigned long)s->period, 1.e3 * s->period / *rate,
+            (unsigned long)s->buffer, 1.e3 * s->buffer / *rate);
+
+    return 0;
+
+  error:
+    snd_pcm_close(s->pcm);
+    s->pcm = NULL;
+
+    return -1;
+}
+
+/* Get the address of up to frames contiguous frames at the mmap position */
+static int16_t *mmap_begin(struct alsa_stream *s, snd_pcm_uframes_t * offset,
+                           snd_pcm_uframes_t * frames)
+{
+    const snd_pcm_channel_area_t *areas;
+
+    if (snd_pcm_mmap_begin(s->pcm, &areas, offset, frames) < 0)
+        return NULL;
+
+    return (int16_t *) ((uint8_t *) areas[0].addr +
+                        (areas[0].first + *offset * areas[0].step) / 8);
+}
+
+/* Fill the free part of the playback buffer with silence */
+static void fill_silence(struct alsa_stream *s)
+{
+    snd_pcm_uframes_t offset;
+    snd_pcm_uframes_t frames;
+    snd_pcm_sframes_t avail;
+    int16_t        *data;
+
+    avail = snd_pcm_avail_update(s->pcm);
+    while (avail > 0)
+    {
+        frames = avail;
+        data = mmap_begin(s, &offset, &frames);
+        if (data == NULL || frames == 0)
+            break;
+
+        memset(data, 0, frames * FRAME_SIZE);
+        if (snd_pcm_mmap_commit(s->pcm, offset, frames) < 0)
+            break;
+
+        avail -= frames;
+    }
+}
+
+/* Prepare a stream and start it; playback starts with a full buffer */
+static int start_stream(struct alsa_stream *s)
+{
+    int             err;
+
+    if (s->pcm == NULL)
+        return 0;
+
+    err = snd_pcm_prepare(s->pcm);
+    if (err < 0)
+        return err;
+
+    if (snd_pcm_stream(s->pcm) == SND_PCM_STREAM_PLAYBACK)
+        fill_silence(s);
+
+    return snd_pcm_start(s->pcm);
+}
+
+/* Restart a stream after an xrun or suspend */
+static void recover(struct alsa_stream *s, int err)
+{
+    if (err == -EPIPE)
+        s->xruns++;
+
+    s->error = 1;
+
+    if (snd_pcm_recover(s->pcm, err, 1) < 0 || start_stream(s) < 0)
+        fprintf(stderr, "ALSA: Cannot recover from %s\n", snd_strerror(err));
+}
+
+static void update_delay(struct alsa_stream *s)
+{
+    snd_pcm_sframes_t delay;
+
+    if (s->pcm == NULL || snd_pcm_delay(s->pcm, &delay) < 0)
+        return;
+
+    if (delay < s->delay_min)
+        s->delay_min = delay;
+    if (delay > s->delay_max)
+        s->delay_max = delay;
+}
+
+static void reset_delay(struct alsa_stream *s)
+{
+    s->delay_min = INT32_MAX;
+    s->delay_max = INT32_MIN;
+}
+
+/* Measurement mode: collect statistics and print them once per second */
+static void measure(struct alsa_data *d)
+{
+    uint64_t        now = time_us();
+
+    if (d->wakeup_us && now - d->wakeup_us > d->wakeup_max)
+        d->wakeup_max = now - d->wakeup_us;
+    d->wakeup_us = now;
+
+    update_delay(&d->in);
+    update_delay(&d->out);
+
+    if (now - d->report_us < ALSA_REPORT_US)
+        return;
+
+    fprintf(stderr, "ALSA: period %lu, max wakeup interval %.2f ms",
+            (unsigned long)d->period, 1.e-3 * d->wakeup_max);
+    if (d->in.pcm != NULL)
+        fprintf(stderr, "; capture buffer %lu, delay %ld..%ld, xruns %"
+                PRIu32, (unsigned long)d->in.buffer, (long)d->in.delay_min,
+                (long)d->in.delay_max, d->in.xruns);
+    if (d->out.pcm != NULL)
+        fprintf(stderr, "; playback buffer %lu, delay %ld..%ld, xruns %"
+                PRIu32, (unsigned long)d->out.buffer, (long)d->out.delay_min,
+                (long)d->out.delay_max, d->out.xruns);
+    fprintf(stderr, "\n");
+
+    d->wakeup_max = 0;
+    d->report_us = now;
+    reset_delay(&d->in);
+    reset_delay(&d->out);
+}
+
+/* Process one period in place; returns the number of frames processed */
+static snd_pcm_uframes_t process(audio_t * audio, struct alsa_data *d)
+{
+    snd_pcm_uframes_t frames = d->period;
+    snd_pcm_uframes_t in_offset = 0;
+    snd_pcm_uframes_t out_offset = 0;
+    snd_pcm_sframes_t avail;
+    int16_t        *in = NULL;
+    int16_t        *out = d->scratch;
+    unsigned long   status;
+    int             err;
+
+    avail = snd_pcm_avail_update(d->clock->pcm);
+    if (avail < 0)
+    {
+        recover(d->clock, avail);
+        return 0;
+    }
+    if ((snd_pcm_uframes_t) avail < d->period)
+        return 0;
+
+    if (d->in.pcm != NULL)
+    {
+        in = mmap_begin(&d->in, &in_offset, &frames);
+        if (in == NULL)
+            return 0;
+    }
+
+    if (d->out.pcm != NULL)
+    {
+        avail = snd_pcm_avail_update(d->out.pcm);
+        if (avail < 0)
+            recover(&d->out, avail);
+        else if ((snd_pcm_uframes_t) avail >= frames)
+            out = mmap_begin(&d->out, &out_offset, &frames);
+
+        /* no room to play this period; it is lost */
+        if (out == NULL || out == d->scratch)
+        {
+            out = d->scratch;
+            d->out.error = 1;
+        }
+    }
+
+    status = d->in.error | d->out.error;
+    d->in.error = 0;
+    d->out.error = 0;
+
+    audio_process(audio, in, out, frames, status);
+
+    if (in != NULL &&
+        (err = snd_pcm_mmap_commit(d->in.pcm, in_offset, frames)) < 0)
+        recover(&d->in, err);
+
+    if (out != d->scratch &&
+        (err = snd_pcm_mmap_commit(d->out.pcm, out_offset, frames)) < 0)
+        recover(&d->out, err);
+
+    return frames;
+}
+
+static void    *alsa_thread(void *arg)
+{
+    audio_t        *audio = (audio_t *) arg;
+    struct alsa_data *d = audio->backend_data;
+    int             err;
+
+    while (atomic_load(&d->running))
+    {
+        err = snd_pcm_wait(d->clock->pcm, ALSA_WAIT_MS);
+        if (err < 0)
+        {
+            recover(d->clock, err);
+            continue;
+        }
+        if (err == 0)
+            continue;
+
+        if (d->measure)
+            measure(d);
+
+        while (process(audio, d) > 0)
+            ;
+    }
+
+    return NULL;
+}
+
+/* Parse <pcm>[/period=<frames>][/periods=<num>][/measure] */
+static int parse_arg(struct alsa_data *d, const char *arg, char **name,
+                     snd_pcm_uframes_t * period, unsigned int *periods)
+{
+    char           *copy = strdup(arg);
+    char           *opt;
+    char           *save;
+
+    if (copy == NULL)
+        return -1;
+
+    opt = strtok_r(copy, "/", &save);
+    *name = strdup(opt != NULL && *arg != '/' ? opt : "default");
+    if (opt != NULL && *arg != '/')
+        opt = strtok_r(NULL, "/", &save);
+
+    for (; opt != NULL; opt = strtok_r(NULL, "/", &save))
+    {
+        if (strncmp(opt, "period=", 7) == 0)
+            *period = atoi(opt + 7);
+        else if (strncmp(opt, "periods=", 8) == 0)
+            *periods = atoi(opt + 8);
+        else if (strcmp(opt, "measure") == 0)
+            d->measure = 1;
+        else
+        {
+            fprintf(stderr, "Unknown ALSA option: %s\n", opt);
+            free(copy);
+            free(*name);
+            return -1;
+        }
+    }
+
+    free(copy);
+
+    return *name != NULL ? 0 : -1;
+}
+
+static int alsa_open(audio_t * audio, const char *arg, int index,
+                     uint32_t sample_rate)
+{
+    struct alsa_data *d;
+    snd_pcm_uframes_t period = 0;
+    unsigned int    periods = ALSA_PERIODS;
+    unsigned int    rate;
+    char           *name;
+
+    (void)index;
+
+    d = (struct alsa_data *)calloc(1, sizeof(struct alsa_data));
+    if (d == NULL)
+        return -1;
+
+    if (parse_arg(d, arg, &name, &period, &periods) == -1)
+    {
+        free(d);
+        return -1;
+    }
+
+    rate = sample_rate ? sample_rate : 48000;
+    if (period == 0)
+        period = (uint64_t) rate * ALSA_PERIOD_US / 1000000;
+
+    if ((audio->conf & AUDIO_CONF_INPUT) &&
+        open_stream(&d->in, name, SND_PCM_STREAM_CAPTURE, &rate, period,
+                    periods) == -1)
+        goto error;
+
+    if ((audio->conf & AUDIO_CONF_OUTPUT) &&
+        open_stream(&d->out, name, SND_PCM_STREAM_PLAYBACK, &rate, period,
+                    periods) == -1)
+        goto error;
+
+    /* the callers size Opus frames and RTP timestamps by sample_rate; a
+     * different rate would play at the wrong pitch, so fail like the
+     * PortAudio backend does */
+    if (sample_rate && rate != sample_rate)
+    {
+        fprintf(stderr, "ALSA: %u Hz is not supported (nearest is %u Hz)\n",
+                sample_rate, rate);
+        goto error;
+    }
+
+    d->clock = d->in.pcm != NULL ? &d->in : &d->out;
+    d->period = d->clock->period;
+
+    d->scratch = (int16_t *) calloc(d->period, FRAME_SIZE);
+    if (d->scratch == NULL)
+        goto error;
+
+    free(name);
+    audio->backend_data = d;
+
+    return 0;
+
+  error:
+    if (d->in.pcm != NULL)
+        snd_pcm_close(d->in.pcm);
+    if (d->out.pcm != NULL)
+        snd_pcm_close(d->out.pcm);
+    free(name);
+    free(d);
+
+    return -1;
+}
+
+static int alsa_close(audio_t * audio)
+{
+    struct alsa_data *d = audio->backend_data;
+
+    if (d->in.pcm != NULL)
+        snd_pcm_close(d->in.pcm);
+    if (d->out.pcm != NULL)
+        snd_pcm_close(d->out.pcm);
+
+    free(d->scratch);
+    free(d);
+
+    fprintf(stderr, "Stream closed\n");
+
+    return 0;
+}
+
+static int alsa_start(audio_t * audio)
+{
+    struct alsa_data *d = audio->backend_data;
+    int             err;
+
+    d->in.xruns = 0;
+    d->out.xruns = 0;
+    d->in.error = 0;
+    d->out.error = 0;
+    reset_delay(&d->in);
+    reset_delay(&d->out);
+    d->wakeup_us = 0;
+    d->wakeup_max = 0;
+    d->report_us = time_us();
+
+    if ((err = start_stream(&d->out)) < 0 || (err = start_stream(&d->in)) < 0)
+    {
+        fprintf(stderr, "Error starting ALSA stream: %s\n", snd_strerror(err));
+        return -1;
+    }
+
+    atomic_store(&d->running, 1);
+
+    err = pthread_create(&d->thread, NULL, alsa_thread, audio);
+    if (err)
+    {
+        fprintf(stderr, "Error starting audio thread: %d: %s\n", err,
+                strerror(err));
+        atomic_store(&d->running, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int alsa_stop(audio_t * audio)
+{
+    struct alsa_data *d = audio->backend_data;
+
+    if (!atomic_load(&d->running))
+    {
+        fprintf(stderr, "Audio stream not active\n");
+        return 0;
+    }
+
+    atomic_store(&d->running, 0);
+    pthread_join(d->thread, NULL);
+
+    if (d->in.pcm != NULL)
+        snd_pcm_drop(d->in.pcm);
+    if (d->out.pcm != NULL)
+        snd_pcm_drop(d->out.pcm);
+
+    fprintf(stderr, "Audio stream stopped\n");
+    fprintf(stderr, " ALSA capture xruns:  %" PRIu32 "\n", d->in.xruns);
+    fprintf(stderr, " ALSA playback xruns: %" PRIu32 "\n", d->out.xruns);
+
+    return 0;
+}
+
+const struct audio_backend audio_backend_alsa = {
+    .name = "alsa",
+    .open = alsa_open,
+    .close = alsa_close,
+    .start = alsa_start,
+    .stop = alsa_stop,
+};
+
+#endif /* HAVE_ALSA */
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#ifndef __AUDIO_BACKEND_H__
+#define __AUDIO_BACKEND_H__
+
+#include <stdint.h>
+
+#include "audio_util.h"
+
+/**
+ * @file
+ * Interface between audio_util and the audio backends.
+ *
+ * A backend moves audio between a device and the ring buffers of an
+ * audio_t. Whenever the device has captured or needs a period of frames,
+ * the backend calls audio_process() from its own thread. Everything else,
+ * i.e. buffering, playback threshold, wakeup and statistics, is common to
+ * all backends.
+ */
+
+#define CHANNELS    1
+#define FRAME_SIZE  2 * CHANNELS        /* 2 bytes / sample */
+
+/**
+ * Audio backend operations.
+ *
+ * @name   Name used to select the backend, see audio_open().
+ * @open   Open the device for audio->conf and store private data in
+ *         audio->backend_data. arg is the text after the ':' in the
+ *         backend specification or an empty string. Returns 0 if OK.
+ * @close  Close the device and free the private data. Returns 0 if OK.
+ * @start  Start calling audio_process(). Returns 0 if OK.
+ * @stop   Stop calling audio_process(); it must not be running when this
+ *         returns. Returns 0 if OK.
+ */
+struct audio_backend {
+    const char     *name;
+    int             (*open) (audio_t * audio, const char *arg, int index,
+                             uint32_t sample_rate);
+    int             (*close) (audio_t * audio);
+    int             (*start) (audio_t * audio);
+    int             (*stop) (audio_t * audio);
+};
+
+/* PortAudio devices, see audio_pa.c */
+extern const struct audio_backend audio_backend_pa;
+
+/* Files, pipes and no device at all, see audio_file.c */
+extern const struct audio_backend audio_backend_file;
+extern const struct audio_backend audio_backend_fast;
+extern const struct audio_backend audio_backend_null;
+
+#if HAVE_ALSA
+/* ALSA devices with mmap access, see audio_alsa.c */
+extern const struct audio_backend audio_backend_alsa;
+#endif
+
+/**
+ * Process one period of audio.
+ *
+ * @param  audio      The audio handle.
+ * @param  input      Captured frames, ignored without AUDIO_CONF_INPUT.
+ * @param  output     Buffer for the frames to play, ignored without
+ *                    AUDIO_CONF_OUTPUT.
+ * @param  frame_cnt  Number of frames in the period.
+ * @param  status     Non-zero if the device reported an error for this
+ *                    period, e.g. an xrun.
+ */
+void            audio_process(audio_t * audio, const void *input, void *output,
+                              unsigned long frame_cnt, unsigned long status);
+
+#endif
@@ -23,13 +23,53 @@
 
 #include "audio_util.h"
 #include "common.h"
+#include "jitter_buffer.h"
+#include "resampler.h"
+#include "rtp.h"
+
+#define AUDIO_FRAMES 5760       // allows receiving up to 120 msec frames
+#define AUDIO_BUFLEN 2 * AUDIO_FRAMES   // 120 msec: 48000 * 0.12
+#define DECODE_FRAMES 4 * AUDIO_FRAMES  // room for concealing lost packets
+#define RESAMPLED_FRAMES DECODE_FRAMES + 64     // room for playing slower
+
+/* TCP receive buffer; a backlog of many packets is read with one call */
+#define NET_BUFLEN  65536
+
+/* transmit audio uses short frames to keep the delay low */
+#define TX_FRAME_US     10000
+#define TX_BITRATE      16000
+#define TX_MAX_BYTES    1000
 
 /* application state and config */
 struct app_data {
     uint32_t        sample_rate;        /* audio sample rate */
     int             device_index;       /* audio device index */
+    char           *audio_backend;      /* see audio_open() */
     int             server_port;        /* network port number */
     char           *server_ip;
+    uint32_t        frame_us;   /* requested frame duration; 0 = default */
+    int             use_udp;    /* receive RTP over UDP */
+    int             duplex;     /* send microphone audio while PTT is on */
+};
+
+/**
+ * Receive buffer for the TCP audio stream.
+ *
+ * @data   Received data.
+ * @wridx  End of the received data.
+ * @rdidx  First byte of the next packet.
+ */
+struct net_buf {
+    uint8_t         data[NET_BUFLEN];
+    int             wridx;
+    int             rdidx;
+};
+
+/* decoder statistics */
+struct decode_stats {
+    uint64_t        errors;
+    uint64_t        fec_frames; /* lost frames decoded from FEC data */
+    uint64_t        plc_frames; /* lost frames concealed */
 };
 
 static int      keep_running = 1;       /* set to 0 to exit infinite loop */
@@ -47,10 +87,20 @@ static void help(void)
         "\n Usage: audio_client [options]\n"
         "\n Possible options are:\n\n"
         "  -d <num>    Audio device index (see -l).\n"
+        "  -a <str>    Audio backend: portaudio (default), null, file:<path>\n"
+        "              or fast:<path> (not paced). A WAV or raw file; \"-\"\n"
+        "              is stdin or stdout; <in>,<out> with -x. With ALSA=1\n"
+        "              also alsa:<pcm>[/period=<frames>][/periods=<num>]\n"
+        "              [/measure].\n"
         "  -r <num>    Audio sample rate (default is 48000).\n"
         "  -l          List audio devices.\n"
         "  -s <str>    Server IP (default is 127.0.0.1).\n"
         "  -p <num>    Network port number (default is 42001).\n"
+        "  -f <num>    Request Opus frame duration in ms: 2.5, 5, 10, 20, 40\n"
+        "              or 60 (default is set by the server).\n"
+        "  -U          Receive RTP over UDP instead of TCP.\n"
+        "  -x          Full duplex: send microphone audio while PTT is on.\n"
+        "              The PTT state comes from ic706_client -a.\n"
         "  -h          This help message.\n\n";
 
     fprintf(stderr, "%s", help_string);
@@ -63,7 +113,7 @@ static void parse_options(int argc, char **argv, struct app_data *app)
 
     if (argc > 1)
     {
-        while ((option = getopt(argc, argv, "d:r:ls:p:h")) != -1)
+        while ((option = getopt(argc, argv, "d:a:r:ls:p:f:Uxh")) != -1)
         {
             switch (option)
             {
@@ -71,6 +121,10 @@ static void parse_options(int argc, char **argv, struct app_data *app)
                 app->device_index = atoi(optarg);
                 break;
 
+            case 'a':
+                app->audio_backend = strdup(optarg);
+                break;
+
             case 'r':
                 app->sample_rate = (uint32_t) atof(optarg);
                 break;
@@ -87,6 +141,24 @@ static void parse_options(int argc, char **argv, struct app_data *app)
                 app->server_port = atoi(optarg);
                 break;
 
+            case 'f':
+                app->frame_us = (uint32_t) (1000.0 * atof(optarg));
+                if (!audio_frame_valid(app->frame_us))
+                {
+                    fprintf(stderr, "Invalid frame duration: %s ms\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'U':
+                app->use_udp = 1;
+                break;
+
+            case 'x':
+                app->duplex = 1;
+                break;
+
             case 'h':
                 help();
                 exit(EXIT_SUCCESS);
@@ -99,10 +171,306 @@ static void parse_options(int argc, char **argv, struct app_data *app)
     }
 }
 
+/*
+ * Read as much of the stream as is available. The partial packet left over
+ * from the previous read is moved to the start of the buffer first; it is
+ * shorter than the buffer since a packet is at most 8191 bytes.
+ */
+static int read_stream(int fd, struct net_buf *buf)
+{
+    int             num;
+
+    buf->wridx -= buf->rdidx;
+    if (buf->wridx > 0 && buf->rdidx > 0)
+        memmove(buf->data, &buf->data[buf->rdidx], buf->wridx);
+    buf->rdidx = 0;
+
+    num = read(fd, &buf->data[buf->wridx], NET_BUFLEN - buf->wridx);
+    if (num > 0)
+        buf->wridx += num;
+
+    return num;
+}
+
+/*
+ * Get the next complete packet from the stream. Returns its length
+ * including the 2 byte header, 0 if the rest of it has not been received
+ * yet, or -1 if the stream is out of sync.
+ */
+static int next_audio_packet(struct net_buf *buf, uint8_t ** pkt)
+{
+    uint8_t        *data = &buf->data[buf->rdidx];
+    int             avail = buf->wridx - buf->rdidx;
+    int             len;
+
+    if (avail < 2)
+        return 0;
+
+    len = data[0] + ((data[1] & 0x1F) << 8);
+    if ((data[1] & 0xE0) != 0x80 || len < 2)
+        return -1;
+
+    if (avail < len)
+        return 0;
+
+    *pkt = data;
+    buf->rdidx += len;
+
+    return len;
+}
+
+/* Add frames of silence to the playback buffer */
+static void play_silence(audio_t * audio, uint32_t frames)
+{
+    uint8_t        *pcm;
+    uint32_t        space;
+
+    while (frames > 0)
+    {
+        pcm = audio_write_peek(audio, &space);
+        if (space == 0)
+            return;
+
+        if (space > frames)
+            space = frames;
+
+        memset(pcm, 0, 2 * space);
+        audio_write_commit(audio, space);
+        frames -= space;
+    }
+}
+
+/*
+ * Decode a packet into the playback buffer. The packets lost just before it
+ * are decoded first: the last one from the FEC data in this packet, the
+ * others by packet loss concealment. The decoder also falls back to
+ * concealment when the packet has no FEC data.
+ *
+ * The audio is then resampled to the speed set by the jitter buffer, which
+ * compensates for clock drift and removes excess delay.
+ *
+ * If the server has not sent anything during silence before this packet,
+ * gap is the length of the silence in frames or JITTER_GAP_UNKNOWN.
+ *
+ * Returns the number of frames played or a negative opus error code.
+ */
+static int decode_packet(audio_t * audio, OpusDecoder * decoder,
+                         struct jitter_buffer *jb, struct resampler *rs,
+                         const uint8_t * data, int len, int lost,
+                         uint32_t gap, struct decode_stats *stats)
+{
+    static opus_int16 decoded[DECODE_FRAMES];
+    static int16_t  resampled[RESAMPLED_FRAMES];
+    int16_t        *pcm;
+    uint32_t        space;
+    uint32_t        level;
+    uint32_t        drop;
+    double          speed;
+    int             samples;
+    int             total = 0;
+    int             num;
+
+    samples = opus_decoder_get_nb_samples(decoder, data, len);
+    if (samples <= 0 || samples > AUDIO_FRAMES)
+        samples = AUDIO_FRAMES;
+
+    /* longer dropouts are left to the jitter buffer */
+    if (lost > DECODE_FRAMES / samples - 1)
+        lost = DECODE_FRAMES / samples - 1;
+
+    for (; lost > 0; lost--)
+    {
+        if (lost == 1)
+        {
+            num = opus_decode(decoder, data, len, &decoded[total], samples,
+                              1);
+            stats->fec_frames += num > 0 ? num : 0;
+        }
+        else
+        {
+            num = opus_decode(decoder, NULL, 0, &decoded[total], samples, 0);
+            stats->plc_frames += num > 0 ? num : 0;
+        }
+
+        if (num < 0)
+            goto error;
+
+        total += num;
+    }
+
+    num = opus_decode(decoder, data, len, &decoded[total],
+                      DECODE_FRAMES - total < AUDIO_FRAMES ?
+                      DECODE_FRAMES - total : AUDIO_FRAMES, 0);
+    if (num < 0)
+        goto error;
+
+    total += num;
+
+    /* start the talkspurt with the usual delay */
+    if (gap)
+        play_silence(audio, jitter_gap(jb, gap, total,
+                                       audio_frames_queued(audio),
+                                       audio->underflows));
+
+    level = audio_frames_queued(audio);
+
+    /* adapt the playout delay to the network jitter and the clock drift */
+    drop = jitter_arrival(jb, time_us(), total, level, audio->underflows);
+    speed = jitter_speed(jb, total, drop);
+    audio_set_threshold(audio, jb->target);
+
+    /* resample directly into the ring buffer if the output fits there */
+    pcm = (int16_t *) audio_write_peek(audio, &space);
+    if (space < total / speed + 2)
+    {
+        pcm = resampled;
+        space = RESAMPLED_FRAMES;
+    }
+
+    num = resampler_process(rs, decoded, total, pcm, space, speed);
+
+    if (pcm == resampled)
+        audio_write_frames(audio, (uint8_t *) resampled, num);
+    else
+        audio_write_commit(audio, num);
+
+    return num;
+
+  error:
+    stats->errors++;
+    fprintf(stderr, "Decoder error: %d (%s)\n", num, opus_strerror(num));
+
+    return num;
+}
+
+/*
+ * Send an RTCP receiver report to the server. It is preceded by the frame
+ * duration request so that a restarted server gets it again.
+ */
+static void send_report(int fd, struct rtp_receiver *rx, uint32_t ssrc,
+                        uint32_t frame_us)
+{
+    uint8_t         report[RTCP_RR_LEN];
+
+    /* errors are expected while the server is down */
+    if (frame_us)
+        send_audio_frame(fd, frame_us);
+
+    rtcp_write_rr(rx, ssrc, report);
+    if (write(fd, report, RTCP_RR_LEN) < 0 && errno != ECONNREFUSED)
+        fprintf(stderr, "Error sending receiver report: %d: %s\n", errno,
+                strerror(errno));
+}
+
+/* Open the local socket that receives PTT packets from ic706_client */
+static int open_ptt_socket(void)
+{
+    struct sockaddr_in addr;
+    int             fd;
+
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error creating socket: %d: %s\n", errno,
+                strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(DEFAULT_PTT_PORT);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        fprintf(stderr, "bind() error: %d: %s\n", errno, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Update the PTT state from the packets received from ic706_client */
+static void read_ptt(int fd, int *ptt)
+{
+    uint8_t         pkt[16];
+    ssize_t         num;
+
+    while ((num = recv(fd, pkt, sizeof(pkt), 0)) > 0)
+    {
+        if (num == 4 && pkt[0] == 0xFE && pkt[1] == PKT_TYPE_PTT &&
+            pkt[3] == 0xFD)
+            *ptt = pkt[2] != 0;
+    }
+}
+
+/*
+ * Encode and send the captured microphone audio. Over TCP the packets have
+ * the same 2 byte header as the audio we receive; over UDP they are RTP
+ * packets. Returns the number of encoded bytes sent.
+ */
+static uint64_t send_mic_audio(audio_t * audio, OpusEncoder * encoder,
+                               struct rtp_sender *tx, int fd, int use_udp,
+                               uint32_t frame_size)
+{
+    static opus_int16 buffer[AUDIO_FRAMES];
+    uint8_t         packet[RTP_HDR_LEN + TX_MAX_BYTES];
+    uint8_t        *start;
+    uint8_t        *pcm;
+    uint32_t        avail;
+    uint64_t        sent = 0;
+    int             len;
+
+    while (audio_frames_available(audio) >= frame_size)
+    {
+        /* encode directly from the ring buffer unless the frames wrap */
+        pcm = audio_read_peek(audio, &avail);
+        if (avail < frame_size)
+        {
+            audio_read_frames(audio, (uint8_t *) buffer, frame_size);
+            pcm = (uint8_t *) buffer;
+            avail = 0;
+        }
+
+        len = opus_encode(encoder, (opus_int16 *) pcm, frame_size,
+                          &packet[RTP_HDR_LEN], TX_MAX_BYTES);
+        if (avail)
+            audio_read_commit(audio, frame_size);
+
+        if (len <= 0)
+        {
+            fprintf(stderr, "Encoder error: %d (%s)\n", len,
+                    opus_strerror(len));
+            continue;
+        }
+
+        sent += len;
+
+        if (use_udp)
+        {
+            start = packet;
+            len += rtp_write_header(tx, packet, frame_size);
+        }
+        else
+        {
+            len += 2;
+            start = &packet[RTP_HDR_LEN - 2];
+            start[0] = (uint8_t) (len & 0xFF);
+            start[1] = (uint8_t) (0x80 | ((len >> 8) & 0x1F));
+        }
+
+        if (write(fd, start, len) < 0 && errno != ECONNREFUSED)
+            fprintf(stderr, "Error sending audio: %d: %s\n", errno,
+                    strerror(errno));
+    }
+
+    return sent;
+}
+
 int main(int argc, char **argv)
 {
     struct sockaddr_in serv_addr;
-    struct pollfd   poll_fds[1];
+    struct pollfd   poll_fds[2];
     int             exit_code = EXIT_FAILURE;
     int             net_fd = -1;
     int             connected = 0;
@@ -110,17 +478,41 @@ int main(int argc, char **argv)
 
     audio_t        *audio;
     OpusDecoder    *decoder;
+    struct jitter_buffer jb;
+    struct resampler rs;
     uint64_t        encoded_bytes = 0;
-    uint64_t        decoder_errors = 0;
+    struct decode_stats stats = { 0, 0, 0 };
     int             error;
 
+    /* transmit audio */
+    OpusEncoder    *encoder = NULL;
+    struct rtp_sender tx;
+    uint32_t        tx_frame_size;
+    uint64_t        tx_bytes = 0;
+    int             ptt_fd = -1;
+    int             ptt = 0;
+    int             was_ptt = 0;
+
+    struct rtp_receiver rx;
+    uint32_t        ssrc = (uint32_t) time_us() ^ getpid();
+    uint64_t        last_report = 0;
+    uint32_t        next_ts = 0;        /* expected RTP timestamp */
+    int             have_ts = 0;
+    int             silence = 0;        /* TCP server sends nothing */
+    static struct net_buf net_buf;
+
     struct app_data app = {
         .sample_rate = 48000,
         .device_index = -1,
+        .audio_backend = NULL,
         .server_port = DEFAULT_AUDIO_PORT,
+        .frame_us = 0,
+        .use_udp = 0,
+        .duplex = 0,
     };
 
     parse_options(argc, argv, &app);
+    tx_frame_size = app.sample_rate * TX_FRAME_US / 1000000;
     if (app.server_ip == NULL)
         app.server_ip = strdup("127.0.0.1");
 
@@ -128,7 +520,8 @@ int main(int argc, char **argv)
     fprintf(stderr, "using server port %d\n", app.server_port);
 
     /* initialize audio subsystem */
-    audio = audio_init(app.device_index, app.sample_rate, AUDIO_CONF_OUTPUT);
+    audio = audio_open(app.audio_backend, app.device_index, app.sample_rate,
+                       app.duplex ? AUDIO_CONF_DUPLEX : AUDIO_CONF_OUTPUT);
     if (audio == NULL)
         exit(EXIT_FAILURE);
 
@@ -141,6 +534,34 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
+    jitter_init(&jb, app.sample_rate);
+    resampler_init(&rs);
+    rtp_receiver_init(&rx);
+
+    if (app.duplex)
+    {
+        encoder = opus_encoder_create(app.sample_rate, 1,
+                                      OPUS_APPLICATION_VOIP, &error);
+        if (error != OPUS_OK)
+        {
+            fprintf(stderr, "Error creating opus encoder: %d (%s)\n",
+                    error, opus_strerror(error));
+            goto cleanup;
+        }
+
+        opus_encoder_ctl(encoder,
+                         OPUS_SET_MAX_BANDWIDTH(OPUS_BANDWIDTH_WIDEBAND));
+        opus_encoder_ctl(encoder, OPUS_SET_BITRATE(TX_BITRATE));
+        rtp_sender_init(&tx, app.sample_rate);
+
+        ptt_fd = open_ptt_socket();
+        if (ptt_fd == -1)
+            goto cleanup;
+    }
+
+    poll_fds[1].fd = ptt_fd;
+    poll_fds[1].events = POLLIN;
+
     /* setup signal handler */
     if (signal(SIGINT, signal_handler) == SIG_ERR)
         printf("Warning: Can't catch SIGINT\n");
@@ -159,33 +580,48 @@ int main(int argc, char **argv)
 
     while (keep_running)
     {
-        if (net_fd == -1)
+        if (app.use_udp)
         {
-            net_fd = socket(AF_INET, SOCK_STREAM, 0);
+            /* the server starts sending when it gets the first report */
+            net_fd = create_udp_socket(0, &serv_addr);
             if (net_fd == -1)
-            {
-                fprintf(stderr, "Error creating socket: %d: %s\n", errno,
-                        strerror(errno));
                 goto cleanup;
-            }
-        }
 
-        /* Try to connect to server */
-        if (connect(net_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr))
-            == -1)
+            rtp_receiver_init(&rx);
+            last_report = 0;
+            have_ts = 0;
+        }
+        else
         {
-            fprintf(stderr, "Connect error %d: %s\n", errno, strerror(errno));
-
-            /* These errors may be temporary; try again */
-            if (errno == ECONNREFUSED || errno == ENETUNREACH ||
-                errno == ETIMEDOUT)
+            if (net_fd == -1)
             {
-                sleep(1);
-                continue;
+                net_fd = socket(AF_INET, SOCK_STREAM, 0);
+                if (net_fd == -1)
+                {
+                    fprintf(stderr, "Error creating socket: %d: %s\n",
+                            errno, strerror(errno));
+                    goto cleanup;
+                }
             }
-            else
+
+            /* Try to connect to server */
+            if (connect(net_fd, (struct sockaddr *)&serv_addr,
+                        sizeof(serv_addr)) == -1)
             {
-                goto cleanup;
+                fprintf(stderr, "Connect error %d: %s\n", errno,
+                        strerror(errno));
+
+                /* These errors may be temporary; try again */
+                if (errno == ECONNREFUSED || errno == ENETUNREACH ||
+                    errno == ETIMEDOUT)
+                {
+                    sleep(1);
+                    continue;
+                }
+                else
+                {
+                    goto cleanup;
+                }
             }
         }
 
@@ -194,81 +630,172 @@ int main(int argc, char **argv)
         connected = 1;
         fprintf(stderr, "Connected...\n");
 
+        if (!app.use_udp && app.frame_us &&
+            send_audio_frame(net_fd, app.frame_us))
+            fprintf(stderr, "Error requesting frame duration: %d: %s\n",
+                    errno, strerror(errno));
+
         /* start audio system */
+        jitter_init(&jb, app.sample_rate);
+        resampler_init(&rs);
+        silence = 0;
+        net_buf.wridx = 0;
+        net_buf.rdidx = 0;
+        audio_set_threshold(audio, jb.target);
         audio_start(audio);
 
         while (keep_running && connected)
         {
-            res = poll(poll_fds, 1, 500);
+            /* the reports also keep the RTP stream alive */
+            if (app.use_udp && time_ms() - last_report >= RTCP_INTERVAL_MS)
+            {
+                send_report(net_fd, &rx, ssrc, app.frame_us);
+                last_report = time_ms();
+            }
+
+            /* microphone audio is only sent while PTT is on */
+            if (ptt)
+                tx_bytes += send_mic_audio(audio, encoder, &tx, net_fd,
+                                           app.use_udp, tx_frame_size);
+            else if (app.duplex)
+                audio_read_commit(audio, audio_frames_available(audio));
+
+            res = poll(poll_fds, 2, ptt ? TX_FRAME_US / 1000 : 500);
 
             if (res <= 0)
                 continue;
 
-            /* service network socket */
-            if (poll_fds[0].revents & POLLIN)
+            if (poll_fds[1].revents & POLLIN)
             {
+                read_ptt(ptt_fd, &ptt);
 
-#define AUDIO_FRAMES 5760       // allows receiving up to 120 msec frames
-#define AUDIO_BUFLEN 2 * AUDIO_FRAMES   // 120 msec: 48000 * 0.12
-                uint8_t         buffer1[AUDIO_BUFLEN];
-                uint8_t         buffer2[AUDIO_BUFLEN * 2];
-                uint16_t        length;
+                /* start with fresh audio and encoder state */
+                if (ptt && !was_ptt)
+                {
+                    audio_read_commit(audio, audio_frames_available(audio));
+                    opus_encoder_ctl(encoder, OPUS_RESET_STATE);
+                }
+
+                if (ptt != was_ptt)
+                    fprintf(stderr, "PTT %s\n", ptt ? "on" : "off");
+
+                was_ptt = ptt;
+            }
 
+            /* service RTP socket; a report sent while the server is down
+             * leaves an ICMP error that keeps POLLERR set until recv()
+             * returns it */
+            if (app.use_udp && (poll_fds[0].revents & (POLLIN | POLLERR)))
+            {
+                uint8_t         dgram[RTP_HDR_LEN + AUDIO_BUFLEN];
+                struct rtp_header hdr;
+                int32_t         skipped;
+                uint32_t        gap;
+                int             samples;
+                int             lost;
                 int             num;
 
-                /* read 2 byte header */
-                num = read(net_fd, buffer1, 2);
-                if (num != 2)
+                while ((num = recv(net_fd, dgram, sizeof(dgram), 0)) > 0 ||
+                       (num == -1 && errno == ECONNREFUSED))
                 {
-                    /* unrecovarable error; disconnect */
-                    fprintf(stderr, "Error reading packet header: %d\n", num);
-                    close(net_fd);
-                    net_fd = -1;
-                    connected = 0;
-                    poll_fds[0].fd = -1;
-                    audio_stop(audio);
+                    if (num == -1)
+                        continue;
 
-                    num = opus_decode(decoder, NULL, 0, (opus_int16 *) buffer2,
-                                      AUDIO_FRAMES, 0);
+                    if (rtp_parse(dgram, num, &hdr) || hdr.pt != RTP_PT_OPUS)
+                        continue;
 
-                    continue;
+                    /* a new stream, e.g. after a server restart */
+                    if (rx.have_seq && hdr.ssrc != rx.ssrc)
+                    {
+                        fprintf(stderr, "New RTP stream\n");
+                        opus_decoder_ctl(decoder, OPUS_RESET_STATE);
+                        jitter_init(&jb, app.sample_rate);
+                        resampler_init(&rs);
+                        have_ts = 0;
+                    }
+
+                    /* late and duplicate packets are dropped */
+                    lost = rtp_receive(&rx, &hdr);
+                    if (lost < 0)
+                        continue;
+
+                    /* the marker bit follows silence that was not sent;
+                     * the timestamp tells how long it was */
+                    samples = opus_packet_get_nb_samples(hdr.payload,
+                                                         hdr.payload_len,
+                                                         RTP_CLOCK_RATE);
+                    gap = 0;
+                    if (hdr.marker && have_ts && samples > 0)
+                    {
+                        skipped = (int32_t) (hdr.timestamp - next_ts) -
+                            lost * samples;
+                        if (skipped > 0)
+                            gap = (uint64_t) skipped * app.sample_rate /
+                                RTP_CLOCK_RATE;
+                    }
+
+                    next_ts = hdr.timestamp + (samples > 0 ? samples : 0);
+                    have_ts = 1;
+
+                    encoded_bytes += hdr.payload_len;
+                    decode_packet(audio, decoder, &jb, &rs, hdr.payload,
+                                  hdr.payload_len, lost, gap, &stats);
                 }
+            }
 
-                length = buffer1[0] + ((buffer1[1] & 0x1F) << 8);
-                length -= 2;
-                num = read(net_fd, buffer1, length);
+            /* service network socket */
+            else if (poll_fds[0].revents & POLLIN)
+            {
+                uint8_t        *pkt;
+                int             num;
 
-                if (num == length)
-                {
-                    encoded_bytes += num;
-                    num = opus_decode(decoder, buffer1, num,
-                                      (opus_int16 *) buffer2, AUDIO_FRAMES, 0);
+                num = read_stream(net_fd, &net_buf);
+                if (num == -1 && (errno == EINTR || errno == EAGAIN))
+                    continue;
 
-                    if (num > 0)
-                    {
-                        audio_write_frames(audio, buffer2, num);
-                    }
-                    else
+                if (num > 0)
+                {
+                    /* decode every complete packet; a partial one is
+                     * completed by the next read */
+                    while ((num = next_audio_packet(&net_buf, &pkt)) > 0)
                     {
-                        decoder_errors++;
-                        fprintf(stderr, "Decoder error: %d (%s)\n", num,
-                                opus_strerror(num));
+                        /* an empty packet means that nothing is sent during
+                         * the following silence */
+                        if (num == 2)
+                        {
+                            silence = 1;
+                            continue;
+                        }
+
+                        encoded_bytes += num - 2;
+                        decode_packet(audio, decoder, &jb, &rs, &pkt[2],
+                                      num - 2, 0,
+                                      silence ? JITTER_GAP_UNKNOWN : 0,
+                                      &stats);
+                        silence = 0;
                     }
+
+                    if (num == 0)
+                        continue;
+
+                    fprintf(stderr, "Invalid packet header\n");
                 }
                 else if (num == 0)
                 {
                     fprintf(stderr, "Connection closed (FD=%d)\n", net_fd);
-                    close(net_fd);
-                    net_fd = -1;
-                    connected = 0;
-                    poll_fds[0].fd = -1;
-                    audio_stop(audio);
                 }
                 else
                 {
-                    fprintf(stderr, "Error reading from net: %d / \n", num);
+                    fprintf(stderr, "Error reading from net: %d: %s\n",
+                            errno, strerror(errno));
                 }
 
+                /* unrecoverable error; disconnect */
+                close(net_fd);
+                net_fd = -1;
+                connected = 0;
+                poll_fds[0].fd = -1;
+                audio_stop(audio);
             }
         }
     }
@@ -278,15 +805,31 @@ int main(int argc, char **argv)
 
   cleanup:
     close(net_fd);
+    close(ptt_fd);
     if (app.server_ip != NULL)
         free(app.server_ip);
+    if (app.audio_backend != NULL)
+        free(app.audio_backend);
 
     audio_stop(audio);
     audio_close(audio);
     opus_decoder_destroy(decoder);
+    if (encoder != NULL)
+        opus_encoder_destroy(encoder);
 
     fprintf(stderr, "  Encoded bytes in: %" PRIu64 "\n", encoded_bytes);
-    fprintf(stderr, "  Decoder errors  : %" PRIu64 "\n", decoder_errors);
+    fprintf(stderr, "  Decoder errors  : %" PRIu64 "\n", stats.errors);
+    if (app.duplex)
+        fprintf(stderr, "  Encoded bytes out: %" PRIu64 "\n", tx_bytes);
+    if (app.use_udp)
+    {
+        fprintf(stderr, "  Packets received: %" PRIu32 "\n", rx.received);
+        fprintf(stderr, "  Packets lost    : %" PRIu32 " (%" PRIu32
+                " late)\n", rtp_lost(&rx), rx.late);
+        fprintf(stderr, "  Frames FEC / PLC: %" PRIu64 " / %" PRIu64 "\n",
+                stats.fec_frames, stats.plc_frames);
+    }
+    jitter_print(stderr, &jb);
 
     exit(exit_code);
 }
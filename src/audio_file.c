@@ -0,0 +1,467 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "audio_backend.h"
+#include "audio_util.h"
+#include "common.h"
+#include "wav.h"
+
+/*
+ * Audio from and to files instead of a sound card.
+ *
+ * A thread processes one period of frames on each tick of a timerfd, so
+ * the rest of the application sees the same timing as with a device. In
+ * the free-running mode the thread instead processes a period whenever
+ * the capture buffer has room for it (input) or the playback buffer can
+ * fill it (output only), which measures how fast the application can
+ * produce or consume audio.
+ *
+ * Samples are 16 bit mono in host byte order, see wav.h.
+ */
+
+/* Period between ticks */
+#define FILE_PERIOD_MS      10
+
+/* Sleep while the free-running mode waits for the application */
+#define FAST_POLL_US        200
+
+/**
+ * File backend state.
+ *
+ * @in           Source file or NULL for silence.
+ * @out          Sink file or NULL to discard the output.
+ * @in_start     File offset of the first sample, -1 for a pipe.
+ * @in_len       Number of sample bytes in the file, -1 to read to the end.
+ * @in_left      Number of sample bytes left until the end of the data.
+ * @out_wav      Write a WAV header to out.
+ * @out_bytes    Number of sample bytes written to out.
+ * @fast         Free-running instead of real time.
+ * @sample_rate  Sample rate.
+ * @period       Number of frames per tick.
+ * @timer_fd     The timerfd pacing the thread.
+ * @thread       The thread calling audio_process().
+ * @running      Cleared to stop the thread.
+ * @in_buf       Frames read from in.
+ * @out_buf      Frames to write to out.
+ */
+struct file_data {
+    FILE           *in;
+    FILE           *out;
+    long            in_start;
+    long            in_len;
+    long            in_left;
+    int             out_wav;
+    uint32_t        out_bytes;
+    int             fast;
+    uint32_t        sample_rate;
+    uint32_t        period;
+    int             timer_fd;
+    pthread_t       thread;
+    _Atomic int     running;
+    int16_t        *in_buf;
+    int16_t        *out_buf;
+};
+
+
+/* Open a file for input or output; "-" is stdin or stdout */
+static FILE *open_file(const char *path, int output)
+{
+    FILE           *fp;
+
+    if (strcmp(path, "-") == 0)
+        return output ? stdout : stdin;
+
+    fp = fopen(path, output ? "wb" : "rb");
+    if (fp == NULL)
+        fprintf(stderr, "Error opening %s: %d: %s\n", path, errno,
+                strerror(errno));
+
+    return fp;
+}
+
+static void close_file(FILE * fp)
+{
+    if (fp == NULL)
+        return;
+
+    if (fp == stdin || fp == stdout)
+        fflush(fp);
+    else
+        fclose(fp);
+}
+
+/* Read frames up to the end of the data */
+static size_t read_frames(struct file_data *f, int16_t * buf, size_t frames)
+{
+    size_t          num;
+
+    if (f->in_left >= 0 && frames > (size_t) f->in_left / FRAME_SIZE)
+        frames = f->in_left / FRAME_SIZE;
+
+    num = fread(buf, FRAME_SIZE, frames, f->in);
+    if (f->in_left >= 0)
+        f->in_left -= num * FRAME_SIZE;
+
+    return num;
+}
+
+/* Read a period of input, looping at the end of a file */
+static void read_input(struct file_data *f)
+{
+    size_t          num = 0;
+
+    if (f->in != NULL)
+    {
+        num = read_frames(f, f->in_buf, f->period);
+        if (num < f->period && f->in_start >= 0 &&
+            fseek(f->in, f->in_start, SEEK_SET) == 0)
+        {
+            f->in_left = f->in_len;
+            num += read_frames(f, f->in_buf + num, f->period - num);
+        }
+    }
+
+    /* silence after the end of a pipe */
+    memset(f->in_buf + num, 0, (f->period - num) * FRAME_SIZE);
+}
+
+static void run_period(audio_t * audio, struct file_data *f)
+{
+    size_t          num;
+
+    if (audio->conf & AUDIO_CONF_INPUT)
+        read_input(f);
+
+    audio_process(audio, f->in_buf, f->out_buf, f->period, 0);
+
+    if ((audio->conf & AUDIO_CONF_OUTPUT) && f->out != NULL)
+    {
+        num = fwrite(f->out_buf, FRAME_SIZE, f->period, f->out);
+        f->out_bytes += num * FRAME_SIZE;
+        if (num < f->period)
+            audio->status_errors++;
+    }
+}
+
+/* Check whether the free-running mode can process the next period */
+static int fast_ready(audio_t * audio, struct file_data *f)
+{
+    uint32_t        needed = f->period * FRAME_SIZE;
+    uint32_t        queued;
+
+    /* input drives the timing if there is any */
+    if (audio->rb_in != NULL)
+        return ring_buffer_size(audio->rb_in) -
+            ring_buffer_count(audio->rb_in) >= needed;
+
+    queued = ring_buffer_count(audio->rb_out);
+    if (audio->player_state == AUDIO_STATE_BUFFERING)
+        needed += atomic_load_explicit(&audio->threshold,
+                                       memory_order_relaxed) * FRAME_SIZE;
+
+    return queued >= needed;
+}
+
+static void    *file_thread(void *arg)
+{
+    audio_t        *audio = (audio_t *) arg;
+    struct file_data *f = audio->backend_data;
+    uint64_t        ticks;
+
+    while (atomic_load(&f->running))
+    {
+        if (f->fast)
+        {
+            if (!fast_ready(audio, f))
+            {
+                usleep(FAST_POLL_US);
+                continue;
+            }
+            ticks = 1;
+        }
+        else
+        {
+            /* catch up if the thread has been delayed */
+            ticks = evtimer_read(f->timer_fd);
+        }
+
+        while (ticks--)
+            run_period(audio, f);
+    }
+
+    return NULL;
+}
+
+/* Open the files named in arg: <path> or <in>,<out> in duplex mode */
+static int open_files(audio_t * audio, struct file_data *f, const char *arg,
+                      uint32_t * sample_rate)
+{
+    char           *paths = strdup(arg);
+    char           *in_path = NULL;
+    char           *out_path = NULL;
+    char           *sep;
+    uint32_t        rate = 0;
+    int             res = -1;
+
+    if (paths == NULL)
+        return -1;
+
+    sep = strchr(paths, ',');
+    if (sep != NULL)
+        *sep++ = '\0';
+
+    if (audio->conf == AUDIO_CONF_DUPLEX)
+    {
+        in_path = paths;
+        out_path = sep;
+    }
+    else if (audio->conf == AUDIO_CONF_INPUT)
+    {
+        in_path = paths;
+    }
+    else
+    {
+        out_path = paths;
+    }
+
+    if (in_path != NULL && *in_path != '\0')
+    {
+        f->in = open_file(in_path, 0);
+        if (f->in == NULL)
+            goto cleanup;
+
+        if (wav_path(in_path) &&
+            wav_read_header(f->in, in_path, &rate, &f->in_len) == -1)
+            goto cleanup;
+
+        if (*sample_rate == 0)
+            *sample_rate = rate;
+        else if (rate != 0 && rate != *sample_rate)
+            fprintf(stderr, "%s: %u Hz file played at %u Hz\n", in_path,
+                    rate, *sample_rate);
+
+        f->in_start = ftell(f->in);
+        f->in_left = f->in_len;
+        fprintf(stderr, "Audio input: %s\n", in_path);
+    }
+
+    if (*sample_rate == 0)
+        *sample_rate = 48000;
+
+    if (out_path != NULL && *out_path != '\0')
+    {
+        f->out = open_file(out_path, 1);
+        if (f->out == NULL)
+            goto cleanup;
+
+        f->out_wav = wav_path(out_path);
+        if (f->out_wav && wav_write_header(f->out, *sample_rate, 0) == -1)
+        {
+            fprintf(stderr, "Error writing %s\n", out_path);
+            goto cleanup;
+        }
+
+        fprintf(stderr, "Audio output: %s\n", out_path);
+    }
+
+    res = 0;
+
+  cleanup:
+    free(paths);
+
+    return res;
+}
+
+static int open_backend(audio_t * audio, const char *arg,
+                        uint32_t sample_rate, int fast)
+{
+    struct file_data *f;
+
+    f = (struct file_data *)calloc(1, sizeof(struct file_data));
+    if (f == NULL)
+        return -1;
+
+    f->in_start = -1;
+    f->in_len = -1;
+    f->in_left = -1;
+    f->fast = fast;
+    f->timer_fd = -1;
+
+    if (open_files(audio, f, arg, &sample_rate) == -1)
+        goto error;
+
+    f->sample_rate = sample_rate;
+    f->period = sample_rate * FILE_PERIOD_MS / 1000;
+    fprintf(stderr, "Sample rate: %u, %u frames per period%s\n",
+            sample_rate, f->period, fast ? ", free-running" : "");
+
+    f->in_buf = (int16_t *) calloc(f->period, FRAME_SIZE);
+    f->out_buf = (int16_t *) calloc(f->period, FRAME_SIZE);
+    if (f->in_buf == NULL || f->out_buf == NULL)
+        goto error;
+
+    if (!fast)
+    {
+        /* blocking; the thread sleeps in read() */
+        f->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (f->timer_fd == -1)
+        {
+            fprintf(stderr, "Error creating timer: %d: %s\n", errno,
+                    strerror(errno));
+            goto error;
+        }
+    }
+
+    audio->backend_data = f;
+
+    return 0;
+
+  error:
+    close_file(f->in);
+    close_file(f->out);
+    free(f->in_buf);
+    free(f->out_buf);
+    free(f);
+
+    return -1;
+}
+
+static int file_open(audio_t * audio, const char *arg, int index,
+                     uint32_t sample_rate)
+{
+    (void)index;
+
+    return open_backend(audio, arg, sample_rate, 0);
+}
+
+static int fast_open(audio_t * audio, const char *arg, int index,
+                     uint32_t sample_rate)
+{
+    (void)index;
+
+    return open_backend(audio, arg, sample_rate, 1);
+}
+
+static int null_open(audio_t * audio, const char *arg, int index,
+                     uint32_t sample_rate)
+{
+    (void)arg;
+    (void)index;
+
+    return open_backend(audio, "", sample_rate, 0);
+}
+
+static int file_close(audio_t * audio)
+{
+    struct file_data *f = audio->backend_data;
+    int             error = 0;
+
+    /* fill in the lengths unless the output is a pipe */
+    if (f->out != NULL && f->out_wav && fseek(f->out, 0, SEEK_SET) == 0)
+        error = wav_write_header(f->out, f->sample_rate, f->out_bytes);
+
+    close_file(f->in);
+    close_file(f->out);
+
+    if (f->timer_fd != -1)
+        close(f->timer_fd);
+
+    free(f->in_buf);
+    free(f->out_buf);
+    free(f);
+
+    fprintf(stderr, "Stream closed\n");
+
+    return error;
+}
+
+static int file_start(audio_t * audio)
+{
+    struct file_data *f = audio->backend_data;
+    int             error;
+
+    if (f->timer_fd != -1 &&
+        evtimer_start(f->timer_fd, FILE_PERIOD_MS, FILE_PERIOD_MS) == -1)
+    {
+        fprintf(stderr, "Error starting timer: %d: %s\n", errno,
+                strerror(errno));
+        return -1;
+    }
+
+    atomic_store(&f->running, 1);
+
+    error = pthread_create(&f->thread, NULL, file_thread, audio);
+    if (error)
+    {
+        fprintf(stderr, "Error starting audio thread: %d: %s\n", error,
+                strerror(error));
+        atomic_store(&f->running, 0);
+        if (f->timer_fd != -1)
+            evtimer_stop(f->timer_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int file_stop(audio_t * audio)
+{
+    struct file_data *f = audio->backend_data;
+
+    if (!atomic_load(&f->running))
+    {
+        fprintf(stderr, "Audio stream not active\n");
+        return 0;
+    }
+
+    /* the thread exits after the next tick; the timer must still run */
+    atomic_store(&f->running, 0);
+    pthread_join(f->thread, NULL);
+
+    if (f->timer_fd != -1)
+        evtimer_stop(f->timer_fd);
+
+    if (f->out != NULL)
+        fflush(f->out);
+
+    fprintf(stderr, "Audio stream stopped\n");
+
+    return 0;
+}
+
+const struct audio_backend audio_backend_file = {
+    .name = "file",
+    .open = file_open,
+    .close = file_close,
+    .start = file_start,
+    .stop = file_stop,
+};
+
+const struct audio_backend audio_backend_fast = {
+    .name = "fast",
+    .open = fast_open,
+    .close = file_close,
+    .start = file_start,
+    .stop = file_stop,
+};
+
+const struct audio_backend audio_backend_null = {
+    .name = "null",
+    .open = null_open,
+    .close = file_close,
+    .start = file_start,
+    .stop = file_stop,
+};
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#include <portaudio.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "audio_backend.h"
+#include "audio_util.h"
+
+/**
+ * PortAudio stream.
+ *
+ * @stream       Audio stream handle.
+ * @device_info  Audio device info.
+ * @param        Stream parameters, used for both input and output.
+ */
+struct pa_data {
+    PaStream       *stream;
+    const PaDeviceInfo *device_info;
+    PaStreamParameters param;
+};
+
+
+static int pa_callback(const void *input, void *output,
+                       unsigned long frame_cnt,
+                       const PaStreamCallbackTimeInfo * timeInfo,
+                       PaStreamCallbackFlags statusFlags, void *user_data)
+{
+    (void)timeInfo;
+
+    audio_process((audio_t *) user_data, input, output, frame_cnt,
+                  statusFlags);
+
+    return paContinue;
+}
+
+static int pa_open(audio_t * audio, const char *arg, int index,
+                   uint32_t sample_rate)
+{
+    struct pa_data *pa;
+    PaError         error;
+
+    (void)arg;
+
+    error = Pa_Initialize();  /** FIXME: make it quiet */
+    if (error != paNoError)
+    {
+        fprintf(stderr, "Error initializing audio %d: %s", error,
+                Pa_GetErrorText(error));
+        return error;
+    }
+
+    pa = (struct pa_data *)malloc(sizeof(struct pa_data));
+    if (!pa)
+    {
+        Pa_Terminate();
+        return paInsufficientMemory;
+    }
+
+    if (index < 0)
+    {
+        pa->param.device = Pa_GetDefaultInputDevice();
+        fprintf(stderr, "Audio device not specified. Default is %d\n",
+                pa->param.device);
+    }
+    else
+    {
+        pa->param.device = index;
+    }
+
+    /** FIXME: ring buffer assumes 1 channel */
+    pa->param.channelCount = CHANNELS;
+    fprintf(stderr, "Number of channels: %d\n", pa->param.channelCount);
+
+    pa->param.sampleFormat = paInt16;
+    pa->param.hostApiSpecificStreamInfo = NULL;
+    pa->param.suggestedLatency = 0.04f; //pa->device_info->defaultLowInputLatency;
+
+    pa->device_info = Pa_GetDeviceInfo(pa->param.device);
+    fprintf(stderr, "Using audio device no. %d: %s\n",
+            pa->param.device, pa->device_info->name);
+
+    /** FIXME: check if sample rate is supported */
+    if (sample_rate == 0)
+        sample_rate = pa->device_info->defaultSampleRate;
+    fprintf(stderr, "Sample rate: %d\n", sample_rate);
+
+    fprintf(stderr, "Latencies (LH): %d  %.d\n",
+            (int)(1.e3 * pa->device_info->defaultLowInputLatency),
+            (int)(1.e3 * pa->device_info->defaultHighInputLatency));
+
+    error = Pa_OpenStream(&pa->stream,
+                          audio->conf & AUDIO_CONF_INPUT ? &pa->param : NULL,
+                          audio->conf & AUDIO_CONF_OUTPUT ? &pa->param : NULL,
+                          sample_rate, paFramesPerBufferUnspecified,
+                          paClipOff | paDitherOff, pa_callback, audio);
+    if (error != paNoError)
+    {
+        fprintf(stderr, "Error opening audio stream %d (%s)\n", error,
+                Pa_GetErrorText(error));
+
+        free(pa);
+        Pa_Terminate();
+        return error;
+    }
+
+    audio->backend_data = pa;
+
+    return paNoError;
+}
+
+static int pa_close(audio_t * audio)
+{
+    struct pa_data *pa = audio->backend_data;
+    PaError         error;
+
+    error = Pa_CloseStream(pa->stream);
+    if (error != paNoError)
+        fprintf(stderr, "Error closing audio stream %d: %s\n",
+                error, Pa_GetErrorText(error));
+    else
+        fprintf(stderr, "Stream closed\n");
+
+    Pa_Terminate();
+    free(pa);
+
+    return error;
+}
+
+static int pa_start(audio_t * audio)
+{
+    struct pa_data *pa = audio->backend_data;
+    PaError         error;
+
+    error = Pa_StartStream(pa->stream);
+    if (error != paNoError)
+        fprintf(stderr, "Error starting audio stream %d: %s\n",
+                error, Pa_GetErrorText(error));
+
+    return error;
+}
+
+static int pa_stop(audio_t * audio)
+{
+    struct pa_data *pa = audio->backend_data;
+    PaError         error = paNoError;
+
+    if (Pa_IsStreamActive(pa->stream))
+    {
+        error = Pa_StopStream(pa->stream);
+        if (error != paNoError)
+            fprintf(stderr, "Error stopping audio stream %d: %s\n",
+                    error, Pa_GetErrorText(error));
+        else
+            fprintf(stderr, "Audio stream stopped\n");
+    }
+    else
+    {
+        fprintf(stderr, "Audio stream not active\n");
+    }
+
+    return error;
+}
+
+const struct audio_backend audio_backend_pa = {
+    .name = "portaudio",
+    .open = pa_open,
+    .close = pa_close,
+    .start = pa_start,
+    .stop = pa_stop,
+};
+
+int audio_list_devices(void)
+{
+    const PaDeviceInfo *dev_info;
+    PaError         error;
+    int             i, num_devices;
+
+
+    error = Pa_Initialize();  /** FIXME: make it quiet */
+    if (error != paNoError)
+    {
+        fprintf(stderr, "Error initializing audio %d: %s",
+                error, Pa_GetErrorText(error));
+        return 0;
+    }
+
+    num_devices = Pa_GetDeviceCount();
+    if (num_devices < 0)
+    {
+        fprintf(stderr, "ERROR: Pa_GetDeviceCount returned 0x%x\n",
+                num_devices);
+        Pa_Terminate();
+        return 0;
+    }
+
+    fprintf(stderr, "\nAvailable input / output devices:\n");
+    fprintf(stderr, " IDX  CHi CHo  Rate   Lat. (ms)  Name\n");
+    for (i = 0; i < num_devices; i++)
+    {
+        dev_info = Pa_GetDeviceInfo(i);
+
+        if (dev_info->maxInputChannels > 0)
+        {
+            fprintf(stderr, " %2d  %3d %3d %7.0f  %3.0f  %3.0f   %s\n",
+                    i, dev_info->maxInputChannels, dev_info->maxOutputChannels,
+                    dev_info->defaultSampleRate,
+                    1.e3 * dev_info->defaultLowInputLatency,
+                    1.e3 * dev_info->defaultHighInputLatency, dev_info->name);
+        }
+    }
+
+    fprintf(stderr, "\n");
+
+    Pa_Terminate();
+
+    return num_devices;
+}
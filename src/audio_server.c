@@ -10,6 +10,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>           // PRId64 and PRIu64
+#include <math.h>
 #include <netinet/in.h>
 #include <opus.h>
 #include <signal.h>
@@ -18,30 +19,147 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "audio_util.h"
 #include "common.h"
-
+#include "fanout.h"
+#include "latency.h"
+#include "rtp.h"
 
 /* application state and config */
 struct app_data {
     int32_t         opus_bitrate;
     int32_t         opus_complexity;
+    uint32_t        opus_frame_us;      /* default frame duration */
+    int             opus_lowdelay;      /* restricted low delay mode */
+    int             opus_dtx;   /* discontinuous transmission */
+    double          gate_db;    /* silence gate level in dBFS; 0 = off */
+    double          gate_power; /* the same as mean square sample value */
+    uint32_t        quiet_us;   /* time the level has been below the gate */
     uint32_t        sample_rate;        /* audio sample rate */
     int             device_index;       /* audio device index */
+    char           *audio_backend;      /* see audio_open() */
     int             network_port;       /* network port number */
-
-    /* Copy of connected client IP address in betwork byte order.
-     * Used to check whether a new conection comes from a client that has
-     * connected earlier but disappeared without properly disconnecting.
-     */
-    uint32_t        cli_addr;
+    int             use_udp;    /* also accept RTP clients over UDP */
+    int             duplex;     /* play transmit audio from the client */
+    uint32_t        tx_delay_ms;        /* playout delay of transmit audio */
+    int             max_listeners;      /* clients sharing the audio */
+    uint32_t        queue_ms;   /* send queue length per listener */
+    int             drop_policy;        /* FANOUT_DROP_xyz */
+    uint32_t        frame_us;   /* frame duration used for all listeners */
+    int32_t         cc_min_bitrate;     /* congestion control; 0 = off */
 };
 
 
 static int      keep_running = 1;       /* set to 0 to exit infinite loop */
 
+/* A TCP listener whose queue has not moved for this long is disconnected */
+#define LISTENER_STALL_MS   5000
+
+/* Audio below the gate level is still sent for this long, so that the ends
+ * of words are not cut off */
+#define GATE_HANGOVER_MS    300
+
+/* The transmit token is released after this long without transmit audio */
+#define TX_RELEASE_MS       1000
+
+/* Congestion control: the bitrate is stepped down while a listener cannot
+ * keep up, at most once per CC_DOWN_HOLD_MS so that a step can take effect
+ * first. It is stepped up again after CC_UP_HOLD_MS without congestion;
+ * the wait doubles up to CC_UP_HOLD_MAX_MS for every step up that is
+ * followed by congestion before the next one would be due. */
+#define CC_DOWN_HOLD_MS     1000
+#define CC_UP_HOLD_MS       10000
+#define CC_UP_HOLD_MAX_MS   120000
+
+/* Packet loss reported by an RTP client that is, or is no longer,
+ * congestion */
+#define CC_LOSS_HIGH        10
+#define CC_LOSS_LOW         2
+
+/**
+ * Connected client listening to the audio.
+ *
+ * @active      Set while the slot is in use.
+ * @fd          TCP socket or -1 for RTP clients.
+ * @addr        Client IP address in network byte order. Used to check
+ *              whether a new connection comes from a client that has
+ *              connected earlier but disappeared without properly
+ *              disconnecting.
+ * @udp_addr    Address of an RTP client.
+ * @last_rx     Time of the last datagram from an RTP client.
+ * @frame_us    Frame duration requested by the client.
+ * @loss_perc   Packet loss reported by an RTP client.
+ * @in          Requests and transmit audio from the client.
+ * @out         Output queue of a TCP client.
+ * @rtp         RTP sender of an RTP client.
+ * @tx_rtp      RTP receiver for transmit audio from an RTP client.
+ * @udp_dropped RTP packets that could not be sent.
+ * @silent      Set when a TCP client has been told that nothing is sent.
+ * @cc_dropped  Dropped packets already seen by the congestion control.
+ */
+struct listener {
+    int             active;
+    int             fd;
+    uint32_t        addr;
+    struct sockaddr_in udp_addr;
+    uint64_t        last_rx;
+    uint32_t        frame_us;
+    int             loss_perc;
+    struct xfr_buf  in;
+    struct fanout_queue out;
+    struct rtp_sender rtp;
+    struct rtp_receiver tx_rtp;
+    uint32_t        udp_dropped;
+    int             silent;
+    uint32_t        cc_dropped;
+};
+
+/* The audio is encoded once and the packets are shared by all listeners */
+static struct listener listeners[FANOUT_MAX_CLIENTS];
+static struct fanout_pool pool;
+static int      num_listeners = 0;
+
+/* Index of the listener allowed to transmit or -1 if nobody is. The token
+ * is taken by the first listener sending transmit audio while it is free.
+ */
+static int      tx_owner = -1;
+static uint64_t tx_last_rx = 0;
+
+/**
+ * Congestion control of the shared encoder.
+ *
+ * @level       Number of steps below the configured bitrate.
+ * @bitrate     Current bitrate.
+ * @down_ms     Time of the last step down.
+ * @up_ms       Time of the last step up.
+ * @clear_ms    Time since when no listener has been congested or 0.
+ * @up_hold_ms  Time without congestion before the next step up.
+ * @steps_down  Number of steps down.
+ * @steps_up    Number of steps up.
+ * @lowest      Lowest bitrate used.
+ */
+struct congestion {
+    int             level;
+    int32_t         bitrate;
+    uint64_t        down_ms;
+    uint64_t        up_ms;
+    uint64_t        clear_ms;
+    uint32_t        up_hold_ms;
+    uint32_t        steps_down;
+    uint32_t        steps_up;
+    int32_t         lowest;
+};
+
+static struct congestion cc;
+
+/* statistics of disconnected listeners */
+static uint32_t dropped_pkts = 0;
+static uint64_t invalid_pkts = 0;
+
 void signal_handler(int signo)
 {
     fprintf(stderr, "\nCaught signal: %d\n", signo);
@@ -56,11 +174,32 @@ static void help(void)
         "\n Possible options are:\n"
         "\n"
         "  -d <num>  Audio device index (see -l).\n"
+        "  -a <str>  Audio backend: portaudio (default), null, file:<path>\n"
+        "            or fast:<path> (not paced). A WAV or raw file; \"-\" is\n"
+        "            stdin or stdout; <in>,<out> with -x. With ALSA=1 also\n"
+        "            alsa:<pcm>[/period=<frames>][/periods=<num>][/measure].\n"
         "  -r <num>  Audio sample rate (default is 48000).\n"
         "  -l        List audio devices.\n"
         "  -b <num>  Opus encoder output rate in bits per sec (default is 16 kbps).\n"
+        "  -B <num>  Lowest bitrate used while a listener cannot keep up\n"
+        "            (default is 6 kbps). 0 disables congestion control.\n"
         "  -c <num>  Opus encoder complexity 1-10 (default is 5).\n"
+        "  -f <num>  Opus frame duration in ms: 2.5, 5, 10, 20, 40 or 60\n"
+        "            (default is 40). Clients may request another one.\n"
+        "  -L        Opus restricted low delay mode (saves 4 ms, no SILK).\n"
+        "  -D        Opus DTX: send nothing but comfort noise updates during\n"
+        "            silence.\n"
+        "  -g <num>  Send nothing while the audio level stays below this\n"
+        "            many dBFS, e.g. -50 for a closed squelch.\n"
         "  -p <num>  Network port number (default is 42001).\n"
+        "  -U        Also serve RTP over UDP on the same port.\n"
+        "  -x        Full duplex: play transmit audio from the client.\n"
+        "  -t <num>  Playout delay of transmit audio in ms (default is 40).\n"
+        "  -m <num>  Maximum number of listeners sharing the audio (default\n"
+        "            is 1, up to 8).\n"
+        "  -q <num>  Send queue length per listener in ms (default is 200).\n"
+        "  -k        Keep the queued audio of slow listeners and drop new\n"
+        "            packets instead of the oldest ones.\n"
         "  -h        This help message.\n\n";
 
     fprintf(stderr, "%s", help_string);
@@ -73,7 +212,8 @@ static void parse_options(int argc, char **argv, struct app_data *app)
 
     if (argc > 1)
     {
-        while ((option = getopt(argc, argv, "d:r:lb:c:p:h")) != -1)
+        while ((option = getopt(argc, argv,
+                                "d:a:r:lb:B:c:f:LDg:p:Uxt:m:q:kh")) != -1)
         {
             switch (option)
             {
@@ -81,6 +221,10 @@ static void parse_options(int argc, char **argv, struct app_data *app)
                 app->device_index = atoi(optarg);
                 break;
 
+            case 'a':
+                app->audio_backend = strdup(optarg);
+                break;
+
             case 'r':
                 app->sample_rate = (uint32_t) atof(optarg);
                 break;
@@ -93,14 +237,78 @@ static void parse_options(int argc, char **argv, struct app_data *app)
                 app->opus_bitrate = (int32_t) atof(optarg);
                 break;
 
+            case 'B':
+                app->cc_min_bitrate = (int32_t) atof(optarg);
+                break;
+
             case 'c':
                 app->opus_complexity = atoi(optarg);
                 break;
 
+            case 'f':
+                app->opus_frame_us = (uint32_t) (1000.0 * atof(optarg));
+                if (!audio_frame_valid(app->opus_frame_us))
+                {
+                    fprintf(stderr, "Invalid frame duration: %s ms\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'L':
+                app->opus_lowdelay = 1;
+                break;
+
+            case 'D':
+                app->opus_dtx = 1;
+                break;
+
+            case 'g':
+                app->gate_db = atof(optarg);
+                if (app->gate_db >= 0.0)
+                {
+                    fprintf(stderr, "Invalid gate level: %s dBFS\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                app->gate_power = 32768.0 * 32768.0 *
+                    pow(10.0, app->gate_db / 10.0);
+                break;
+
             case 'p':
                 app->network_port = atoi(optarg);
                 break;
 
+            case 'U':
+                app->use_udp = 1;
+                break;
+
+            case 'x':
+                app->duplex = 1;
+                break;
+
+            case 't':
+                app->tx_delay_ms = atoi(optarg);
+                break;
+
+            case 'm':
+                app->max_listeners = atoi(optarg);
+                if (app->max_listeners < 1 ||
+                    app->max_listeners > FANOUT_MAX_CLIENTS)
+                {
+                    fprintf(stderr, "Invalid number of listeners: %s\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'q':
+                app->queue_ms = atoi(optarg);
+                break;
+
+            case 'k':
+                app->drop_policy = FANOUT_DROP_NEWEST;
+                break;
+
             case 'h':
                 help();
                 exit(EXIT_SUCCESS);
@@ -123,11 +331,586 @@ static void setup_encoder(OpusEncoder * encoder, struct app_data *app)
     opus_encoder_ctl(encoder, OPUS_SET_MAX_BANDWIDTH(OPUS_BANDWIDTH_WIDEBAND));
     opus_encoder_ctl(encoder, OPUS_SET_BITRATE(app->opus_bitrate));
     opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(app->opus_complexity));
+    opus_encoder_ctl(encoder, OPUS_SET_DTX(app->opus_dtx));
 
     opus_encoder_ctl(encoder, OPUS_GET_COMPLEXITY(&x));
     fprintf(stderr, "  Complexity: %d\n", x);
     opus_encoder_ctl(encoder, OPUS_GET_BITRATE(&x));
     fprintf(stderr, "  Bitrate   : %d\n", x);
+    opus_encoder_ctl(encoder, OPUS_GET_LOOKAHEAD(&x));
+    fprintf(stderr, "  Lookahead : %d samples\n", x);
+    fprintf(stderr, "  Frame     : %.1f ms%s\n", 1.e-3 * app->opus_frame_us,
+            app->opus_lowdelay ? " (restricted low delay)" : "");
+    fprintf(stderr, "  DTX       : %s\n", app->opus_dtx ? "on" : "off");
+    if (app->gate_db < 0.0)
+        fprintf(stderr, "  Gate      : %.0f dBFS\n", app->gate_db);
+    if (app->cc_min_bitrate > 0 && app->cc_min_bitrate < app->opus_bitrate)
+        fprintf(stderr, "  Congestion: down to %d bps\n",
+                app->cc_min_bitrate);
+}
+
+/*
+ * Update the expected packet loss of a listener from a receiver report. The
+ * loss decays slowly so that FEC is not switched on and off by every
+ * report.
+ */
+static int update_loss(int loss_perc, uint8_t fraction)
+{
+    int             perc = (fraction * 100 + 255) / 256;
+
+    if (perc < loss_perc * 3 / 4)
+        perc = loss_perc * 3 / 4;
+
+    return perc;
+}
+
+/*
+ * Set the expected packet loss to the worst one reported by the listeners.
+ * In-band FEC is used when there is any loss.
+ */
+static void set_packet_loss(OpusEncoder * encoder, int *loss_perc)
+{
+    int             perc = 0;
+    int             i;
+
+    for (i = 0; i < FANOUT_MAX_CLIENTS; i++)
+        if (listeners[i].active && listeners[i].loss_perc > perc)
+            perc = listeners[i].loss_perc;
+
+    if (perc == *loss_perc)
+        return;
+
+    opus_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(perc));
+    opus_encoder_ctl(encoder, OPUS_SET_INBAND_FEC(perc > 0));
+
+    if ((perc > 0) != (*loss_perc > 0))
+        fprintf(stderr, "Packet loss %d%%; FEC %s\n", perc,
+                perc > 0 ? "on" : "off");
+
+    *loss_perc = perc;
+}
+
+/*
+ * Check whether a listener is congested: 1 if it is, 0 if it is keeping up
+ * and -1 in between. A TCP client is congested when its queue is more than
+ * half full; the queue holds the backlog since fanout keeps the unsent data
+ * in the socket small. An RTP client is congested when it reports loss.
+ * Any packet dropped since the last check is congestion either way.
+ */
+static int listener_congestion(struct listener *l)
+{
+    uint32_t        dropped;
+    int             new_drops;
+
+    dropped = l->fd != -1 ? l->out.dropped : l->udp_dropped;
+    new_drops = dropped != l->cc_dropped;
+    l->cc_dropped = dropped;
+
+    if (l->fd != -1)
+    {
+        if (new_drops || (l->out.count > 1 &&
+                          l->out.count * 2 > l->out.max_pkts))
+            return 1;
+
+        return l->out.count <= 1 ? 0 : -1;
+    }
+
+    if (new_drops || l->loss_perc >= CC_LOSS_HIGH)
+        return 1;
+
+    return l->loss_perc <= CC_LOSS_LOW ? 0 : -1;
+}
+
+/* Bitrate of a congestion control level; each step is 3/4 of the last */
+static int32_t level_bitrate(const struct app_data *app, int level)
+{
+    int32_t         bitrate = app->opus_bitrate;
+
+    while (level-- > 0)
+        bitrate = bitrate * 3 / 4;
+
+    return bitrate < app->cc_min_bitrate ? app->cc_min_bitrate : bitrate;
+}
+
+/* Set the bitrate and a bandwidth that suits it */
+static void set_bitrate(OpusEncoder * encoder, const struct app_data *app)
+{
+    opus_int32      bandwidth = OPUS_BANDWIDTH_WIDEBAND;
+
+    cc.bitrate = level_bitrate(app, cc.level);
+    if (cc.level > 0 && cc.bitrate < 8000)
+        bandwidth = OPUS_BANDWIDTH_NARROWBAND;
+    else if (cc.level > 0 && cc.bitrate < 11000)
+        bandwidth = OPUS_BANDWIDTH_MEDIUMBAND;
+
+    opus_encoder_ctl(encoder, OPUS_SET_BITRATE(cc.bitrate));
+    opus_encoder_ctl(encoder, OPUS_SET_MAX_BANDWIDTH(bandwidth));
+
+    if (cc.bitrate < cc.lowest)
+        cc.lowest = cc.bitrate;
+
+    fprintf(stderr, "Bitrate %d bps, %s\n", cc.bitrate,
+            bandwidth == OPUS_BANDWIDTH_NARROWBAND ? "narrowband" :
+            bandwidth == OPUS_BANDWIDTH_MEDIUMBAND ? "mediumband" :
+            "wideband");
+}
+
+/*
+ * Adapt the bitrate to the slowest listener. Rather than letting the
+ * latency grow, the queues drop packets while the bitrate is too high.
+ */
+static void update_congestion(OpusEncoder * encoder,
+                              const struct app_data *app)
+{
+    uint64_t        now;
+    int             congested = 0;
+    int             clear = 1;
+    int             state;
+    int             i;
+
+    if (app->cc_min_bitrate <= 0 || app->cc_min_bitrate >= app->opus_bitrate)
+        return;
+
+    for (i = 0; i < FANOUT_MAX_CLIENTS; i++)
+    {
+        if (!listeners[i].active)
+            continue;
+
+        state = listener_congestion(&listeners[i]);
+        if (state == 1)
+            congested = 1;
+        else if (state == -1)
+            clear = 0;
+    }
+
+    now = time_ms();
+    if (congested)
+    {
+        cc.clear_ms = 0;
+        if (now - cc.down_ms < CC_DOWN_HOLD_MS ||
+            cc.bitrate <= app->cc_min_bitrate)
+            return;
+
+        /* the last step up was too early */
+        if (cc.up_ms && now - cc.up_ms < cc.up_hold_ms)
+        {
+            cc.up_hold_ms *= 2;
+            if (cc.up_hold_ms > CC_UP_HOLD_MAX_MS)
+                cc.up_hold_ms = CC_UP_HOLD_MAX_MS;
+        }
+        else
+        {
+            cc.up_hold_ms = CC_UP_HOLD_MS;
+        }
+
+        cc.level++;
+        cc.down_ms = now;
+        cc.steps_down++;
+    }
+    else if (!clear || cc.level == 0)
+    {
+        cc.clear_ms = 0;
+        return;
+    }
+    else
+    {
+        if (cc.clear_ms == 0)
+            cc.clear_ms = now;
+        if (now - cc.clear_ms < cc.up_hold_ms)
+            return;
+
+        cc.level--;
+        cc.up_ms = now;
+        cc.clear_ms = now;
+        cc.steps_up++;
+    }
+
+    set_bitrate(encoder, app);
+}
+
+/* Upstream audio packet; not a CI-V packet type */
+#define PKT_TYPE_TX_AUDIO   0x80
+
+/*
+ * Get the next message from a TCP client. Besides CI-V style requests the
+ * client sends transmit audio packets with the same 2 byte header as the
+ * audio we send. The second byte tells them apart since 0x80-0x9F is not a
+ * packet type.
+ */
+static int next_message(struct xfr_buf *buffer)
+{
+    uint8_t        *buf = &buffer->data[buffer->rdidx];
+    int             avail = buffer->wridx - buffer->rdidx;
+    int             len;
+
+    /* every message is at least 3 bytes */
+    if (avail < 2)
+        return PKT_TYPE_INCOMPLETE;
+
+    len = buf[0] + ((buf[1] & 0x1F) << 8);
+    if ((buf[1] & 0xE0) != 0x80 || len <= 2)
+        return next_packet(buffer);
+
+    if (avail < len)
+        return PKT_TYPE_INCOMPLETE;
+
+    buffer->pkt = buf;
+    buffer->pkt_len = len;
+    buffer->rdidx += len;
+
+    return PKT_TYPE_TX_AUDIO;
+}
+
+/*
+ * Decode transmit audio into the playback buffer. Lost packets are
+ * concealed, but only a few since the playout delay is short.
+ */
+static void play_tx_audio(audio_t * audio, OpusDecoder * decoder,
+                          const uint8_t * data, int len, int lost)
+{
+#define TX_FRAMES 2880          // up to 60 msec
+#define TX_MAX_LOST 3
+    static opus_int16 buffer[(TX_MAX_LOST + 1) * TX_FRAMES];
+    opus_int16     *pcm;
+    uint32_t        space;
+    int             samples;
+    int             total = 0;
+    int             num;
+
+    samples = opus_decoder_get_nb_samples(decoder, data, len);
+    if (samples <= 0 || samples > TX_FRAMES)
+        samples = TX_FRAMES;
+
+    if (lost > TX_MAX_LOST)
+        lost = TX_MAX_LOST;
+
+    pcm = (opus_int16 *) audio_write_peek(audio, &space);
+    if (space < (uint32_t) ((lost + 1) * samples))
+        pcm = buffer;
+
+    for (; lost > 0; lost--)
+    {
+        num = opus_decode(decoder, NULL, 0, &pcm[total], samples, 0);
+        if (num > 0)
+            total += num;
+    }
+
+    num = opus_decode(decoder, data, len, &pcm[total], samples, 0);
+    if (num > 0)
+        total += num;
+    else
+        fprintf(stderr, "Decoder error: %d (%s)\n", num, opus_strerror(num));
+
+    if (pcm == buffer)
+        audio_write_frames(audio, (uint8_t *) buffer, total);
+    else
+        audio_write_commit(audio, total);
+}
+
+/* Check whether a datagram is a valid frame duration request */
+static int frame_request(const uint8_t * dgram, int len)
+{
+    return len == 4 && dgram[0] == 0xFE &&
+        dgram[1] == PKT_TYPE_AUDIO_FRAME && dgram[3] == 0xFD &&
+        audio_frame_valid(dgram[2] * AUDIO_FRAME_UNIT_US);
+}
+
+/* Get a free listener slot or NULL if all are in use */
+static struct listener *find_free_slot(const struct app_data *app)
+{
+    int             i;
+
+    for (i = 0; i < app->max_listeners; i++)
+        if (!listeners[i].active)
+            return &listeners[i];
+
+    return NULL;
+}
+
+/* Get the first listener with the given IP address */
+static struct listener *find_listener(uint32_t addr)
+{
+    int             i;
+
+    for (i = 0; i < FANOUT_MAX_CLIENTS; i++)
+        if (listeners[i].active && listeners[i].addr == addr)
+            return &listeners[i];
+
+    return NULL;
+}
+
+/* Get the RTP listener with the given address and port */
+static struct listener *find_udp_listener(const struct sockaddr_in *addr)
+{
+    struct listener *l;
+    int             i;
+
+    for (i = 0; i < FANOUT_MAX_CLIENTS; i++)
+    {
+        l = &listeners[i];
+        if (l->active && l->fd == -1 &&
+            l->udp_addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+            l->udp_addr.sin_port == addr->sin_port)
+            return l;
+    }
+
+    return NULL;
+}
+
+/* Number of packets queued for a listener at most */
+static int queue_pkts(const struct app_data *app)
+{
+    return (app->queue_ms * 1000 + app->frame_us - 1) / app->frame_us;
+}
+
+/* Set up a listener slot for a TCP (fd != -1) or RTP client */
+static void listener_open(struct app_data *app, struct listener *l, int fd,
+                          const struct sockaddr_in *addr)
+{
+    l->active = 1;
+    l->fd = fd;
+    l->addr = addr->sin_addr.s_addr;
+    l->udp_addr = *addr;
+    l->last_rx = time_ms();
+    l->frame_us = app->opus_frame_us;
+    l->loss_perc = 0;
+    l->udp_dropped = 0;
+    l->silent = 0;
+    l->cc_dropped = 0;
+
+    memset(&l->in, 0, sizeof(l->in));
+    if (fd != -1)
+        fanout_queue_init(&l->out, fd, app->drop_policy, queue_pkts(app));
+
+    rtp_sender_init(&l->rtp, app->sample_rate);
+    rtp_receiver_init(&l->tx_rtp);
+}
+
+/* Free a listener slot, keeping the statistics */
+static void listener_release(struct listener *l)
+{
+    if (l->fd != -1)
+    {
+        fprintf(stderr, "  Packets sent / dropped: %" PRIu32 " / %" PRIu32
+                "\n", l->out.sent, l->out.dropped);
+        dropped_pkts += l->out.dropped;
+        fanout_queue_clear(&pool, &l->out);
+        close(l->fd);
+        l->fd = -1;
+    }
+
+    dropped_pkts += l->udp_dropped;
+    invalid_pkts += l->in.invalid_pkts;
+    l->active = 0;
+
+    if (tx_owner == l - listeners)
+        tx_owner = -1;
+}
+
+/* Disconnect a listener; audio stops with the last one */
+static void listener_close(audio_t * audio, struct listener *l)
+{
+    listener_release(l);
+
+    if (--num_listeners == 0)
+        audio_stop(audio);
+}
+
+/* Add a listener; audio starts with the first one */
+static void listener_add(struct app_data *app, audio_t * audio,
+                         struct listener *l, int fd,
+                         const struct sockaddr_in *addr)
+{
+    listener_open(app, l, fd, addr);
+
+    if (num_listeners++ == 0)
+        audio_start(audio);
+}
+
+/*
+ * Use the shortest frame duration requested by any listener for all of
+ * them.
+ */
+static void update_frame(struct app_data *app)
+{
+    uint32_t        frame_us = 0;
+    int             i;
+
+    for (i = 0; i < FANOUT_MAX_CLIENTS; i++)
+        if (listeners[i].active &&
+            (frame_us == 0 || listeners[i].frame_us < frame_us))
+            frame_us = listeners[i].frame_us;
+
+    if (frame_us == 0 || frame_us == app->frame_us)
+        return;
+
+    app->frame_us = frame_us;
+
+    /* the queues hold the same time */
+    for (i = 0; i < FANOUT_MAX_CLIENTS; i++)
+        if (listeners[i].active && listeners[i].fd != -1)
+            fanout_queue_limit(&listeners[i].out, queue_pkts(app));
+}
+
+/* Check whether a listener may transmit and take the token if it is free */
+static int may_transmit(struct listener *l)
+{
+    int             idx = l - listeners;
+
+    if (tx_owner != idx && tx_owner != -1 &&
+        time_ms() - tx_last_rx < TX_RELEASE_MS)
+        return 0;
+
+    if (tx_owner != idx)
+        fprintf(stderr, "Transmit audio from listener %d\n", idx);
+
+    tx_owner = idx;
+    tx_last_rx = time_ms();
+
+    return 1;
+}
+
+/*
+ * Process frame duration requests and transmit audio received from a
+ * listener.
+ */
+static void listener_process(audio_t * audio, OpusDecoder * decoder,
+                             struct listener *l)
+{
+    struct xfr_buf *in = &l->in;
+    int             pkt_type;
+
+    while ((pkt_type = next_message(in)) != PKT_TYPE_INCOMPLETE)
+    {
+        if (pkt_type == PKT_TYPE_TX_AUDIO)
+        {
+            if (decoder != NULL && may_transmit(l))
+                play_tx_audio(audio, decoder, &in->pkt[2], in->pkt_len - 2,
+                              0);
+            continue;
+        }
+
+        if (pkt_type != PKT_TYPE_AUDIO_FRAME || in->pkt_len != 4 ||
+            !audio_frame_valid(in->pkt[2] * AUDIO_FRAME_UNIT_US))
+        {
+            in->invalid_pkts++;
+            continue;
+        }
+
+        in->valid_pkts++;
+
+        /* RTP clients repeat the request with every report */
+        if (l->frame_us == in->pkt[2] * AUDIO_FRAME_UNIT_US)
+            continue;
+
+        l->frame_us = in->pkt[2] * AUDIO_FRAME_UNIT_US;
+        fprintf(stderr, "Client requested %.1f ms frames\n",
+                1.e-3 * l->frame_us);
+    }
+}
+
+/*
+ * Send an encoded packet to a listener. TCP clients get it through their
+ * queue, RTP clients directly with their own RTP header.
+ */
+static int listener_send(int udp_fd, struct listener *l,
+                         struct fanout_pkt *pkt, uint32_t frame_size)
+{
+    uint8_t         header[RTP_HDR_LEN];
+    struct iovec    iov[2];
+    struct msghdr   msg;
+
+    if (l->fd != -1)
+    {
+        l->silent = 0;
+        return fanout_queue_send(&pool, &l->out, pkt);
+    }
+
+    /* the 2 byte TCP header is not sent */
+    iov[0].iov_base = header;
+    iov[0].iov_len = rtp_write_header(&l->rtp, header, frame_size);
+    iov[1].iov_base = &pkt->data[2];
+    iov[1].iov_len = pkt->len - 2;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &l->udp_addr;
+    msg.msg_namelen = sizeof(l->udp_addr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    if (sendmsg(udp_fd, &msg, 0) < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            l->udp_dropped++;
+        else
+            fprintf(stderr, "Error sending RTP packet: %d: %s\n", errno,
+                    strerror(errno));
+    }
+
+    return 0;
+}
+
+/*
+ * Skip a frame that is not sent during silence. RTP clients see the jump in
+ * the timestamps; TCP clients get an empty packet when the silence starts.
+ */
+static int listener_skip(struct listener *l, struct fanout_pkt *empty,
+                         uint32_t frame_size)
+{
+    if (l->fd == -1)
+    {
+        rtp_skip(&l->rtp, frame_size);
+        return 0;
+    }
+
+    if (l->silent)
+        return 0;
+
+    l->silent = 1;
+
+    return fanout_queue_send(&pool, &l->out, empty);
+}
+
+/*
+ * Energy gate for a closed squelch: the gate closes when the level has been
+ * below app->gate_db for GATE_HANGOVER_MS and opens again with the first
+ * louder frame.
+ */
+static int gate_closed(struct app_data *app, const opus_int16 * pcm,
+                       uint32_t frames)
+{
+    int64_t         sum = 0;
+    uint32_t        i;
+
+    for (i = 0; i < frames; i++)
+        sum += pcm[i] * pcm[i];
+
+    if (sum >= app->gate_power * frames)
+    {
+        app->quiet_us = 0;
+        return 0;
+    }
+
+    if (app->quiet_us <= 1000 * GATE_HANGOVER_MS)
+        app->quiet_us += app->frame_us;
+
+    return app->quiet_us > 1000 * GATE_HANGOVER_MS;
+}
+
+/* Print the time from frame ready to sent */
+static void print_send_latency(const struct histogram *hist)
+{
+    if (hist->count == 0)
+        return;
+
+    fprintf(stderr, "  Wakeup to send time in ms:\n");
+    fprintf(stderr, "      Count      p50      p90      p99    p99.9"
+            "      max\n");
+    fprintf(stderr, "    %7" PRIu64 " %8.2f %8.2f %8.2f %8.2f %8.2f\n",
+            hist->count, 1.e-3 * hist_percentile(hist, 50.0),
+            1.e-3 * hist_percentile(hist, 90.0),
+            1.e-3 * hist_percentile(hist, 99.0),
+            1.e-3 * hist_percentile(hist, 99.9), 1.e-3 * hist->max);
 }
 
 int main(int argc, char **argv)
@@ -137,42 +920,67 @@ int main(int argc, char **argv)
     struct sockaddr_in cli_addr;
     socklen_t       cli_addr_len;
 
-    struct pollfd   poll_fds[2];
-    int             connected;
+    /* listening socket, RTP socket, audio wakeup and the listeners */
+#define POLL_LISTENERS 3
+    struct pollfd   poll_fds[POLL_LISTENERS + FANOUT_MAX_CLIENTS];
+    struct listener *l;
+    struct rtp_header hdr;
+    int             loss_perc = 0;      /* packet loss set in the encoder */
+    uint32_t        frame_size; /* samples per frame */
+    int             timeout;
+    uint64_t        now;
+    int             i;
+    uint64_t        wakeup_us = 0;      /* time when frames were ready */
+    struct histogram send_hist; /* wakeup to send time */
 
     audio_t        *audio;
     OpusEncoder    *encoder;
+    OpusDecoder    *decoder = NULL;     /* transmit audio */
     uint64_t        encoded_bytes = 0;
     uint64_t        encoder_errors = 0;
+    uint64_t        silent_frames = 0;
     int             error;
 
 
     struct app_data app = {
         .opus_bitrate = 16000,
         .opus_complexity = 5,
+        .opus_frame_us = 40000,
+        .opus_lowdelay = 0,
+        .opus_dtx = 0,
+        .gate_db = 0.0,
+        .gate_power = 0.0,
+        .quiet_us = 0,
         .sample_rate = 48000,
         .device_index = -1,
+        .audio_backend = NULL,
         .network_port = DEFAULT_AUDIO_PORT,
-        .cli_addr = 0,
-    };
-
-    struct xfr_buf  net_in_buf = {
-        .wridx = 0,
-        .write_errors = 0,
-        .valid_pkts = 0,
-        .invalid_pkts = 0,
+        .duplex = 0,
+        .tx_delay_ms = 40,
+        .max_listeners = 1,
+        .queue_ms = 200,
+        .drop_policy = FANOUT_DROP_OLDEST,
+        .cc_min_bitrate = 6000,
     };
 
     parse_options(argc, argv, &app);
     fprintf(stderr, "Using network port %d\n", app.network_port);
+    if (app.max_listeners > 1)
+        fprintf(stderr, "Serving up to %d listeners\n", app.max_listeners);
 
     /* initialize audio subsystem */
-    audio = audio_init(app.device_index, app.sample_rate, AUDIO_CONF_INPUT);
+    audio = audio_open(app.audio_backend, app.device_index, app.sample_rate,
+                       app.duplex ? AUDIO_CONF_DUPLEX : AUDIO_CONF_INPUT);
     if (audio == NULL)
         exit(EXIT_FAILURE);
 
+    /* transmit audio is played with its own, short delay; every over
+     * starts with an empty buffer, so clock drift does not matter */
+    audio_set_threshold(audio, app.sample_rate * app.tx_delay_ms / 1000);
+
     /* audio encoder */
-    encoder = opus_encoder_create(app.sample_rate, 1,
+    encoder = opus_encoder_create(app.sample_rate, 1, app.opus_lowdelay ?
+                                  OPUS_APPLICATION_RESTRICTED_LOWDELAY :
                                   OPUS_APPLICATION_AUDIO, &error);
     if (error != OPUS_OK)
     {
@@ -183,50 +991,218 @@ int main(int argc, char **argv)
     }
     setup_encoder(encoder, &app);
 
+    cc.bitrate = app.opus_bitrate;
+    cc.lowest = app.opus_bitrate;
+    cc.up_hold_ms = CC_UP_HOLD_MS;
+
+    if (app.duplex)
+    {
+        decoder = opus_decoder_create(app.sample_rate, 1, &error);
+        if (error != OPUS_OK)
+        {
+            fprintf(stderr, "Error creating opus decoder: %d (%s)\n",
+                    error, opus_strerror(error));
+            opus_encoder_destroy(encoder);
+            audio_close(audio);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     /* setup signal handler */
     if (signal(SIGINT, signal_handler) == SIG_ERR)
         printf("Warning: Can't catch SIGINT\n");
     if (signal(SIGTERM, signal_handler) == SIG_ERR)
         printf("Warning: Can't catch SIGTERM\n");
 
+    fanout_pool_init(&pool);
+    for (i = 0; i < FANOUT_MAX_CLIENTS; i++)
+    {
+        listeners[i].active = 0;
+        listeners[i].fd = -1;
+    }
+
     /* network socket (listening for connections) */
     sock_fd = create_server_socket(app.network_port);
     poll_fds[0].fd = sock_fd;
     poll_fds[0].events = POLLIN;
 
-    /* network socket to client (when connected)
-     * FIXME: we could use it to check when writing is wont block
-     */
+    /* RTP clients send receiver reports to this socket */
     poll_fds[1].fd = -1;
+    poll_fds[1].events = POLLIN;
+    if (app.use_udp)
+    {
+        poll_fds[1].fd = create_udp_socket(app.network_port, NULL);
+        if (poll_fds[1].fd == -1)
+            goto cleanup;
+    }
+
+    /* the audio callback signals when a frame has been captured */
+    poll_fds[2].fd = audio->wakeup_fd;
+    poll_fds[2].events = POLLIN;
+
+    memset(&send_hist, 0, sizeof(send_hist));
     memset(&cli_addr, 0, sizeof(struct sockaddr_in));
     cli_addr_len = sizeof(cli_addr);
-    connected = 0;
+    app.frame_us = app.opus_frame_us;
 
     while (keep_running)
     {
+        /* the listeners share the encoder */
+        update_frame(&app);
+        set_packet_loss(encoder, &loss_perc);
+        update_congestion(encoder, &app);
+        frame_size = app.sample_rate * app.frame_us / 1000000;
 
-        if (poll(poll_fds, 2, 10) < 0)
+        /* wait for a complete frame; without an eventfd poll the buffer
+         * at least once per frame */
+        audio_set_wakeup(audio, frame_size);
+        timeout = 500;
+        if (poll_fds[2].fd == -1)
+        {
+            timeout = app.frame_us / 1000;
+            if (timeout < 1)
+                timeout = 1;
+            else if (timeout > 10)
+                timeout = 10;
+        }
+
+        /* network sockets to listeners; RTP clients use poll_fds[1] */
+        for (i = 0; i < FANOUT_MAX_CLIENTS; i++)
+        {
+            l = &listeners[i];
+            poll_fds[POLL_LISTENERS + i].fd = l->active ? l->fd : -1;
+            poll_fds[POLL_LISTENERS + i].events = POLLIN;
+            if (l->active && l->fd != -1 && fanout_queue_pending(&l->out))
+                poll_fds[POLL_LISTENERS + i].events |= POLLOUT;
+        }
+
+        if (poll(poll_fds, POLL_LISTENERS + FANOUT_MAX_CLIENTS, timeout) < 0)
             continue;
 
-        /* service network socket */
-        if (connected && (poll_fds[1].revents & POLLIN))
+        if (poll_fds[2].revents & POLLIN)
+            wakeup_us = audio_wakeup_ack(audio);
+
+        /* listeners that went away without a word */
+        now = time_ms();
+        for (i = 0; i < FANOUT_MAX_CLIENTS; i++)
         {
-            switch (read_data(poll_fds[1].fd, &net_in_buf))
+            l = &listeners[i];
+            if (!l->active)
+                continue;
+
+            if (l->fd == -1 && now - l->last_rx > RTP_TIMEOUT_MS)
             {
-            case PKT_TYPE_EOF:
-                fprintf(stderr, "Connection closed (FD=%d)\n", poll_fds[1].fd);
-                close(poll_fds[1].fd);
-                poll_fds[1].fd = -1;
-                poll_fds[1].events = 0;
-                connected = 0;
-                app.cli_addr = 0;
-                audio_stop(audio);
-                break;
+                fprintf(stderr, "UDP client timed out\n");
+                listener_close(audio, l);
             }
+            else if (l->fd != -1 && fanout_queue_pending(&l->out) &&
+                     now - l->out.progress_ms > LISTENER_STALL_MS)
+            {
+                fprintf(stderr, "Listener stalled (FD=%d)\n", l->fd);
+                listener_close(audio, l);
+            }
+        }
+
+        /* datagrams from RTP clients: receiver reports, frame duration
+         * requests and transmit audio */
+        if (poll_fds[1].revents & POLLIN)
+        {
+            uint8_t         dgram[1500];
+            struct sockaddr_in addr;
+            socklen_t       addr_len = sizeof(addr);
+            ssize_t         num;
+            uint8_t         fraction;
+            int             is_rr;
+            int             alive;
+            int             lost;
 
-            net_in_buf.wridx = 0;
+            while ((num = recvfrom(poll_fds[1].fd, dgram, sizeof(dgram), 0,
+                                   (struct sockaddr *)&addr, &addr_len)) > 0)
+            {
+                /* Only receiver reports and frame duration requests open
+                 * a slot or keep it open. Anything else could come from a
+                 * spoofed address that we would then flood with audio. */
+                is_rr = rtcp_parse_rr(dgram, num, &fraction) == 0;
+                alive = is_rr || frame_request(dgram, num);
+
+                l = find_udp_listener(&addr);
+                if (l == NULL && !alive)
+                {
+                    invalid_pkts++;
+                    continue;
+                }
+
+                if (l == NULL && (l = find_free_slot(&app)) != NULL)
+                {
+                    fprintf(stderr, "New UDP client from %s:%d\n",
+                            inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+                    listener_add(&app, audio, l, -1, &addr);
+                }
+                else if (l == NULL)
+                {
+                    /* with all slots in use, only a known client may move
+                     * to another port */
+                    l = find_listener(addr.sin_addr.s_addr);
+                    if (l == NULL || l->fd != -1)
+                        continue;
+
+                    fprintf(stderr, "UDP client moved to port %d\n",
+                            ntohs(addr.sin_port));
+                    l->udp_addr = addr;
+                }
+
+                if (alive)
+                    l->last_rx = time_ms();
+
+                if (dgram[0] == 0xFE)
+                {
+                    append_data(&l->in, dgram, num);
+                }
+                else if (is_rr)
+                {
+                    l->loss_perc = update_loss(l->loss_perc, fraction);
+                }
+                else if (decoder != NULL && rtp_parse(dgram, num, &hdr) == 0
+                         && hdr.pt == RTP_PT_OPUS && may_transmit(l))
+                {
+                    /* transmit audio; late packets are dropped */
+                    lost = rtp_receive(&l->tx_rtp, &hdr);
+                    if (lost >= 0)
+                        play_tx_audio(audio, decoder, hdr.payload,
+                                      hdr.payload_len, lost);
+                }
+            }
         }
 
+        /* service network sockets; the listeners send frame duration
+         * requests and transmit audio */
+        for (i = 0; i < FANOUT_MAX_CLIENTS; i++)
+        {
+            l = &listeners[i];
+            if (!l->active || l->fd == -1)
+                continue;
+
+            if ((poll_fds[POLL_LISTENERS + i].revents & POLLOUT) &&
+                fanout_queue_flush(&pool, &l->out) == -1)
+            {
+                fprintf(stderr, "Error writing to FD %d: %d: %s\n", l->fd,
+                        errno, strerror(errno));
+                listener_close(audio, l);
+                continue;
+            }
+
+            if ((poll_fds[POLL_LISTENERS + i].revents & POLLIN) &&
+                read_data(l->fd, &l->in) == 0)
+            {
+                fprintf(stderr, "Connection closed (FD=%d)\n", l->fd);
+                listener_close(audio, l);
+            }
+        }
+
+        for (i = 0; i < FANOUT_MAX_CLIENTS; i++)
+            if (listeners[i].active)
+                listener_process(audio, decoder, &listeners[i]);
+
         /* check if there are any new connections pending */
         if (poll_fds[0].revents & POLLIN)
         {
@@ -244,25 +1220,20 @@ int main(int argc, char **argv)
             fprintf(stderr, "New connection from %s\n",
                     inet_ntoa(cli_addr.sin_addr));
 
-            if (!connected)
+            if ((l = find_free_slot(&app)) != NULL)
             {
                 fprintf(stderr, "Connection accepted (FD=%d)\n", new);
-                poll_fds[1].fd = new;
-                poll_fds[1].events = POLLIN;
-
-                connected = 1;
-                app.cli_addr = cli_addr.sin_addr.s_addr;
-
-                audio_start(audio);
+                listener_add(&app, audio, l, new, &cli_addr);
             }
-            else if (app.cli_addr == cli_addr.sin_addr.s_addr)
+            else if ((l = find_listener(cli_addr.sin_addr.s_addr)) != NULL)
             {
-                /* this is the same client reconnecting */
+                /* this is the same client reconnecting, possibly switching
+                 * from RTP to TCP */
                 fprintf(stderr,
                         "Client already connected; reconnect (FD= %d -> %d)\n",
-                        poll_fds[1].fd, new);
-                close(poll_fds[1].fd);
-                poll_fds[1].fd = new;
+                        l->fd, new);
+                listener_release(l);
+                listener_open(&app, l, new, &cli_addr);
             }
             else
             {
@@ -272,31 +1243,56 @@ int main(int argc, char **argv)
         }
 
         /* process available audio data */
-        if (connected)
+        while (num_listeners && audio_frames_available(audio) >= frame_size)
         {
-#define AUDIO_FRAMES 1920       // 40 msec: 48000 * 0.04
-#define AUDIO_BUFLEN 3840
-            uint8_t         buffer1[AUDIO_BUFLEN];
-            uint8_t         buffer2[AUDIO_BUFLEN + 2];
-            uint16_t        length;
+#define AUDIO_FRAMES 2880       // up to 60 msec: 48000 * 0.06
+            uint8_t         buffer[2 * AUDIO_FRAMES];
+            struct fanout_pkt *pkt;
+            uint8_t        *pcm;
+            uint32_t        avail;
+            int             length;
 
-            if (audio_frames_available(audio) < AUDIO_FRAMES)
-                continue;
+            /* cannot happen; every queue holds a limited number */
+            pkt = fanout_pkt_get(&pool);
+            if (pkt == NULL)
+                break;
 
-            length = audio_read_frames(audio, buffer1, AUDIO_FRAMES);
+            /* encode directly from the ring buffer; a copy is only needed if
+             * it could not be mirrored and the frames wrap around its end */
+            pcm = audio_read_peek(audio, &avail);
+            if (avail >= frame_size)
+            {
+                length = frame_size;
+            }
+            else
+            {
+                pcm = buffer;
+                length = audio_read_frames(audio, buffer, frame_size);
+                avail = 0;
+            }
 
-            if (length != AUDIO_FRAMES)
+            if (length != (int)frame_size)
             {
                 fprintf(stderr,
                         "Error reading audio (got %d instead of %d frames)\n",
-                        length, AUDIO_FRAMES);
+                        length, frame_size);
             }
             else
             {
-                /* encode audio frame (items 0, 1 are reserved for header) */
-                length = opus_encode(encoder, (opus_int16 *) buffer1,
-                                     AUDIO_FRAMES, &buffer2[2], AUDIO_BUFLEN);
-                if (length > 0)
+                /* encode audio frame once for all listeners, leaving room
+                 * for the header */
+                if (app.gate_power > 0.0 &&
+                    gate_closed(&app, (opus_int16 *) pcm, frame_size))
+                    length = 0;
+                else
+                    length = opus_encode(encoder, (opus_int16 *) pcm,
+                                         frame_size, &pkt->data[2],
+                                         FANOUT_PKT_LEN - 2);
+                if (avail)
+                    audio_read_commit(audio, frame_size);
+
+                /* DTX frames are only 1 or 2 bytes and need not be sent */
+                if (length > 2 || (length > 0 && !app.opus_dtx))
                 {
                     encoded_bytes += length;
 
@@ -305,13 +1301,44 @@ int main(int argc, char **argv)
                      *   byte 2: 0x80 & 5 bit MSB of buffer length incl. header
                      */
                     length += 2;
-                    buffer2[0] = (uint8_t) (length & 0xFF);
-                    buffer2[1] = (uint8_t) (0x80 | ((length >> 8) & 0x1F));
-                    if (write(poll_fds[1].fd, buffer2, length) < 0)
-                        fprintf(stderr,
-                                "Error writing audio to network socket\n");
-                    //else
-                    //    fprintf(stderr, "SENT: %d\n", length);
+                    pkt->data[0] = (uint8_t) (length & 0xFF);
+                    pkt->data[1] = (uint8_t) (0x80 | ((length >> 8) & 0x1F));
+                    pkt->len = length;
+
+                    for (i = 0; i < FANOUT_MAX_CLIENTS; i++)
+                    {
+                        l = &listeners[i];
+                        if (l->active &&
+                            listener_send(poll_fds[1].fd, l, pkt,
+                                          frame_size) == -1)
+                        {
+                            fprintf(stderr,
+                                    "Error writing audio to FD %d: %d: %s\n",
+                                    l->fd, errno, strerror(errno));
+                            listener_close(audio, l);
+                        }
+                    }
+                }
+                else if (length >= 0)
+                {
+                    silent_frames++;
+
+                    pkt->data[0] = 2;
+                    pkt->data[1] = 0x80;
+                    pkt->len = 2;
+
+                    for (i = 0; i < FANOUT_MAX_CLIENTS; i++)
+                    {
+                        l = &listeners[i];
+                        if (l->active &&
+                            listener_skip(l, pkt, frame_size) == -1)
+                        {
+                            fprintf(stderr,
+                                    "Error writing audio to FD %d: %d: %s\n",
+                                    l->fd, errno, strerror(errno));
+                            listener_close(audio, l);
+                        }
+                    }
                 }
                 else
                 {
@@ -319,16 +1346,28 @@ int main(int argc, char **argv)
                     fprintf(stderr, "Encoder error: %d (%s)\n",
                             length, opus_strerror(length));
                 }
+
+                /* first frame after the wakeup */
+                if (wakeup_us)
+                {
+                    hist_add(&send_hist, time_us() - wakeup_us);
+                    wakeup_us = 0;
+                }
             }
 
+            fanout_pkt_put(&pool, pkt);
         }
-
+        wakeup_us = 0;
     }
 
     fprintf(stderr, "Shutting down...\n");
     exit_code = EXIT_SUCCESS;
 
   cleanup:
+    for (i = 0; i < FANOUT_MAX_CLIENTS; i++)
+        if (listeners[i].active)
+            listener_release(&listeners[i]);
+
     close(poll_fds[0].fd);
     close(poll_fds[1].fd);
 
@@ -336,12 +1375,21 @@ int main(int argc, char **argv)
     audio_close(audio);
 
     opus_encoder_destroy(encoder);
+    if (decoder != NULL)
+        opus_decoder_destroy(decoder);
 
     //fprintf(stderr, "  Audio bytes: %" PRIu64 "\n", abuf.bytes_read);
     //fprintf(stderr, "  Average read: %" PRIu64 "\n", abuf.avg_read);
 
     fprintf(stderr, "  Encoded bytes : %" PRIu64 "\n", encoded_bytes);
     fprintf(stderr, "  Encoder errors: %" PRIu64 "\n", encoder_errors);
+    fprintf(stderr, "  Silent frames not sent: %" PRIu64 "\n", silent_frames);
+    fprintf(stderr, "  Packets dropped: %" PRIu32 "\n", dropped_pkts);
+    fprintf(stderr, "  Invalid requests: %" PRIu64 "\n", invalid_pkts);
+    if (cc.steps_down)
+        fprintf(stderr, "  Bitrate steps down / up: %" PRIu32 " / %" PRIu32
+                ", lowest %d bps\n", cc.steps_down, cc.steps_up, cc.lowest);
+    print_send_latency(&send_hist);
 
     exit(exit_code);
 }
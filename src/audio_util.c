@@ -6,87 +6,72 @@
  * Simplified BSD License. See license.txt for details.
  *
  */
+#include <errno.h>
 #include <inttypes.h>           // PRId64 and PRIu64
-#include <portaudio.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
+#include "audio_backend.h"
 #include "audio_util.h"
+#include "common.h"
 
 
 #define SAMPLE_RATE 48000
-#define CHANNELS    1
-#define FRAME_SIZE  2 * CHANNELS        /* 2 bytes / sample */
-#define BUFFER_LEN_SEC 0.48
+#define BUFFER_LEN_SEC 1.0
 #define BUFFER_SIZE (SAMPLE_RATE * FRAME_SIZE) * BUFFER_LEN_SEC
 
-/* buffer threshold to start playback */
-#define PLAYBACK_THRESHOLD (SAMPLE_RATE * FRAME_SIZE) * 0.2
+/* default buffer threshold to start playback in frames */
+#define PLAYBACK_THRESHOLD SAMPLE_RATE * 0.2
 
 
-int audio_reader_cb(const void *input, void *output, unsigned long frame_cnt,
-                    const PaStreamCallbackTimeInfo * timeInfo,
-                    PaStreamCallbackFlags statusFlags, void *user_data)
+/* Store captured frames */
+static void capture(audio_t * audio, const void *input,
+                    unsigned long frame_cnt)
 {
-    (void)output;
-    (void)timeInfo;
-
-    audio_t        *audio = (audio_t *) user_data;
-    PaStreamCallbackResult result = paContinue;
     unsigned long   byte_cnt = frame_cnt * FRAME_SIZE;
+    uint32_t        frames;
+    uint64_t        one = 1;
 
-    if (byte_cnt + ring_buffer_count(audio->rb) > ring_buffer_size(audio->rb))
-    {
+    /* the main thread has not kept up; the new data is dropped */
+    if (ring_buffer_write(audio->rb_in, (unsigned char *)input, byte_cnt) <
+        byte_cnt)
         audio->overflows++;
-    }
-
-    ring_buffer_write(audio->rb, (unsigned char *)input, byte_cnt);
-    audio->frames_tot += frame_cnt;
-
-    if (audio->frames_avg)
-        audio->frames_avg = (audio->frames_avg + frame_cnt) / 2;
-    else
-        audio->frames_avg = frame_cnt;
 
-    if (statusFlags)
-        audio->status_errors++;
+    /* wake up the main thread once when enough frames are ready */
+    frames = atomic_load_explicit(&audio->wakeup_frames, memory_order_relaxed);
+    if (frames == 0 || ring_buffer_count(audio->rb_in) < frames * FRAME_SIZE ||
+        atomic_exchange(&audio->wakeup_pending, 1))
+        return;
 
-    return result;
+    atomic_store(&audio->wakeup_us, time_us());
+    if (write(audio->wakeup_fd, &one, sizeof(one)) != sizeof(one))
+        atomic_store(&audio->wakeup_pending, 0);
 }
 
-
-int audio_writer_cb(const void *input, void *output, unsigned long frame_cnt,
-                    const PaStreamCallbackTimeInfo * timeInfo,
-                    PaStreamCallbackFlags statusFlags, void *user_data)
+/* Fill output with buffered frames or silence while buffering */
+static void playback(audio_t * audio, void *output, unsigned long frame_cnt)
 {
-    (void)input;
-    (void)timeInfo;
-
-    audio_t        *audio = (audio_t *) user_data;
-    PaStreamCallbackResult result = paContinue;
     unsigned long   byte_cnt = frame_cnt * FRAME_SIZE;
-    unsigned long   i;
-    uint16_t       *out = (uint16_t *) output;
-
 
     if (audio->player_state == AUDIO_STATE_BUFFERING)
     {
-        if (ring_buffer_count(audio->rb) < PLAYBACK_THRESHOLD)
+        if (ring_buffer_count(audio->rb_out) <
+            atomic_load_explicit(&audio->threshold,
+                                 memory_order_relaxed) * FRAME_SIZE)
         {
-            for (i = 0; i < frame_cnt; i++)
-                out[i] = 0;
-
-            return result;
+            memset(output, 0, byte_cnt);
+            return;
         }
         /* there is enough data in buffer to start playback */
         audio->player_state = AUDIO_STATE_PLAYING;
     }
 
-
-    if (byte_cnt > ring_buffer_count(audio->rb))
+    if (byte_cnt > ring_buffer_count(audio->rb_out))
     {
-        for (i = 0; i < frame_cnt; i++)
-            out[i] = 0;
+        memset(output, 0, byte_cnt);
 
         /* switch back to buffering */
         audio->player_state = AUDIO_STATE_BUFFERING;
@@ -94,141 +79,185 @@ int audio_writer_cb(const void *input, void *output, unsigned long frame_cnt,
     }
     else
     {
-        ring_buffer_read(audio->rb, (unsigned char *)output, byte_cnt);
-        audio->frames_tot += frame_cnt;
+        ring_buffer_read(audio->rb_out, (unsigned char *)output, byte_cnt);
     }
+}
+
+/* Update statistics at the end of the callback */
+static void update_stats(audio_t * audio, unsigned long frame_cnt,
+                         unsigned long status)
+{
+    audio->frames_tot += frame_cnt;
 
-    /* update statistics */
     if (audio->frames_avg)
         audio->frames_avg = (audio->frames_avg + frame_cnt) / 2;
     else
         audio->frames_avg = frame_cnt;
 
-    if (statusFlags)
+    if (status)
         audio->status_errors++;
+}
 
-    return result;
+void audio_process(audio_t * audio, const void *input, void *output,
+                   unsigned long frame_cnt, unsigned long status)
+{
+    if (audio->conf & AUDIO_CONF_INPUT)
+        capture(audio, input, frame_cnt);
+    if (audio->conf & AUDIO_CONF_OUTPUT)
+        playback(audio, output, frame_cnt);
+    update_stats(audio, frame_cnt, status);
 }
 
+/* Allocate a ring buffer for the stream */
+static ring_buffer_t *create_buffer(void)
+{
+    ring_buffer_t  *rb;
 
-audio_t        *audio_init(int index, uint32_t sample_rate, uint8_t conf)
+    /* aligned so that the read and write indices are on separate cache
+     * lines */
+    rb = (ring_buffer_t *) aligned_alloc(RING_BUFFER_ALIGN,
+                                         sizeof(ring_buffer_t));
+    if (rb == NULL)
+        return NULL;
+
+    /* mirrored so that any number of frames can be accessed in place */
+    if (ring_buffer_init_mirrored(rb, BUFFER_SIZE) == -1)
+    {
+        fprintf(stderr, "Error mapping mirrored buffer: %d: %s\n", errno,
+                strerror(errno));
+        ring_buffer_init(rb, BUFFER_SIZE);
+    }
+
+    return rb;
+}
+
+static void free_buffer(ring_buffer_t * rb)
+{
+    if (rb == NULL)
+        return;
+
+    ring_buffer_free(rb);
+    free(rb);
+}
+
+
+/* Backends that can be selected in audio_open(); the first is the default */
+static const struct audio_backend *const backends[] = {
+    &audio_backend_pa,
+    &audio_backend_file,
+    &audio_backend_fast,
+    &audio_backend_null,
+#if HAVE_ALSA
+    &audio_backend_alsa,
+#endif
+    NULL
+};
+
+/* Find the backend named at the start of spec and set arg to its argument */
+static const struct audio_backend *find_backend(const char *spec,
+                                                const char **arg)
 {
+    const char     *sep;
+    size_t          len;
+    int             i;
+
+    if (spec == NULL || *spec == '\0')
+    {
+        *arg = "";
+        return backends[0];
+    }
+
+    sep = strchr(spec, ':');
+    len = sep ? (size_t) (sep - spec) : strlen(spec);
+    *arg = sep ? sep + 1 : "";
+
+    for (i = 0; backends[i] != NULL; i++)
+        if (strlen(backends[i]->name) == len &&
+            strncmp(backends[i]->name, spec, len) == 0)
+            return backends[i];
+
+    return NULL;
+}
+
+audio_t        *audio_open(const char *spec, int index, uint32_t sample_rate,
+                           uint8_t conf)
+{
+    const struct audio_backend *backend;
+    const char     *arg;
     audio_t        *audio;
-    PaError         error;
 
-    if ((conf != AUDIO_CONF_INPUT) && (conf != AUDIO_CONF_OUTPUT))
+    if ((conf != AUDIO_CONF_INPUT) && (conf != AUDIO_CONF_OUTPUT) &&
+        (conf != AUDIO_CONF_DUPLEX))
     {
         fprintf(stderr, "%s: conf %d not implemented\n", __func__, conf);
         return NULL;
     }
 
-    error = Pa_Initialize();  /** FIXME: make it quiet */
-    if (error != paNoError)
+    backend = find_backend(spec, &arg);
+    if (backend == NULL)
     {
-        fprintf(stderr, "Error initializing audio %d: %s", error,
-                Pa_GetErrorText(error));
+        fprintf(stderr, "Unknown audio backend: %s\n", spec);
         return NULL;
     }
+    fprintf(stderr, "Audio backend: %s\n", backend->name);
 
     audio = (audio_t *) malloc(sizeof(audio_t));
     if (!audio)
         return NULL;
 
+    audio->backend = backend;
+    audio->backend_data = NULL;
     audio->frames_tot = 0;
     audio->frames_avg = 0;
     audio->status_errors = 0;
     audio->overflows = 0;
     audio->underflows = 0;
+    audio->threshold = PLAYBACK_THRESHOLD;
+    audio->wakeup_fd = -1;
+    audio->wakeup_frames = 0;
+    audio->wakeup_pending = 0;
+    audio->wakeup_us = 0;
     audio->conf = conf;
     audio->player_state = AUDIO_STATE_STOPPED;
 
-    if (index < 0)
+    if (backend->open(audio, arg, index, sample_rate) != 0)
     {
-        audio->input_param.device = Pa_GetDefaultInputDevice();
-        fprintf(stderr, "Audio device not specified. Default is %d\n",
-                audio->input_param.device);
-    }
-    else
-    {
-        audio->input_param.device = index;
+        free(audio);
+        return NULL;
     }
 
-    /** FIXME: ring buffer assumes 1 channel */
-    audio->input_param.channelCount = CHANNELS;
-    fprintf(stderr, "Number of channels: %d\n",
-            audio->input_param.channelCount);
-
-    audio->input_param.sampleFormat = paInt16;
-    audio->input_param.hostApiSpecificStreamInfo = NULL;
-    audio->input_param.suggestedLatency = 0.04f;        //audio->device_info->defaultLowInputLatency;
-
-    audio->device_info = Pa_GetDeviceInfo(audio->input_param.device);
-    fprintf(stderr, "Using audio device no. %d: %s\n",
-            audio->input_param.device, audio->device_info->name);
+    audio->rb_in = conf & AUDIO_CONF_INPUT ? create_buffer() : NULL;
+    audio->rb_out = conf & AUDIO_CONF_OUTPUT ? create_buffer() : NULL;
 
-    /** FIXME: check if sample rate is supported */
-    if (sample_rate == 0)
-        sample_rate = audio->device_info->defaultSampleRate;
-    fprintf(stderr, "Sample rate: %d\n", sample_rate);
-
-    fprintf(stderr, "Latencies (LH): %d  %.d\n",
-            (int)(1.e3 * audio->device_info->defaultLowInputLatency),
-            (int)(1.e3 * audio->device_info->defaultHighInputLatency));
-
-    switch (conf)
+    if (conf & AUDIO_CONF_INPUT)
     {
-    case AUDIO_CONF_INPUT:
-        error = Pa_OpenStream(&audio->stream, &audio->input_param, NULL,
-                              sample_rate, paFramesPerBufferUnspecified,
-                              paClipOff | paDitherOff, audio_reader_cb, audio);
-        break;
-
-    case AUDIO_CONF_OUTPUT:
-        error = Pa_OpenStream(&audio->stream, NULL, &audio->input_param,
-                              sample_rate, paFramesPerBufferUnspecified,
-                              paClipOff | paDitherOff, audio_writer_cb, audio);
-        break;
-
-    default:
-        /* should never happen */
-        fprintf(stderr, "%s: Invalid conf %d\n", __func__, conf);
-        error = paInvalidFlag;
-        break;
+        audio->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (audio->wakeup_fd == -1)
+            fprintf(stderr, "Error creating eventfd: %d: %s\n", errno,
+                    strerror(errno));
     }
 
-    if (error != paNoError)
-    {
-        fprintf(stderr, "Error opening audio stream %d (%s)\n", error,
-                Pa_GetErrorText(error));
-
-        free(audio);
-        return NULL;
-    }
-
-    /* allocate ring buffer */
-    audio->rb = (ring_buffer_t *) malloc(sizeof(ring_buffer_t));
-    ring_buffer_init(audio->rb, BUFFER_SIZE);
-
     fprintf(stderr, "Audio stream opened\n");
 
     return audio;
 }
 
+audio_t        *audio_init(int index, uint32_t sample_rate, uint8_t conf)
+{
+    return audio_open(NULL, index, sample_rate, conf);
+}
+
 int audio_close(audio_t * audio)
 {
-    PaError         error;
+    int             error;
 
-    error = Pa_CloseStream(audio->stream);
-    if (error != paNoError)
-        fprintf(stderr, "Error closing audio stream %d: %s\n",
-                error, Pa_GetErrorText(error));
-    else
-        fprintf(stderr, "Stream closed\n");
+    error = audio->backend->close(audio);
 
-    Pa_Terminate();
+    if (audio->wakeup_fd != -1)
+        close(audio->wakeup_fd);
 
-    ring_buffer_free(audio->rb);
-    free(audio->rb);
+    free_buffer(audio->rb_in);
+    free_buffer(audio->rb_out);
     free(audio);
 
     return error;
@@ -236,7 +265,7 @@ int audio_close(audio_t * audio)
 
 int audio_start(audio_t * audio)
 {
-    PaError         error;
+    int             error;
 
     audio->frames_tot = 0;
     audio->frames_avg = 0;
@@ -244,40 +273,29 @@ int audio_start(audio_t * audio)
     audio->overflows = 0;
     audio->underflows = 0;
 
-    ring_buffer_clear(audio->rb);
+    /* consumer side only; the callback is not running yet */
+    if (audio->rb_in != NULL)
+        ring_buffer_clear(audio->rb_in);
+    if (audio->rb_out != NULL)
+        ring_buffer_clear(audio->rb_out);
 
-    error = Pa_StartStream(audio->stream);
-    if (error != paNoError)
-    {
-        fprintf(stderr, "Error starting audio stream %d: %s\n",
-                error, Pa_GetErrorText(error));
-    }
+    /* set before the first period is processed */
+    audio->player_state = AUDIO_STATE_BUFFERING;
+
+    error = audio->backend->start(audio);
+    if (error)
+        audio->player_state = AUDIO_STATE_STOPPED;
     else
-    {
         fprintf(stderr, "Audio stream started\n");
-        audio->player_state = AUDIO_STATE_BUFFERING;
-    }
 
     return error;
 }
 
 int audio_stop(audio_t * audio)
 {
-    PaError         error = 0;
+    int             error;
 
-    if (Pa_IsStreamActive(audio->stream))
-    {
-        error = Pa_StopStream(audio->stream);
-        if (error != paNoError)
-            fprintf(stderr, "Error stopping audio stream %d: %s\n",
-                    error, Pa_GetErrorText(error));
-        else
-            fprintf(stderr, "Audio stream stopped\n");
-    }
-    else
-    {
-        fprintf(stderr, "Audio stream not active\n");
-    }
+    error = audio->backend->stop(audio);
 
     audio->player_state = AUDIO_STATE_STOPPED;
 
@@ -293,70 +311,87 @@ int audio_stop(audio_t * audio)
 
 uint32_t audio_frames_available(audio_t * audio)
 {
-    return ring_buffer_count(audio->rb) / FRAME_SIZE;
+    return ring_buffer_count(audio->rb_in) / FRAME_SIZE;
+}
+
+uint32_t audio_frames_queued(audio_t * audio)
+{
+    return ring_buffer_count(audio->rb_out) / FRAME_SIZE;
 }
 
 uint32_t audio_read_frames(audio_t * audio, unsigned char *buffer,
                            uint32_t frames)
 {
-    uint32_t        frames_read = ring_buffer_count(audio->rb) / FRAME_SIZE;
+    uint32_t        frames_read = ring_buffer_count(audio->rb_in) / FRAME_SIZE;
 
     if (frames_read > frames)
         frames_read = frames;
 
-    ring_buffer_read(audio->rb, buffer, frames_read * FRAME_SIZE);
+    ring_buffer_read(audio->rb_in, buffer, frames_read * FRAME_SIZE);
 
     return frames_read;
 }
 
-void audio_write_frames(audio_t * audio, uint8_t * buffer, uint32_t frames)
+uint8_t        *audio_read_peek(audio_t * audio, uint32_t * frames)
+{
+    uint_fast32_t   num;
+    uint8_t        *data = ring_buffer_read_peek(audio->rb_in, &num);
+
+    *frames = num / FRAME_SIZE;
+
+    return data;
+}
+
+void audio_read_commit(audio_t * audio, uint32_t frames)
 {
-    ring_buffer_write(audio->rb, buffer, frames * FRAME_SIZE);
+    ring_buffer_read_commit(audio->rb_in, frames * FRAME_SIZE);
 }
 
-int audio_list_devices(void)
+void audio_set_threshold(audio_t * audio, uint32_t frames)
 {
-    const PaDeviceInfo *dev_info;
-    PaError         error;
-    int             i, num_devices;
+    atomic_store_explicit(&audio->threshold, frames, memory_order_relaxed);
+}
 
+void audio_set_wakeup(audio_t * audio, uint32_t frames)
+{
+    if (audio->wakeup_fd != -1)
+        atomic_store_explicit(&audio->wakeup_frames, frames,
+                              memory_order_relaxed);
+}
 
-    error = Pa_Initialize();  /** FIXME: make it quiet */
-    if (error != paNoError)
-    {
-        fprintf(stderr, "Error initializing audio %d: %s",
-                error, Pa_GetErrorText(error));
-        return 0;
-    }
+uint64_t audio_wakeup_ack(audio_t * audio)
+{
+    uint64_t        count;
+    uint64_t        wakeup_us;
 
-    num_devices = Pa_GetDeviceCount();
-    if (num_devices < 0)
-    {
-        fprintf(stderr, "ERROR: Pa_GetDeviceCount returned 0x%x\n",
-                num_devices);
-        Pa_Terminate();
+    if (read(audio->wakeup_fd, &count, sizeof(count)) != sizeof(count))
         return 0;
-    }
 
-    fprintf(stderr, "\nAvailable input / output devices:\n");
-    fprintf(stderr, " IDX  CHi CHo  Rate   Lat. (ms)  Name\n");
-    for (i = 0; i < num_devices; i++)
-    {
-        dev_info = Pa_GetDeviceInfo(i);
+    /* read the time before the callback can signal again */
+    wakeup_us = atomic_load(&audio->wakeup_us);
+    atomic_store(&audio->wakeup_pending, 0);
 
-        if (dev_info->maxInputChannels > 0)
-        {
-            fprintf(stderr, " %2d  %3d %3d %7.0f  %3.0f  %3.0f   %s\n",
-                    i, dev_info->maxInputChannels, dev_info->maxOutputChannels,
-                    dev_info->defaultSampleRate,
-                    1.e3 * dev_info->defaultLowInputLatency,
-                    1.e3 * dev_info->defaultHighInputLatency, dev_info->name);
-        }
-    }
+    return wakeup_us;
+}
 
-    fprintf(stderr, "\n");
+void audio_write_frames(audio_t * audio, uint8_t * buffer, uint32_t frames)
+{
+    if (ring_buffer_write(audio->rb_out, buffer, frames * FRAME_SIZE) <
+        frames * FRAME_SIZE)
+        audio->overflows++;
+}
+
+uint8_t        *audio_write_peek(audio_t * audio, uint32_t * frames)
+{
+    uint_fast32_t   num;
+    uint8_t        *data = ring_buffer_write_peek(audio->rb_out, &num);
 
-    Pa_Terminate();
+    *frames = num / FRAME_SIZE;
 
-    return num_devices;
+    return data;
+}
+
+void audio_write_commit(audio_t * audio, uint32_t frames)
+{
+    ring_buffer_write_commit(audio->rb_out, frames * FRAME_SIZE);
 }
@@ -9,7 +9,6 @@
 #ifndef __AUDIO_UTIL_H__
 #define __AUDIO_UTIL_H__
 
-#include <portaudio.h>
 #include <stdint.h>
 
 #include "ring_buffer.h"
@@ -17,32 +16,46 @@
 /**
  * Data structure for audio configuration and data.
  * 
- * @stream          Audio stream handle.
- * @device_info     Audio device info.
- * @input_param     Input parameters.
- * @rb              Ring buffer for storing audio data.
+ * @backend         The backend moving audio to and from the device.
+ * @backend_data    Private data of the backend.
+ * @rb_in           Ring buffer for captured audio, NULL without input.
+ * @rb_out          Ring buffer for audio to play, NULL without output.
  * @frames_tot      Total number of frames received.
  * @frames_avg      Average number of frames received per period.
  * @status_errors   Status errors received in the callback function.
- * @overflows       Number of times we wrote incoming audio data into a full
- *                  buffer
+ * @overflows       Number of times incoming audio data was dropped because the
+ *                  buffer was full. Counted by both the callback (input) and
+ *                  the main thread (output).
  * @underflows      Number of times audio output requested more frames than we
  *                  had in the buffer.
+ * @threshold       Number of frames needed to start playback.
+ * @wakeup_fd       Eventfd signalled when wakeup_frames have been captured,
+ *                  -1 without input.
+ * @wakeup_frames   Number of captured frames that trigger a wakeup; 0 turns
+ *                  the wakeup off.
+ * @wakeup_pending  Set by the callback when it signals wakeup_fd and cleared
+ *                  by audio_wakeup_ack().
+ * @wakeup_us       Time when wakeup_fd was signalled.
  * @conf            Audio configuration flags (input, output duplex).
  * @player_state    Audio player state (stopped, buffering, playing).
  */
 struct audio_data {
-    PaStream       *stream;
-    const PaDeviceInfo *device_info;
-    PaStreamParameters input_param;
+    const struct audio_backend *backend;
+    void           *backend_data;
 
-    ring_buffer_t  *rb;
+    ring_buffer_t  *rb_in;
+    ring_buffer_t  *rb_out;
 
     uint64_t        frames_tot;
     uint32_t        frames_avg;
     uint32_t        status_errors;
-    uint32_t        overflows;
-    uint32_t        underflows;
+    _Atomic uint32_t overflows;
+    _Atomic uint32_t underflows;
+    _Atomic uint32_t threshold;
+    int             wakeup_fd;
+    _Atomic uint32_t wakeup_frames;
+    _Atomic int     wakeup_pending;
+    _Atomic uint64_t wakeup_us;
     uint8_t         conf;
 
     uint8_t         player_state;
@@ -59,24 +72,53 @@ typedef struct audio_data audio_t;
 #define AUDIO_STATE_PLAYING     0x02
 
 /**
- * Initialize audio backend.
+ * Open an audio stream.
  *
+ * @param   spec    The backend and its argument as <name>[:<arg>], or NULL
+ *                  for the default (PortAudio):
+ *                    portaudio       The PortAudio device given by index.
+ *                    file:<path>     Read and/or write a 16 bit mono WAV
+ *                                    file (*.wav) or raw samples at the
+ *                                    sample rate. For duplex the argument
+ *                                    is <in>,<out>. A path of "-" is
+ *                                    stdin or stdout. Input loops at the
+ *                                    end of a file.
+ *                    fast:<path>     The same as file, but not paced in
+ *                                    real time: input runs as fast as the
+ *                                    buffer is read, output as fast as it
+ *                                    is written.
+ *                    null            Capture silence and discard output.
+ *                    alsa:<pcm>      The ALSA device with mmap access, if
+ *                                    built with ALSA=1. Options may follow
+ *                                    as /period=<frames>, /periods=<num>
+ *                                    and /measure, see audio_alsa.c.
  * @param   index   The index of the audio device to initialize.
  * @param   sample_rate Sample rate. Use 0 for default.
  * @param   conf    Audio configuration, see AUDIO_CONF_xyz.
- * @return  Pointer to the audio handle to be used for subsequent API calls.
+ * @return  Pointer to the audio handle to be used for subsequent API calls,
+ *          or NULL if an error occurred.
  * @sa      audio_list_devices()
- * @note    If audio is initialized for both input and output, it will run in
- *          full duplex mode, i.e. the callback will both read and write
- *          samples in the same call.
+ * @note    If audio is opened for both input and output, it will run in
+ *          full duplex mode, i.e. the backend will both read and write
+ *          samples in the same period. Captured audio is read with the
+ *          audio_read functions, and audio to play is written with the
+ *          audio_write functions, each using its own buffer.
+ */
+audio_t        *audio_open(const char *spec, int index, uint32_t sample_rate,
+                           uint8_t conf);
+
+/**
+ * Open an audio stream on a PortAudio device.
+ *
+ * The same as audio_open() with the default backend.
  */
 audio_t        *audio_init(int index, uint32_t sample_rate, uint8_t conf);
 
 /**
- * Close audio stream and terminate portaudio session.
+ * Close audio stream and release the device.
  *
  * @param audio The audio handle.
- * @return The error code returned by portaudio (0 means OK).
+ * @return The error code returned by the backend (0 means OK).
  */
 int             audio_close(audio_t * audio);
 
@@ -84,7 +126,7 @@ int             audio_close(audio_t * audio);
  * Start audio stream for reading.
  *
  * @param audio The audio handle.
- * @return  The error code returned by portaudio (0 means OK).
+ * @return  The error code returned by the backend (0 means OK).
  */
 int             audio_start(audio_t * audio);
 
@@ -92,12 +134,12 @@ int             audio_start(audio_t * audio);
  * Stop audio stream.
  *
  * @param audio The audio handle.
- * @return The error code returned by portaudio (0 means OK).
+ * @return The error code returned by the backend (0 means OK).
  */
 int             audio_stop(audio_t * audio);
 
 /**
- * Get number of audio frames available for read.
+ * Get number of captured audio frames available for read.
  *
  * @param audio Pointer to the audio handle.
  * @return The number of frames available in the buffer.
@@ -107,6 +149,14 @@ int             audio_stop(audio_t * audio);
  */
 uint32_t        audio_frames_available(audio_t * audio);
 
+/**
+ * Get number of audio frames waiting to be played.
+ *
+ * @param audio Pointer to the audio handle.
+ * @return The number of frames in the playback buffer.
+ */
+uint32_t        audio_frames_queued(audio_t * audio);
+
 /**
  * Read audio frames.
  *
@@ -118,16 +168,95 @@ uint32_t        audio_frames_available(audio_t * audio);
 uint32_t        audio_read_frames(audio_t * audio, unsigned char *buffer,
                                   uint32_t frames);
 
+/**
+ * Get audio frames without copying them.
+ *
+ * @param   audio     Pointer to the audio handle.
+ * @param   frames    Set to the number of frames available at the returned
+ *                    address.
+ * @return  Pointer to the oldest frame in the buffer.
+ *
+ * The frames stay in the buffer until audio_read_commit() is called. Unless
+ * the buffer could not be mirrored, all available frames are contiguous.
+ */
+uint8_t        *audio_read_peek(audio_t * audio, uint32_t * frames);
+
+/**
+ * Remove frames obtained with audio_read_peek() from the buffer.
+ *
+ * @param   audio     Pointer to the audio handle.
+ * @param   frames    The number of frames to remove.
+ */
+void            audio_read_commit(audio_t * audio, uint32_t frames);
+
+/**
+ * Set the number of frames needed to start playback.
+ *
+ * @param   audio   Pointer to the audio handle.
+ * @param   frames  The number of frames.
+ *
+ * Playback starts when the buffer holds this many frames and stops again on
+ * underflow. It can be changed while the stream is running.
+ */
+void            audio_set_threshold(audio_t * audio, uint32_t frames);
+
+/**
+ * Set the number of captured frames that signal audio->wakeup_fd.
+ *
+ * @param   audio   Pointer to the audio handle.
+ * @param   frames  The number of frames, usually one encoder frame. Use 0 to
+ *                  turn the wakeup off.
+ *
+ * The callback signals the eventfd once when the capture buffer holds at
+ * least this many frames, so the main loop can poll it instead of checking
+ * the buffer periodically. It is signalled again after audio_wakeup_ack().
+ */
+void            audio_set_wakeup(audio_t * audio, uint32_t frames);
+
+/**
+ * Acknowledge a wakeup.
+ *
+ * @param   audio   Pointer to the audio handle.
+ * @return  The time in microseconds when the wakeup was signalled, see
+ *          time_us(), or 0 if there was none.
+ *
+ * Call this when audio->wakeup_fd is readable and before reading the frames.
+ */
+uint64_t        audio_wakeup_ack(audio_t * audio);
+
 /**
  * Write audio frames.
  *
  * @param   audio   Pointer to the audio handle.
  * @param   buffer  Pointer to the buffer containing the frames to write.
  * @param   frames  The number of frames to write.
+ *
+ * Frames that do not fit in the buffer are dropped and counted as overflow.
  */
 void            audio_write_frames(audio_t * audio, uint8_t * buffer,
                                    uint32_t frames);
 
+/**
+ * Get free space in the buffer for writing frames in place.
+ *
+ * @param   audio     Pointer to the audio handle.
+ * @param   frames    Set to the number of frames that can be written at the
+ *                    returned address.
+ * @return  Pointer to the free space.
+ *
+ * The frames are played after audio_write_commit() has been called.
+ */
+uint8_t        *audio_write_peek(audio_t * audio, uint32_t * frames);
+
+/**
+ * Add frames written to the address returned by audio_write_peek() to the
+ * buffer.
+ *
+ * @param   audio     Pointer to the audio handle.
+ * @param   frames    The number of frames written.
+ */
+void            audio_write_commit(audio_t * audio, uint32_t frames);
+
 /**
  * List available audio devices.
  * 
@@ -0,0 +1,587 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#include <errno.h>
+#include <inttypes.h>           // PRIu64
+#include <math.h>
+#include <opus.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "latency.h"
+#include "wav.h"
+
+/*
+ * Benchmark of Opus encoder settings on recorded audio.
+ *
+ * Every file of the corpus is encoded and decoded with every combination
+ * of the settings given on the command line, one frame at a time like
+ * audio_server and audio_client do it. Each combination gives one line of
+ * CSV on stdout:
+ *
+ *   frame_ms, complexity, bitrate, bandwidth, application
+ *                     The settings.
+ *   frames, errors    Number of frames coded and encoder or decoder
+ *                     errors.
+ *   rtf               Real-time factor: encode plus decode time divided by
+ *                     the duration of the audio. Below 1 is faster than
+ *                     real time.
+ *   enc_p50_us, enc_p99_us, dec_p50_us, dec_p99_us
+ *                     Per-frame encode and decode time percentiles.
+ *   bytes_per_packet  Mean packet size.
+ *   kbps              Achieved bitrate.
+ *   snr_db            Signal to noise ratio of the decoded audio against
+ *                     the original, aligned by the encoder lookahead, over
+ *                     the frames without errors. It is only a proxy for
+ *                     quality; Opus does not preserve the waveform, so
+ *                     compare values between settings rather than read them
+ *                     as absolute quality.
+ *
+ * Times are wall clock times of a single thread, so the machine should be
+ * otherwise idle.
+ */
+
+/* Maximum number of values for a setting */
+#define MAX_VALUES      16
+
+/* Maximum packet size; the same as the network buffers */
+#define MAX_PACKET      1500
+
+/* Read buffer increment while loading the corpus */
+#define LOAD_CHUNK      (1 << 20)
+
+/* A list of values to benchmark */
+struct value_list {
+    int             num;
+    int             values[MAX_VALUES];
+};
+
+/* Setting values with a name */
+struct name_value {
+    const char     *name;
+    int             value;
+};
+
+/* application state and config */
+struct app_data {
+    uint32_t        sample_rate;        /* rate of the corpus */
+    struct value_list frame_us; /* frame durations */
+    struct value_list complexity;
+    struct value_list bitrate;
+    struct value_list bandwidth;        /* maximum bandwidths */
+    struct value_list application;
+};
+
+/* One file of the corpus */
+struct corpus_file {
+    const char     *name;
+    int16_t        *samples;
+    uint32_t        len;        /* number of samples */
+};
+
+/* One combination of settings */
+struct settings {
+    uint32_t        frame_us;
+    int             complexity;
+    int             bitrate;
+    int             bandwidth;
+    int             application;
+};
+
+/* Results of one combination over the whole corpus */
+struct result {
+    uint64_t        frames;
+    uint64_t        errors;
+    uint64_t        bytes;
+    uint64_t        samples;
+    uint64_t        enc_ns;
+    uint64_t        dec_ns;
+    struct histogram enc_hist;  /* per-frame encode time in ns */
+    struct histogram dec_hist;  /* per-frame decode time in ns */
+    double          signal;     /* energy of the original */
+    double          noise;      /* energy of the difference */
+};
+
+static const struct name_value bandwidths[] = {
+    {"nb", OPUS_BANDWIDTH_NARROWBAND},
+    {"mb", OPUS_BANDWIDTH_MEDIUMBAND},
+    {"wb", OPUS_BANDWIDTH_WIDEBAND},
+    {"swb", OPUS_BANDWIDTH_SUPERWIDEBAND},
+    {"fb", OPUS_BANDWIDTH_FULLBAND},
+    {NULL, 0}
+};
+
+static const struct name_value applications[] = {
+    {"voip", OPUS_APPLICATION_VOIP},
+    {"audio", OPUS_APPLICATION_AUDIO},
+    {"lowdelay", OPUS_APPLICATION_RESTRICTED_LOWDELAY},
+    {NULL, 0}
+};
+
+
+static void help(void)
+{
+    static const char help_string[] =
+        "\n Usage: bench_audio [options] <file> [<file> ...]\n"
+        "\n Encodes and decodes the files with every combination of the\n"
+        " settings and prints the results as CSV. The files are 16 bit mono\n"
+        " WAV (*.wav) or raw samples at the sample rate.\n"
+        "\n Possible options are:\n"
+        "\n"
+        "  -r <num>   Sample rate: 8000, 12000, 16000, 24000 or 48000\n"
+        "             (default is 48000).\n"
+        "  -f <list>  Frame durations in ms (default is 10,20,40).\n"
+        "  -c <list>  Complexities 0-10 (default is 1,5,10).\n"
+        "  -b <list>  Bitrates in bits per sec (default is 8000,16000,32000).\n"
+        "  -w <list>  Maximum bandwidths: nb, mb, wb, swb, fb\n"
+        "             (default is nb,wb,fb).\n"
+        "  -a <list>  Applications: voip, audio, lowdelay (default is all).\n"
+        "  -h         This help message.\n\n"
+        " Lists are comma separated, e.g. -f 2.5,5,10.\n\n";
+
+    fprintf(stderr, "%s", help_string);
+}
+
+/* Parse a comma separated list of numbers multiplied by scale, or names */
+static int parse_list(const char *arg, struct value_list *list,
+                      const struct name_value *names, double scale)
+{
+    char           *copy = strdup(arg);
+    char           *tok;
+    char           *save;
+    int             i;
+
+    if (copy == NULL)
+        return -1;
+
+    list->num = 0;
+    for (tok = strtok_r(copy, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save))
+    {
+        if (list->num == MAX_VALUES)
+        {
+            fprintf(stderr, "Too many values: %s\n", arg);
+            goto error;
+        }
+
+        if (names == NULL)
+        {
+            list->values[list->num++] = (int)lround(atof(tok) * scale);
+            continue;
+        }
+
+        for (i = 0; names[i].name != NULL; i++)
+            if (strcmp(names[i].name, tok) == 0)
+                break;
+
+        if (names[i].name == NULL)
+        {
+            fprintf(stderr, "Invalid value: %s\n", tok);
+            goto error;
+        }
+        list->values[list->num++] = names[i].value;
+    }
+
+    free(copy);
+
+    return list->num > 0 ? 0 : -1;
+
+  error:
+    free(copy);
+
+    return -1;
+}
+
+static const char *value_name(const struct name_value *names, int value)
+{
+    int             i;
+
+    for (i = 0; names[i].name != NULL; i++)
+        if (names[i].value == value)
+            return names[i].name;
+
+    return "?";
+}
+
+static void check_list(const char *arg, int res, const struct value_list *list,
+                       int min, int max)
+{
+    int             i;
+
+    for (i = 0; res == 0 && i < list->num; i++)
+        if (list->values[i] < min || list->values[i] > max)
+            res = -1;
+
+    if (res == -1)
+    {
+        fprintf(stderr, "Invalid list: %s\n", arg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Parse command line options */
+static void parse_options(int argc, char **argv, struct app_data *app)
+{
+    int             option;
+    int             res;
+    int             i;
+
+    while ((option = getopt(argc, argv, "r:f:c:b:w:a:h")) != -1)
+    {
+        switch (option)
+        {
+        case 'r':
+            app->sample_rate = (uint32_t) atof(optarg);
+            break;
+
+        case 'f':
+            res = parse_list(optarg, &app->frame_us, NULL, 1000.0);
+            for (i = 0; res == 0 && i < app->frame_us.num; i++)
+                if (!audio_frame_valid(app->frame_us.values[i]))
+                    res = -1;
+            check_list(optarg, res, &app->frame_us, 2500, 60000);
+            break;
+
+        case 'c':
+            res = parse_list(optarg, &app->complexity, NULL, 1.0);
+            check_list(optarg, res, &app->complexity, 0, 10);
+            break;
+
+        case 'b':
+            res = parse_list(optarg, &app->bitrate, NULL, 1.0);
+            check_list(optarg, res, &app->bitrate, 500, 512000);
+            break;
+
+        case 'w':
+            res = parse_list(optarg, &app->bandwidth, bandwidths, 1.0);
+            check_list(optarg, res, &app->bandwidth, INT32_MIN, INT32_MAX);
+            break;
+
+        case 'a':
+            res = parse_list(optarg, &app->application, applications, 1.0);
+            check_list(optarg, res, &app->application, INT32_MIN,
+                       INT32_MAX);
+            break;
+
+        case 'h':
+            help();
+            exit(EXIT_SUCCESS);
+
+        default:
+            help();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    switch (app->sample_rate)
+    {
+    case 8000:
+    case 12000:
+    case 16000:
+    case 24000:
+    case 48000:
+        break;
+
+    default:
+        fprintf(stderr, "Invalid sample rate: %" PRIu32 "\n",
+                app->sample_rate);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Load a file of the corpus into memory */
+static int load_file(struct corpus_file *file, const char *path,
+                     uint32_t sample_rate)
+{
+    FILE           *fp;
+    uint8_t        *data = NULL;
+    uint8_t        *new_data;
+    size_t          size = 0;
+    size_t          num;
+    long            data_len = -1;
+    uint32_t        rate = sample_rate;
+    int             res = -1;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Error opening %s: %d: %s\n", path, errno,
+                strerror(errno));
+        return -1;
+    }
+
+    if (wav_path(path) &&
+        wav_read_header(fp, path, &rate, &data_len) == -1)
+        goto cleanup;
+
+    if (rate != sample_rate)
+    {
+        fprintf(stderr, "%s: %" PRIu32 " Hz, expected %" PRIu32 " Hz\n",
+                path, rate, sample_rate);
+        goto cleanup;
+    }
+
+    do
+    {
+        new_data = realloc(data, size + LOAD_CHUNK);
+        if (new_data == NULL)
+        {
+            fprintf(stderr, "%s: Out of memory\n", path);
+            goto cleanup;
+        }
+        data = new_data;
+
+        num = fread(data + size, 1, LOAD_CHUNK, fp);
+        size += num;
+    }
+    while (num == LOAD_CHUNK);
+
+    if (data_len >= 0 && (size_t) data_len < size)
+        size = data_len;
+
+    file->name = path;
+    file->samples = (int16_t *) data;
+    file->len = size / 2;
+    data = NULL;
+    res = 0;
+
+  cleanup:
+    free(data);
+    fclose(fp);
+
+    return res;
+}
+
+static uint64_t time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Encode and decode one file, adding to the results */
+static int run_file(const struct corpus_file *file, uint32_t sample_rate,
+                    const struct settings *s, struct result *res)
+{
+    OpusEncoder    *encoder;
+    OpusDecoder    *decoder;
+    unsigned char   packet[MAX_PACKET];
+    int16_t        *out;
+    uint8_t        *failed;         /* frames with an error, by index */
+    uint32_t        frame_size = sample_rate * s->frame_us / 1000000;
+    uint32_t        pos;
+    uint32_t        i;
+    uint64_t        t0, t1, t2;
+    opus_int32      lookahead = 0;
+    double          diff;
+    int             len;
+    int             error;
+
+    out = (int16_t *) calloc(file->len, sizeof(int16_t));
+    failed = (uint8_t *) calloc(file->len / frame_size + 1, 1);
+    if (out == NULL || failed == NULL)
+    {
+        free(out);
+        free(failed);
+        return -1;
+    }
+
+    encoder = opus_encoder_create(sample_rate, 1, s->application, &error);
+    if (error != OPUS_OK)
+    {
+        fprintf(stderr, "Error creating opus encoder: %d (%s)\n",
+                error, opus_strerror(error));
+        free(out);
+        free(failed);
+        return -1;
+    }
+
+    decoder = opus_decoder_create(sample_rate, 1, &error);
+    if (error != OPUS_OK)
+    {
+        fprintf(stderr, "Error creating opus decoder: %d (%s)\n",
+                error, opus_strerror(error));
+        opus_encoder_destroy(encoder);
+        free(out);
+        free(failed);
+        return -1;
+    }
+
+    /* the same settings as audio_server */
+    opus_encoder_ctl(encoder, OPUS_SET_MAX_BANDWIDTH(s->bandwidth));
+    opus_encoder_ctl(encoder, OPUS_SET_BITRATE(s->bitrate));
+    opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(s->complexity));
+    opus_encoder_ctl(encoder, OPUS_GET_LOOKAHEAD(&lookahead));
+
+    for (pos = 0; pos + frame_size <= file->len; pos += frame_size)
+    {
+        t0 = time_ns();
+        len = opus_encode(encoder, &file->samples[pos], frame_size, packet,
+                          MAX_PACKET);
+        t1 = time_ns();
+
+        if (len < 0)
+        {
+            failed[pos / frame_size] = 1;
+            res->errors++;
+            continue;
+        }
+
+        if (opus_decode(decoder, packet, len, &out[pos], frame_size, 0) !=
+            (int)frame_size)
+        {
+            failed[pos / frame_size] = 1;
+            res->errors++;
+            continue;
+        }
+        t2 = time_ns();
+
+        res->frames++;
+        res->bytes += len;
+        res->enc_ns += t1 - t0;
+        res->dec_ns += t2 - t1;
+        hist_add(&res->enc_hist, t1 - t0);
+        hist_add(&res->dec_hist, t2 - t1);
+    }
+
+    /* the decoded audio is delayed by the encoder lookahead; frames that
+     * were not coded would only measure the error */
+    for (i = lookahead; i < pos; i++)
+    {
+        if (failed[i / frame_size])
+            continue;
+
+        diff = (double)out[i] - file->samples[i - lookahead];
+        res->signal += (double)file->samples[i - lookahead] *
+            file->samples[i - lookahead];
+        res->noise += diff * diff;
+    }
+    res->samples += pos;
+
+    opus_decoder_destroy(decoder);
+    opus_encoder_destroy(encoder);
+    free(out);
+    free(failed);
+
+    return 0;
+}
+
+static void print_header(void)
+{
+    printf("frame_ms,complexity,bitrate,bandwidth,application,frames,errors,"
+           "rtf,enc_p50_us,enc_p99_us,dec_p50_us,dec_p99_us,"
+           "bytes_per_packet,kbps,snr_db\n");
+}
+
+static void print_result(const struct settings *s, const struct result *res,
+                         uint32_t sample_rate)
+{
+    double          duration = (double)res->samples / sample_rate;
+    double          frames = res->frames ? res->frames : 1;
+
+    printf("%.1f,%d,%d,%s,%s,%" PRIu64 ",%" PRIu64 ",%.4f,%.1f,%.1f,%.1f,"
+           "%.1f,%.1f,%.2f,%.2f\n", 1.e-3 * s->frame_us, s->complexity,
+           s->bitrate, value_name(bandwidths, s->bandwidth),
+           value_name(applications, s->application), res->frames,
+           res->errors, duration > 0 ?
+           1.e-9 * (res->enc_ns + res->dec_ns) / duration : 0.0,
+           1.e-3 * hist_percentile(&res->enc_hist, 50.0),
+           1.e-3 * hist_percentile(&res->enc_hist, 99.0),
+           1.e-3 * hist_percentile(&res->dec_hist, 50.0),
+           1.e-3 * hist_percentile(&res->dec_hist, 99.0),
+           res->bytes / frames, duration > 0 ?
+           8.e-3 * res->bytes / duration : 0.0, res->noise > 0 ?
+           10.0 * log10(res->signal / res->noise) : INFINITY);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    struct app_data app = {
+        .sample_rate = 48000,
+        .frame_us = {3, {10000, 20000, 40000}},
+        .complexity = {3, {1, 5, 10}},
+        .bitrate = {3, {8000, 16000, 32000}},
+        .bandwidth = {3, {OPUS_BANDWIDTH_NARROWBAND, OPUS_BANDWIDTH_WIDEBAND,
+                          OPUS_BANDWIDTH_FULLBAND}},
+        .application = {3, {OPUS_APPLICATION_VOIP, OPUS_APPLICATION_AUDIO,
+                            OPUS_APPLICATION_RESTRICTED_LOWDELAY}},
+    };
+    struct corpus_file *files;
+    struct settings s;
+    struct result   res;
+    uint64_t        samples = 0;
+    int             num_files;
+    int             f, c, b, w, a, i;
+    int             exit_code = EXIT_FAILURE;
+
+    parse_options(argc, argv, &app);
+
+    num_files = argc - optind;
+    if (num_files < 1)
+    {
+        help();
+        exit(EXIT_FAILURE);
+    }
+
+    files = (struct corpus_file *)calloc(num_files, sizeof(*files));
+    if (files == NULL)
+        exit(EXIT_FAILURE);
+
+    for (i = 0; i < num_files; i++)
+    {
+        if (load_file(&files[i], argv[optind + i], app.sample_rate) == -1)
+            goto cleanup;
+        samples += files[i].len;
+    }
+
+    fprintf(stderr, "%s\n", opus_get_version_string());
+    fprintf(stderr, "Corpus: %d files, %.1f s at %" PRIu32 " Hz\n",
+            num_files, (double)samples / app.sample_rate, app.sample_rate);
+    fprintf(stderr, "Combinations: %d\n", app.frame_us.num *
+            app.complexity.num * app.bitrate.num * app.bandwidth.num *
+            app.application.num);
+
+    print_header();
+
+    for (a = 0; a < app.application.num; a++)
+        for (w = 0; w < app.bandwidth.num; w++)
+            for (f = 0; f < app.frame_us.num; f++)
+                for (c = 0; c < app.complexity.num; c++)
+                    for (b = 0; b < app.bitrate.num; b++)
+                    {
+                        s.frame_us = app.frame_us.values[f];
+                        s.complexity = app.complexity.values[c];
+                        s.bitrate = app.bitrate.values[b];
+                        s.bandwidth = app.bandwidth.values[w];
+                        s.application = app.application.values[a];
+
+                        memset(&res, 0, sizeof(res));
+                        for (i = 0; i < num_files; i++)
+                            if (run_file(&files[i], app.sample_rate, &s,
+                                         &res) == -1)
+                                goto cleanup;
+
+                        print_result(&s, &res, app.sample_rate);
+                    }
+
+    exit_code = EXIT_SUCCESS;
+
+  cleanup:
+    for (i = 0; i < num_files; i++)
+        free(files[i].samples);
+    free(files);
+
+    exit(exit_code);
+}
@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "common.h"
+
+/* Buffered records are written once this many bytes are collected */
+#define CAPTURE_FLUSH_LEN   (CAPTURE_BUF_LEN / 2)
+
+/* Write a block, retrying after short writes */
+static int write_all(int fd, const uint8_t * data, int len)
+{
+    ssize_t         num;
+
+    while (len > 0)
+    {
+        num = write(fd, data, len);
+        if (num == -1 && errno == EINTR)
+            continue;
+        if (num <= 0)
+            return -1;
+
+        data += num;
+        len -= num;
+    }
+
+    return 0;
+}
+
+/* Write the buffers passed on by capture_flush() */
+static void    *writer_thread(void *arg)
+{
+    struct capture *cap = (struct capture *)arg;
+    const uint8_t  *data;
+    int             len;
+
+    pthread_mutex_lock(&cap->lock);
+    for (;;)
+    {
+        while (cap->write_len == 0 && !cap->stop)
+            pthread_cond_wait(&cap->cond, &cap->lock);
+
+        if (cap->write_len == 0)
+            break;
+
+        /* the other buffer is not touched until write_len is cleared */
+        data = cap->buf[!cap->fill];
+        len = cap->write_len;
+        pthread_mutex_unlock(&cap->lock);
+
+        if (write_all(cap->fd, data, len) == -1)
+        {
+            fprintf(stderr, "Error writing capture file: %d: %s\n", errno,
+                    strerror(errno));
+            pthread_mutex_lock(&cap->lock);
+            cap->lost += len;
+        }
+        else
+        {
+            pthread_mutex_lock(&cap->lock);
+        }
+
+        cap->write_len = 0;
+    }
+    pthread_mutex_unlock(&cap->lock);
+
+    return NULL;
+}
+
+int capture_open(struct capture *cap, const char *path)
+{
+    char            magic[CAPTURE_MAGIC_LEN];
+    int             error;
+
+    cap->fill = 0;
+    cap->len = 0;
+    cap->write_len = 0;
+    cap->stop = 0;
+    cap->lost = 0;
+    cap->records = 0;
+    cap->dropped = 0;
+
+    cap->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (cap->fd == -1)
+    {
+        fprintf(stderr, "Error opening capture file %s: %d: %s\n", path,
+                errno, strerror(errno));
+        return -1;
+    }
+
+    if (read(cap->fd, magic, CAPTURE_MAGIC_LEN) == 0)
+    {
+        /* new file */
+        memcpy(cap->buf[0], CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+        cap->len = CAPTURE_MAGIC_LEN;
+    }
+    else if (memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN))
+    {
+        fprintf(stderr, "%s is not a capture file\n", path);
+        close(cap->fd);
+        cap->fd = -1;
+        return -1;
+    }
+
+    pthread_mutex_init(&cap->lock, NULL);
+    pthread_cond_init(&cap->cond, NULL);
+
+    error = pthread_create(&cap->thread, NULL, writer_thread, cap);
+    if (error)
+    {
+        fprintf(stderr, "Error starting capture thread: %d: %s\n", error,
+                strerror(error));
+        pthread_cond_destroy(&cap->cond);
+        pthread_mutex_destroy(&cap->lock);
+        close(cap->fd);
+        cap->fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void put_le(uint8_t * out, uint64_t value, int bytes)
+{
+    int             i;
+
+    for (i = 0; i < bytes; i++, value >>= 8)
+        out[i] = value & 0xFF;
+}
+
+static uint64_t get_le(const uint8_t * in, int bytes)
+{
+    uint64_t        value = 0;
+
+    while (bytes--)
+        value = (value << 8) | in[bytes];
+
+    return value;
+}
+
+void capture_packet(struct capture *cap, int src, int chan,
+                    const uint8_t * pkt, int len)
+{
+    uint8_t        *rec;
+
+    if (cap->fd == -1)
+        return;
+
+    if (cap->len + CAPTURE_HDR_LEN + len > CAPTURE_BUF_LEN)
+    {
+        cap->dropped++;
+        return;
+    }
+
+    rec = &cap->buf[cap->fill][cap->len];
+    put_le(&rec[0], time_us(), 8);
+    put_le(&rec[8], len, 2);
+    rec[10] = src;
+    rec[11] = chan;
+    memcpy(&rec[CAPTURE_HDR_LEN], pkt, len);
+
+    cap->len += CAPTURE_HDR_LEN + len;
+    cap->records++;
+
+    if (cap->len >= CAPTURE_FLUSH_LEN)
+        capture_flush(cap);
+}
+
+int capture_flush(struct capture *cap)
+{
+    int             res = -1;
+
+    if (cap->fd == -1 || cap->len == 0)
+        return 0;
+
+    /* keep filling the current buffer while the thread is busy */
+    pthread_mutex_lock(&cap->lock);
+    if (cap->write_len == 0)
+    {
+        cap->write_len = cap->len;
+        cap->fill = !cap->fill;
+        cap->len = 0;
+        pthread_cond_signal(&cap->cond);
+        res = 0;
+    }
+    pthread_mutex_unlock(&cap->lock);
+
+    return res;
+}
+
+void capture_close(struct capture *cap)
+{
+    if (cap->fd == -1)
+        return;
+
+    /* the thread writes what it has been given before it exits */
+    pthread_mutex_lock(&cap->lock);
+    cap->stop = 1;
+    pthread_cond_signal(&cap->cond);
+    pthread_mutex_unlock(&cap->lock);
+    pthread_join(cap->thread, NULL);
+
+    if (write_all(cap->fd, cap->buf[cap->fill], cap->len) == -1)
+        cap->lost += cap->len;
+
+    if (cap->lost)
+        fprintf(stderr, "Error writing capture file; %" PRIu64
+                " bytes lost\n", cap->lost);
+
+    pthread_cond_destroy(&cap->cond);
+    pthread_mutex_destroy(&cap->lock);
+    close(cap->fd);
+    cap->fd = -1;
+}
+
+int capture_read(int fd, uint64_t * time, int *src, int *chan,
+                 uint8_t * data)
+{
+    uint8_t         hdr[CAPTURE_HDR_LEN];
+    ssize_t         num;
+    int             len;
+
+    num = read(fd, hdr, CAPTURE_HDR_LEN);
+    if (num == 0)
+        return 0;
+
+    if (num != CAPTURE_HDR_LEN)
+        return -1;
+
+    *time = get_le(&hdr[0], 8);
+    len = get_le(&hdr[8], 2);
+    *src = hdr[10];
+    *chan = hdr[11];
+
+    if (read(fd, data, len) != len)
+        return -1;
+
+    return len;
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * @file
+ * Capture of the control traffic.
+ *
+ * Every packet parsed by transfer_data() can be appended to a capture file.
+ * The file starts with the 8 byte magic CAPTURE_MAGIC followed by records:
+ *
+ *     time   8 bytes   monotonic time in microseconds
+ *     len    2 bytes   length of data
+ *     src    1 byte    CAPTURE_SRC_UART or CAPTURE_SRC_NET
+ *     chan   1 byte    client slot on the server, otherwise 0
+ *     data   len bytes the packet as received, including invalid ones
+ *
+ * All integers are little endian. The source also gives the direction:
+ * packets from the UART are going to the network and vice versa.
+ *
+ * Records are collected in memory and passed in large blocks to a thread
+ * that writes them, so a slow file system never blocks the caller. If the
+ * thread can not keep up, records are dropped.
+ *
+ * Records are appended to an existing file, so a file can hold several
+ * sessions. The time of each session starts at the boot of its host.
+ */
+
+#define CAPTURE_MAGIC       "IC706CAP"
+#define CAPTURE_MAGIC_LEN   8
+#define CAPTURE_HDR_LEN     12
+
+#define CAPTURE_SRC_UART    0
+#define CAPTURE_SRC_NET     1
+
+/* Size of the write buffer */
+#define CAPTURE_BUF_LEN     65536
+
+/* Period of capture_flush() calls, so that the last records of a quiet
+ * link reach the file before a crash */
+#define CAPTURE_FLUSH_MS    1000
+
+/**
+ * Capture file.
+ *
+ * @fd         The file descriptor or -1 if capture is off.
+ * @buf        Two buffers; one is filled while the other is written.
+ * @fill       Index of the buffer being filled.
+ * @len        Number of bytes in the buffer being filled.
+ * @write_len  Number of bytes in the other buffer left for the writer
+ *             thread; 0 when it is idle.
+ * @stop       Set to make the writer thread exit.
+ * @lost       Number of bytes the writer thread failed to write.
+ * @thread     The writer thread.
+ * @lock       Protects write_len, fill (while the thread runs), stop and
+ *             lost.
+ * @cond       Signals a new buffer to write or stop.
+ * @records    Number of records captured.
+ * @dropped    Number of records dropped because buf was full.
+ */
+struct capture {
+    int             fd;
+    uint8_t         buf[2][CAPTURE_BUF_LEN];
+    int             fill;
+    int             len;
+    int             write_len;
+    int             stop;
+    uint64_t        lost;
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    uint64_t        records;
+    uint64_t        dropped;
+};
+
+/**
+ * Open capture file.
+ *
+ * @param  cap   The capture.
+ * @param  path  The file name. Records are appended if the file exists.
+ * @retval  0    OK.
+ * @retval -1    The file could not be opened, is not a capture file or the
+ *               writer thread could not be started.
+ */
+int             capture_open(struct capture *cap, const char *path);
+
+/**
+ * Add packet to the capture.
+ *
+ * @param  cap   The capture.
+ * @param  src   CAPTURE_SRC_UART or CAPTURE_SRC_NET.
+ * @param  chan  Client slot or 0.
+ * @param  pkt   The packet.
+ * @param  len   The length of the packet.
+ */
+void            capture_packet(struct capture *cap, int src, int chan,
+                               const uint8_t * pkt, int len);
+
+/**
+ * Pass buffered records to the writer thread. This happens by itself when
+ * the buffer is half full; call it every CAPTURE_FLUSH_MS as well.
+ *
+ * @retval  0    The records were passed on or there were none.
+ * @retval -1    The thread is still writing the previous ones.
+ */
+int             capture_flush(struct capture *cap);
+
+/** Write all buffered records, stop the writer thread and close the file. */
+void            capture_close(struct capture *cap);
+
+/**
+ * Read next record from a capture file.
+ *
+ * @param  fd    The capture file, positioned after the magic.
+ * @param  time  The time of the record.
+ * @param  src   The source of the record.
+ * @param  chan  The channel of the record.
+ * @param  data  Buffer of at least 65535 bytes for the packet.
+ * @return The length of the packet, 0 at end of file or -1 on error.
+ */
+int             capture_read(int fd, uint64_t * time, int *src, int *chan,
+                             uint8_t * data);
+
+#endif
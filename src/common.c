@@ -12,8 +12,12 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
-#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <termios.h>
 #include <unistd.h>
 
@@ -83,6 +87,197 @@ int set_serial_config(int fd, int speed, int parity, int blocking)
     return 0;
 }
 
+int pty_open(char *name, int len, int *slave_fd)
+{
+    struct termios  tty;
+    int             fd;
+    int             num;
+    int             unlock = 0;
+
+    fd = open("/dev/ptmx", O_RDWR | O_NOCTTY);
+    if (fd == -1)
+        goto error;
+
+    if (ioctl(fd, TIOCSPTLCK, &unlock) == -1 || ioctl(fd, TIOCGPTN, &num) == -1)
+        goto error;
+
+    snprintf(name, len, "/dev/pts/%d", num);
+
+    *slave_fd = open(name, O_RDWR | O_NOCTTY);
+    if (*slave_fd == -1)
+        goto error;
+
+    /* binary data; no translation of any kind */
+    if (tcgetattr(*slave_fd, &tty) == 0)
+    {
+        cfmakeraw(&tty);
+        cfsetspeed(&tty, B19200);
+        tcsetattr(*slave_fd, TCSANOW, &tty);
+    }
+
+    return fd;
+
+  error:
+    fprintf(stderr, "Error creating PTY: %d: %s\n", errno, strerror(errno));
+    if (fd != -1)
+        close(fd);
+
+    return -1;
+}
+
+int evloop_init(struct evloop *loop)
+{
+    loop->num_events = 0;
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1)
+    {
+        fprintf(stderr, "Error creating epoll instance: %d: %s\n", errno,
+                strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+void evloop_close(struct evloop *loop)
+{
+    close(loop->epoll_fd);
+    loop->epoll_fd = -1;
+    loop->num_events = 0;
+}
+
+static int evloop_ctl(struct evloop *loop, int op, int fd, uint32_t events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(loop->epoll_fd, op, fd, &ev) == -1)
+    {
+        fprintf(stderr, "epoll_ctl(%d) error on FD %d: %d: %s\n", op, fd,
+                errno, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int evloop_add(struct evloop *loop, int fd, uint32_t events)
+{
+    return evloop_ctl(loop, EPOLL_CTL_ADD, fd, events);
+}
+
+int evloop_mod(struct evloop *loop, int fd, uint32_t events)
+{
+    return evloop_ctl(loop, EPOLL_CTL_MOD, fd, events);
+}
+
+int evloop_del(struct evloop *loop, int fd)
+{
+    int             i;
+
+    /* forget pending events so that they are not reported for a new file
+     * descriptor with the same number */
+    for (i = 0; i < loop->num_events; i++)
+        if (loop->events[i].data.fd == fd)
+            loop->events[i].events = 0;
+
+    return evloop_ctl(loop, EPOLL_CTL_DEL, fd, 0);
+}
+
+int evloop_wait(struct evloop *loop, int timeout_ms)
+{
+    int             res;
+
+    res = epoll_wait(loop->epoll_fd, loop->events, EVLOOP_MAX_EVENTS,
+                     timeout_ms);
+
+    loop->num_events = res > 0 ? res : 0;
+
+    return res;
+}
+
+uint32_t evloop_events(struct evloop *loop, int fd)
+{
+    int             i;
+
+    if (fd < 0)
+        return 0;
+
+    for (i = 0; i < loop->num_events; i++)
+        if (loop->events[i].data.fd == fd)
+            return loop->events[i].events;
+
+    return 0;
+}
+
+int evtimer_create(struct evloop *loop)
+{
+    int             fd;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error creating timer: %d: %s\n", errno,
+                strerror(errno));
+        return -1;
+    }
+
+    if (evloop_add(loop, fd, EPOLLIN) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+void evtimer_close(struct evloop *loop, int fd)
+{
+    if (fd < 0)
+        return;
+
+    evloop_del(loop, fd);
+    close(fd);
+}
+
+int evtimer_start(int fd, unsigned int delay_ms, unsigned int period_ms)
+{
+    struct itimerspec its;
+
+    /* a zero it_value would disarm the timer */
+    if (delay_ms == 0)
+        delay_ms = 1;
+
+    its.it_value.tv_sec = delay_ms / 1000;
+    its.it_value.tv_nsec = (delay_ms % 1000) * 1000000L;
+    its.it_interval.tv_sec = period_ms / 1000;
+    its.it_interval.tv_nsec = (period_ms % 1000) * 1000000L;
+
+    return timerfd_settime(fd, 0, &its, NULL);
+}
+
+int evtimer_stop(int fd)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+
+    return timerfd_settime(fd, 0, &its, NULL);
+}
+
+uint64_t evtimer_read(int fd)
+{
+    uint64_t        expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return 0;
+
+    return expirations;
+}
+
 int create_server_socket(int port)
 {
     struct sockaddr_in serv_addr;
@@ -115,7 +310,7 @@ int create_server_socket(int port)
         return -1;
     }
 
-    if (listen(sock_fd, 1) == -1)
+    if (listen(sock_fd, LISTEN_BACKLOG) == -1)
     {
         fprintf(stderr, "listen() error: %d: %s\n", errno, strerror(errno));
 
@@ -126,58 +321,196 @@ int create_server_socket(int port)
     return sock_fd;
 }
 
+int create_udp_socket(int port, const struct sockaddr_in *peer)
+{
+    struct sockaddr_in addr;
+    int             sock_fd;
+    int             yes = 1;
+
+    sock_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sock_fd == -1)
+    {
+        fprintf(stderr, "Error creating socket: %d: %s\n", errno,
+                strerror(errno));
+
+        return -1;
+    }
+
+    /* the server binds one socket per client to the same port */
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1)
+        fprintf(stderr, "Error setting SO_REUSEADDR: %d: %s\n", errno,
+                strerror(errno));
+
+    if (port)
+    {
+        memset(&addr, 0, sizeof(struct sockaddr_in));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(port);
+        if (bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        {
+            fprintf(stderr, "bind() error: %d: %s\n", errno, strerror(errno));
+            goto error;
+        }
+    }
+
+    if (peer != NULL &&
+        connect(sock_fd, (const struct sockaddr *)peer, sizeof(*peer)) == -1)
+    {
+        fprintf(stderr, "connect() error: %d: %s\n", errno, strerror(errno));
+        goto error;
+    }
+
+    return sock_fd;
+
+  error:
+    close(sock_fd);
+
+    return -1;
+}
+
+/* Discard packets that have already been processed and move any partial
+ * packet to the beginning of the buffer */
+static void compact_buffer(struct xfr_buf *buffer)
+{
+    if (buffer->rdidx > 0)
+    {
+        buffer->wridx -= buffer->rdidx;
+        if (buffer->wridx > 0)
+            memmove(buffer->data, &buffer->data[buffer->rdidx],
+                    buffer->wridx);
+
+        buffer->rdidx = 0;
+    }
+}
+
+int append_data(struct xfr_buf *buffer, const uint8_t * data, int len)
+{
+    compact_buffer(buffer);
+
+    if (buffer->wridx + len > RDBUF_SIZE)
+    {
+        buffer->invalid_pkts++;
+        return -1;
+    }
+
+    memcpy(&buffer->data[buffer->wridx], data, len);
+    buffer->wridx += len;
+
+    return 0;
+}
+
 int read_data(int fd, struct xfr_buf *buffer)
 {
-    uint8_t        *buf = buffer->data;
-    int             type = PKT_TYPE_INCOMPLETE;
-    size_t          num;
+    int             num;
 
-    /* read data */
-    num = read(fd, &buf[buffer->wridx], RDBUF_SIZE - buffer->wridx);
+    compact_buffer(buffer);
+
+    /* buffer is full without containing a complete packet; drop data */
+    if (buffer->wridx == RDBUF_SIZE)
+    {
+        buffer->invalid_pkts++;
+        buffer->wridx = 0;
+    }
 
+    num = read(fd, &buffer->data[buffer->wridx], RDBUF_SIZE - buffer->wridx);
     if (num > 0)
     {
         buffer->wridx += num;
-
-        /* There is at least one character in the buffer.
-         *
-         * If buf[0] = 0xFE then this is a regular packet. Check if
-         * buf[end] = 0xFD, if yes, the packet is complete and return
-         * the packet type.
-         *
-         * If buf[0] = 0x00 and wridx = 1 then this is an EOS packet.
-         * If buf[0] = 0x00 and wridx > 1 then this is an invalid
-         * packet (does not start with 0xFE).
-         */
-        if (buf[0] == 0xFE)
-        {
-            if (buf[buffer->wridx - 1] == 0xFD)
-                type = buf[1];
-            else
-                type = PKT_TYPE_INCOMPLETE;
-        }
-        else if ((buf[0] == 0x00) && (buffer->wridx == 1))
-        {
-            type = PKT_TYPE_EOS;
-        }
-        else
-        {
-            type = PKT_TYPE_INVALID;
-        }
     }
     else if (num == 0)
     {
-        type = PKT_TYPE_EOF;
         fprintf(stderr, "Received EOF from FD %d\n", fd);
     }
-    else
+    else if (errno != EAGAIN && errno != EWOULDBLOCK)
     {
-        type = PKT_TYPE_INVALID;
         fprintf(stderr, "Error reading from FD %d: %d: %s\n", fd, errno,
                 strerror(errno));
     }
 
-    return type;
+    return num;
+}
+
+int next_packet(struct xfr_buf *buffer)
+{
+    uint8_t        *buf = buffer->data;
+    uint8_t        *end;
+    int             start = buffer->rdidx;
+    int             i;
+
+    buffer->pkt = NULL;
+    buffer->pkt_len = 0;
+
+    if (start >= buffer->wridx)
+        return PKT_TYPE_INCOMPLETE;
+
+    buffer->pkt = &buf[start];
+
+    if (buf[start] == 0xFE)
+    {
+        /* find the end of the packet; a new preamble before the end means
+         * that the current packet is truncated */
+        for (i = start + 1; i < buffer->wridx; i++)
+            if (buf[i] == 0xFD || buf[i] == 0xFE)
+                break;
+
+        if (i == buffer->wridx)
+        {
+            /* wait for more data */
+            buffer->pkt = NULL;
+            return PKT_TYPE_INCOMPLETE;
+        }
+
+        if (buf[i] == 0xFE || i - start < 2)
+        {
+            /* truncated packet or 0xFE 0xFD without type */
+            buffer->rdidx = buf[i] == 0xFE ? i : i + 1;
+            buffer->pkt_len = buffer->rdidx - start;
+            return PKT_TYPE_INVALID;
+        }
+
+        buffer->rdidx = i + 1;
+        buffer->pkt_len = i + 1 - start;
+
+        return buf[start + 1];
+    }
+
+    if (buf[start] == 0x00 && start == buffer->wridx - 1)
+    {
+        /* EOS is a single 0x00 outside a packet at the end of a read; a
+         * run of zeros is line noise or a break */
+        buffer->rdidx++;
+        buffer->pkt_len = 1;
+
+        return PKT_TYPE_EOS;
+    }
+
+    /* garbage; resynchronize on the next preamble */
+    end = memchr(&buf[start], 0xFE, buffer->wridx - start);
+    buffer->rdidx = end ? end - buf : buffer->wridx;
+    buffer->pkt_len = buffer->rdidx - start;
+
+    return PKT_TYPE_INVALID;
+}
+
+/* Send packet to ofd or to the output function of the buffer */
+static int output_packet(int ofd, struct xfr_buf *buffer, int type,
+                         const uint8_t * pkt, int len)
+{
+    if (buffer->output != NULL)
+        return buffer->output(buffer->output_data, type, pkt, len) != 0;
+
+    return write(ofd, pkt, len) != len;
+}
+
+/* Send reply to ifd or to the reply function of the buffer */
+static int reply_packet(int ifd, struct xfr_buf *buffer, int type,
+                        const uint8_t * pkt, int len)
+{
+    if (buffer->reply != NULL)
+        return buffer->reply(buffer->reply_data, type, pkt, len) != 0;
+
+    return write(ifd, pkt, len) != len;
 }
 
 int transfer_data(int ifd, int ofd, struct xfr_buf *buffer)
@@ -186,37 +519,45 @@ int transfer_data(int ifd, int ofd, struct xfr_buf *buffer)
     uint8_t         init2_resp[] = { 0xFE, 0xF1, 0xFD };
     int             pkt_type;
 
-    pkt_type = read_data(ifd, buffer);
+    pkt_type = next_packet(buffer);
+    if (buffer->input != NULL && pkt_type != PKT_TYPE_INCOMPLETE)
+        pkt_type = buffer->input(buffer->input_data, buffer, pkt_type);
+
     switch (pkt_type)
     {
     case PKT_TYPE_KEEPALIVE:
         /* emulated on server side; do not forward */
-        buffer->wridx = 0;
         buffer->valid_pkts++;
 
     case PKT_TYPE_INIT1:
         /* Sent by the first unit that is powered on.
            Expects PKT_TYPE_INIT1 + PKT_TYPE_INIT2 in response. */
-        buffer->write_errors += write(ifd, init1_resp, 3) != 3;
-        buffer->write_errors += write(ifd, init2_resp, 3) != 3;
-        buffer->wridx = 0;
+        buffer->write_errors += reply_packet(ifd, buffer, PKT_TYPE_INIT1,
+                                             init1_resp, 3);
+        buffer->write_errors += reply_packet(ifd, buffer, PKT_TYPE_INIT2,
+                                             init2_resp, 3);
         buffer->valid_pkts++;
         break;
 
     case PKT_TYPE_INIT2:
         /* Sent by the panel when powered on and the radio is already on.
            Expects PKT_TYPE_INIT2 in response. */
-        buffer->write_errors += write(ifd, init2_resp, 3);
-        buffer->wridx = 0;
+        buffer->write_errors += reply_packet(ifd, buffer, PKT_TYPE_INIT2,
+                                             init2_resp, 3);
         buffer->valid_pkts++;
         break;
 
     case PKT_TYPE_PWK:
-        /* Power on/off message sent by panel; leave handling to server */
+    case PKT_TYPE_CAPS:
+    case PKT_TYPE_TSTAMP:
+    case PKT_TYPE_TSTAMP_ECHO:
+    case PKT_TYPE_CONTROL:
+        /* Power on/off message sent by panel, client capabilities,
+           latency measurement or control token; leave handling to server
+           and client */
 #if DEBUG
-        print_buffer(ifd, ofd, buffer->data, buffer->wridx);
+        print_buffer(ifd, ofd, buffer->pkt, buffer->pkt_len);
 #endif
-        buffer->wridx = 0;
         buffer->valid_pkts++;
         break;
 
@@ -225,18 +566,20 @@ int transfer_data(int ifd, int ofd, struct xfr_buf *buffer)
 
     case PKT_TYPE_INVALID:
         buffer->invalid_pkts++;
-        buffer->wridx = 0;
+        break;
+
+    case PKT_TYPE_LCD_DELTA:
+        /* not decoded by the input function */
+        buffer->invalid_pkts++;
         break;
 
     default:
-        /* we also "send" on EOF packet because buffer may not be empty */
 #if DEBUG
-        print_buffer(ifd, ofd, buffer->data, buffer->wridx);
+        print_buffer(ifd, ofd, buffer->pkt, buffer->pkt_len);
 #endif
-        buffer->write_errors +=
-            write(ofd, buffer->data, buffer->wridx) != buffer->wridx;
+        buffer->write_errors += output_packet(ofd, buffer, pkt_type,
+                                              buffer->pkt, buffer->pkt_len);
 
-        buffer->wridx = 0;
         buffer->valid_pkts++;
     }
 
@@ -245,20 +588,20 @@ int transfer_data(int ifd, int ofd, struct xfr_buf *buffer)
 
 uint64_t time_ms(void)
 {
-    struct timeval  tval;
+    struct timespec tspec;
 
-    gettimeofday(&tval, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &tspec);
 
-    return 1e3 * tval.tv_sec + 1e-3 * tval.tv_usec;
+    return 1000ULL * tspec.tv_sec + tspec.tv_nsec / 1000000;
 }
 
 uint64_t time_us(void)
 {
-    struct timeval  tval;
+    struct timespec tspec;
 
-    gettimeofday(&tval, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &tspec);
 
-    return 1e6 * tval.tv_sec + tval.tv_usec;
+    return 1000000ULL * tspec.tv_sec + tspec.tv_nsec / 1000;
 }
 
 int send_keepalive(int fd)
@@ -280,93 +623,178 @@ void send_pwr_message(int fd, int poweron)
                 strerror(errno));
 }
 
-int pwk_init(void)
+int send_caps(int fd, uint8_t caps)
 {
-    int             fd;
-    int             wr_err = 0;
+    uint8_t         msg[] = { 0xFE, 0xA1, 0x00, 0xFD };
+
+    msg[2] = caps;
+
+    return (write(fd, msg, 4) != 4);
+}
+
+int send_audio_frame(int fd, uint32_t frame_us)
+{
+    uint8_t         msg[] = { 0xFE, 0xA5, 0x00, 0xFD };
 
+    msg[2] = frame_us / AUDIO_FRAME_UNIT_US;
 
-    /*  Export GPIO7 unless it is already exported */
-    if (access("/sys/class/gpio/gpio7", F_OK) == -1)
+    return (write(fd, msg, 4) != 4);
+}
+
+int audio_frame_valid(uint32_t frame_us)
+{
+    switch (frame_us)
     {
-        /*  $ echo 7 > /sys/class/gpio/export */
-        fd = open("/sys/class/gpio/export", O_WRONLY);
-        if (fd < 0)
-            return -1;
+    case 2500:
+    case 5000:
+    case 10000:
+    case 20000:
+    case 40000:
+    case 60000:
+        return 1;
 
-        wr_err += write(fd, "7", 1) != 1;
-        close(fd);
+    default:
+        return 0;
     }
+}
 
-    /*  $ echo "in" > /sys/class/gpio/gpio7/direction */
-    fd = open("/sys/class/gpio/gpio7/direction", O_WRONLY);
-    if (fd < 0)
-        return -1;
+#define SYSFS_GPIO_DIR "/sys/class/gpio/"
+#define MAX_GPIO_BUF   100
 
-    wr_err += write(fd, "in", 2) != 2;
-    close(fd);
+/* Directory containing the GPIO files; see gpio_set_dir() */
+static char     gpio_dir[MAX_GPIO_BUF] = SYSFS_GPIO_DIR;
+static int      gpio_fake = 0;
 
-    /*  $ echo 1 > /sys/class/gpio/gpio7/active_low */
-    fd = open("/sys/class/gpio/gpio7/active_low", O_WRONLY);
-    if (fd < 0)
-        return -1;
+void gpio_set_dir(const char *dir)
+{
+    snprintf(gpio_dir, sizeof(gpio_dir), "%s/", dir);
+    gpio_fake = 1;
 
-    wr_err += write(fd, "1", 1) != 1;
-    close(fd);
+    /* errors show up when the files are opened */
+    mkdir(dir, 0755);
+}
+
+int gpio_events(void)
+{
+    return gpio_fake ? EPOLLIN : EPOLLPRI;
+}
+
+/*
+ * Write value to a file in the GPIO directory.
+ *
+ * Returns -1 if the file can not be opened, 1 in case of a write error and
+ * 0 if successful. Missing files are created in the fake GPIO directory.
+ */
+static int gpio_write(const char *name, const char *value)
+{
+    char            buf[2 * MAX_GPIO_BUF];
+    int             len = strlen(value);
+    int             wr_err;
+    int             fd;
 
-    /*  $ echo "falling" > /sys/class/gpio/gpio7/edge  */
-    fd = open("/sys/class/gpio/gpio7/edge", O_WRONLY);
+    snprintf(buf, sizeof(buf), "%s%s", gpio_dir, name);
+    fd = open(buf, gpio_fake ? O_WRONLY | O_CREAT | O_TRUNC : O_WRONLY,
+              0644);
     if (fd < 0)
         return -1;
 
-    wr_err += write(fd, "falling", 7) != 7;
+    wr_err = write(fd, value, len) != len;
     close(fd);
 
-    fd = open("/sys/class/gpio/gpio7/value", O_RDONLY);
+    return wr_err;
+}
 
-    if (wr_err)
-        fprintf(stderr, "Write errors during PWK_INIT: %d\n", wr_err);
+/* Export GPIO unless it is already exported; returns like gpio_write() */
+static int gpio_export(unsigned int gpio)
+{
+    char            buf[2 * MAX_GPIO_BUF];
 
-    return fd;
-}
+    snprintf(buf, sizeof(buf), "%sgpio%u", gpio_dir, gpio);
+    if (access(buf, F_OK) == 0)
+        return 0;
 
+    if (gpio_fake)
+        return mkdir(buf, 0755);
 
-#define SYSFS_GPIO_DIR "/sys/class/gpio/"
-#define MAX_GPIO_BUF   100
+    snprintf(buf, sizeof(buf), "%u", gpio);
 
-int gpio_init_out(unsigned int gpio)
+    return gpio_write("export", buf);
+}
+
+int pwk_init(void)
 {
-    int             fd;
-    int             len;
+    static const char *const setup[][2] = {
+        {"gpio7/direction", "in"},
+        {"gpio7/active_low", "1"},
+        {"gpio7/edge", "falling"},
+    };
+    char            buf[2 * MAX_GPIO_BUF];
     int             wr_err = 0;
-    char            buf[MAX_GPIO_BUF];
+    int             res;
+    int             fd;
+    unsigned int    i;
+
+    res = gpio_export(7);
+    if (res < 0)
+        return -1;
 
+    wr_err += res;
 
-    /* check whether GPIO is already exported, if not, export it */
-    snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "gpio%d", gpio);
-    if (access(buf, F_OK) == -1)
+    for (i = 0; i < sizeof(setup) / sizeof(setup[0]); i++)
     {
-        /* export GPIO */
-        fd = open(SYSFS_GPIO_DIR "export", O_WRONLY);
-        if (fd < 0)
+        res = gpio_write(setup[i][0], setup[i][1]);
+        if (res < 0)
             return -1;
 
-        len = snprintf(buf, sizeof(buf), "%d", gpio);
-        wr_err += write(fd, buf, len) != len;
-        close(fd);
+        wr_err += res;
+    }
+
+    snprintf(buf, sizeof(buf), "%sgpio7/value", gpio_dir);
+    if (gpio_fake)
+    {
+        /* The fake input is a FIFO; "echo -n 0 > gpio7/value" presses the
+         * button. Start with the button released so that the first read
+         * does not block. */
+        if (mkfifo(buf, 0644) == -1 && errno != EEXIST)
+            return -1;
+
+        fd = open(buf, O_RDWR | O_NONBLOCK);
+        if (fd >= 0)
+            wr_err += write(fd, "1", 1) != 1;
     }
+    else
+    {
+        fd = open(buf, O_RDONLY);
+    }
+
+    if (wr_err)
+        fprintf(stderr, "Write errors during PWK_INIT: %d\n", wr_err);
+
+    return fd;
+}
+
+int gpio_init_out(unsigned int gpio)
+{
+    char            buf[MAX_GPIO_BUF];
+    int             wr_err = 0;
+    int             res;
+
+    res = gpio_export(gpio);
+    if (res < 0)
+        return -1;
+
+    wr_err += res;
 
     /* set direction to "out" */
-    snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "gpio%d/direction", gpio);
-    fd = open(buf, O_WRONLY);
-    if (fd < 0)
+    snprintf(buf, sizeof(buf), "gpio%u/direction", gpio);
+    res = gpio_write(buf, "out");
+    if (res < 0)
         return -1;
 
-    wr_err += write(fd, "out", 3) != 3;
-    close(fd);
+    wr_err += res;
 
     /* intialize with a 0 */
-    if (gpio_set_value(20, 0) < 0)
+    if (gpio_set_value(gpio, 0) < 0)
         return -1;
 
     if (wr_err)
@@ -380,21 +808,9 @@ int gpio_init_out(unsigned int gpio)
 
 int gpio_set_value(unsigned int gpio, unsigned int value)
 {
-    int             fd;
-    int             wr_err = 0;
     char            buf[MAX_GPIO_BUF];
 
-    snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "gpio%d/value", gpio);
-    fd = open(buf, O_WRONLY);
-    if (fd < 0)
-        return -1;
-
-    if (value == 1)
-        wr_err += write(fd, "1", 1) != 1;
-    else
-        wr_err += write(fd, "0", 1) != 1;
-
-    close(fd);
+    snprintf(buf, sizeof(buf), "gpio%u/value", gpio);
 
-    return -wr_err;
+    return gpio_write(buf, value == 1 ? "1" : "0") ? -1 : 0;
 }
@@ -9,7 +9,9 @@
 #ifndef __COMMON_H__
 #define __COMMON_H__
 
+#include <netinet/in.h>
 #include <stdint.h>
+#include <sys/epoll.h>
 
 /* Use 1 = debug, 0 = release */
 #define DEBUG 0
@@ -17,13 +19,19 @@
 /* Read buffer size */
 #define RDBUF_SIZE 2048
 
-/* Amount of time in micorseconds we sleep in the main loop between cycles */
-#define LOOP_DELAY_US 1000
+/* Maximum number of events returned by a single evloop_wait() */
+#define EVLOOP_MAX_EVENTS 16
+
+/* Maximum number of pending connections on a server socket */
+#define LISTEN_BACKLOG 8
 
 /* default network ports */
 #define DEFAULT_CTL_PORT   42000
 #define DEFAULT_AUDIO_PORT 42001
 
+/* local UDP port where ic706_client sends PTT packets to audio_client */
+#define DEFAULT_PTT_PORT   42002
+
 
 /* The following lines define different types of packets sent between
  * radio and panel.
@@ -74,14 +82,92 @@
  */
 #define PKT_TYPE_PWK        0xA0
 
+/* Capabilities supported by the client, sent client->server after connect:
+ * 0xFE 0xA1 <flags> 0xFD
+ */
+#define PKT_TYPE_CAPS       0xA1
+#define CAP_LCD_DELTA       0x01        /* client can decode LCD deltas */
+#define CAP_OBSERVER        0x02        /* client never takes control */
+#define CAP_TIMESTAMP       0x04        /* client measures latency */
+
+/* Delta coded PKT_TYPE_LCD sent server->client, see lcd_delta.h */
+#define PKT_TYPE_LCD_DELTA  0xA2
+
+/* Latency measurement in both directions, see latency.h */
+#define PKT_TYPE_TSTAMP         0xA3
+#define PKT_TYPE_TSTAMP_ECHO    0xA4
+
+/* Opus frame duration requested by the audio client after connect, in units
+ * of AUDIO_FRAME_UNIT_US:
+ * 0xFE 0xA5 <duration> 0xFD
+ */
+#define PKT_TYPE_AUDIO_FRAME    0xA5
+#define AUDIO_FRAME_UNIT_US     500
+
+/* Control token state sent server->client when it changes:
+ * 0xFE 0xA6 0x01 0xFD -- the client has control
+ * 0xFE 0xA6 0x00 0xFD -- the client has lost control
+ */
+#define PKT_TYPE_CONTROL        0xA6
+
+
+struct xfr_buf;
+
+/**
+ * Input function called by transfer_data() for every packet it finds,
+ * before the packet is handled, e.g. to capture or decode it.
+ *
+ * @param data    The input_data of the xfr_buf.
+ * @param buffer  The buffer. buffer->pkt and buffer->pkt_len may be pointed
+ *                to another packet that is handled instead.
+ * @param type    The packet type.
+ * @return The type of the packet to handle; never PKT_TYPE_INCOMPLETE.
+ */
+typedef int     (*xfr_input_fn) (void *data, struct xfr_buf * buffer,
+                                 int type);
+
+/**
+ * Output function used by transfer_data() instead of writing to ofd, or
+ * for the INIT replies instead of writing to ifd.
+ *
+ * @param data  The output_data of the xfr_buf.
+ * @param type  The packet type.
+ * @param pkt   The packet.
+ * @param len   The length of the packet.
+ * @return 0 if the packet was sent or queued, otherwise an error.
+ */
+typedef int     (*xfr_output_fn) (void *data, int type, const uint8_t * pkt,
+                                  int len);
 
 /* convenience struct for data transfers */
 struct xfr_buf {
     uint8_t         data[RDBUF_SIZE];
     int             wridx;              /* next available write slot. */
+    int             rdidx;              /* first byte not yet parsed */
+    uint8_t        *pkt;                /* packet found by next_packet() */
+    int             pkt_len;            /* length of pkt in bytes */
     uint32_t        write_errors;       /* write errors */
     uint64_t        valid_pkts;         /* number of valid packets */
     uint64_t        invalid_pkts;       /* number of invalid packets */
+    xfr_input_fn    input;              /* input function or NULL */
+    void           *input_data;         /* user data for input */
+    xfr_output_fn   output;             /* output function or NULL */
+    void           *output_data;        /* user data for output */
+    xfr_output_fn   reply;              /* reply function or NULL */
+    void           *reply_data;         /* user data for reply */
+};
+
+/**
+ * Event loop based on epoll.
+ *
+ * @epoll_fd    The epoll instance.
+ * @num_events  Number of events returned by the last evloop_wait().
+ * @events      The events returned by the last evloop_wait().
+ */
+struct evloop {
+    int             epoll_fd;
+    int             num_events;
+    struct epoll_event events[EVLOOP_MAX_EVENTS];
 };
 
 /**
@@ -93,31 +179,75 @@ struct xfr_buf {
  */
 int             create_server_socket(int port);
 
+/**
+ * Create a non-blocking UDP socket.
+ *
+ * @param  port  Local port to bind to or 0 for any.
+ * @param  peer  Peer address to connect to or NULL.
+ * @return The file descriptor of the socket or -1 if an error occurred.
+ *
+ * SO_REUSEADDR is set so that the server can bind a connected socket for
+ * each client to the port it receives new clients on.
+ */
+int             create_udp_socket(int port, const struct sockaddr_in *peer);
+
 /**
  * Read data from file descriptor.
  *
  * @param  fd      The file descriptor.
- * @param  buffer  Pointer to the serial_buffer structure to use.
- * @returns The packet type if the packet is complete.
+ * @param  buffer  Pointer to the xfr_buf structure to use.
+ * @return The number of bytes read, 0 on EOF or -1 if an error occurred
+ *         (errno is set).
  *
- * This function will read all available data from the UART and put the
- * data into the buffer starting at index buffer->wridx. When the read
- * is finished buffer->wridx will again point to the first available
- * slot in buffer, which mneans that it is also equal to the number of
- * bytes in the buffer.
+ * This function will read as much data as is available from the file
+ * descriptor, up to the free space in the buffer, and append it to the
+ * data starting at index buffer->wridx. Data that has already been parsed
+ * by next_packet() is discarded before the read so that a partial packet
+ * left over from a previous read is moved to the beginning of the buffer.
  *
- * If the last byte read was 0xFD the packet is considered complete
- * and the function will return the packet type. The caller can use this
- * information to decide whether the packet should be forwarded to the
- * network interface.
+ * The function does not look at the data; use next_packet() or
+ * transfer_data() to extract the packets.
+ */
+int             read_data(int fd, struct xfr_buf *buffer);
+
+/**
+ * Append data to a buffer.
  *
- * If the last byte is not 0xFD then the read is only partial and the
- * function returns PKT_TYPE_INCOMPLETE to indicate this to the caller.
+ * @param  buffer  Pointer to the xfr_buf structure to use.
+ * @param  data    The data, e.g. packets received in a datagram.
+ * @param  len     The length of data.
+ * @retval  0      The data was appended.
+ * @retval -1      There is not enough room; the data is dropped and counted
+ *                 as invalid packet.
  *
- * @bug We assume that 0xFD can only occur as the last byte during a
- *      read() op, which is not always the case.
+ * Like read_data(), parsed data is discarded first.
  */
-int             read_data(int fd, struct xfr_buf *buffer);
+int             append_data(struct xfr_buf *buffer, const uint8_t * data,
+                            int len);
+
+/**
+ * Find the next complete packet in the buffer.
+ *
+ * @param  buffer  Pointer to the xfr_buf structure to use.
+ * @return The packet type or PKT_TYPE_INCOMPLETE if there are no more
+ *         complete packets in the buffer.
+ *
+ * The buffer is scanned starting at buffer->rdidx. When a complete packet
+ * is found buffer->pkt and buffer->pkt_len are set to point to the packet
+ * inside buffer->data (no copying takes place) and buffer->rdidx is advanced
+ * past the packet. The packet pointer is valid until the next call to
+ * read_data().
+ *
+ * A regular packet starts with 0xFE and ends with 0xFD. A 0x00 outside a
+ * packet is reported as PKT_TYPE_EOS if it is the last byte received. Any
+ * other data, including other zeros, is skipped until the next 0xFE and
+ * reported as PKT_TYPE_INVALID; the same happens when a 0xFE is found
+ * before the 0xFD terminating the current packet.
+ *
+ * Call the function repeatedly until it returns PKT_TYPE_INCOMPLETE to
+ * process every packet received in a single read.
+ */
+int             next_packet(struct xfr_buf *buffer);
 
 /**
  * Transfer data from one interface to the other.
@@ -126,20 +256,143 @@ int             read_data(int fd, struct xfr_buf *buffer);
  * @param ofd Output file descriptor.
  * @param buffer Pointer to the serial buffer structure use to collect
  *               packets from the serial port.
- * @return The packet type that was read.
+ * @return The packet type that was processed or PKT_TYPE_INCOMPLETE if
+ *         there are no more complete packets in the buffer.
+ *
+ * This function processes the next packet in the buffer, see next_packet().
+ * It does not read from ifd; that must be done using read_data() after
+ * which transfer_data() should be called until it returns
+ * PKT_TYPE_INCOMPLETE.
+ *
+ * If buffer->input is set, every packet is passed to that function first.
+ * It can replace the packet, e.g. a PKT_TYPE_LCD_DELTA by the full
+ * PKT_TYPE_LCD; delta packets that reach transfer_data() are invalid.
+ *
+ * If buffer->output is set, packets are passed to that function instead of
+ * being written to ofd. Replies to INIT packets are still written to ifd.
  *
  * @todo Some packet type are transfered, others are not
  */
 int             transfer_data(int ifd, int ofd, struct xfr_buf *buffer);
 
+/**
+ * Initialize event loop.
+ *
+ * @param  loop  Pointer to the event loop structure.
+ * @retval  0    The event loop was initialized.
+ * @retval -1    An error occurred (errno is set).
+ */
+int             evloop_init(struct evloop *loop);
+
+/** Close the event loop. The registered file descriptors are not closed. */
+void            evloop_close(struct evloop *loop);
+
+/**
+ * Add file descriptor to the event loop.
+ *
+ * @param  loop    Pointer to the event loop structure.
+ * @param  fd      The file descriptor to monitor.
+ * @param  events  The epoll events to monitor, e.g. EPOLLIN or EPOLLPRI.
+ * @retval  0      The file descriptor was added.
+ * @retval -1      An error occurred (errno is set).
+ */
+int             evloop_add(struct evloop *loop, int fd, uint32_t events);
+
+/** Change the events monitored for a file descriptor. */
+int             evloop_mod(struct evloop *loop, int fd, uint32_t events);
+
+/**
+ * Remove file descriptor from the event loop.
+ *
+ * @note Must be called before the file descriptor is closed.
+ */
+int             evloop_del(struct evloop *loop, int fd);
+
+/**
+ * Wait for events.
+ *
+ * @param  loop        Pointer to the event loop structure.
+ * @param  timeout_ms  Maximum time to wait in milliseconds; -1 waits until
+ *                     an event occurs.
+ * @return The number of file descriptors with pending events, 0 if the
+ *         timeout expired or -1 if an error occurred (errno is set).
+ *
+ * A signal will interrupt the wait and cause the function to return -1
+ * with errno set to EINTR.
+ */
+int             evloop_wait(struct evloop *loop, int timeout_ms);
+
+/**
+ * Get the events reported for a file descriptor by the last evloop_wait().
+ *
+ * @return The epoll event mask or 0 if there are no events for fd.
+ */
+uint32_t        evloop_events(struct evloop *loop, int fd);
+
+/**
+ * Create a timer and add it to the event loop.
+ *
+ * @param  loop  Pointer to the event loop structure.
+ * @return The file descriptor of the timer or -1 if an error occurred.
+ *
+ * The timer is a timerfd using CLOCK_MONOTONIC, i.e. it is not affected
+ * when the wall clock is changed. It is created in the stopped state; use
+ * evtimer_start() to arm it. When the timer expires the file descriptor
+ * becomes readable (EPOLLIN) and evtimer_read() must be called to
+ * acknowledge the expiration.
+ */
+int             evtimer_create(struct evloop *loop);
+
+/** Remove timer from the event loop and close it. */
+void            evtimer_close(struct evloop *loop, int fd);
+
+/**
+ * Start timer.
+ *
+ * @param  fd         The timer file descriptor.
+ * @param  delay_ms   Time until the first expiration in milliseconds.
+ * @param  period_ms  Period for subsequent expirations in milliseconds or 0
+ *                    for a one-shot timer.
+ * @retval  0         The timer was started.
+ * @retval -1         An error occurred (errno is set).
+ *
+ * Starting a timer that is already running will restart it.
+ */
+int             evtimer_start(int fd, unsigned int delay_ms,
+                              unsigned int period_ms);
+
+/** Stop timer. Pending expirations are discarded. */
+int             evtimer_stop(int fd);
+
+/**
+ * Acknowledge timer expirations.
+ *
+ * @param  fd  The timer file descriptor.
+ * @return The number of expirations since the last call or since the timer
+ *         was started. 0 means the timer has not expired.
+ */
+uint64_t        evtimer_read(int fd);
+
 inline void     print_buffer(int from, int to, const uint8_t * buf,
                              unsigned int len);
 int             set_serial_config(int fd, int speed, int parity, int blocking);
 
-/** Get current time in milliseconds. */
+/**
+ * Open a pseudo terminal in raw mode to stand in for the UART.
+ *
+ * @param  name      Buffer for the name of the slave device.
+ * @param  len       Size of name.
+ * @param  slave_fd  Set to a file descriptor for the slave device. It should
+ *                   be kept open; otherwise reading the master fails with
+ *                   EIO whenever no other process has the slave open.
+ * @return The file descriptor of the master device or -1 on error.
+ */
+int             pty_open(char *name, int len, int *slave_fd);
+
+/** Get current time of the monotonic clock in milliseconds. */
 uint64_t        time_ms(void);
 
-/** Get current time in microseconds. */
+/** Get current time of the monotonic clock in microseconds. */
 uint64_t        time_us(void);
 
 /**
@@ -157,6 +410,46 @@ int             send_keepalive(int fd);
  */
 void            send_pwr_message(int fd, int poweron);
 
+/**
+ * Send a PKT_TYPE_CAPS message.
+ *
+ * @param fd   The file descriptor to where the message should be sent.
+ * @param caps The supported capabilities, see CAP_xyz.
+ * @return 0 if the write was successful.
+ */
+int             send_caps(int fd, uint8_t caps);
+
+/**
+ * Send a PKT_TYPE_AUDIO_FRAME message.
+ *
+ * @param fd       The file descriptor to where the message should be sent.
+ * @param frame_us The requested Opus frame duration in microseconds.
+ * @return 0 if the write was successful.
+ */
+int             send_audio_frame(int fd, uint32_t frame_us);
+
+/**
+ * Check whether a frame duration is supported by Opus.
+ *
+ * @param frame_us The frame duration in microseconds.
+ * @return 1 for 2.5, 5, 10, 20, 40 and 60 ms, otherwise 0.
+ */
+int             audio_frame_valid(uint32_t frame_us);
+
+/**
+ * Use a fake GPIO directory instead of /sys/class/gpio.
+ *
+ * @param  dir  The directory. It is created if necessary.
+ *
+ * Intended for testing without the GPIO hardware. Missing files are created
+ * as regular files, so the output values can be inspected with cat. The PWK
+ * input is a FIFO that reports a button press when "0" is written to it.
+ */
+void            gpio_set_dir(const char *dir);
+
+/** Get the epoll events that signal a change of the PWK input. */
+int             gpio_events(void);
+
 /**
  * Initialize GPIO_7 used to sense PWK signal.
  *
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "fanout.h"
+
+/* Unsent data allowed in the kernel socket buffer before we stop writing;
+ * one packet is always passed on even if it is longer. */
+#define FANOUT_NOTSENT_LOWAT    256
+
+void fanout_pool_init(struct fanout_pool *pool)
+{
+    int             i;
+
+    pool->free = NULL;
+    for (i = 0; i < FANOUT_POOL_PKTS; i++)
+    {
+        pool->pkts[i].refs = 0;
+        pool->pkts[i].len = 0;
+        pool->pkts[i].next = pool->free;
+        pool->free = &pool->pkts[i];
+    }
+}
+
+struct fanout_pkt *fanout_pkt_get(struct fanout_pool *pool)
+{
+    struct fanout_pkt *pkt = pool->free;
+
+    if (pkt == NULL)
+        return NULL;
+
+    pool->free = pkt->next;
+    pkt->refs = 1;
+    pkt->len = 0;
+
+    return pkt;
+}
+
+void fanout_pkt_put(struct fanout_pool *pool, struct fanout_pkt *pkt)
+{
+    if (--pkt->refs > 0)
+        return;
+
+    pkt->next = pool->free;
+    pool->free = pkt;
+}
+
+void fanout_queue_init(struct fanout_queue *q, int fd, int policy,
+                       int max_pkts)
+{
+    int             yes = 1;
+    int             lowat = FANOUT_NOTSENT_LOWAT;
+
+    q->fd = fd;
+    q->policy = policy;
+    q->head = 0;
+    q->count = 0;
+    q->offset = 0;
+    q->progress_ms = time_ms();
+    q->sent = 0;
+    q->dropped = 0;
+    fanout_queue_limit(q, max_pkts);
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    /* errors are not fatal; the socket may not be TCP */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+}
+
+void fanout_queue_limit(struct fanout_queue *q, int max_pkts)
+{
+    if (max_pkts < 1)
+        max_pkts = 1;
+    else if (max_pkts > FANOUT_QUEUE_SLOTS)
+        max_pkts = FANOUT_QUEUE_SLOTS;
+
+    q->max_pkts = max_pkts;
+}
+
+/* Remove the oldest packet that has not been started */
+static int drop_oldest(struct fanout_pool *pool, struct fanout_queue *q)
+{
+    struct fanout_pkt *pkt;
+    int             first = q->head;
+
+    if (q->offset)
+    {
+        if (q->count < 2)
+            return -1;
+
+        /* move the partly written packet into the dropped one's slot */
+        first = (q->head + 1) % FANOUT_QUEUE_SLOTS;
+        pkt = q->slots[first];
+        q->slots[first] = q->slots[q->head];
+    }
+    else
+    {
+        pkt = q->slots[first];
+    }
+
+    q->head = (q->head + 1) % FANOUT_QUEUE_SLOTS;
+    q->count--;
+    q->dropped++;
+    fanout_pkt_put(pool, pkt);
+
+    return 0;
+}
+
+int fanout_queue_send(struct fanout_pool *pool, struct fanout_queue *q,
+                      struct fanout_pkt *pkt)
+{
+    while (q->count >= q->max_pkts)
+    {
+        if (q->policy == FANOUT_DROP_NEWEST || drop_oldest(pool, q) == -1)
+        {
+            q->dropped++;
+            return fanout_queue_flush(pool, q);
+        }
+    }
+
+    if (q->count == 0)
+        q->progress_ms = time_ms();
+
+    pkt->refs++;
+    q->slots[(q->head + q->count) % FANOUT_QUEUE_SLOTS] = pkt;
+    q->count++;
+
+    return fanout_queue_flush(pool, q);
+}
+
+int fanout_queue_flush(struct fanout_pool *pool, struct fanout_queue *q)
+{
+    struct iovec    iov[FANOUT_QUEUE_SLOTS];
+    struct fanout_pkt *pkt;
+    ssize_t         num;
+    int             unsent;
+    int             room;
+    int             i;
+
+    while (q->count)
+    {
+        /* the backlog is better kept here than in the socket buffer */
+        if (ioctl(q->fd, SIOCOUTQNSD, &unsent) == -1)
+            unsent = 0;
+        if (unsent >= FANOUT_NOTSENT_LOWAT)
+            return 0;
+
+        /* the first packet and as many more as fit below the low-water
+         * mark; the rest waits for the next check */
+        pkt = q->slots[q->head];
+        iov[0].iov_base = &pkt->data[q->offset];
+        iov[0].iov_len = pkt->len - q->offset;
+        room = FANOUT_NOTSENT_LOWAT - unsent - (pkt->len - q->offset);
+
+        for (i = 1; i < q->count; i++)
+        {
+            pkt = q->slots[(q->head + i) % FANOUT_QUEUE_SLOTS];
+            if (pkt->len > room)
+                break;
+
+            iov[i].iov_base = pkt->data;
+            iov[i].iov_len = pkt->len;
+            room -= pkt->len;
+        }
+
+        num = writev(q->fd, iov, i);
+        if (num == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            return -1;
+        }
+
+        q->progress_ms = time_ms();
+
+        /* release the packets that have been written in full */
+        num += q->offset;
+        while (q->count && num >= q->slots[q->head]->len)
+        {
+            num -= q->slots[q->head]->len;
+            fanout_pkt_put(pool, q->slots[q->head]);
+            q->head = (q->head + 1) % FANOUT_QUEUE_SLOTS;
+            q->count--;
+            q->sent++;
+        }
+        q->offset = num;
+    }
+
+    return 0;
+}
+
+void fanout_queue_clear(struct fanout_pool *pool, struct fanout_queue *q)
+{
+    while (q->count)
+    {
+        fanout_pkt_put(pool, q->slots[q->head]);
+        q->head = (q->head + 1) % FANOUT_QUEUE_SLOTS;
+        q->count--;
+    }
+
+    q->offset = 0;
+}
+
+int fanout_queue_pending(const struct fanout_queue *q)
+{
+    return q->count > 0;
+}
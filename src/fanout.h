@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#ifndef __FANOUT_H__
+#define __FANOUT_H__
+
+#include <stdint.h>
+
+/**
+ * @file
+ * Send the same packets to several non-blocking sockets.
+ *
+ * A packet is written once into a buffer from a shared pool and queued by
+ * reference to each client, so the cost per client is a pointer in its
+ * queue and its share of a writev(). The buffer returns to the pool when
+ * the last client has sent or dropped it.
+ *
+ * Each client has its own queue, so a slow client only loses its own
+ * packets. Data is only passed to the kernel while it has little unsent
+ * data for the socket; the backlog stays in the queue where the drop
+ * policy applies instead of adding latency in the socket buffer. A packet
+ * that has been partly written is never dropped, so the stream stays
+ * framed.
+ */
+
+/* Maximum number of clients sharing a pool */
+#define FANOUT_MAX_CLIENTS  8
+
+/* Maximum number of packets in a client queue */
+#define FANOUT_QUEUE_SLOTS  32
+
+/* Maximum length of a packet */
+#define FANOUT_PKT_LEN      1500
+
+/* Enough packets for full queues plus the one being filled */
+#define FANOUT_POOL_PKTS    (FANOUT_MAX_CLIENTS * FANOUT_QUEUE_SLOTS + 1)
+
+/* Drop policies for a full queue */
+#define FANOUT_DROP_OLDEST  0   /* keep latency low */
+#define FANOUT_DROP_NEWEST  1   /* keep the queued packets */
+
+/**
+ * Shared packet.
+ *
+ * @refs  Number of references; the packet is free when it drops to 0.
+ * @len   Length of the packet.
+ * @next  Next free packet while in the pool.
+ * @data  The packet.
+ */
+struct fanout_pkt {
+    int             refs;
+    int             len;
+    struct fanout_pkt *next;
+    uint8_t         data[FANOUT_PKT_LEN];
+};
+
+/**
+ * Pool of shared packets.
+ *
+ * @pkts  The packets.
+ * @free  List of free packets.
+ */
+struct fanout_pool {
+    struct fanout_pkt pkts[FANOUT_POOL_PKTS];
+    struct fanout_pkt *free;
+};
+
+/**
+ * Output queue of a client.
+ *
+ * @fd           The socket.
+ * @policy       What to drop when the queue is full, see FANOUT_DROP_xyz.
+ * @max_pkts     Maximum number of packets in the queue.
+ * @slots        The queued packets.
+ * @head         Index of the oldest packet.
+ * @count        Number of packets in the queue.
+ * @offset       Number of bytes of the oldest packet already written.
+ * @progress_ms  Time when the queue was last empty or data was written.
+ * @sent         Packets written in full.
+ * @dropped      Packets dropped because the queue was full.
+ */
+struct fanout_queue {
+    int             fd;
+    int             policy;
+    int             max_pkts;
+    struct fanout_pkt *slots[FANOUT_QUEUE_SLOTS];
+    int             head;
+    int             count;
+    int             offset;
+    uint64_t        progress_ms;
+    uint32_t        sent;
+    uint32_t        dropped;
+};
+
+/** Initialize a packet pool with all packets free. */
+void            fanout_pool_init(struct fanout_pool *pool);
+
+/**
+ * Get a free packet from the pool.
+ *
+ * @param  pool  The pool.
+ * @return A packet with one reference held by the caller, or NULL if the
+ *         pool is empty.
+ */
+struct fanout_pkt *fanout_pkt_get(struct fanout_pool *pool);
+
+/** Release a reference to a packet. */
+void            fanout_pkt_put(struct fanout_pool *pool,
+                               struct fanout_pkt *pkt);
+
+/**
+ * Initialize an output queue.
+ *
+ * @param  q         The queue.
+ * @param  fd        The socket. It will be switched to non-blocking mode
+ *                   and configured for low latency.
+ * @param  policy    Drop policy, see FANOUT_DROP_xyz.
+ * @param  max_pkts  Maximum number of packets in the queue, up to
+ *                   FANOUT_QUEUE_SLOTS.
+ */
+void            fanout_queue_init(struct fanout_queue *q, int fd, int policy,
+                                  int max_pkts);
+
+/** Change the maximum number of packets; excess packets are dropped later. */
+void            fanout_queue_limit(struct fanout_queue *q, int max_pkts);
+
+/**
+ * Queue a packet and write as much as possible to the socket.
+ *
+ * @param  pool  The pool the packet comes from.
+ * @param  q     The queue.
+ * @param  pkt   The packet. The queue takes its own reference.
+ * @retval  0    The packet was written, queued or dropped.
+ * @retval -1    A write error other than EAGAIN occurred (errno is set).
+ */
+int             fanout_queue_send(struct fanout_pool *pool,
+                                  struct fanout_queue *q,
+                                  struct fanout_pkt *pkt);
+
+/**
+ * Write queued packets until the socket would block or has enough unsent
+ * data.
+ *
+ * @retval  0    OK; there may still be packets left in the queue.
+ * @retval -1    A write error other than EAGAIN occurred (errno is set).
+ */
+int             fanout_queue_flush(struct fanout_pool *pool,
+                                   struct fanout_queue *q);
+
+/** Release all queued packets, e.g. before closing the socket. */
+void            fanout_queue_clear(struct fanout_pool *pool,
+                                   struct fanout_queue *q);
+
+/** Check whether there is data waiting to be written. */
+int             fanout_queue_pending(const struct fanout_queue *q);
+
+#endif
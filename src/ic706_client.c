@@ -15,23 +15,50 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include "capture.h"
 #include "common.h"
+#include "latency.h"
+#include "lcd_delta.h"
+#include "pkt_queue.h"
+#include "udp_link.h"
 
 /* GPIO pin controlling panel power */
 #define  PANEL_PWR_PIN 20
 
 static char    *uart = NULL;    /* UART port */
+static char    *capture_file = NULL;    /* capture traffic to this file */
 static char    *server_ip = NULL;       /* Server IP */
 static int      server_port = 42000;    /* Network port */
+static int      use_lcd_delta = 0;      /* request delta coded LCD packets */
+static int      observer = 0;   /* never take control of the radio */
+static int      use_timestamps = 0;     /* measure latency */
+static int      use_udp = 0;    /* connect to the server over UDP */
+static int      send_ptt = 0;   /* send PTT packets to audio_client */
+static int      ptt_fd = -1;    /* socket for the PTT packets */
+static int      in_control = 0; /* the server has given us control */
+static int      ptt_on = 0;     /* last PTT state from the panel */
 static int      keep_running = 1;       /* set to 0 to exit infinite loop */
+static int      dump_latency = 0;       /* set by SIGUSR1 */
+
+static struct latency lat;      /* round trip times of packets to server */
+static struct pkt_queue netq;   /* output queue for the TCP socket */
+static struct udp_link udp;     /* link state when using UDP */
+static struct lcd_delta lcd;    /* LCD delta decoder */
+static struct capture cap;      /* capture of received packets */
 
 void signal_handler(int signo)
 {
+    if (signo == SIGUSR1)
+    {
+        dump_latency = 1;
+        return;
+    }
+
     if (signo == SIGINT)
         fprintf(stderr, "\nCaught SIGINT\n");
     else if (signo == SIGTERM)
@@ -50,6 +77,13 @@ static void help(void)
         "  -s    Server IP (default is 127.0.0.1).\n"
         "  -p    Network port number (default is 42000).\n"
         "  -u    Uart port (default is /dev/ttyO1).\n"
+        "  -c    Capture received packets to file (see ic706_replay).\n"
+        "  -g    Use fake GPIO directory instead of /sys/class/gpio.\n"
+        "  -z    Request delta coded LCD packets from the server.\n"
+        "  -o    Observer mode; only display, never control the radio.\n"
+        "  -t    Measure latency using timestamps; print with SIGUSR1.\n"
+        "  -U    Connect to the server over UDP (implies no -z).\n"
+        "  -a    Send the PTT state to audio_client -x on this host.\n"
         "  -h    This help message.\n\n";
 
     fprintf(stderr, "%s", help_string);
@@ -62,7 +96,7 @@ static void parse_options(int argc, char **argv)
 
     if (argc > 1)
     {
-        while ((option = getopt(argc, argv, "s:p:u:h")) != -1)
+        while ((option = getopt(argc, argv, "s:p:u:c:zotUag:h")) != -1)
         {
             switch (option)
             {
@@ -78,6 +112,34 @@ static void parse_options(int argc, char **argv)
                 uart = strdup(optarg);
                 break;
 
+            case 'c':
+                capture_file = strdup(optarg);
+                break;
+
+            case 'g':
+                gpio_set_dir(optarg);
+                break;
+
+            case 'z':
+                use_lcd_delta = 1;
+                break;
+
+            case 'o':
+                observer = 1;
+                break;
+
+            case 't':
+                use_timestamps = 1;
+                break;
+
+            case 'U':
+                use_udp = 1;
+                break;
+
+            case 'a':
+                send_ptt = 1;
+                break;
+
             case 'h':
                 help();
                 exit(EXIT_SUCCESS);
@@ -90,6 +152,142 @@ static void parse_options(int argc, char **argv)
     }
 }
 
+/* Send packet to the server over the active transport */
+static int net_send(int type, const uint8_t * pkt, int len)
+{
+    if (use_udp)
+        return udp_link_send(&udp, type, pkt, len);
+
+    return pkt_queue_send(&netq, type, pkt, len);
+}
+
+/* Tell the server about our capabilities if they are not the defaults */
+static int send_client_caps(void)
+{
+    uint8_t         pkt[] = { 0xFE, PKT_TYPE_CAPS, 0x00, 0xFD };
+
+    if (!use_lcd_delta && !observer && !use_timestamps)
+        return 0;
+
+    pkt[2] = (use_lcd_delta ? CAP_LCD_DELTA : 0) |
+        (observer ? CAP_OBSERVER : 0) | (use_timestamps ? CAP_TIMESTAMP : 0);
+
+    return net_send(PKT_TYPE_CAPS, pkt, 4) != 0;
+}
+
+/* Send the PTT state to audio_client; it may not be running */
+static void relay_ptt(int on)
+{
+    uint8_t         pkt[] = { 0xFE, PKT_TYPE_PTT, 0x00, 0xFD };
+
+    if (ptt_fd == -1)
+        return;
+
+    pkt[2] = on;
+    if (write(ptt_fd, pkt, 4) == -1 && errno != ECONNREFUSED)
+        fprintf(stderr, "Error sending PTT to audio_client: %d: %s\n",
+                errno, strerror(errno));
+}
+
+/*
+ * Update the control state from the server. audio_client gets PTT only
+ * while we have control; otherwise our microphone audio would go to the
+ * rig while the server ignores our PTT, and it would block the transmit
+ * audio of the client that has control.
+ */
+static void set_control(int on)
+{
+    if (on == in_control)
+        return;
+
+    in_control = on;
+    fprintf(stderr, "Control %s\n", on ? "granted" : "released");
+
+    /* PTT pressed before the grant starts the transmit audio now; losing
+     * the control stops it */
+    if (ptt_on && !observer)
+        relay_ptt(on);
+}
+
+/* Output function for packets from the UART; queue them by priority. The
+ * timestamp is queued together with the packet so that they can not be
+ * separated by the priority queue.
+ */
+static int queue_output(void *data, int type, const uint8_t * pkt, int len)
+{
+    uint8_t         buf[PKT_QUEUE_PKT_LEN];
+
+    if (use_timestamps && len + TSTAMP_LEN <= PKT_QUEUE_PKT_LEN)
+    {
+        memcpy(buf, pkt, len);
+        len += latency_stamp(&lat, type, &buf[len]);
+        pkt = buf;
+        lat.sent++;
+    }
+
+    (void)data;
+
+    /* audio_client gates the transmit audio with PTT */
+    if (type == PKT_TYPE_PTT && len >= 4)
+    {
+        ptt_on = pkt[2] != 0;
+        if (in_control && !observer)
+            relay_ptt(ptt_on);
+    }
+
+    return net_send(type, pkt, len) != 0;
+}
+
+/* Reply function for packets from the server. The reply must not bypass
+ * the priority queue, where it could split a partly written packet, nor
+ * the UDP link layer, which drops bare datagrams.
+ */
+static int net_reply(void *data, int type, const uint8_t * pkt, int len)
+{
+    (void)data;
+
+    return net_send(type, pkt, len);
+}
+
+/* Input function for packets from the UART */
+static int uart_input(void *data, struct xfr_buf *buffer, int type)
+{
+    (void)data;
+
+    capture_packet(&cap, CAPTURE_SRC_UART, 0, buffer->pkt, buffer->pkt_len);
+
+    return type;
+}
+
+/* Input function for packets from the server; rebuilds delta coded LCD
+ * packets */
+static int net_input(void *data, struct xfr_buf *buffer, int type)
+{
+    (void)data;
+
+    if (cap.fd != -1)
+        capture_packet(&cap, CAPTURE_SRC_NET, 0, buffer->pkt,
+                       buffer->pkt_len);
+
+    if (!use_lcd_delta)
+        return type;
+
+    if (type == PKT_TYPE_LCD_DELTA)
+    {
+        if (lcd_delta_decode(&lcd, buffer->pkt, buffer->pkt_len) == -1)
+            return PKT_TYPE_INVALID;
+
+        buffer->pkt = lcd.ref;
+        buffer->pkt_len = lcd.ref_len;
+        type = PKT_TYPE_LCD;
+    }
+    else if (type == PKT_TYPE_LCD)
+    {
+        lcd_delta_update(&lcd, buffer->pkt, buffer->pkt_len);
+    }
+
+    return type;
+}
 
 int main(int argc, char **argv)
 {
@@ -101,26 +299,51 @@ int main(int argc, char **argv)
     int             poweron = 0;
     struct sockaddr_in serv_addr;
     struct xfr_buf  uart_buf, net_buf;
-    fd_set          readfds, exceptfds;
-
-    struct timeval  timeout;
+    int             pollout = 0;
+    int             udp_timer = -1;     /* drives the UDP link */
+    int             capture_timer = -1; /* flushes the capture */
+    int             udp_timeout = 0;
+    uint32_t        udp_restarts = 0;
+    struct evloop   loop;
+    uint32_t        events;
+    int             pkt_type;
     int             res;
 
     /* initialize buffers */
     uart_buf.wridx = 0;
+    uart_buf.rdidx = 0;
     uart_buf.write_errors = 0;
     uart_buf.valid_pkts = 0;
     uart_buf.invalid_pkts = 0;
     net_buf.wridx = 0;
+    net_buf.rdidx = 0;
     net_buf.write_errors = 0;
     net_buf.valid_pkts = 0;
     net_buf.invalid_pkts = 0;
 
+    uart_buf.input = NULL;
+    uart_buf.input_data = NULL;
+    uart_buf.output = queue_output;
+    uart_buf.output_data = NULL;
+    uart_buf.reply = NULL;
+    net_buf.input = NULL;
+    net_buf.input_data = NULL;
+    net_buf.output = NULL;
+    net_buf.reply = net_reply;
+    net_buf.reply_data = NULL;
+    cap.fd = -1;
+
+    /* LCD delta decoder for packets received from the server */
+    memset(&lcd, 0, sizeof(lcd));
+    latency_init(&lat);
+
     /* setup signal handler */
     if (signal(SIGINT, signal_handler) == SIG_ERR)
         printf("Warning: Can't catch SIGINT\n");
     if (signal(SIGTERM, signal_handler) == SIG_ERR)
         printf("Warning: Can't catch SIGTERM\n");
+    if (signal(SIGUSR1, signal_handler) == SIG_ERR)
+        printf("Warning: Can't catch SIGUSR1\n");
 
     parse_options(argc, argv);
     if (uart == NULL)
@@ -131,6 +354,31 @@ int main(int argc, char **argv)
     fprintf(stderr, "Using UART %s\n", uart);
     fprintf(stderr, "Using server IP %s\n", server_ip);
     fprintf(stderr, "using server port %d\n", server_port);
+    if (use_udp && use_lcd_delta)
+    {
+        /* a lost datagram would break the chain of deltas */
+        fprintf(stderr, "Delta coded LCD packets are not used over UDP\n");
+        use_lcd_delta = 0;
+    }
+
+    if (use_lcd_delta)
+    {
+        fprintf(stderr, "Using delta coded LCD packets\n");
+        net_buf.input = net_input;
+    }
+
+    if (capture_file != NULL)
+    {
+        if (capture_open(&cap, capture_file) == -1)
+            exit(EXIT_FAILURE);
+
+        fprintf(stderr, "Capturing packets to %s\n", capture_file);
+        uart_buf.input = uart_input;
+        net_buf.input = net_input;
+    }
+
+    if (evloop_init(&loop) == -1)
+        exit(EXIT_FAILURE);
 
     /* open and configure serial interface */
     uart_fd = open(uart, O_RDWR | O_NOCTTY | O_NONBLOCK);
@@ -138,6 +386,7 @@ int main(int argc, char **argv)
     {
         fprintf(stderr, "Error opening UART: %d: %s\n", errno,
                 strerror(errno));
+        evloop_close(&loop);
         exit(EXIT_FAILURE);
     }
 
@@ -186,78 +435,193 @@ int main(int argc, char **argv)
         goto cleanup;
     }
 
-    FD_ZERO(&readfds);
-    FD_ZERO(&exceptfds);
+    if (send_ptt)
+    {
+        struct sockaddr_in audio_addr;
+
+        memset(&audio_addr, 0, sizeof(audio_addr));
+        audio_addr.sin_family = AF_INET;
+        audio_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        audio_addr.sin_port = htons(DEFAULT_PTT_PORT);
+        ptt_fd = create_udp_socket(0, &audio_addr);
+        if (ptt_fd == -1)
+            goto cleanup;
+    }
+
+    evloop_add(&loop, uart_fd, EPOLLIN);
+    evloop_add(&loop, pwk_fd, gpio_events() | EPOLLERR);
+
+    if (use_udp)
+    {
+        udp_timer = evtimer_create(&loop);
+        if (udp_timer == -1)
+            goto cleanup;
+
+        evtimer_start(udp_timer, UDP_TICK_MS, UDP_TICK_MS);
+    }
+
+    if (capture_file != NULL)
+    {
+        capture_timer = evtimer_create(&loop);
+        if (capture_timer == -1)
+            goto cleanup;
+
+        evtimer_start(capture_timer, CAPTURE_FLUSH_MS, CAPTURE_FLUSH_MS);
+    }
 
     while (keep_running)
     {
-        if (net_fd == -1)
+        if (use_udp)
         {
-            net_fd = socket(AF_INET, SOCK_STREAM, 0);
+            /* there is no connection to set up; the link times out when
+             * the server disappears but keeps trying */
+            net_fd = create_udp_socket(0, &serv_addr);
             if (net_fd == -1)
-            {
-                fprintf(stderr, "Error creating socket: %d: %s\n", errno,
-                        strerror(errno));
                 goto cleanup;
-            }
         }
-
-        /* Try to connect to server */
-        if (connect(net_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr))
-            == -1)
+        else
         {
-            fprintf(stderr, "Connect error %d: %s\n", errno, strerror(errno));
-
-            /* These errors may be temporary; try again */
-            if (errno == ECONNREFUSED || errno == ENETUNREACH ||
-                errno == ETIMEDOUT)
+            if (net_fd == -1)
             {
-                sleep(1);
-                continue;
+                net_fd = socket(AF_INET, SOCK_STREAM, 0);
+                if (net_fd == -1)
+                {
+                    fprintf(stderr, "Error creating socket: %d: %s\n", errno,
+                            strerror(errno));
+                    goto cleanup;
+                }
             }
-            else
+
+            /* Try to connect to server */
+            if (connect(net_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr))
+                == -1)
             {
-                goto cleanup;
+                fprintf(stderr, "Connect error %d: %s\n", errno, strerror(errno));
+
+                /* These errors may be temporary; try again */
+                if (errno == ECONNREFUSED || errno == ENETUNREACH ||
+                    errno == ETIMEDOUT)
+                {
+                    sleep(1);
+                    continue;
+                }
+                else
+                {
+                    goto cleanup;
+                }
             }
         }
 
         connected = 1;
         fprintf(stderr, "Connected...\n");
+        evloop_add(&loop, net_fd, EPOLLIN);
+
+        /* packets to the server are queued by priority so that PTT is never
+         * delayed by other traffic */
+        if (use_udp)
+            udp_link_init(&udp, net_fd);
+        else
+            pkt_queue_init(&netq, net_fd);
+        pollout = 0;
+
+        /* the server will send a full LCD packet before any delta */
+        lcd_delta_reset(&lcd);
+        net_buf.write_errors += send_client_caps();
 
         while (keep_running && connected)
         {
-            /* FIXME: don't need to set this every time? */
-            FD_SET(net_fd, &readfds);
-            FD_SET(uart_fd, &readfds);
-            FD_SET(pwk_fd, &exceptfds);
-
-            /* previous select may have altered timeout */
-            timeout.tv_sec = 1;
-            timeout.tv_usec = 0;
-            res = select(FD_SETSIZE, &readfds, NULL, &exceptfds, &timeout);
+            if (dump_latency)
+            {
+                dump_latency = 0;
+                fprintf(stderr, "Latency statistics:\n");
+                latency_print(stderr, &lat);
+            }
 
+            res = evloop_wait(&loop, -1);
             if (res <= 0)
                 continue;
 
             /* service network socket */
-            if (FD_ISSET(net_fd, &readfds))
+            events = evloop_events(&loop, net_fd);
+            if (events & EPOLLOUT)
+                uart_buf.write_errors += pkt_queue_flush(&netq) != 0;
+
+            if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
             {
-                if (transfer_data(net_fd, uart_fd, &net_buf) == PKT_TYPE_EOF)
+                if (use_udp)
+                {
+                    if (udp_link_recv(&udp, &net_buf) == -1)
+                        fprintf(stderr, "UDP error: %d: %s\n", errno,
+                                strerror(errno));
+
+                    /* a restarted server has forgotten our capabilities
+                     * and the control */
+                    if (udp.restarts != udp_restarts)
+                    {
+                        udp_restarts = udp.restarts;
+                        set_control(0);
+                        net_buf.write_errors += send_client_caps();
+                    }
+                }
+                else if (read_data(net_fd, &net_buf) == 0)
                 {
                     fprintf(stderr, "Connection closed (FD=%d)\n", net_fd);
-                    FD_CLR(net_fd, &readfds);
+                    set_control(0);
+                    evloop_del(&loop, net_fd);
                     close(net_fd);
                     net_fd = -1;
+                    netq.fd = -1;
                     connected = 0;
+                    net_buf.wridx = 0;
+                    net_buf.rdidx = 0;
+                }
+
+                while ((pkt_type = transfer_data(net_fd, uart_fd, &net_buf))
+                       != PKT_TYPE_INCOMPLETE)
+                {
+                    if (pkt_type == PKT_TYPE_TSTAMP)
+                    {
+                        /* the preceding packet has been written to the
+                         * UART */
+                        uint8_t         echo[TSTAMP_LEN];
+                        int             len;
+
+                        len = latency_echo(net_buf.pkt, net_buf.pkt_len, echo);
+                        if (len)
+                            net_buf.write_errors +=
+                                net_send(PKT_TYPE_TSTAMP_ECHO, echo,
+                                         len) != 0;
+                    }
+                    else if (pkt_type == PKT_TYPE_TSTAMP_ECHO)
+                    {
+                        latency_update(&lat, net_buf.pkt, net_buf.pkt_len);
+                    }
+                    else if (pkt_type == PKT_TYPE_CONTROL &&
+                             net_buf.pkt_len == 4)
+                    {
+                        set_control(net_buf.pkt[2] != 0);
+                    }
                 }
             }
 
             /* service UART port */
-            if (FD_ISSET(uart_fd, &readfds))
-                transfer_data(uart_fd, net_fd, &uart_buf);
+            if (evloop_events(&loop, uart_fd) & EPOLLIN)
+            {
+                /* only a PTY used for testing can be closed */
+                res = read_data(uart_fd, &uart_buf);
+                if (res == 0 || (res == -1 && errno != EAGAIN))
+                {
+                    fprintf(stderr, "UART closed\n");
+                    keep_running = 0;
+                    break;
+                }
+
+                while (transfer_data(uart_fd, net_fd, &uart_buf) !=
+                       PKT_TYPE_INCOMPLETE) ;
+            }
 
             /* power button interrupts */
-            if (FD_ISSET(pwk_fd, &exceptfds))
+            if (evloop_events(&loop, pwk_fd) & gpio_events())
             {
                 /* FIXME: If pin is debounce-filtered and we only trigger on
                    one edge we don't really need to read the value */
@@ -277,11 +641,40 @@ int main(int argc, char **argv)
                     fprintf(stderr, "Power status: %d\n", poweron);
                     gpio_set_value(PANEL_PWR_PIN, poweron);
                     if (connected)
-                        send_pwr_message(net_fd, poweron);
+                    {
+                        uint8_t         msg[] = { 0xFE, 0xA0, 0x00, 0xFD };
+
+                        msg[2] = poweron;
+                        uart_buf.write_errors +=
+                            net_send(PKT_TYPE_PWK, msg, 4) != 0;
+                    }
                 }
             }
 
-            usleep(LOOP_DELAY_US);
+            /* retransmissions and heartbeats */
+            if (evloop_events(&loop, udp_timer) & EPOLLIN)
+            {
+                evtimer_read(udp_timer);
+                res = udp_link_timer(&udp);
+                if (res == -1 && !udp_timeout)
+                    fprintf(stderr, "No response from server\n");
+                udp_timeout = res == -1;
+            }
+
+            /* records must not wait in memory for a quiet link */
+            if (evloop_events(&loop, capture_timer) & EPOLLIN)
+            {
+                evtimer_read(capture_timer);
+                capture_flush(&cap);
+            }
+
+            /* only wait for EPOLLOUT while there is data to send */
+            if (connected && !use_udp && pkt_queue_pending(&netq) != pollout)
+            {
+                pollout = !pollout;
+                evloop_mod(&loop, net_fd,
+                           pollout ? EPOLLIN | EPOLLOUT : EPOLLIN);
+            }
         }
     }
 
@@ -289,13 +682,24 @@ int main(int argc, char **argv)
     exit_code = EXIT_SUCCESS;
 
   cleanup:
+    evtimer_close(&loop, udp_timer);
+    evtimer_close(&loop, capture_timer);
+    evloop_close(&loop);
     close(net_fd);
     close(uart_fd);
     close(pwk_fd);
+    close(ptt_fd);
     if (uart != NULL)
         free(uart);
     if (server_ip != NULL)
         free(server_ip);
+    if (capture_file != NULL)
+    {
+        capture_close(&cap);
+        free(capture_file);
+        fprintf(stderr, "Captured packets / dropped: %" PRIu64 " / %" PRIu64
+                "\n", cap.records, cap.dropped);
+    }
 
     fprintf(stderr, "  Valid packets uart / net: %" PRIu64 " / %" PRIu64 "\n",
             uart_buf.valid_pkts, net_buf.valid_pkts);
@@ -303,6 +707,20 @@ int main(int argc, char **argv)
             uart_buf.invalid_pkts, net_buf.invalid_pkts);
     fprintf(stderr, "   Write errors uart / net: %" PRIu32 " / %" PRIu32 "\n",
             uart_buf.write_errors, net_buf.write_errors);
+    if (use_udp)
+        fprintf(stderr, "UDP sent / received / dropped: %" PRIu64 " / %"
+                PRIu64 " / %" PRIu32 "\nUDP retransmits / NACKs / stale: %"
+                PRIu32 " / %" PRIu32 " / %" PRIu32 "\n", udp.sent,
+                udp.received, udp.dropped, udp.retransmits, udp.nacks,
+                udp.stale);
+    else
+        fprintf(stderr, "Packets dropped / superseded: %" PRIu32 " / %"
+                PRIu32 "\n", netq.dropped, netq.superseded);
+    if (use_lcd_delta)
+        fprintf(stderr, "LCD packets full / delta: %" PRIu64 " / %" PRIu64
+                "\n", lcd.full_pkts, lcd.delta_pkts);
+    if (use_timestamps)
+        latency_print(stderr, &lat);
 
     exit(exit_code);
 }
@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>           // PRId64 and PRIu64
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "common.h"
+
+/*
+ * Replay a capture file made with ic706_server -c or ic706_client -c.
+ *
+ * The packets received from one source are written to a PTY that can be
+ * used as UART by the server or the client. Data written by the daemon to
+ * the PTY is read and discarded.
+ *
+ * A capture file may hold several sessions, each timed from the boot of
+ * its host. A record that is older than the one before it or follows it
+ * after more than REPLAY_MAX_GAP_S starts a new session, which is replayed
+ * right after the previous one.
+ */
+
+/* Longest gap between records replayed as it was */
+#define REPLAY_MAX_GAP_S    60
+
+static char    *capture_file = NULL;    /* file to replay */
+static char    *link_name = NULL;       /* symlink to the PTY */
+static int      src = CAPTURE_SRC_UART;        /* source to replay */
+static double   speed = 1.0;    /* 0 = as fast as possible */
+static int      start_delay = 2;        /* seconds before the first packet */
+static int      keep_running = 1;       /* set to 0 to exit infinite loop */
+
+void signal_handler(int signo)
+{
+    if (signo == SIGINT)
+        fprintf(stderr, "\nCaught SIGINT\n");
+    else if (signo == SIGTERM)
+        fprintf(stderr, "\nCaught SIGTERM\n");
+    else
+        fprintf(stderr, "\nCaught signal: %d\n", signo);
+
+    keep_running = 0;
+}
+
+static void help(void)
+{
+    static const char help_string[] =
+        "\n Usage: ic706_replay [options] -f file\n"
+        "\n Possible options are:\n\n"
+        "  -f    Capture file.\n"
+        "  -r    Source to replay: uart or net (default is uart).\n"
+        "  -x    Speed factor; 0 replays as fast as possible (default is 1).\n"
+        "  -l    Create symlink with this name to the PTY.\n"
+        "  -w    Seconds to wait before the first packet (default is 2).\n"
+        "  -h    This help message.\n\n";
+
+    fprintf(stderr, "%s", help_string);
+}
+
+/* Parse command line options */
+static void parse_options(int argc, char **argv)
+{
+    int             option;
+
+    if (argc > 1)
+    {
+        while ((option = getopt(argc, argv, "f:r:x:l:w:h")) != -1)
+        {
+            switch (option)
+            {
+            case 'f':
+                capture_file = strdup(optarg);
+                break;
+
+            case 'r':
+                if (!strcmp(optarg, "uart"))
+                    src = CAPTURE_SRC_UART;
+                else if (!strcmp(optarg, "net"))
+                    src = CAPTURE_SRC_NET;
+                else
+                {
+                    help();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'x':
+                speed = atof(optarg);
+                break;
+
+            case 'l':
+                link_name = strdup(optarg);
+                break;
+
+            case 'w':
+                start_delay = atoi(optarg);
+                break;
+
+            case 'h':
+                help();
+                exit(EXIT_SUCCESS);
+
+            default:
+                help();
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int             exit_code = EXIT_FAILURE;
+    int             cap_fd = -1;
+    int             pty_fd = -1;
+    int             slave_fd = -1;
+    char            pty_name[32];
+    char            magic[CAPTURE_MAGIC_LEN];
+    static uint8_t  pkt[65536];
+    uint8_t         rdbuf[RDBUF_SIZE];
+    struct evloop   loop;
+
+    uint64_t        pkt_time, first_time = 0;
+    uint64_t        last_time = 0;
+    int             new_session = 1;
+    uint64_t        sessions = 0;
+    uint64_t        start, due, now;
+    uint64_t        packets = 0;
+    uint64_t        bytes_out = 0;
+    uint64_t        bytes_in = 0;
+    uint64_t        max_late = 0;
+    int             pkt_src, pkt_chan;
+    int             len;
+    int             timeout;
+    ssize_t         num;
+
+    if (signal(SIGINT, signal_handler) == SIG_ERR)
+        printf("Warning: Can't catch SIGINT\n");
+    if (signal(SIGTERM, signal_handler) == SIG_ERR)
+        printf("Warning: Can't catch SIGTERM\n");
+
+    parse_options(argc, argv);
+    if (capture_file == NULL)
+    {
+        help();
+        exit(EXIT_FAILURE);
+    }
+
+    if (evloop_init(&loop) == -1)
+        exit(EXIT_FAILURE);
+
+    cap_fd = open(capture_file, O_RDONLY);
+    if (cap_fd == -1)
+    {
+        fprintf(stderr, "Error opening %s: %d: %s\n", capture_file, errno,
+                strerror(errno));
+        goto cleanup;
+    }
+
+    if (read(cap_fd, magic, CAPTURE_MAGIC_LEN) != CAPTURE_MAGIC_LEN ||
+        memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN))
+    {
+        fprintf(stderr, "%s is not a capture file\n", capture_file);
+        goto cleanup;
+    }
+
+    pty_fd = pty_open(pty_name, sizeof(pty_name), &slave_fd);
+    if (pty_fd == -1)
+        goto cleanup;
+
+    fprintf(stderr, "Replaying %s packets on %s\n",
+            src == CAPTURE_SRC_UART ? "UART" : "network", pty_name);
+
+    if (link_name != NULL)
+    {
+        unlink(link_name);
+        if (symlink(pty_name, link_name) == -1)
+        {
+            fprintf(stderr, "Error creating %s: %d: %s\n", link_name, errno,
+                    strerror(errno));
+            goto cleanup;
+        }
+    }
+
+    evloop_add(&loop, pty_fd, EPOLLIN);
+
+    start = time_us() + 1000000ULL * start_delay;
+
+    while (keep_running)
+    {
+        len = capture_read(cap_fd, &pkt_time, &pkt_src, &pkt_chan, pkt);
+        if (len == 0)
+            break;
+
+        if (len == -1)
+        {
+            fprintf(stderr, "Truncated capture file\n");
+            break;
+        }
+
+        /* every source counts for the session boundaries */
+        if (pkt_time < last_time ||
+            pkt_time - last_time > 1000000ULL * REPLAY_MAX_GAP_S)
+            new_session = 1;
+        last_time = pkt_time;
+
+        if (pkt_src != src)
+            continue;
+
+        if (new_session)
+        {
+            new_session = 0;
+            first_time = pkt_time;
+            if (sessions++)
+            {
+                fprintf(stderr, "Session %" PRIu64 " starts\n", sessions);
+                start = time_us();
+            }
+        }
+
+        due = start;
+        if (speed > 0.0)
+            due += (pkt_time - first_time) / speed;
+
+        /* wait for the packet to become due; drain the PTY meanwhile */
+        for (;;)
+        {
+            now = time_us();
+            timeout = now < due ? (due - now + 999) / 1000 : 0;
+
+            if (evloop_wait(&loop, timeout) > 0 &&
+                (evloop_events(&loop, pty_fd) & EPOLLIN))
+            {
+                num = read(pty_fd, rdbuf, sizeof(rdbuf));
+                if (num > 0)
+                    bytes_in += num;
+            }
+
+            if (!keep_running || time_us() >= due)
+                break;
+        }
+
+        if (!keep_running)
+            break;
+
+        now = time_us();
+        if (now - due > max_late)
+            max_late = now - due;
+
+        if (write(pty_fd, pkt, len) != len)
+        {
+            fprintf(stderr, "Error writing to PTY: %d: %s\n", errno,
+                    strerror(errno));
+            goto cleanup;
+        }
+
+        packets++;
+        bytes_out += len;
+    }
+
+    now = time_us();
+    fprintf(stderr, "Replay finished...\n");
+    exit_code = EXIT_SUCCESS;
+
+    if (packets && now > start)
+    {
+        fprintf(stderr, "Replayed packets / bytes: %" PRIu64 " / %" PRIu64
+                "\n", packets, bytes_out);
+        if (sessions > 1)
+            fprintf(stderr, "Sessions: %" PRIu64 "\n", sessions);
+        fprintf(stderr, "Bytes read from PTY: %" PRIu64 "\n", bytes_in);
+        fprintf(stderr, "Duration: %.3f s\n", 1.e-6 * (now - start));
+        fprintf(stderr, "Rate: %.1f packets/s, %.1f bytes/s\n",
+                1.e6 * packets / (now - start),
+                1.e6 * bytes_out / (now - start));
+        fprintf(stderr, "Maximum lateness: %.3f ms\n", 1.e-3 * max_late);
+    }
+
+  cleanup:
+    evloop_close(&loop);
+    close(cap_fd);
+    close(pty_fd);
+    close(slave_fd);
+    if (link_name != NULL)
+    {
+        unlink(link_name);
+        free(link_name);
+    }
+    free(capture_file);
+
+    exit(exit_code);
+}
@@ -11,33 +11,116 @@
 #include <fcntl.h>
 #include <inttypes.h>           // PRId64 and PRIu64
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include "capture.h"
 #include "common.h"
+#include "latency.h"
+#include "lcd_delta.h"
+#include "pkt_queue.h"
+#include "udp_link.h"
 
 
 static char    *uart = NULL;    /* UART port */
+static char    *capture_file = NULL;    /* capture traffic to this file */
 static int      port = 42000;   /* Network port */
+static int      use_udp = 0;    /* also accept clients over UDP */
 static int      keep_running = 1;       /* set to 0 to exit infinite loop */
+static int      dump_latency = 0;       /* set by SIGUSR1 */
+
+/* Maximum number of connected clients; one of them may control the radio
+ * while the others only receive the radio->panel packets. */
+#define MAX_CLIENTS 8
+
+/* A client that has sent nothing, not even a TCP ACK or a UDP heartbeat,
+ * for this long is presumed dead and may be replaced by a reconnect. TCP
+ * keepalive probes are sent after CLIENT_IDLE_S of silence so that a live
+ * client always answers within this time. */
+#define CLIENT_DEAD_MS  3000
+#define CLIENT_IDLE_S   1
+#define CLIENT_PROBES   5
+
+/**
+ * Connected client.
+ *
+ * @fd          Network socket or -1 if the slot is free.
+ * @addr        Client IP address in network byte order.
+ * @udp_port    Client UDP port in network byte order; 0 for TCP clients.
+ * @caps        Capabilities reported by the client, see CAP_xyz.
+ * @lcd_resync  Set when the next LCD packet must be sent in full.
+ * @in          Buffer for data received from the client.
+ * @out         Output queue for data sent to TCP clients.
+ * @pollout     Set while waiting for EPOLLOUT.
+ * @link        UDP link state for UDP clients.
+ * @ignored     Packets ignored because the client does not have control.
+ */
+struct client {
+    int             fd;
+    uint32_t        addr;
+    uint16_t        udp_port;
+    uint8_t         caps;
+    int             lcd_resync;
+    struct xfr_buf  in;
+    struct pkt_queue out;
+    int             pollout;
+    struct udp_link link;
+    uint32_t        ignored;
+};
+
+static struct client clients[MAX_CLIENTS];
+
+/* Index of the client holding the control token or -1 if nobody has it.
+ * The token is taken by the first client sending a control packet while it
+ * is free and released when that client disconnects.
+ */
+static int      controller = -1;
+
+static struct evloop loop;
+static int      uart_fd = -1;
+static struct lcd_delta lcd;    /* LCD delta encoder shared by all clients */
+static struct latency lat;      /* round trip times of packets to clients */
+static struct capture cap;      /* capture of received packets */
+static int      pwk_timer = -1; /* resets GPIO_PWK after a pulse */
 
-/* Copy of connected client IP address in betwork byte order.
- * Used to check whether a new conection comes from a client that has
- * connected earlier but disappeared without properly disconnecting.
+/* rig_is_on is set to 1 every time we receive a PKT_TYPE_LCD. While
+ * rig_is_on=1 a PKT_TYPE_KEEPALIVE is sent to the UART every 150 ms.
+ *
+ * rig_is_on is set to 0 again when we receive a PKT_TYPE_EOS from the
+ * UART.
+ *
+ * rig_is_on is also used when we receive a power on/off message from the
+ * client.
  */
-uint32_t        client_addr = 0;
+static int      rig_is_on = 0;
+
+/* statistics of disconnected clients */
+static struct xfr_buf net_buf;
+static uint32_t dropped_pkts = 0;
+static uint32_t superseded_pkts = 0;
+static uint32_t ignored_pkts = 0;
+static uint32_t udp_retransmits = 0;
+static uint32_t udp_nacks = 0;
+static uint32_t udp_stale = 0;
 
 /* GPIO pin used to emulate PWK signal */
 #define  GPIO_PWK 20
 
 void signal_handler(int signo)
 {
+    if (signo == SIGUSR1)
+    {
+        dump_latency = 1;
+        return;
+    }
+
     if (signo == SIGINT)
         fprintf(stderr, "\nCaught SIGINT\n");
     else if (signo == SIGTERM)
@@ -56,7 +139,11 @@ static void help(void)
         "\n"
         "  -p    Network port number (default is 42000).\n"
         "  -u    Uart port (default is /dev/ttyO1).\n"
-        "  -h    This help message.\n\n";
+        "  -U    Also accept clients over UDP on the same port.\n"
+        "  -c    Capture received packets to file (see ic706_replay).\n"
+        "  -g    Use fake GPIO directory instead of /sys/class/gpio.\n"
+        "  -h    This help message.\n\n"
+        "\n Send SIGUSR1 to print latency statistics.\n\n";
 
     fprintf(stderr, "%s", help_string);
 }
@@ -68,7 +155,7 @@ static void parse_options(int argc, char **argv)
 
     if (argc > 1)
     {
-        while ((option = getopt(argc, argv, "p:u:h")) != -1)
+        while ((option = getopt(argc, argv, "p:u:Uc:g:h")) != -1)
         {
             switch (option)
             {
@@ -80,6 +167,18 @@ static void parse_options(int argc, char **argv)
                 uart = strdup(optarg);
                 break;
 
+            case 'U':
+                use_udp = 1;
+                break;
+
+            case 'c':
+                capture_file = strdup(optarg);
+                break;
+
+            case 'g':
+                gpio_set_dir(optarg);
+                break;
+
             case 'h':
                 help();
                 exit(EXIT_SUCCESS);
@@ -93,43 +192,477 @@ static void parse_options(int argc, char **argv)
 }
 
 
+/* Send packet to client without blocking. Packets that can not be sent
+ * right away are queued by priority until the socket becomes writable.
+ * Use len = 0 to flush the queue.
+ */
+static int client_send(struct client *c, int type, const uint8_t * pkt,
+                       int len)
+{
+    int             error;
+
+    if (c->udp_port)
+        return len ? udp_link_send(&c->link, type, pkt, len) : 0;
+
+    if (len)
+        error = pkt_queue_send(&c->out, type, pkt, len);
+    else
+        error = pkt_queue_flush(&c->out);
+
+    /* only wait for EPOLLOUT while there is data to send */
+    if (pkt_queue_pending(&c->out) != c->pollout)
+    {
+        c->pollout = !c->pollout;
+        evloop_mod(&loop, c->fd, c->pollout ? EPOLLIN | EPOLLOUT : EPOLLIN);
+    }
+
+    return error;
+}
+
+/* Tell a client whether it has control; ic706_client only passes PTT on
+ * to audio_client while it has */
+static void send_control(struct client *c, int on)
+{
+    uint8_t         pkt[] = { 0xFE, PKT_TYPE_CONTROL, 0x00, 0xFD };
+
+    pkt[2] = on;
+    c->in.write_errors += client_send(c, PKT_TYPE_CONTROL, pkt, 4) != 0;
+}
+
+/* Take the control token if it is free; return 1 if client has control */
+static int has_control(struct client *c)
+{
+    int             i = c - clients;
+
+    if (controller == -1 && !(c->caps & CAP_OBSERVER))
+    {
+        controller = i;
+        fprintf(stderr, "Client %d (FD=%d) has control\n", i, c->fd);
+        send_control(c, 1);
+    }
+
+    return controller == i;
+}
+
+/* Output function for packets received from a client */
+static int client_to_uart(void *data, int type, const uint8_t * pkt, int len)
+{
+    struct client  *c = (struct client *)data;
+
+    (void)type;
+
+    if (!has_control(c))
+    {
+        c->ignored++;
+        return 0;
+    }
+
+    return write(uart_fd, pkt, len) != len;
+}
+
+/* Send packet to client followed by the timestamp if the client has
+ * requested it. Both are queued together so that the timestamp can not be
+ * separated from the packet by the priority queue.
+ */
+static int client_send_stamped(struct client *c, int type,
+                               const uint8_t * pkt, int len,
+                               const uint8_t * stamp)
+{
+    uint8_t         buf[PKT_QUEUE_PKT_LEN];
+
+    if (!(c->caps & CAP_TIMESTAMP) || len + TSTAMP_LEN > PKT_QUEUE_PKT_LEN)
+        return client_send(c, type, pkt, len);
+
+    memcpy(buf, pkt, len);
+    memcpy(&buf[len], stamp, TSTAMP_LEN);
+    lat.sent++;
+
+    return client_send(c, type, buf, len + TSTAMP_LEN);
+}
+
+/* Output function for packets received from the UART; sends the packet to
+ * every client. LCD packets are delta coded once for all clients that
+ * support it.
+ */
+static int fanout(void *data, int type, const uint8_t * pkt, int len)
+{
+    uint8_t         delta[LCD_DELTA_MAX_LEN];
+    uint8_t         stamp[TSTAMP_LEN];
+    int             delta_len = 0;
+    int             use_delta = 0;
+    int             errors = 0;
+    int             i;
+
+    (void)data;
+
+    if (type == PKT_TYPE_LCD)
+    {
+        for (i = 0; i < MAX_CLIENTS; i++)
+            if (clients[i].fd != -1 && (clients[i].caps & CAP_LCD_DELTA))
+                use_delta = 1;
+
+        if (use_delta)
+            delta_len = lcd_delta_encode(&lcd, pkt, len, delta);
+        else
+            lcd_delta_update(&lcd, pkt, len);
+    }
+
+    /* one timestamp for all clients measuring latency */
+    for (i = 0; i < MAX_CLIENTS; i++)
+    {
+        if (clients[i].fd != -1 && (clients[i].caps & CAP_TIMESTAMP))
+        {
+            latency_stamp(&lat, type, stamp);
+            break;
+        }
+    }
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+    {
+        struct client  *c = &clients[i];
+
+        if (c->fd == -1)
+            continue;
+
+        /* A queued LCD packet is replaced by the new one, so the client
+         * would miss the reference for a delta. */
+        if (type != PKT_TYPE_LCD)
+        {
+            errors += client_send_stamped(c, type, pkt, len, stamp) != 0;
+        }
+        else if (delta_len && (c->caps & CAP_LCD_DELTA) && !c->lcd_resync &&
+                 !pkt_queue_count(&c->out, PKT_PRIO_LCD))
+        {
+            errors += client_send_stamped(c, PKT_TYPE_LCD_DELTA, delta,
+                                          delta_len, stamp) != 0;
+        }
+        else
+        {
+            c->lcd_resync = 0;
+            errors += client_send_stamped(c, type, pkt, len, stamp) != 0;
+        }
+    }
+
+    return errors;
+}
+
+/* Reply function for a client. The reply must not bypass the priority
+ * queue, where it could split a partly written packet, nor the UDP link
+ * layer, which drops bare datagrams.
+ */
+static int client_reply(void *data, int type, const uint8_t * pkt, int len)
+{
+    return client_send((struct client *)data, type, pkt, len);
+}
+
+/* Input function capturing packets from the UART */
+static int uart_input(void *data, struct xfr_buf *buffer, int type)
+{
+    (void)data;
+
+    capture_packet(&cap, CAPTURE_SRC_UART, 0, buffer->pkt, buffer->pkt_len);
+
+    return type;
+}
+
+/* Input function capturing packets from a client */
+static int client_input(void *data, struct xfr_buf *buffer, int type)
+{
+    struct client  *c = (struct client *)data;
+
+    capture_packet(&cap, CAPTURE_SRC_NET, c - clients, buffer->pkt,
+                   buffer->pkt_len);
+
+    return type;
+}
+
+/* Probe an idle TCP client so that client_dead() can tell a silent client
+ * from a dead one; the kernel closes the connection after CLIENT_PROBES
+ * unanswered probes */
+static void set_keepalive(int fd)
+{
+    int             yes = 1;
+    int             idle = CLIENT_IDLE_S;
+    int             probes = CLIENT_PROBES;
+
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+}
+
+static void client_open(struct client *c, int fd, uint32_t addr,
+                        uint16_t udp_port)
+{
+    c->fd = fd;
+    c->addr = addr;
+    c->udp_port = udp_port;
+    c->caps = 0;
+    c->lcd_resync = 1;
+    c->pollout = 0;
+    c->ignored = 0;
+
+    memset(&c->in, 0, sizeof(c->in));
+    c->in.input = cap.fd == -1 ? NULL : client_input;
+    c->in.input_data = c;
+    c->in.output = client_to_uart;
+    c->in.output_data = c;
+    c->in.reply = client_reply;
+    c->in.reply_data = c;
+
+    /* a slow client must never block the UART path */
+    if (udp_port)
+    {
+        udp_link_init(&c->link, fd);
+    }
+    else
+    {
+        pkt_queue_init(&c->out, fd);
+        set_keepalive(fd);
+    }
+
+    evloop_add(&loop, fd, EPOLLIN);
+}
+
+static void client_close(struct client *c)
+{
+    evloop_del(&loop, c->fd);
+    close(c->fd);
+    c->fd = -1;
+
+    net_buf.valid_pkts += c->in.valid_pkts;
+    net_buf.invalid_pkts += c->in.invalid_pkts;
+    net_buf.write_errors += c->in.write_errors;
+    ignored_pkts += c->ignored;
+    if (c->udp_port)
+    {
+        dropped_pkts += c->link.dropped;
+        udp_retransmits += c->link.retransmits;
+        udp_nacks += c->link.nacks;
+        udp_stale += c->link.stale;
+    }
+    else
+    {
+        dropped_pkts += c->out.dropped;
+        superseded_pkts += c->out.superseded;
+    }
+
+    if (controller == c - clients)
+    {
+        fprintf(stderr, "Control released\n");
+        controller = -1;
+    }
+}
+
+/* Check whether nothing has been received from a client for
+ * CLIENT_DEAD_MS */
+static int client_dead(struct client *c)
+{
+    struct tcp_info info;
+    socklen_t       len = sizeof(info);
+
+    if (c->udp_port)
+        return time_ms() - c->link.last_rx >= CLIENT_DEAD_MS;
+
+    if (getsockopt(c->fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1)
+        return 0;
+
+    return info.tcpi_state != TCP_ESTABLISHED ||
+        info.tcpi_last_ack_recv >= CLIENT_DEAD_MS;
+}
+
+/* Find the controlling client if it has the same IP address and is dead */
+static struct client *find_controller(uint32_t addr)
+{
+    if (controller != -1 && clients[controller].addr == addr &&
+        client_dead(&clients[controller]))
+        return &clients[controller];
+
+    return NULL;
+}
+
+static struct client *find_free_slot(void)
+{
+    int             i;
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+        if (clients[i].fd == -1)
+            return &clients[i];
+
+    return NULL;
+}
+
+/* Find UDP client by address */
+static struct client *find_udp_client(const struct sockaddr_in *addr)
+{
+    int             i;
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+        if (clients[i].fd != -1 && clients[i].udp_port == addr->sin_port &&
+            clients[i].addr == addr->sin_addr.s_addr)
+            return &clients[i];
+
+    return NULL;
+}
+
+/* Add new client; returns NULL if there is no free slot */
+static struct client *client_accept(int fd, const struct sockaddr_in *addr,
+                                    uint16_t udp_port)
+{
+    struct client  *c;
+
+    fprintf(stderr, "New connection from %s%s\n", inet_ntoa(addr->sin_addr),
+            udp_port ? " (UDP)" : "");
+
+    /* A new connection from the IP address of a dead controlling client
+     * means that the client has connected earlier but disappeared
+     * without properly disconnecting. It keeps the control. A live
+     * controller may share the address with an observer or with another
+     * operator behind the same NAT, so it is left alone.
+     */
+    if ((c = find_controller(addr->sin_addr.s_addr)) != NULL)
+    {
+        fprintf(stderr,
+                "Client already connected; reconnect (FD= %d -> %d)\n",
+                c->fd, fd);
+
+        client_close(c);
+        client_open(c, fd, addr->sin_addr.s_addr, udp_port);
+        controller = c - clients;
+        send_control(c, 1);
+    }
+    else if ((c = find_free_slot()) != NULL)
+    {
+        fprintf(stderr, "Connection accepted (FD=%d)\n", fd);
+        client_open(c, fd, addr->sin_addr.s_addr, udp_port);
+    }
+    else
+    {
+        fprintf(stderr, "Connection refused\n");
+        close(fd);
+    }
+
+    return c;
+}
+
+/* Process the packets received from a client */
+static void client_receive(struct client *c)
+{
+    int             i = c - clients;
+    int             pkt_type;
+
+    while ((pkt_type = transfer_data(c->fd, uart_fd, &c->in)) !=
+           PKT_TYPE_INCOMPLETE)
+    {
+        switch (pkt_type)
+        {
+        case PKT_TYPE_PWK:
+            if (!has_control(c))
+            {
+                c->ignored++;
+                break;
+            }
+
+            /* power on/off message */
+            fprintf(stderr, "POWER: %s\n", c->in.pkt[2] ? "on" : "off");
+
+            if (c->in.pkt[2] != rig_is_on)
+            {
+                /* Activate PWK line; will be reset by pwk_timer */
+                gpio_set_value(GPIO_PWK, 1);
+                evtimer_start(pwk_timer, 500, 0);
+            }
+            break;
+
+        case PKT_TYPE_CAPS:
+            /* client capabilities; a lost UDP datagram would break the
+             * chain of LCD deltas */
+            c->caps = c->in.pkt[2];
+            if (c->udp_port)
+                c->caps &= ~CAP_LCD_DELTA;
+
+            if (c->caps & CAP_LCD_DELTA)
+                fprintf(stderr, "Client %d: delta coded LCD\n", i);
+
+            if (c->caps & CAP_TIMESTAMP)
+                fprintf(stderr, "Client %d: timestamps\n", i);
+
+            if (c->caps & CAP_OBSERVER)
+            {
+                fprintf(stderr, "Client %d: observer\n", i);
+                if (controller == i)
+                {
+                    controller = -1;
+                    send_control(c, 0);
+                }
+            }
+            break;
+
+        case PKT_TYPE_TSTAMP:
+            /* the preceding packet has been written to the UART */
+            {
+                uint8_t         echo[TSTAMP_LEN];
+                int             len;
+
+                len = latency_echo(c->in.pkt, c->in.pkt_len, echo);
+                if (len)
+                    c->in.write_errors +=
+                        client_send(c, PKT_TYPE_TSTAMP_ECHO, echo, len) != 0;
+            }
+            break;
+
+        case PKT_TYPE_TSTAMP_ECHO:
+            latency_update(&lat, c->in.pkt, c->in.pkt_len);
+            break;
+        }
+    }
+}
+
 int main(int argc, char **argv)
 {
     int             exit_code = EXIT_FAILURE;
     int             sock_fd = -1;
-    int             net_fd = -1;
-    int             uart_fd = -1;
-    struct sockaddr_in serv_addr, cli_addr;
+    int             udp_fd = -1;
+    struct sockaddr_in cli_addr;
     socklen_t       cli_addr_len;
 
-    struct timeval  timeout;
-    fd_set          active_fds, read_fds;
+    struct client  *c;
+    int             keepalive_timer = -1;       /* PKT_TYPE_KEEPALIVE period */
+    int             udp_timer = -1;     /* drives the UDP links */
+    int             capture_timer = -1; /* flushes the capture */
+    uint32_t        events;
     int             res;
-    int             connected;
-    int             rig_is_on;
+    int             pkt_type;
+    int             i;
 
-    uint64_t        pwk_on_time;        /* time used when PWK line is activated */
-    uint64_t        last_keepalive;
-    uint64_t        current_time;
-
-    struct xfr_buf  uart_buf, net_buf;
+    struct xfr_buf  uart_buf;
 
     /* initialize buffers */
     uart_buf.wridx = 0;
+    uart_buf.rdidx = 0;
     uart_buf.write_errors = 0;
     uart_buf.valid_pkts = 0;
     uart_buf.invalid_pkts = 0;
-    net_buf.wridx = 0;
-    net_buf.write_errors = 0;
-    net_buf.valid_pkts = 0;
-    net_buf.invalid_pkts = 0;
-
+    uart_buf.input = NULL;
+    uart_buf.input_data = NULL;
+    uart_buf.output = fanout;
+    uart_buf.output_data = NULL;
+    uart_buf.reply = NULL;
+    cap.fd = -1;
+    memset(&net_buf, 0, sizeof(net_buf));
+    memset(&lcd, 0, sizeof(lcd));
+    latency_init(&lat);
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+        clients[i].fd = -1;
 
     /* setup signal handler */
     if (signal(SIGINT, signal_handler) == SIG_ERR)
         printf("Warning: Can't catch SIGINT\n");
     if (signal(SIGTERM, signal_handler) == SIG_ERR)
         printf("Warning: Can't catch SIGTERM\n");
+    if (signal(SIGUSR1, signal_handler) == SIG_ERR)
+        printf("Warning: Can't catch SIGUSR1\n");
 
     parse_options(argc, argv);
     if (uart == NULL)
@@ -138,12 +671,25 @@ int main(int argc, char **argv)
     fprintf(stderr, "Using network port %d\n", port);
     fprintf(stderr, "Using UART port %s\n", uart);
 
+    if (capture_file != NULL)
+    {
+        if (capture_open(&cap, capture_file) == -1)
+            exit(EXIT_FAILURE);
+
+        fprintf(stderr, "Capturing packets to %s\n", capture_file);
+        uart_buf.input = uart_input;
+    }
+
+    if (evloop_init(&loop) == -1)
+        exit(EXIT_FAILURE);
+
     /* open and configure serial interface */
     uart_fd = open(uart, O_RDWR | O_NOCTTY | O_NONBLOCK);
     if (uart_fd == -1)
     {
         fprintf(stderr, "Error opening UART: %d: %s\n", errno,
                 strerror(errno));
+        evloop_close(&loop);
         exit(EXIT_FAILURE);
     }
 
@@ -164,131 +710,163 @@ int main(int argc, char **argv)
     }
 
     /* open and configure network interface */
-    sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    sock_fd = create_server_socket(port);
     if (sock_fd == -1)
-    {
-        fprintf(stderr, "Error creating socket: %d: %s\n", errno,
-                strerror(errno));
         goto cleanup;
-    }
 
-    int             yes = 1;
+    memset(&cli_addr, 0, sizeof(struct sockaddr_in));
+    cli_addr_len = sizeof(cli_addr);
 
-    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1)
-        fprintf(stderr, "Error setting SO_REUSEADDR: %d: %s\n", errno,
-                strerror(errno));
+    evloop_add(&loop, uart_fd, EPOLLIN);
+    evloop_add(&loop, sock_fd, EPOLLIN);
 
-    /* bind socket to host address */
-    memset(&serv_addr, 0, sizeof(struct sockaddr_in));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(port);
-    if (bind(sock_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == -1)
-    {
-        fprintf(stderr, "bind() error: %d: %s\n", errno, strerror(errno));
+    keepalive_timer = evtimer_create(&loop);
+    pwk_timer = evtimer_create(&loop);
+    if (keepalive_timer == -1 || pwk_timer == -1)
         goto cleanup;
-    }
 
-    if (listen(sock_fd, 1) == -1)
+    if (use_udp)
     {
-        fprintf(stderr, "listen() error: %d: %s\n", errno, strerror(errno));
-        goto cleanup;
+        udp_fd = create_udp_socket(port, NULL);
+        udp_timer = evtimer_create(&loop);
+        if (udp_fd == -1 || udp_timer == -1)
+            goto cleanup;
+
+        fprintf(stderr, "Accepting UDP clients on port %d\n", port);
+        evloop_add(&loop, udp_fd, EPOLLIN);
+        evtimer_start(udp_timer, UDP_TICK_MS, UDP_TICK_MS);
     }
 
-    memset(&cli_addr, 0, sizeof(struct sockaddr_in));
-    cli_addr_len = sizeof(cli_addr);
+    if (capture_file != NULL)
+    {
+        capture_timer = evtimer_create(&loop);
+        if (capture_timer == -1)
+            goto cleanup;
 
-    FD_ZERO(&active_fds);
-    FD_SET(uart_fd, &active_fds);
-    FD_SET(sock_fd, &active_fds);
-
-    /* rig_is_on is set to 1 every time we receive a PKT_TYPE_LCD. While
-     * rig_is_on=1 a PKT_TYPE_KEEPALIVE is sent to the UART every 150 ms.
-     *
-     * rig_is_on is set to 0 again when we receive a PKT_TYPE_EOS from the
-     * UART.
-     *
-     * rig_is_on is also used when we receive a power on/off message from the
-     * client.
-     */
-    rig_is_on = 0;
-    connected = 0;
-    last_keepalive = 0;
-    pwk_on_time = 0;
+        evtimer_start(capture_timer, CAPTURE_FLUSH_MS, CAPTURE_FLUSH_MS);
+    }
 
     while (keep_running)
     {
-        /* check if we should send a PKT_TYPE_KEEPALIVE to the UART */
-        current_time = time_ms();
-        if (rig_is_on && (current_time - last_keepalive) > 150)
+        if (dump_latency)
         {
-            send_keepalive(uart_fd);
-            last_keepalive = current_time;
+            dump_latency = 0;
+            fprintf(stderr, "Latency statistics:\n");
+            latency_print(stderr, &lat);
         }
 
-        /* check if GPIO_PWK needs to be reset */
-        if (pwk_on_time && (current_time - pwk_on_time) > 500)
+        res = evloop_wait(&loop, -1);
+        if (res <= 0)
+            continue;
+
+        /* send PKT_TYPE_KEEPALIVE to the UART */
+        if (evloop_events(&loop, keepalive_timer) & EPOLLIN)
         {
-            gpio_set_value(GPIO_PWK, 0);
-            pwk_on_time = 0;
+            if (evtimer_read(keepalive_timer) && rig_is_on)
+                uart_buf.write_errors += send_keepalive(uart_fd);
         }
 
-        /* previous select may have altered timeout */
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 50000;
-        read_fds = active_fds;
+        /* end of PWK pulse */
+        if (evloop_events(&loop, pwk_timer) & EPOLLIN)
+        {
+            if (evtimer_read(pwk_timer))
+                gpio_set_value(GPIO_PWK, 0);
+        }
 
-        res = select(FD_SETSIZE, &read_fds, NULL, NULL, &timeout);
-        if (res <= 0)
-            continue;
+        /* records must not wait in memory for a quiet link */
+        if (evloop_events(&loop, capture_timer) & EPOLLIN)
+        {
+            evtimer_read(capture_timer);
+            capture_flush(&cap);
+        }
 
         /* service UART port */
-        if (FD_ISSET(uart_fd, &read_fds))
+        if (evloop_events(&loop, uart_fd) & EPOLLIN)
         {
-            switch (transfer_data(uart_fd, net_fd, &uart_buf))
+            /* only a PTY used for testing can be closed */
+            res = read_data(uart_fd, &uart_buf);
+            if (res == 0 || (res == -1 && errno != EAGAIN))
             {
-            case PKT_TYPE_INIT2:
-                rig_is_on = 1;
-                uart_buf.write_errors += send_keepalive(uart_fd);
-                last_keepalive = current_time;
+                fprintf(stderr, "UART closed\n");
                 break;
+            }
 
-            case PKT_TYPE_EOS:
-                rig_is_on = 0;
-                break;
+            while ((pkt_type = transfer_data(uart_fd, -1, &uart_buf)) !=
+                   PKT_TYPE_INCOMPLETE)
+            {
+                switch (pkt_type)
+                {
+                case PKT_TYPE_INIT2:
+                    rig_is_on = 1;
+                    uart_buf.write_errors += send_keepalive(uart_fd);
+                    evtimer_start(keepalive_timer, 150, 150);
+                    break;
+
+                case PKT_TYPE_EOS:
+                    rig_is_on = 0;
+                    evtimer_stop(keepalive_timer);
+                    break;
+                }
             }
         }
 
-        /* service network socket */
-        if (connected && FD_ISSET(net_fd, &read_fds))
+        /* service network sockets */
+        for (i = 0; i < MAX_CLIENTS; i++)
         {
-            switch (transfer_data(net_fd, uart_fd, &net_buf))
-            {
-            case PKT_TYPE_PWK:
-                /* power on/off message */
-                fprintf(stderr, "POWER: %s\n", net_buf.data[2] ? "on" : "off");
+            c = &clients[i];
+            if (c->fd == -1)
+                continue;
+
+            events = evloop_events(&loop, c->fd);
+            if (events & EPOLLOUT)
+                c->in.write_errors += client_send(c, 0, NULL, 0) != 0;
 
-                if (net_buf.data[2] != rig_is_on)
+            if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                continue;
+
+            if (c->udp_port)
+            {
+                res = udp_link_recv(&c->link, &c->in);
+                if (res == -1)
                 {
-                    /* Activate PWK line; will be reset by main loop */
-                    gpio_set_value(GPIO_PWK, 1);
-                    pwk_on_time = current_time;
+                    fprintf(stderr, "UDP error (FD=%d): %d: %s\n", c->fd,
+                            errno, strerror(errno));
+                    client_close(c);
+                    continue;
                 }
-                break;
+            }
+            else
+            {
+                res = read_data(c->fd, &c->in);
+                if (res == 0 || (res == -1 && errno != EAGAIN))
+                {
+                    fprintf(stderr, "Connection closed (FD=%d)\n", c->fd);
+                    client_close(c);
+                    continue;
+                }
+            }
 
-            case PKT_TYPE_EOF:
-                fprintf(stderr, "Connection closed (FD=%d)\n", net_fd);
-                FD_CLR(net_fd, &active_fds);
-                close(net_fd);
-                net_fd = -1;
-                connected = 0;
-                client_addr = 0;
-                break;
+            client_receive(c);
+        }
+
+        /* retransmissions and heartbeats of UDP clients */
+        if (evloop_events(&loop, udp_timer) & EPOLLIN)
+        {
+            evtimer_read(udp_timer);
+            for (i = 0; i < MAX_CLIENTS; i++)
+            {
+                c = &clients[i];
+                if (c->fd != -1 && c->udp_port &&
+                    udp_link_timer(&c->link) == -1)
+                {
+                    fprintf(stderr, "Client timed out (FD=%d)\n", c->fd);
+                    client_close(c);
+                }
             }
         }
 
         /* check if there are any new connections pending */
-        if (FD_ISSET(sock_fd, &read_fds))
+        if (evloop_events(&loop, sock_fd) & EPOLLIN)
         {
             int             new = accept(sock_fd, (struct sockaddr *)&cli_addr,
                                          &cli_addr_len);
@@ -300,48 +878,64 @@ int main(int argc, char **argv)
                 goto cleanup;
             }
 
-            fprintf(stderr, "New connection from %s\n",
-                    inet_ntoa(cli_addr.sin_addr));
+            client_accept(new, &cli_addr, 0);
+        }
 
-            if (!connected)
-            {
-                fprintf(stderr, "Connection accepted (FD=%d)\n", new);
-                net_fd = new;
-                client_addr = cli_addr.sin_addr.s_addr;
-                FD_SET(net_fd, &active_fds);
-                connected = 1;
-            }
-            else if (client_addr == cli_addr.sin_addr.s_addr)
-            {
-                /* this is the same client reconnecting */
-                fprintf(stderr,
-                        "Client already connected; reconnect (FD= %d -> %d)\n",
-                        net_fd, new);
-
-                FD_CLR(net_fd, &active_fds);
-                close(net_fd);
-                net_fd = new;
-                FD_SET(net_fd, &active_fds);
-            }
-            else
+        /* New UDP clients. Datagrams arrive here until the client has its
+         * own connected socket. */
+        if (evloop_events(&loop, udp_fd) & EPOLLIN)
+        {
+            uint8_t         dgram[UDP_MAX_LEN];
+            ssize_t         num;
+            int             new;
+
+            while ((num = recvfrom(udp_fd, dgram, sizeof(dgram), 0,
+                                   (struct sockaddr *)&cli_addr,
+                                   &cli_addr_len)) >= 0)
             {
-                fprintf(stderr, "Connection refused\n");
-                close(new);
+                c = find_udp_client(&cli_addr);
+                if (c == NULL)
+                {
+                    new = create_udp_socket(port, &cli_addr);
+                    if (new == -1)
+                        continue;
+
+                    c = client_accept(new, &cli_addr, cli_addr.sin_port);
+                    if (c == NULL)
+                        continue;
+                }
+
+                udp_link_input(&c->link, &c->in, dgram, num);
+                client_receive(c);
             }
         }
-
-        usleep(LOOP_DELAY_US);
     }
 
     fprintf(stderr, "Shutting down...\n");
     exit_code = EXIT_SUCCESS;
 
   cleanup:
+    for (i = 0; i < MAX_CLIENTS; i++)
+        if (clients[i].fd != -1)
+            client_close(&clients[i]);
+
+    evtimer_close(&loop, keepalive_timer);
+    evtimer_close(&loop, pwk_timer);
+    evtimer_close(&loop, udp_timer);
+    evtimer_close(&loop, capture_timer);
+    evloop_close(&loop);
     close(uart_fd);
-    close(net_fd);
     close(sock_fd);
+    close(udp_fd);
     if (uart != NULL)
         free(uart);
+    if (capture_file != NULL)
+    {
+        capture_close(&cap);
+        free(capture_file);
+        fprintf(stderr, "Captured packets / dropped: %" PRIu64 " / %" PRIu64
+                "\n", cap.records, cap.dropped);
+    }
 
     fprintf(stderr, "  Valid packets uart / net: %" PRIu64 " / %" PRIu64 "\n",
             uart_buf.valid_pkts, net_buf.valid_pkts);
@@ -349,6 +943,16 @@ int main(int argc, char **argv)
             uart_buf.invalid_pkts, net_buf.invalid_pkts);
     fprintf(stderr, "   Write errors uart / net: %" PRIu32 " / %" PRIu32 "\n",
             uart_buf.write_errors, net_buf.write_errors);
+    fprintf(stderr, "LCD packets full / delta: %" PRIu64 " / %" PRIu64 "\n",
+            lcd.full_pkts, lcd.delta_pkts);
+    fprintf(stderr, "Packets dropped / superseded / ignored: %" PRIu32
+            " / %" PRIu32 " / %" PRIu32 "\n", dropped_pkts, superseded_pkts,
+            ignored_pkts);
+    if (use_udp)
+        fprintf(stderr, "UDP retransmits / NACKs / stale: %" PRIu32 " / %"
+                PRIu32 " / %" PRIu32 "\n", udp_retransmits, udp_nacks,
+                udp_stale);
+    latency_print(stderr, &lat);
 
     exit(exit_code);
 }
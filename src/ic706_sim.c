@@ -0,0 +1,448 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>           // PRId64 and PRIu64
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "common.h"
+
+/*
+ * Simulator for the radio or the control panel.
+ *
+ * A PTY is opened and its name printed; use it as UART for ic706_server
+ * (radio mode) or ic706_client (panel mode) together with the -g option of
+ * the daemons.
+ *
+ * Radio mode performs the INIT1 / INIT2 handshake, sends LCD packets at the
+ * selected rate and expects a PKT_TYPE_KEEPALIVE at least every
+ * SIM_KEEPALIVE_TIMEOUT ms. If the keepalive stops, the radio sends EOS and
+ * powers up again after SIM_RESTART_DELAY ms.
+ *
+ * Panel mode performs the handshake and sends a mix of tune, button and PTT
+ * packets at the selected rate.
+ */
+
+#define SIM_RADIO   0
+#define SIM_PANEL   1
+
+#define SIM_TICK_MS             10
+#define SIM_INIT_RETRY          1000    /* ms between handshake attempts */
+#define SIM_KEEPALIVE_TIMEOUT   500
+#define SIM_RESTART_DELAY       1000
+
+/* length of the simulated LCD packets including 0xFE 0x60 ... 0xFD */
+#define SIM_LCD_LEN             50
+
+#define STATE_OFF   0           /* waiting to power up */
+#define STATE_INIT  1           /* INIT1 sent, waiting for response */
+#define STATE_ON    2
+
+static char    *link_name = NULL;       /* symlink to the PTY */
+static int      mode = SIM_RADIO;
+static double   rate = 0.0;     /* packets per second; 0 = mode default */
+static int      duration = 0;   /* seconds; 0 = until interrupted */
+static int      keep_running = 1;       /* set to 0 to exit infinite loop */
+
+/**
+ * Simulator state.
+ *
+ * @fd              The PTY master.
+ * @state           STATE_xyz.
+ * @state_time      Time of the last state change in ms.
+ * @keepalive_time  Time of the last PKT_TYPE_KEEPALIVE in ms.
+ * @lcd             The current LCD packet.
+ * @ptt             Current PTT state in panel mode.
+ * @sent            Packets sent since STATE_ON.
+ * @start_us        Time of entering STATE_ON in microseconds.
+ */
+struct sim {
+    int             fd;
+    int             state;
+    uint64_t        state_time;
+    uint64_t        keepalive_time;
+    uint8_t         lcd[SIM_LCD_LEN];
+    int             ptt;
+    uint64_t        sent;
+    uint64_t        start_us;
+
+    /* statistics */
+    uint64_t        tx_pkts;
+    uint64_t        tx_bytes;
+    uint64_t        overruns;
+    uint64_t        rx_pkts[256];
+    uint64_t        invalid_pkts;
+    uint64_t        keepalive_gap;
+    uint32_t        keepalive_timeouts;
+    uint32_t        handshakes;
+};
+
+void signal_handler(int signo)
+{
+    if (signo == SIGINT)
+        fprintf(stderr, "\nCaught SIGINT\n");
+    else if (signo == SIGTERM)
+        fprintf(stderr, "\nCaught SIGTERM\n");
+    else
+        fprintf(stderr, "\nCaught signal: %d\n", signo);
+
+    keep_running = 0;
+}
+
+static void help(void)
+{
+    static const char help_string[] =
+        "\n Usage: ic706_sim [options]\n"
+        "\n Possible options are:\n\n"
+        "  -m    Mode: radio or panel (default is radio).\n"
+        "  -r    Packets per second (default is 10 LCD packets in radio mode\n"
+        "        and 20 control packets in panel mode).\n"
+        "  -t    Run for this many seconds (default is until interrupted).\n"
+        "  -l    Create symlink with this name to the PTY.\n"
+        "  -h    This help message.\n\n";
+
+    fprintf(stderr, "%s", help_string);
+}
+
+/* Parse command line options */
+static void parse_options(int argc, char **argv)
+{
+    int             option;
+
+    if (argc > 1)
+    {
+        while ((option = getopt(argc, argv, "m:r:t:l:h")) != -1)
+        {
+            switch (option)
+            {
+            case 'm':
+                if (!strcmp(optarg, "radio"))
+                    mode = SIM_RADIO;
+                else if (!strcmp(optarg, "panel"))
+                    mode = SIM_PANEL;
+                else
+                {
+                    help();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'r':
+                rate = atof(optarg);
+                break;
+
+            case 't':
+                duration = atoi(optarg);
+                break;
+
+            case 'l':
+                link_name = strdup(optarg);
+                break;
+
+            case 'h':
+                help();
+                exit(EXIT_SUCCESS);
+
+            default:
+                help();
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
+
+/* Write packet to the PTY; count it as overrun if it does not fit */
+static void sim_send(struct sim *sim, const uint8_t * pkt, int len)
+{
+    if (write(sim->fd, pkt, len) != len)
+    {
+        sim->overruns++;
+        return;
+    }
+
+    sim->tx_pkts++;
+    sim->tx_bytes += len;
+}
+
+static void set_state(struct sim *sim, int state)
+{
+    sim->state = state;
+    sim->state_time = time_ms();
+}
+
+/* Change a few bytes of the LCD packet, like a frequency readout */
+static void update_lcd(struct sim *sim)
+{
+    int             pos = 2 + sim->sent % 8;
+
+    sim->lcd[pos] = (sim->lcd[pos] + 1) & 0x7F;
+    if (sim->sent % 50 == 0)
+        sim->lcd[20 + sim->sent % 20] ^= 0x40;
+}
+
+/* Send next control packet of the storm */
+static void send_control(struct sim *sim)
+{
+    uint8_t         pkt[] = { 0xFE, PKT_TYPE_TUNE, 0x00, 0xFD };
+
+    if (sim->sent % 16 == 0)
+    {
+        sim->ptt = !sim->ptt;
+        pkt[1] = PKT_TYPE_PTT;
+        pkt[2] = sim->ptt;
+    }
+    else if (sim->sent % 4 == 0)
+    {
+        pkt[1] = PKT_TYPE_BUTTONS1;
+        pkt[2] = sim->sent % 0x40;
+    }
+    else
+    {
+        /* alternate tuning direction every 8 steps */
+        pkt[2] = (sim->sent / 8) % 2 ? 0x01 : 0x41;
+    }
+
+    sim_send(sim, pkt, sizeof(pkt));
+}
+
+/* Timer tick; drives the state machine and sends the due packets */
+static void sim_tick(struct sim *sim)
+{
+    uint8_t         init1[] = { 0xFE, PKT_TYPE_INIT1, 0xFD };
+    uint8_t         eos = 0x00;
+    uint64_t        now = time_ms();
+    uint64_t        due;
+
+    switch (sim->state)
+    {
+    case STATE_OFF:
+        if (now - sim->state_time >= SIM_RESTART_DELAY)
+        {
+            sim_send(sim, init1, sizeof(init1));
+            set_state(sim, STATE_INIT);
+        }
+        break;
+
+    case STATE_INIT:
+        if (now - sim->state_time >= SIM_INIT_RETRY)
+        {
+            sim_send(sim, init1, sizeof(init1));
+            set_state(sim, STATE_INIT);
+        }
+        break;
+
+    case STATE_ON:
+        if (mode == SIM_RADIO &&
+            now - sim->keepalive_time > SIM_KEEPALIVE_TIMEOUT)
+        {
+            fprintf(stderr, "Keepalive timeout; powering off\n");
+            sim->keepalive_timeouts++;
+            sim_send(sim, &eos, 1);
+            set_state(sim, STATE_OFF);
+            break;
+        }
+
+        due = rate * (time_us() - sim->start_us) / 1000000;
+        while (sim->sent < due)
+        {
+            if (mode == SIM_RADIO)
+            {
+                update_lcd(sim);
+                sim_send(sim, sim->lcd, SIM_LCD_LEN);
+            }
+            else
+            {
+                send_control(sim);
+            }
+            sim->sent++;
+        }
+        break;
+    }
+}
+
+static void handle_packet(struct sim *sim, int type)
+{
+    uint8_t         init2[] = { 0xFE, PKT_TYPE_INIT2, 0xFD };
+    uint64_t        now;
+
+    switch (type)
+    {
+    case PKT_TYPE_INVALID:
+        sim->invalid_pkts++;
+        return;
+
+    case PKT_TYPE_INIT2:
+        /* response to INIT1 (INIT1 + INIT2) or to INIT2 */
+        if (sim->state != STATE_INIT)
+            break;
+
+        if (mode == SIM_RADIO)
+        {
+            /* announce that the radio is on */
+            sim_send(sim, init2, sizeof(init2));
+        }
+
+        fprintf(stderr, "Handshake complete\n");
+        sim->handshakes++;
+        sim->sent = 0;
+        sim->start_us = time_us();
+        sim->keepalive_time = time_ms();
+        set_state(sim, STATE_ON);
+        break;
+
+    case PKT_TYPE_KEEPALIVE:
+        now = time_ms();
+        if (sim->state == STATE_ON &&
+            now - sim->keepalive_time > sim->keepalive_gap)
+            sim->keepalive_gap = now - sim->keepalive_time;
+
+        sim->keepalive_time = now;
+        break;
+    }
+
+    sim->rx_pkts[type]++;
+}
+
+static void print_stats(struct sim *sim)
+{
+    int             i;
+
+    fprintf(stderr, "Packets / bytes sent: %" PRIu64 " / %" PRIu64 "\n",
+            sim->tx_pkts, sim->tx_bytes);
+    fprintf(stderr, "Overruns: %" PRIu64 "\n", sim->overruns);
+    fprintf(stderr, "Handshakes: %" PRIu32 "\n", sim->handshakes);
+    if (mode == SIM_RADIO)
+        fprintf(stderr, "Keepalive timeouts / max gap: %" PRIu32 " / %"
+                PRIu64 " ms\n", sim->keepalive_timeouts, sim->keepalive_gap);
+
+    fprintf(stderr, "Invalid packets received: %" PRIu64 "\n",
+            sim->invalid_pkts);
+    for (i = 0; i < 256; i++)
+        if (sim->rx_pkts[i])
+            fprintf(stderr, "Packets received of type 0x%02X: %" PRIu64 "\n",
+                    i, sim->rx_pkts[i]);
+}
+
+int main(int argc, char **argv)
+{
+    int             exit_code = EXIT_FAILURE;
+    int             slave_fd = -1;
+    int             timer = -1;
+    char            pty_name[32];
+    static struct sim sim;
+    struct xfr_buf  buf;
+    struct evloop   loop;
+    uint64_t        end_time = 0;
+    int             type;
+
+    if (signal(SIGINT, signal_handler) == SIG_ERR)
+        printf("Warning: Can't catch SIGINT\n");
+    if (signal(SIGTERM, signal_handler) == SIG_ERR)
+        printf("Warning: Can't catch SIGTERM\n");
+
+    parse_options(argc, argv);
+    if (rate == 0.0)
+        rate = mode == SIM_RADIO ? 10.0 : 20.0;
+
+    memset(&buf, 0, sizeof(buf));
+    sim.fd = -1;
+    sim.lcd[0] = 0xFE;
+    sim.lcd[1] = PKT_TYPE_LCD;
+    sim.lcd[SIM_LCD_LEN - 1] = 0xFD;
+
+    if (evloop_init(&loop) == -1)
+        exit(EXIT_FAILURE);
+
+    sim.fd = pty_open(pty_name, sizeof(pty_name), &slave_fd);
+    if (sim.fd == -1)
+        goto cleanup;
+
+    /* a daemon that does not keep up must not block the simulator */
+    fcntl(sim.fd, F_SETFL, fcntl(sim.fd, F_GETFL) | O_NONBLOCK);
+
+    fprintf(stderr, "Simulating %s at %.1f packets/s on %s\n",
+            mode == SIM_RADIO ? "radio" : "panel", rate, pty_name);
+
+    if (link_name != NULL)
+    {
+        unlink(link_name);
+        if (symlink(pty_name, link_name) == -1)
+        {
+            fprintf(stderr, "Error creating %s: %d: %s\n", link_name, errno,
+                    strerror(errno));
+            goto cleanup;
+        }
+    }
+
+    timer = evtimer_create(&loop);
+    if (timer == -1)
+        goto cleanup;
+
+    evloop_add(&loop, sim.fd, EPOLLIN);
+    evtimer_start(timer, SIM_TICK_MS, SIM_TICK_MS);
+
+    /* power up on the first tick */
+    sim.state = STATE_OFF;
+    sim.state_time = time_ms() - SIM_RESTART_DELAY;
+    if (duration)
+        end_time = time_ms() + 1000ULL * duration;
+
+    while (keep_running)
+    {
+        if (evloop_wait(&loop, -1) <= 0)
+            continue;
+
+        if (evloop_events(&loop, sim.fd) & EPOLLIN)
+        {
+            read_data(sim.fd, &buf);
+            while ((type = next_packet(&buf)) != PKT_TYPE_INCOMPLETE)
+                handle_packet(&sim, type);
+        }
+
+        if (evloop_events(&loop, timer) & EPOLLIN)
+        {
+            if (evtimer_read(timer))
+                sim_tick(&sim);
+
+            if (end_time && time_ms() >= end_time)
+                break;
+        }
+    }
+
+    /* power off */
+    if (mode == SIM_RADIO && sim.state == STATE_ON)
+    {
+        uint8_t         eos = 0x00;
+
+        sim_send(&sim, &eos, 1);
+    }
+
+    fprintf(stderr, "Shutting down...\n");
+    exit_code = EXIT_SUCCESS;
+
+  cleanup:
+    evtimer_close(&loop, timer);
+    evloop_close(&loop);
+    close(sim.fd);
+    close(slave_fd);
+    if (link_name != NULL)
+    {
+        unlink(link_name);
+        free(link_name);
+    }
+
+    print_stats(&sim);
+
+    exit(exit_code);
+}
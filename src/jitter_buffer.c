@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#include <inttypes.h>           // PRIu64
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jitter_buffer.h"
+
+static uint32_t us_to_frames(const struct jitter_buffer *jb, uint64_t us)
+{
+    return us * jb->sample_rate / 1000000;
+}
+
+static double frames_to_ms(const struct jitter_buffer *jb, uint32_t frames)
+{
+    return 1.e3 * frames / jb->sample_rate;
+}
+
+static int compare_transit(const void *a, const void *b)
+{
+    int64_t         x = *(const int64_t *)a;
+    int64_t         y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Set the target from the spread and the boost */
+static void set_target(struct jitter_buffer *jb, uint32_t spread,
+                       uint32_t frames)
+{
+    uint32_t        target;
+
+    target = us_to_frames(jb, spread + 1000 * JITTER_MARGIN_MS) + frames +
+        jb->boost;
+    if (target > us_to_frames(jb, 1000 * JITTER_MAX_MS))
+        target = us_to_frames(jb, 1000 * JITTER_MAX_MS);
+
+    jb->target = target;
+    if (target < jb->target_min)
+        jb->target_min = target;
+    if (target > jb->target_max)
+        jb->target_max = target;
+}
+
+/* Recalculate the target from the p99 of the transit times */
+static void update_target(struct jitter_buffer *jb, uint32_t frames)
+{
+    int64_t         sorted[JITTER_WINDOW];
+
+    memcpy(sorted, jb->transit, jb->num * sizeof(int64_t));
+    qsort(sorted, jb->num, sizeof(int64_t), compare_transit);
+
+    jb->spread = sorted[(jb->num - 1) * 99 / 100] - sorted[0];
+    jb->boost -= jb->boost / 8;
+    set_target(jb, jb->spread, frames);
+
+    /* more than needed was buffered after every packet; small excesses
+     * are left to the speed control */
+    if (jb->min_level > jb->target + us_to_frames(jb, 1000 * JITTER_MARGIN_MS))
+        jb->drop = jb->min_level - jb->target;
+    else
+        jb->drop = 0;
+
+    jb->count = 0;
+    jb->min_level = UINT32_MAX;
+}
+
+static double clamp(double x, double max)
+{
+    return x > max ? max : (x < -max ? -max : x);
+}
+
+/* Pull the average buffer level toward the target */
+static void update_speed(struct jitter_buffer *jb, uint64_t now,
+                         uint32_t level)
+{
+    double          dt;
+    double          error;
+
+    if (jb->last == 0)
+    {
+        jb->last = now;
+        jb->level_avg = level;
+        return;
+    }
+
+    dt = 1.e-6 * (now - jb->last);
+    jb->last = now;
+    if (dt > JITTER_LEVEL_TC)
+        dt = JITTER_LEVEL_TC;
+
+    jb->level_avg += (level - jb->level_avg) * dt / JITTER_LEVEL_TC;
+    error = 1.e3 * (jb->level_avg - jb->target) / jb->sample_rate;
+
+    /* the excess being dropped is not drift */
+    if (jb->drop == 0)
+        jb->integral = clamp(jb->integral + JITTER_KI * error * dt,
+                             JITTER_MAX_PPM);
+
+    jb->ppm = clamp(jb->integral + JITTER_KP * error, JITTER_MAX_PPM);
+    jb->drift += (jb->ppm - jb->drift) * dt / JITTER_DRIFT_TC;
+}
+
+void jitter_init(struct jitter_buffer *jb, uint32_t sample_rate)
+{
+    memset(jb, 0, sizeof(struct jitter_buffer));
+
+    jb->sample_rate = sample_rate;
+    jb->min_level = UINT32_MAX;
+    jb->target = us_to_frames(jb, 1000 * JITTER_INITIAL_MS);
+    jb->target_min = jb->target;
+    jb->target_max = jb->target;
+}
+
+uint32_t jitter_arrival(struct jitter_buffer *jb, uint64_t now,
+                        uint32_t frames, uint32_t level, uint32_t underflows)
+{
+    int64_t         transit;
+    int64_t         prev;
+    int64_t         min;
+    uint32_t        drop;
+    int             i;
+
+    if (jb->num == 0)
+        jb->start = now;
+
+    /* nothing was sent during silence */
+    if (jb->gap != JITTER_GAP_UNKNOWN)
+        jb->media += jb->gap;
+
+    transit = (int64_t) (now - jb->start) -
+        (int64_t) (jb->media * 1000000 / jb->sample_rate);
+
+    /* without the length of the silence, assume the same transit time as
+     * the packet before it */
+    if (jb->gap == JITTER_GAP_UNKNOWN && jb->num > 0)
+    {
+        prev = jb->transit[(jb->idx + JITTER_WINDOW - 1) % JITTER_WINDOW];
+        if (transit > prev)
+        {
+            jb->media += us_to_frames(jb, transit - prev);
+            transit = prev;
+        }
+    }
+
+    jb->gap = 0;
+    jb->media += frames;
+
+    jb->transit[jb->idx] = transit;
+    jb->idx = (jb->idx + 1) % JITTER_WINDOW;
+    if (jb->num < JITTER_WINDOW)
+        jb->num++;
+
+    /* an underflow means that the target was too low; grow it now */
+    if (underflows != jb->underflows)
+    {
+        jb->underflows = underflows;
+        jb->boost += jb->target / 2 > frames ? jb->target / 2 : frames;
+        jb->drop = 0;
+        set_target(jb, jb->spread, frames);
+    }
+
+    /* a packet later than the current spread allows; grow it now */
+    min = transit;
+    for (i = 0; i < jb->num; i++)
+        if (jb->transit[i] < min)
+            min = jb->transit[i];
+
+    if (transit - min > jb->spread)
+    {
+        jb->spread = transit - min;
+        set_target(jb, jb->spread, frames);
+        jb->drop = 0;
+    }
+
+    drop = frames * JITTER_MAX_DROP / 1000;
+    if (drop > jb->drop)
+        drop = jb->drop;
+
+    jb->drop -= drop;
+    jb->dropped += drop;
+
+    if (level + frames - drop < jb->min_level)
+        jb->min_level = level + frames - drop;
+
+    update_speed(jb, now, level + frames - drop);
+
+    if (++jb->count >= JITTER_UPDATE)
+        update_target(jb, frames);
+
+    return drop;
+}
+
+uint32_t jitter_gap(struct jitter_buffer *jb, uint32_t gap, uint32_t frames,
+                    uint32_t level, uint32_t underflows)
+{
+    uint32_t        slack;
+
+    jb->gap = gap;
+    jb->gaps++;
+    jb->drop = 0;
+
+    /* the buffer running dry during the silence was expected */
+    jb->underflows = underflows;
+
+    /* enough to start playback even if the packet is played faster */
+    slack = frames * JITTER_MAX_PPM / 1000000 + 2;
+    if (level + frames >= jb->target + slack)
+        return 0;
+
+    return jb->target + slack - level - frames;
+}
+
+double jitter_speed(const struct jitter_buffer *jb, uint32_t frames,
+                    uint32_t drop)
+{
+    double          speed = 1.0 + 1.e-6 * jb->ppm;
+
+    if (drop > 0 && drop < frames)
+        speed *= (double)frames / (frames - drop);
+
+    return speed;
+}
+
+void jitter_print(FILE * file, const struct jitter_buffer *jb)
+{
+    fprintf(file, "  Jitter buffer target (min / max / now): %.1f / %.1f / "
+            "%.1f ms\n", frames_to_ms(jb, jb->target_min),
+            frames_to_ms(jb, jb->target_max), frames_to_ms(jb, jb->target));
+    fprintf(file, "  Jitter p99 spread: %.1f ms\n", 1.e-3 * jb->spread);
+    fprintf(file, "  Frames dropped   : %" PRIu64 "\n", jb->dropped);
+    fprintf(file, "  Clock drift      : %+.1f ppm\n", jb->drift);
+    fprintf(file, "  Silent periods   : %" PRIu32 "\n", jb->gaps);
+}
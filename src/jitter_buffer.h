@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#ifndef __JITTER_BUFFER_H__
+#define __JITTER_BUFFER_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * @file
+ * Adaptive playout depth for received audio.
+ *
+ * The playback buffer starts playing when it holds the target number of
+ * frames and goes back to buffering on underflow. The target is chosen
+ * from the arrival times of the audio packets:
+ *
+ * The transit time of a packet is its arrival time minus its position in
+ * the audio stream, both measured from the first packet. Without jitter it
+ * is constant. The spread of the transit times, p99 minus minimum over the
+ * last JITTER_WINDOW packets, is how much earlier than the latest packets
+ * the earliest ones arrive, i.e. how much audio must be buffered to bridge
+ * the gaps. The target is the spread plus one packet plus a small margin for
+ * the audio callback.
+ *
+ * The target grows immediately when the spread grows, and it is boosted on
+ * every underflow; the boost decays slowly. When the buffer holds more than
+ * the target plus the margin after every packet of an update period, for
+ * instance after the target has come down, the excess is removed by playing
+ * the packets up to JITTER_MAX_DROP per mille faster.
+ *
+ * The sender's and our audio clocks differ slightly, so the buffer would
+ * slowly fill up or run dry. The buffer level after each packet is
+ * averaged, and a PI controller pulls the average toward the target by
+ * playing slightly faster or slower, at most JITTER_MAX_PPM. On average
+ * the correction equals the clock drift.
+ *
+ * The sender may stop sending during silence. The buffer then runs dry,
+ * which is not an underflow: when the next packet arrives it is padded
+ * with silence up to the target, so the talkspurt is played with the
+ * usual delay, and the gap is added to the stream position so that the
+ * transit times stay comparable.
+ */
+
+#define JITTER_WINDOW       512 /* packets in the statistics */
+#define JITTER_UPDATE       32  /* packets between target updates */
+#define JITTER_MARGIN_MS    10  /* margin for the audio callback */
+#define JITTER_INITIAL_MS   100 /* target before the first update */
+#define JITTER_MAX_MS       500 /* maximum target */
+#define JITTER_MAX_DROP     20  /* samples dropped per 1000 */
+
+#define JITTER_LEVEL_TC     1.0 /* time constant of the level average, s */
+#define JITTER_KP           20.0        /* ppm per ms of level error */
+#define JITTER_KI           0.5 /* ppm per ms of level error and second */
+#define JITTER_MAX_PPM      1000.0      /* maximum speed correction */
+#define JITTER_DRIFT_TC     300.0       /* averaging of the drift, s */
+
+/* Length of a gap in the stream that is not known */
+#define JITTER_GAP_UNKNOWN  UINT32_MAX
+
+/**
+ * Jitter buffer state.
+ *
+ * @sample_rate  Audio sample rate.
+ * @start        Arrival time of the first packet in us.
+ * @media        Number of frames received since the first packet.
+ * @transit      Transit time of the last packets in us.
+ * @num          Number of values in transit.
+ * @idx          Index of the next value in transit.
+ * @count        Packets since the last target update.
+ * @min_level    Lowest buffer level after a packet since the last update.
+ * @underflows   Number of underflows seen so far.
+ * @target       Target buffer level in frames.
+ * @boost        Frames added to the target after underflows.
+ * @drop         Frames still to be dropped.
+ * @last         Arrival time of the previous packet in us.
+ * @level_avg    Average buffer level after a packet in frames.
+ * @integral     Integral term of the speed correction in ppm.
+ * @ppm          Speed correction in ppm; positive plays faster.
+ * @drift        Average speed correction, i.e. the clock drift, in ppm.
+ * @gap          Frames of silence before the next packet; see jitter_gap().
+ */
+struct jitter_buffer {
+    uint32_t        sample_rate;
+    uint64_t        start;
+    uint64_t        media;
+
+    int64_t         transit[JITTER_WINDOW];
+    int             num;
+    int             idx;
+
+    int             count;
+    uint32_t        min_level;
+    uint32_t        underflows;
+
+    uint32_t        target;
+    uint32_t        boost;
+    uint32_t        drop;
+
+    uint64_t        last;
+    double          level_avg;
+    double          integral;
+    double          ppm;
+    double          drift;
+    uint32_t        gap;
+
+    /* statistics */
+    uint32_t        spread;     /* latest spread in us */
+    uint32_t        target_min;
+    uint32_t        target_max;
+    uint64_t        dropped;    /* frames dropped to reduce the delay */
+    uint32_t        gaps;       /* silent periods */
+};
+
+/** Initialize the jitter buffer; call again after a reconnect. */
+void            jitter_init(struct jitter_buffer *jb, uint32_t sample_rate);
+
+/**
+ * Process a received audio packet.
+ *
+ * @param  jb          The jitter buffer.
+ * @param  now         Arrival time in us.
+ * @param  frames      Number of frames in the packet.
+ * @param  level       Number of frames in the playback buffer before the
+ *                     packet is added.
+ * @param  underflows  Total number of playback buffer underflows.
+ * @return The number of frames to drop from the packet; see
+ *         jitter_speed().
+ */
+uint32_t        jitter_arrival(struct jitter_buffer *jb, uint64_t now,
+                               uint32_t frames, uint32_t level,
+                               uint32_t underflows);
+
+/**
+ * Note that the sender has not sent anything during silence. Call this
+ * before jitter_arrival() for the first packet after the silence.
+ *
+ * @param  jb          The jitter buffer.
+ * @param  gap         Length of the silence in frames, or JITTER_GAP_UNKNOWN
+ *                     if the packet should be taken as arriving on time.
+ * @param  frames      Number of frames in the packet.
+ * @param  level       Number of frames in the playback buffer.
+ * @param  underflows  Total number of playback buffer underflows; the ones
+ *                     during the silence are ignored.
+ * @return The number of frames of silence to add to the playback buffer
+ *         before the packet; the level after the packet is then the target.
+ */
+uint32_t        jitter_gap(struct jitter_buffer *jb, uint32_t gap,
+                           uint32_t frames, uint32_t level,
+                           uint32_t underflows);
+
+/**
+ * Get the playback speed for a packet.
+ *
+ * @param  jb      The jitter buffer.
+ * @param  frames  Number of frames in the packet.
+ * @param  drop    Number of frames to drop, as returned by jitter_arrival().
+ * @return Input frames per output frame, e.g. for resampler_process().
+ */
+double          jitter_speed(const struct jitter_buffer *jb, uint32_t frames,
+                             uint32_t drop);
+
+/** Print jitter buffer statistics. */
+void            jitter_print(FILE * file, const struct jitter_buffer *jb);
+
+#endif
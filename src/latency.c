@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#include <inttypes.h>           // PRIu64
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "latency.h"
+
+/* mask for the 28 bit time field */
+#define TSTAMP_TIME_MASK 0x0FFFFFFF
+
+/* Get histogram bucket of a value */
+static int hist_bucket(uint32_t value)
+{
+    int             msb;
+
+    if (value < HIST_SUB_COUNT)
+        return value;
+
+    msb = 31 - __builtin_clz(value);
+
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB_COUNT +
+        ((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+}
+
+/* Get the lowest value in a histogram bucket */
+static uint64_t hist_bucket_start(int bucket)
+{
+    int             msb;
+
+    if (bucket < HIST_SUB_COUNT)
+        return bucket;
+
+    msb = bucket / HIST_SUB_COUNT + HIST_SUB_BITS - 1;
+
+    return (uint64_t) (HIST_SUB_COUNT + bucket % HIST_SUB_COUNT) <<
+        (msb - HIST_SUB_BITS);
+}
+
+void hist_add(struct histogram *hist, uint32_t value)
+{
+    hist->counts[hist_bucket(value)]++;
+    hist->count++;
+    if (value > hist->max)
+        hist->max = value;
+}
+
+uint32_t hist_percentile(const struct histogram *hist, double pct)
+{
+    uint64_t        limit;
+    uint64_t        sum = 0;
+    uint64_t        value;
+    int             i;
+
+    if (hist->count == 0)
+        return 0;
+
+    limit = (uint64_t) (pct / 100.0 * hist->count + 0.5);
+    if (limit == 0)
+        limit = 1;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        sum += hist->counts[i];
+        if (sum >= limit)
+        {
+            value = hist_bucket_start(i + 1) - 1;
+            return value < hist->max ? value : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+/* Write value as big endian with 7 bits per byte */
+static void put_u7(uint8_t * out, uint32_t value, int bytes)
+{
+    while (bytes--)
+    {
+        out[bytes] = value & 0x7F;
+        value >>= 7;
+    }
+}
+
+static uint32_t get_u7(const uint8_t * in, int bytes)
+{
+    uint32_t        value = 0;
+
+    while (bytes--)
+        value = (value << 7) | (*in++ & 0x7F);
+
+    return value;
+}
+
+void latency_init(struct latency *lat)
+{
+    memset(lat, 0, sizeof(struct latency));
+}
+
+int latency_stamp(struct latency *lat, int type, uint8_t * out)
+{
+    out[0] = 0xFE;
+    out[1] = PKT_TYPE_TSTAMP;
+    put_u7(&out[2], type, 2);
+    put_u7(&out[4], lat->seq++, 2);
+    put_u7(&out[6], time_us() & TSTAMP_TIME_MASK, 4);
+    out[10] = 0xFD;
+
+    return TSTAMP_LEN;
+}
+
+int latency_echo(const uint8_t * pkt, int len, uint8_t * out)
+{
+    if (len != TSTAMP_LEN)
+        return 0;
+
+    memcpy(out, pkt, TSTAMP_LEN);
+    out[1] = PKT_TYPE_TSTAMP_ECHO;
+
+    return TSTAMP_LEN;
+}
+
+/* Get the histogram for a packet type; NULL if there are too many types */
+static struct histogram *find_hist(struct latency *lat, int type)
+{
+    int             i;
+
+    for (i = 0; i < lat->num_types; i++)
+        if (lat->types[i] == type)
+            return &lat->hist[i];
+
+    if (lat->num_types == LATENCY_MAX_TYPES)
+        return NULL;
+
+    lat->types[lat->num_types] = type;
+
+    return &lat->hist[lat->num_types++];
+}
+
+void latency_update(struct latency *lat, const uint8_t * pkt, int len)
+{
+    struct histogram *hist;
+    uint32_t        sent;
+    uint32_t        rtt;
+
+    if (len != TSTAMP_LEN)
+        return;
+
+    lat->echoed++;
+
+    sent = get_u7(&pkt[6], 4);
+    rtt = (time_us() - sent) & TSTAMP_TIME_MASK;
+
+    hist = find_hist(lat, get_u7(&pkt[2], 2));
+    if (hist != NULL)
+        hist_add(hist, rtt);
+}
+
+void latency_print(FILE * file, const struct latency *lat)
+{
+    const struct histogram *hist;
+    int             i;
+
+    fprintf(file, "  Timestamps sent / echoed: %" PRIu64 " / %" PRIu64 "\n",
+            lat->sent, lat->echoed);
+
+    if (lat->num_types == 0)
+        return;
+
+    fprintf(file, "  Round trip time in ms:\n");
+    fprintf(file, "    Type   Count      p50      p90      p99    p99.9"
+            "      max\n");
+
+    for (i = 0; i < lat->num_types; i++)
+    {
+        hist = &lat->hist[i];
+        fprintf(file, "    0x%02X %7" PRIu64 " %8.2f %8.2f %8.2f %8.2f %8.2f\n",
+                lat->types[i], hist->count,
+                1.e-3 * hist_percentile(hist, 50.0),
+                1.e-3 * hist_percentile(hist, 90.0),
+                1.e-3 * hist_percentile(hist, 99.0),
+                1.e-3 * hist_percentile(hist, 99.9), 1.e-3 * hist->max);
+    }
+}
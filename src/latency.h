@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * @file
+ * Latency measurement of the control link.
+ *
+ * When both ends have agreed on CAP_TIMESTAMP, every packet sent over the
+ * network is followed by a PKT_TYPE_TSTAMP packet:
+ *
+ *     0xFE 0xA3 <type:2> <seq:2> <time:4> 0xFD
+ *
+ * where type is the type of the preceding packet, seq is a sequence number
+ * and time is the monotonic send time in microseconds. All fields are sent
+ * big endian with 7 bits per byte so that the payload never contains 0xFD
+ * or 0xFE. The time wraps around after 2^28 us.
+ *
+ * The receiver processes the packets in order, so when it sees the
+ * PKT_TYPE_TSTAMP the preceding packet has already been written to the
+ * UART. It then returns the packet unchanged except for the type, which is
+ * set to PKT_TYPE_TSTAMP_ECHO. The sender computes the round trip time
+ * from the echo and adds it to a log-linear histogram for the packet type.
+ *
+ * The two ends do not share a clock, so only the round trip time can be
+ * measured. It covers the network in both directions plus the time until
+ * the packet was written to the UART on the far side.
+ */
+
+/* Length of a PKT_TYPE_TSTAMP packet */
+#define TSTAMP_LEN  11
+
+/* The histogram has linear buckets of 1 us up to 2^HIST_SUB_BITS us; after
+ * that each power of two is split into 2^HIST_SUB_BITS buckets, giving a
+ * relative resolution better than 1 / 2^HIST_SUB_BITS. */
+#define HIST_SUB_BITS   4
+#define HIST_SUB_COUNT  (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    ((32 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+/* Maximum number of packet types with separate histograms */
+#define LATENCY_MAX_TYPES  16
+
+/**
+ * Log-linear histogram of values in microseconds.
+ *
+ * @counts  Number of values in each bucket.
+ * @count   Total number of values.
+ * @max     The largest value.
+ */
+struct histogram {
+    uint32_t        counts[HIST_BUCKETS];
+    uint64_t        count;
+    uint32_t        max;
+};
+
+/**
+ * Latency statistics.
+ *
+ * @seq        Sequence number of the next PKT_TYPE_TSTAMP.
+ * @sent       Number of PKT_TYPE_TSTAMP sent.
+ * @echoed     Number of PKT_TYPE_TSTAMP_ECHO received.
+ * @num_types  Number of packet types in types and hist.
+ * @types      The packet types with a histogram.
+ * @hist       Round trip time histogram for each packet type.
+ */
+struct latency {
+    uint16_t        seq;
+    uint64_t        sent;
+    uint64_t        echoed;
+    int             num_types;
+    int             types[LATENCY_MAX_TYPES];
+    struct histogram hist[LATENCY_MAX_TYPES];
+};
+
+/** Add a value to the histogram. */
+void            hist_add(struct histogram *hist, uint32_t value);
+
+/**
+ * Get a percentile from the histogram.
+ *
+ * @param  hist  The histogram.
+ * @param  pct   The percentile, 0.0 - 100.0.
+ * @return The highest value equivalent to the percentile or 0 if the
+ *         histogram is empty.
+ */
+uint32_t        hist_percentile(const struct histogram *hist, double pct);
+
+/** Initialize latency statistics. */
+void            latency_init(struct latency *lat);
+
+/**
+ * Create a PKT_TYPE_TSTAMP packet.
+ *
+ * @param  lat   The latency statistics.
+ * @param  type  The type of the packet the stamp refers to.
+ * @param  out   Buffer of at least TSTAMP_LEN bytes.
+ * @return The length of the packet, i.e. TSTAMP_LEN.
+ *
+ * The caller must increment lat->sent each time the stamp is sent.
+ */
+int             latency_stamp(struct latency *lat, int type, uint8_t * out);
+
+/**
+ * Create PKT_TYPE_TSTAMP_ECHO for a received PKT_TYPE_TSTAMP.
+ *
+ * @param  pkt  The received PKT_TYPE_TSTAMP.
+ * @param  len  The length of pkt.
+ * @param  out  Buffer of at least TSTAMP_LEN bytes.
+ * @return The length of the echo packet or 0 if pkt is invalid.
+ */
+int             latency_echo(const uint8_t * pkt, int len, uint8_t * out);
+
+/**
+ * Process a received PKT_TYPE_TSTAMP_ECHO.
+ *
+ * @param  lat  The latency statistics.
+ * @param  pkt  The echo packet.
+ * @param  len  The length of pkt.
+ */
+void            latency_update(struct latency *lat, const uint8_t * pkt,
+                               int len);
+
+/** Print round trip time statistics for each packet type. */
+void            latency_print(FILE * file, const struct latency *lat);
+
+#endif
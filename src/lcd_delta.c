@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+#include "lcd_delta.h"
+
+/* escape character used for byte stuffing the delta payload */
+#define LCD_DELTA_ESC 0xFC
+
+/* Append byte to the delta packet; escape 0xFC, 0xFD and 0xFE */
+static int put_byte(uint8_t * out, int idx, uint8_t byte)
+{
+    if (byte >= LCD_DELTA_ESC && byte <= 0xFE)
+    {
+        out[idx++] = LCD_DELTA_ESC;
+        out[idx++] = byte ^ 0x80;
+    }
+    else
+    {
+        out[idx++] = byte;
+    }
+
+    return idx;
+}
+
+void lcd_delta_reset(struct lcd_delta *lcd)
+{
+    lcd->ref_len = 0;
+}
+
+void lcd_delta_update(struct lcd_delta *lcd, const uint8_t * pkt, int len)
+{
+    if (len > LCD_MAX_LEN)
+    {
+        lcd->ref_len = 0;
+        return;
+    }
+
+    memcpy(lcd->ref, pkt, len);
+    lcd->ref_len = len;
+    lcd->full_pkts++;
+}
+
+int lcd_delta_encode(struct lcd_delta *lcd, const uint8_t * pkt, int len,
+                     uint8_t * out)
+{
+    const uint8_t  *ref = lcd->ref;
+    int             olen = 2;
+    int             last = 0;   /* end of previous record */
+    int             i, j;
+
+    if (len != lcd->ref_len)
+        goto send_full;
+
+    out[0] = 0xFE;
+    out[1] = PKT_TYPE_LCD_DELTA;
+
+    i = 0;
+    while (i < len)
+    {
+        if (pkt[i] == ref[i])
+        {
+            i++;
+            continue;
+        }
+
+        /* Find the end of the changed bytes. Gaps of up to two unchanged
+         * bytes are cheaper to include than to start a new record. */
+        j = i + 1;
+        while (j < len && j - i < 255)
+        {
+            if (pkt[j] != ref[j] ||
+                (j + 1 < len && pkt[j + 1] != ref[j + 1]) ||
+                (j + 2 < len && pkt[j + 2] != ref[j + 2]))
+                j++;
+            else
+                break;
+        }
+
+        /* worst case size of this record including byte stuffing */
+        if (olen + 2 * (2 + j - i) + 1 >= len)
+            goto send_full;
+
+        olen = put_byte(out, olen, i - last);
+        olen = put_byte(out, olen, j - i);
+        for (; i < j; i++)
+            olen = put_byte(out, olen, pkt[i] ^ ref[i]);
+
+        last = j;
+    }
+
+    out[olen++] = 0xFD;
+
+    memcpy(lcd->ref, pkt, len);
+    lcd->delta_pkts++;
+
+    return olen;
+
+  send_full:
+    lcd_delta_update(lcd, pkt, len);
+
+    return 0;
+}
+
+int lcd_delta_decode(struct lcd_delta *lcd, const uint8_t * pkt, int len)
+{
+    uint8_t         payload[LCD_DELTA_MAX_LEN];
+    int             plen = 0;
+    int             pos = 0;
+    int             count;
+    int             i;
+
+    if (lcd->ref_len == 0 || len < 3 || len > LCD_DELTA_MAX_LEN)
+        goto error;
+
+    /* remove byte stuffing */
+    for (i = 2; i < len - 1; i++)
+    {
+        if (pkt[i] == LCD_DELTA_ESC)
+        {
+            if (++i == len - 1)
+                goto error;
+
+            payload[plen++] = pkt[i] ^ 0x80;
+        }
+        else
+        {
+            payload[plen++] = pkt[i];
+        }
+    }
+
+    /* apply records */
+    i = 0;
+    while (i < plen)
+    {
+        if (i + 2 > plen)
+            goto error;
+
+        pos += payload[i++];
+        count = payload[i++];
+        if (count == 0 || pos + count > lcd->ref_len || i + count > plen)
+            goto error;
+
+        while (count--)
+            lcd->ref[pos++] ^= payload[i++];
+    }
+
+    lcd->delta_pkts++;
+
+    return 0;
+
+  error:
+    lcd->ref_len = 0;
+
+    return -1;
+}
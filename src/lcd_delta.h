@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#ifndef __LCD_DELTA_H__
+#define __LCD_DELTA_H__
+
+#include <stdint.h>
+
+/**
+ * @file
+ * Delta coding of PKT_TYPE_LCD packets.
+ *
+ * Consecutive LCD packets usually differ in only a few segments. Instead of
+ * sending the full packet, the server can send a PKT_TYPE_LCD_DELTA packet
+ * that contains the XOR difference to the previous LCD packet:
+ *
+ *     0xFE 0xA2 <skip> <count> <count XOR bytes> ... 0xFD
+ *
+ * where <skip> is the number of unchanged bytes since the end of the
+ * previous record. The payload is byte stuffed so that 0xFC, 0xFD and 0xFE
+ * never appear in it: these are sent as 0xFC followed by the byte XOR 0x80.
+ *
+ * A delta packet can only be applied to an LCD packet of the same length,
+ * so the encoder falls back to sending the full packet whenever the length
+ * changes or the delta would not be smaller.
+ */
+
+/* Maximum length of LCD packets that can be delta coded */
+#define LCD_MAX_LEN  128
+
+/* Maximum length of a PKT_TYPE_LCD_DELTA packet */
+#define LCD_DELTA_MAX_LEN  LCD_MAX_LEN
+
+/**
+ * Delta coder state.
+ *
+ * @ref            The previous LCD packet.
+ * @ref_len        The length of the previous LCD packet; 0 if there is none.
+ * @full_pkts      Number of LCD packets sent / received in full.
+ * @delta_pkts     Number of LCD packets sent / received as delta.
+ */
+struct lcd_delta {
+    uint8_t         ref[LCD_MAX_LEN];
+    int             ref_len;
+    uint64_t        full_pkts;
+    uint64_t        delta_pkts;
+};
+
+/** Forget the reference packet. The next LCD packet will be sent in full. */
+void            lcd_delta_reset(struct lcd_delta *lcd);
+
+/**
+ * Delta code an LCD packet.
+ *
+ * @param  lcd  The delta coder state.
+ * @param  pkt  The complete PKT_TYPE_LCD packet including 0xFE and 0xFD.
+ * @param  len  The length of the packet.
+ * @param  out  Buffer of at least LCD_DELTA_MAX_LEN bytes for the delta.
+ * @return The length of the PKT_TYPE_LCD_DELTA packet in out or 0 if the
+ *         full packet should be sent instead.
+ *
+ * The packet becomes the new reference regardless of the return value.
+ */
+int             lcd_delta_encode(struct lcd_delta *lcd, const uint8_t * pkt,
+                                 int len, uint8_t * out);
+
+/**
+ * Store a full LCD packet as reference for the following delta packets.
+ */
+void            lcd_delta_update(struct lcd_delta *lcd, const uint8_t * pkt,
+                                 int len);
+
+/**
+ * Apply a PKT_TYPE_LCD_DELTA packet to the reference.
+ *
+ * @param  lcd  The delta coder state.
+ * @param  pkt  The complete PKT_TYPE_LCD_DELTA packet.
+ * @param  len  The length of the packet.
+ * @retval  0   The rebuilt LCD packet is available in lcd->ref.
+ * @retval -1   There is no reference or the delta is invalid. The reference
+ *              is reset and the next delta packets will be rejected until a
+ *              full LCD packet is received.
+ */
+int             lcd_delta_decode(struct lcd_delta *lcd, const uint8_t * pkt,
+                                 int len);
+
+#endif
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "pkt_queue.h"
+
+/* Unsent data allowed in the kernel socket buffer. Anything beyond this is
+ * kept in the queue where it can still be reordered by priority. */
+#define PKT_QUEUE_NOTSENT_LOWAT 512
+
+void pkt_queue_init(struct pkt_queue *q, int fd)
+{
+    int             yes = 1;
+    int             lowat = PKT_QUEUE_NOTSENT_LOWAT;
+    int             i;
+
+    q->fd = fd;
+    q->tx_len = 0;
+    q->tx_off = 0;
+    q->dropped = 0;
+    q->superseded = 0;
+
+    for (i = 0; i < PKT_PRIO_NUM; i++)
+    {
+        q->cls[i].head = 0;
+        q->cls[i].count = 0;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    /* errors are not fatal; the socket may not be TCP */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+}
+
+int pkt_queue_prio(int type)
+{
+    switch (type)
+    {
+    case PKT_TYPE_PTT:
+        return PKT_PRIO_PTT;
+
+    case PKT_TYPE_BUTTONS1:
+    case PKT_TYPE_BUTTONS2:
+    case PKT_TYPE_TUNE:
+    case PKT_TYPE_VOLUME:
+    case PKT_TYPE_RFSQL:
+    case PKT_TYPE_MEMCH:
+    case PKT_TYPE_SHIFT:
+    case PKT_TYPE_INIT1:
+    case PKT_TYPE_INIT2:
+    case PKT_TYPE_EOS:
+    case PKT_TYPE_PWK:
+    case PKT_TYPE_CAPS:
+    case PKT_TYPE_TSTAMP_ECHO:
+    case PKT_TYPE_CONTROL:
+        return PKT_PRIO_CONTROL;
+
+    case PKT_TYPE_LCD:
+    case PKT_TYPE_LCD_DELTA:
+        return PKT_PRIO_LCD;
+
+    default:
+        return PKT_PRIO_OTHER;
+    }
+}
+
+/* Add packet to the tail of a class */
+static int enqueue(struct pkt_queue *q, int prio, const uint8_t * pkt,
+                   int len)
+{
+    struct pkt_class *cls = &q->cls[prio];
+    struct pkt_slot *slot;
+
+    if (len > PKT_QUEUE_PKT_LEN)
+    {
+        q->dropped++;
+        return -1;
+    }
+
+    if (prio == PKT_PRIO_LCD && cls->count)
+    {
+        /* only the latest display state is of interest */
+        q->superseded += cls->count;
+        cls->count = 0;
+    }
+    else if (cls->count == PKT_QUEUE_SLOTS)
+    {
+        /* drop the oldest packet */
+        cls->head = (cls->head + 1) % PKT_QUEUE_SLOTS;
+        cls->count--;
+        q->dropped++;
+    }
+
+    slot = &cls->slots[(cls->head + cls->count) % PKT_QUEUE_SLOTS];
+    memcpy(slot->data, pkt, len);
+    slot->len = len;
+    cls->count++;
+
+    return 0;
+}
+
+/* Move the oldest packet of the highest priority class to the empty tx
+ * buffer. The other packets stay in the queue where they can still be
+ * overtaken or superseded. */
+static void fill_tx(struct pkt_queue *q)
+{
+    struct pkt_class *cls;
+    struct pkt_slot *slot;
+    int             prio;
+
+    q->tx_off = 0;
+    q->tx_len = 0;
+
+    for (prio = 0; prio < PKT_PRIO_NUM; prio++)
+    {
+        cls = &q->cls[prio];
+        if (cls->count == 0)
+            continue;
+
+        slot = &cls->slots[cls->head];
+        memcpy(q->tx, slot->data, slot->len);
+        q->tx_len = slot->len;
+        cls->head = (cls->head + 1) % PKT_QUEUE_SLOTS;
+        cls->count--;
+
+        return;
+    }
+}
+
+int pkt_queue_flush(struct pkt_queue *q)
+{
+    ssize_t         num;
+
+    for (;;)
+    {
+        /* the next packet is only chosen once the current one is written,
+         * so that new high priority packets can still overtake queued
+         * ones */
+        if (q->tx_off == q->tx_len)
+            fill_tx(q);
+
+        if (q->tx_off == q->tx_len)
+            return 0;
+
+        num = write(q->fd, &q->tx[q->tx_off], q->tx_len - q->tx_off);
+        if (num == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            return -1;
+        }
+
+        q->tx_off += num;
+    }
+}
+
+int pkt_queue_send(struct pkt_queue *q, int type, const uint8_t * pkt,
+                   int len)
+{
+    enqueue(q, pkt_queue_prio(type), pkt, len);
+
+    return pkt_queue_flush(q);
+}
+
+int pkt_queue_pending(struct pkt_queue *q)
+{
+    int             prio;
+
+    if (q->tx_off < q->tx_len)
+        return 1;
+
+    for (prio = 0; prio < PKT_PRIO_NUM; prio++)
+        if (q->cls[prio].count)
+            return 1;
+
+    return 0;
+}
+
+int pkt_queue_count(struct pkt_queue *q, int prio)
+{
+    return q->cls[prio].count;
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#ifndef __PKT_QUEUE_H__
+#define __PKT_QUEUE_H__
+
+#include <stdint.h>
+
+/**
+ * @file
+ * Output queue with strict priority classes for a non-blocking socket.
+ *
+ * Packets are queued in one of PKT_PRIO_NUM classes and written to the
+ * socket highest priority first whenever the socket can accept more data.
+ * Only one packet at a time is taken out of the queue, so a PTT packet is
+ * never stuck behind more than one partly written packet.
+ *
+ * Each class holds up to PKT_QUEUE_SLOTS packets. When a class is full the
+ * oldest packet is dropped. A new LCD packet always replaces any LCD packet
+ * still waiting in the queue, since only the latest display state matters.
+ */
+
+/* Priority classes, highest priority first */
+#define PKT_PRIO_PTT        0
+#define PKT_PRIO_CONTROL    1   /* buttons, tune, power, ... */
+#define PKT_PRIO_LCD        2
+#define PKT_PRIO_OTHER      3   /* keepalive, statistics, ... */
+#define PKT_PRIO_NUM        4
+
+/* Number of packets per priority class */
+#define PKT_QUEUE_SLOTS     16
+
+/* Maximum length of a queued packet */
+#define PKT_QUEUE_PKT_LEN   256
+
+struct pkt_slot {
+    uint8_t         data[PKT_QUEUE_PKT_LEN];
+    int             len;
+};
+
+struct pkt_class {
+    struct pkt_slot slots[PKT_QUEUE_SLOTS];
+    int             head;       /* index of the oldest packet */
+    int             count;      /* number of packets in the class */
+};
+
+/**
+ * Output queue.
+ *
+ * @fd          The socket.
+ * @cls         The priority classes.
+ * @tx          Packet taken from the queue that is being written.
+ * @tx_len      Number of bytes in tx.
+ * @tx_off      Number of bytes from tx already written.
+ * @dropped     Packets dropped because a class was full or the packet too
+ *              long.
+ * @superseded  LCD packets replaced by a newer one before being sent.
+ */
+struct pkt_queue {
+    int             fd;
+    struct pkt_class cls[PKT_PRIO_NUM];
+    uint8_t         tx[PKT_QUEUE_PKT_LEN];
+    int             tx_len;
+    int             tx_off;
+    uint32_t        dropped;
+    uint32_t        superseded;
+};
+
+/**
+ * Initialize output queue.
+ *
+ * @param  q   The queue.
+ * @param  fd  The socket. It will be switched to non-blocking mode and
+ *             configured for low latency (TCP_NODELAY and a small amount of
+ *             unsent data in the kernel).
+ */
+void            pkt_queue_init(struct pkt_queue *q, int fd);
+
+/** Get the priority class of a packet type. */
+int             pkt_queue_prio(int type);
+
+/**
+ * Queue a packet and write as much as possible to the socket.
+ *
+ * @param  q     The queue.
+ * @param  type  The packet type, used to select the priority class.
+ * @param  pkt   The packet.
+ * @param  len   The length of the packet.
+ * @retval  0    The packet was written or queued.
+ * @retval -1    A write error other than EAGAIN occurred (errno is set).
+ */
+int             pkt_queue_send(struct pkt_queue *q, int type,
+                               const uint8_t * pkt, int len);
+
+/**
+ * Write queued packets to the socket until it would block.
+ *
+ * @retval  0    OK; there may still be data left in the queue.
+ * @retval -1    A write error other than EAGAIN occurred (errno is set).
+ */
+int             pkt_queue_flush(struct pkt_queue *q);
+
+/** Check whether there is data waiting to be written. */
+int             pkt_queue_pending(struct pkt_queue *q);
+
+/** Get number of packets waiting in a priority class. */
+int             pkt_queue_count(struct pkt_queue *q, int prio);
+
+#endif
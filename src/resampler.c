@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "resampler.h"
+
+#define HIST    (RESAMPLER_TAPS - 1)    /* samples kept between chunks */
+#define CENTER  (RESAMPLER_TAPS / 2 - 1)        /* tap at the output */
+
+/* Blackman-Harris window for d in [-RESAMPLER_TAPS/2, RESAMPLER_TAPS/2] */
+static double window(double d)
+{
+    double          x = 2.0 * M_PI * d / RESAMPLER_TAPS;
+
+    return 0.35875 + 0.48829 * cos(x) + 0.14128 * cos(2 * x) +
+        0.01168 * cos(3 * x);
+}
+
+static double lowpass(double d)
+{
+    double          x = 2.0 * RESAMPLER_CUTOFF * d;
+
+    if (fabs(x) < 1.e-9)
+        return 2.0 * RESAMPLER_CUTOFF;
+
+    return sin(M_PI * x) / (M_PI * d);
+}
+
+void resampler_init(struct resampler *rs)
+{
+    double          sum;
+    double          d;
+    int             p;
+    int             k;
+
+    /* tap k of phase p weighs the input sample k - CENTER - p / PHASES
+     * samples from the output position */
+    for (p = 0; p <= RESAMPLER_PHASES; p++)
+    {
+        sum = 0.0;
+        for (k = 0; k < RESAMPLER_TAPS; k++)
+        {
+            d = k - CENTER - (double)p / RESAMPLER_PHASES;
+            rs->filter[p][k] = lowpass(d) * window(d);
+            sum += rs->filter[p][k];
+        }
+
+        /* unity gain at DC */
+        for (k = 0; k < RESAMPLER_TAPS; k++)
+            rs->filter[p][k] /= sum;
+    }
+
+    memset(rs->work, 0, sizeof(rs->work));
+    rs->pos = CENTER;
+}
+
+/* Interpolate one output sample at position pos of work */
+static float interpolate(const struct resampler *rs, double pos)
+{
+    const float    *x;
+    const float    *f0;
+    const float    *f1;
+    double          phase;
+    float           frac;
+    float           acc0 = 0.f;
+    float           acc1 = 0.f;
+    int             idx;
+    int             p;
+    int             k;
+
+    /* in float, a position just below the next sample would round up to
+     * phase RESAMPLER_PHASES and read past the table */
+    idx = (int)pos;
+    phase = (pos - idx) * RESAMPLER_PHASES;
+    p = (int)phase;
+    if (p > RESAMPLER_PHASES - 1)
+        p = RESAMPLER_PHASES - 1;
+    frac = (float)(phase - p);
+
+    x = &rs->work[idx - CENTER];
+    f0 = rs->filter[p];
+    f1 = rs->filter[p + 1];
+
+    /* filtering with both phases and interpolating the results is the
+     * same as interpolating the coefficients */
+    for (k = 0; k < RESAMPLER_TAPS; k++)
+    {
+        acc0 += x[k] * f0[k];
+        acc1 += x[k] * f1[k];
+    }
+
+    return acc0 + frac * (acc1 - acc0);
+}
+
+uint32_t resampler_process(struct resampler *rs, const int16_t * in,
+                           uint32_t frames, int16_t * out, uint32_t max_out,
+                           double speed)
+{
+    uint32_t        num = 0;
+    uint32_t        chunk;
+    uint32_t        end;
+    uint32_t        i;
+    float           y;
+
+    while (frames > 0)
+    {
+        chunk = frames < RESAMPLER_CHUNK ? frames : RESAMPLER_CHUNK;
+        for (i = 0; i < chunk; i++)
+            rs->work[HIST + i] = in[i];
+
+        /* the last tap of the filter must be inside the input */
+        end = HIST + chunk - (RESAMPLER_TAPS - CENTER - 1);
+        while (rs->pos < end && num < max_out)
+        {
+            y = interpolate(rs, rs->pos);
+            if (y > 32767.f)
+                y = 32767.f;
+            else if (y < -32768.f)
+                y = -32768.f;
+
+            out[num++] = (int16_t) lrintf(y);
+            rs->pos += speed;
+        }
+
+        /* out is full; skip the rest of the chunk */
+        if (rs->pos < end)
+            rs->pos = end;
+
+        /* keep the end of the chunk as history for the next one */
+        memmove(rs->work, &rs->work[chunk], HIST * sizeof(float));
+        rs->pos -= chunk;
+        in += chunk;
+        frames -= chunk;
+    }
+
+    return num;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#ifndef __RESAMPLER_H__
+#define __RESAMPLER_H__
+
+#include <stdint.h>
+
+/**
+ * @file
+ * Fractional resampler for small, varying speed changes of a mono stream.
+ *
+ * Each output sample is interpolated from RESAMPLER_TAPS input samples
+ * around its position using a windowed sinc filter. The filter is stored
+ * for RESAMPLER_PHASES sub-sample positions, and the coefficients for the
+ * actual position are interpolated linearly between the two nearest ones.
+ * The inner loops are plain float loops that the compiler vectorizes.
+ *
+ * The position carries over from one call to the next, so the stream is
+ * continuous when the speed changes. The delay is RESAMPLER_TAPS / 2
+ * samples.
+ */
+
+#define RESAMPLER_TAPS      16  /* filter length in input samples */
+#define RESAMPLER_PHASES    64  /* sub-sample positions in the table */
+#define RESAMPLER_CHUNK     512 /* input samples processed at a time */
+#define RESAMPLER_CUTOFF    0.45        /* cutoff relative to sample rate */
+
+/**
+ * Resampler state.
+ *
+ * @filter  Filter coefficients; the last phase is the first one shifted
+ *          by one sample, which makes the interpolation simple.
+ * @work    Input history followed by the chunk being processed.
+ * @pos     Position of the next output sample in work.
+ */
+struct resampler {
+    float           filter[RESAMPLER_PHASES + 1][RESAMPLER_TAPS];
+    float           work[RESAMPLER_TAPS - 1 + RESAMPLER_CHUNK];
+    double          pos;
+};
+
+/** Initialize the resampler; call again to start a new stream. */
+void            resampler_init(struct resampler *rs);
+
+/**
+ * Resample a block of samples.
+ *
+ * @param  rs       The resampler.
+ * @param  in       Input samples.
+ * @param  frames   Number of input samples.
+ * @param  out      Output samples.
+ * @param  max_out  Size of out; at least frames / speed + 2.
+ * @param  speed    Input samples per output sample, e.g. 1.0001 to play
+ *                  100 ppm faster.
+ * @return The number of output samples.
+ */
+uint32_t        resampler_process(struct resampler *rs, const int16_t * in,
+                                  uint32_t frames, int16_t * out,
+                                  uint32_t max_out, double speed);
+
+#endif
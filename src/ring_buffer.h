@@ -1,6 +1,6 @@
 /*
- * Simple ring buffer for nanosdr.
- * 
+ * Lock-free single-producer / single-consumer ring buffer.
+ *
  * Copyright (c) 2014, Alexandru Csete
  * All rights reserved.
  *
@@ -10,43 +10,85 @@
 #ifndef __RING_BUFFER_H__
 #define __RING_BUFFER_H__
 
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 /**
- * @file 
- * Simple ring buffer implementation.
+ * @file
+ * Single-producer / single-consumer ring buffer.
  *
  * @author    Alexandru Csete
  * @date      2014/12/29
  * @copyright Simplified BSD License
  *
- * This file implements a simple ring buffer that can hold data of unsigned
- * char type. The present implementation does not contain any boundary checks
- * and the callers must ensure that (1) the number of elemets written is less
- * than or equal to the buffer size and (2) the umber of elements read from
- * the buffer is less than or equal to the number of elements currently in the
- * buffer.
+ * This file implements a lock-free ring buffer that can hold data of unsigned
+ * char type. One thread may write to the buffer while another thread reads
+ * from it, e.g. the PortAudio callback and the main thread, without any
+ * locking.
+ *
+ * The write index (head) is only modified by the producer and the read index
+ * (tail) only by the consumer. Both are free running counters; the position
+ * in the buffer is found by masking with size - 1, so the size is always a
+ * power of two. A release store of an index after copying the data, paired
+ * with an acquire load on the other side, makes the data visible before the
+ * index. The indices are kept on separate cache lines so that the two
+ * threads do not invalidate each other's cache on every access.
+ *
+ * Since the producer can not touch the read index, writing into a full
+ * buffer drops the new data instead of overwriting the oldest data.
+ *
+ * The contract between the two threads:
  *
- * Furthermore, the buffer does not check how much empty space there is during
- * write operations, i.e. old data will be overwritten if writing happens
- * faster than reading.
+ *   Producer only:  ring_buffer_write(), ring_buffer_write_peek(),
+ *                   ring_buffer_write_commit()
+ *   Consumer only:  ring_buffer_read(), ring_buffer_read_peek(),
+ *                   ring_buffer_read_commit(), ring_buffer_clear()
+ *   Either thread:  ring_buffer_count(), ring_buffer_size(),
+ *                   ring_buffer_is_full(), ring_buffer_is_empty()
+ *   Neither thread: ring_buffer_init(), ring_buffer_init_mirrored(),
+ *                   ring_buffer_resize() and ring_buffer_free() require
+ *                   that nobody else uses the buffer.
+ *
+ * There must be at most one producer and one consumer at any time. See
+ * ring_buffer_test.c for a stress test and a benchmark.
+ *
+ * A buffer created with ring_buffer_init_mirrored() maps the same memory
+ * twice back-to-back, so that buffer[i + size] is buffer[i]. Any window of
+ * up to size elements is then contiguous and can be accessed in place using
+ * the peek and commit functions, e.g. by an encoder reading directly from
+ * the buffer. With a plain buffer the peek functions return the contiguous
+ * part up to the end of the buffer.
  */
 
+#define RING_BUFFER_ALIGN   64  /* cache line size */
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC         0x0001U
+#endif
+
 /**
  * The ring buffer structure.
  *
  * @buffer  The array of elements stored in the buffer.
- * @size    The sizeof the buffer.
- * @start   Index of the oldest element.
- * @count   Number of elements currently in the buffer.
+ * @size    The size of the buffer; a power of two.
+ * @mask    size - 1
+ * @mirrored Set if the memory is mapped twice.
+ * @head    Number of elements written since the last clear.
+ * @tail    Number of elements read since the last clear.
  */
 typedef struct {
     unsigned char  *buffer;
     uint_fast32_t   size;
-    uint_fast32_t   start;
-    uint_fast32_t   count;
+    uint_fast32_t   mask;
+    int             mirrored;
+
+    _Alignas(RING_BUFFER_ALIGN) atomic_uint_fast32_t head;
+    _Alignas(RING_BUFFER_ALIGN) atomic_uint_fast32_t tail;
 } ring_buffer_t;
 
 
@@ -54,22 +96,87 @@ typedef struct {
  * Initialize the ring buffer.
  *
  * @param rb Pointer to a newly allocated ring_buffer_t structure.
- * @param size The size of the buffer.
+ * @param size The minimum size of the buffer; rounded up to a power of two.
  *
  * This function will allocate the memory for the internal buffer and
  * initialize the bookkeeping parameters.
  */
 static inline void ring_buffer_init(ring_buffer_t * rb, uint_fast32_t size)
 {
-    rb->size = size;
-    rb->start = 0;
-    rb->count = 0;
+    rb->size = 1;
+    while (rb->size < size)
+        rb->size <<= 1;
+
+    rb->mask = rb->size - 1;
+    rb->mirrored = 0;
+    atomic_init(&rb->head, 0);
+    atomic_init(&rb->tail, 0);
     rb->buffer = (unsigned char *)malloc(rb->size);
 }
 
+/**
+ * Initialize a mirrored ring buffer.
+ *
+ * @param rb Pointer to a newly allocated ring_buffer_t structure.
+ * @param size The minimum size of the buffer; rounded up to a power of two
+ *             and at least one page.
+ * @retval  0  The buffer has been initialized.
+ * @retval -1  The memory could not be mapped (errno is set); rb has not
+ *             been initialized.
+ */
+static inline int ring_buffer_init_mirrored(ring_buffer_t * rb,
+                                            uint_fast32_t size)
+{
+    uint_fast32_t   len = sysconf(_SC_PAGESIZE);
+    unsigned char  *addr;
+    int             fd;
+
+    while (len < size)
+        len <<= 1;
+
+    fd = syscall(SYS_memfd_create, "ring_buffer", MFD_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    if (ftruncate(fd, len) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    /* reserve address space for both copies, then map the file into it */
+    addr = mmap(NULL, 2 * len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED ||
+        mmap(addr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+             0) == MAP_FAILED ||
+        mmap(addr + len, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             fd, 0) == MAP_FAILED)
+    {
+        if (addr != MAP_FAILED)
+            munmap(addr, 2 * len);
+        close(fd);
+        return -1;
+    }
+
+    /* the mappings keep the memory alive */
+    close(fd);
+
+    rb->buffer = addr;
+    rb->size = len;
+    rb->mask = len - 1;
+    rb->mirrored = 1;
+    atomic_init(&rb->head, 0);
+    atomic_init(&rb->tail, 0);
+
+    return 0;
+}
+
 static inline void ring_buffer_free(ring_buffer_t * rb)
 {
-    free(rb->buffer);
+    if (rb->mirrored)
+        munmap(rb->buffer, 2 * rb->size);
+    else
+        free(rb->buffer);
 }
 
 /**
@@ -79,65 +186,88 @@ static inline void ring_buffer_free(ring_buffer_t * rb)
  * @param  newsize The new size desired for the buffer.
  *
  * @warning The internal buffer will be reallocated and all data lost during
- *          this process.
+ *          this process. Neither the producer nor the consumer may use the
+ *          buffer meanwhile. A mirrored buffer that can not be mapped again
+ *          becomes a plain buffer.
  */
 static inline void ring_buffer_resize(ring_buffer_t * rb,
                                       uint_fast32_t newsize)
 {
+    int             mirrored = rb->mirrored;
+
     ring_buffer_free(rb);
-    ring_buffer_init(rb, newsize);
+    if (!mirrored || ring_buffer_init_mirrored(rb, newsize) == -1)
+        ring_buffer_init(rb, newsize);
 }
 
 /**
- * Check whether the buffer is full.
+ * Get number of elements in the buffer.
  *
- * @param rb Pointer to the ring buffer.
- * @return 1 if the buffer is full, otherwise 0.
+ * The producer may see a count that is too high and the consumer a count
+ * that is too low, but never the other way around.
  */
-static inline int ring_buffer_is_full(ring_buffer_t * rb)
+static inline uint_fast32_t ring_buffer_count(ring_buffer_t * rb)
 {
-    return (rb->count == rb->size);
+    /* tail first; it can never pass the head loaded after it */
+    uint_fast32_t   tail = atomic_load_explicit(&rb->tail,
+                                                memory_order_acquire);
+    uint_fast32_t   head = atomic_load_explicit(&rb->head,
+                                                memory_order_acquire);
+
+    return head - tail;
 }
 
-/** Check whether the buffer is empty. */
-static inline int ring_buffer_is_empty(ring_buffer_t * rb)
+/** Get size of the ring buffer. */
+static inline uint_fast32_t ring_buffer_size(ring_buffer_t * rb)
 {
-    return (rb->count == 0);
+    return rb->size;
 }
 
-/** Get number of elements in the buffer. */
-static inline uint_fast32_t ring_buffer_count(ring_buffer_t * rb)
+/**
+ * Check whether the buffer is full.
+ *
+ * @param rb Pointer to the ring buffer.
+ * @return 1 if the buffer is full, otherwise 0.
+ */
+static inline int ring_buffer_is_full(ring_buffer_t * rb)
 {
-    return rb->count;
+    return (ring_buffer_count(rb) == rb->size);
 }
 
-/** Get size of the ring buffer. */
-static inline uint_fast32_t ring_buffer_size(ring_buffer_t * rb)
+/** Check whether the buffer is empty. */
+static inline int ring_buffer_is_empty(ring_buffer_t * rb)
 {
-    return rb->size;
+    return (ring_buffer_count(rb) == 0);
 }
 
 /**
- * Write data into the buffer.
+ * Write data into the buffer. May only be called by the producer.
  *
  * @param rb   The ring buffer handle.
  * @param src  The source array.
- * @param num  The the number of elements in the input buffer. Must be less
- *             than or equal to @ref rb->size.
+ * @param num  The the number of elements in the input buffer.
+ * @return The number of elements written. Elements that do not fit in the
+ *         buffer are dropped.
  */
-static inline void ring_buffer_write(ring_buffer_t * rb, unsigned char *src,
-                                     uint_fast32_t num)
+static inline uint_fast32_t ring_buffer_write(ring_buffer_t * rb,
+                                              unsigned char *src,
+                                              uint_fast32_t num)
 {
-    if (!num)
-        return;
+    uint_fast32_t   head = atomic_load_explicit(&rb->head,
+                                                memory_order_relaxed);
+    uint_fast32_t   tail = atomic_load_explicit(&rb->tail,
+                                                memory_order_acquire);
+    uint_fast32_t   wp = head & rb->mask;
+    uint_fast32_t   split;
 
-    /* write pointer to first available slot */
-    uint_fast32_t   wp = (rb->start + rb->count) % rb->size;
+    if (num > rb->size - (head - tail))
+        num = rb->size - (head - tail);
 
-    /* new write pointer after successful write */
-    uint_fast32_t   new_wp = (wp + num) % rb->size;
+    if (!num)
+        return 0;
 
-    if (new_wp > wp)
+    split = rb->size - wp;
+    if (num <= split || rb->mirrored)
     {
         /* we can write in a single pass */
         memcpy(&rb->buffer[wp], src, num);
@@ -145,68 +275,160 @@ static inline void ring_buffer_write(ring_buffer_t * rb, unsigned char *src,
     else
     {
         /* we need to wrap around the end */
-        memcpy(&rb->buffer[wp], src, num - new_wp);
-        memcpy(rb->buffer, &src[num - new_wp], new_wp);
+        memcpy(&rb->buffer[wp], src, split);
+        memcpy(rb->buffer, &src[split], num - split);
     }
 
-    /* Update count and check if overwrite has occurred, if yes, adjust
-     * count and read pointer (rb->start)
-     */
-    rb->count += num;
-    if (rb->count > rb->size)
-    {
-        rb->count = rb->size;
-        rb->start = new_wp;
-    }
+    /* publish the data to the consumer */
+    atomic_store_explicit(&rb->head, head + num, memory_order_release);
+
+    return num;
 }
 
 /**
- * Read data from the riung buffer.
+ * Read data from the ring buffer. May only be called by the consumer.
  *
  * @param  rb    The ring buffer handle.
  * @param  dest  Pointer to the preallocated destination buffer.
- * @param  num   The number of elements to read. Must be less than or equal to
- *               @ref rb->count.
+ * @param  num   The number of elements to read.
+ * @return The number of elements read; less than num if the buffer did not
+ *         contain num elements.
  */
-static inline void ring_buffer_read(ring_buffer_t * rb, unsigned char *dest,
-                                    uint_fast32_t num)
+static inline uint_fast32_t ring_buffer_read(ring_buffer_t * rb,
+                                             unsigned char *dest,
+                                             uint_fast32_t num)
 {
-    if (!num)
-        return;
+    uint_fast32_t   tail = atomic_load_explicit(&rb->tail,
+                                                memory_order_relaxed);
+    uint_fast32_t   head = atomic_load_explicit(&rb->head,
+                                                memory_order_acquire);
+    uint_fast32_t   rp = tail & rb->mask;
+    uint_fast32_t   split;
 
-    /* index of the last value to read */
-    uint_fast32_t   end = (rb->start + num - 1) % rb->size;
+    if (num > head - tail)
+        num = head - tail;
 
-    if (end < rb->start)
-    {
-        /* we need to read in two passes */
-        uint_fast32_t   split = rb->size - rb->start;
+    if (!num)
+        return 0;
 
-        memcpy(dest, &rb->buffer[rb->start], split);
-        memcpy(&dest[split], rb->buffer, end + 1);
+    split = rb->size - rp;
+    if (num <= split || rb->mirrored)
+    {
+        /* can read in a single pass */
+        memcpy(dest, &rb->buffer[rp], num);
     }
     else
     {
-        /* can read in a single pass */
-        memcpy(dest, &rb->buffer[rb->start], num);
+        /* we need to read in two passes */
+        memcpy(dest, &rb->buffer[rp], split);
+        memcpy(&dest[split], rb->buffer, num - split);
     }
 
-    rb->count -= num;
-    rb->start = (end + 1) % rb->size;
+    /* hand the space back to the producer */
+    atomic_store_explicit(&rb->tail, tail + num, memory_order_release);
+
+    return num;
+}
+
+/**
+ * Get the data at the read position without consuming it. May only be
+ * called by the consumer.
+ *
+ * @param  rb    The ring buffer handle.
+ * @param  num   Set to the number of contiguous elements at the returned
+ *               address; the full count for a mirrored buffer.
+ * @return Pointer to the oldest element. The elements remain in the buffer
+ *         until they are consumed with ring_buffer_read_commit().
+ */
+static inline unsigned char *ring_buffer_read_peek(ring_buffer_t * rb,
+                                                   uint_fast32_t * num)
+{
+    uint_fast32_t   tail = atomic_load_explicit(&rb->tail,
+                                                memory_order_relaxed);
+    uint_fast32_t   head = atomic_load_explicit(&rb->head,
+                                                memory_order_acquire);
+    uint_fast32_t   rp = tail & rb->mask;
+
+    *num = head - tail;
+    if (!rb->mirrored && *num > rb->size - rp)
+        *num = rb->size - rp;
+
+    return &rb->buffer[rp];
 }
 
+/**
+ * Consume elements obtained with ring_buffer_read_peek().
+ *
+ * @param  rb    The ring buffer handle.
+ * @param  num   The number of elements to consume; at most the number
+ *               returned by the peek.
+ */
+static inline void ring_buffer_read_commit(ring_buffer_t * rb,
+                                           uint_fast32_t num)
+{
+    uint_fast32_t   tail = atomic_load_explicit(&rb->tail,
+                                                memory_order_relaxed);
+
+    atomic_store_explicit(&rb->tail, tail + num, memory_order_release);
+}
+
+/**
+ * Get the free space at the write position. May only be called by the
+ * producer.
+ *
+ * @param  rb    The ring buffer handle.
+ * @param  num   Set to the number of contiguous free elements at the
+ *               returned address; all free space for a mirrored buffer.
+ * @return Pointer to the first free element. Data written there becomes
+ *         visible to the consumer with ring_buffer_write_commit().
+ */
+static inline unsigned char *ring_buffer_write_peek(ring_buffer_t * rb,
+                                                    uint_fast32_t * num)
+{
+    uint_fast32_t   head = atomic_load_explicit(&rb->head,
+                                                memory_order_relaxed);
+    uint_fast32_t   tail = atomic_load_explicit(&rb->tail,
+                                                memory_order_acquire);
+    uint_fast32_t   wp = head & rb->mask;
+
+    *num = rb->size - (head - tail);
+    if (!rb->mirrored && *num > rb->size - wp)
+        *num = rb->size - wp;
+
+    return &rb->buffer[wp];
+}
+
+/**
+ * Publish elements written to the address returned by
+ * ring_buffer_write_peek().
+ *
+ * @param  rb    The ring buffer handle.
+ * @param  num   The number of elements written; at most the number returned
+ *               by the peek.
+ */
+static inline void ring_buffer_write_commit(ring_buffer_t * rb,
+                                            uint_fast32_t num)
+{
+    uint_fast32_t   head = atomic_load_explicit(&rb->head,
+                                                memory_order_relaxed);
+
+    atomic_store_explicit(&rb->head, head + num, memory_order_release);
+}
 
 /**
- * Clear the buffer.
+ * Clear the buffer. May only be called by the consumer.
  *
  * @param rb The ring buffer handle.
  *
- * This function will clear the buffer by setting the start and the count to 0.
+ * This function will clear the buffer by discarding all elements that have
+ * been written so far.
  */
 static inline void ring_buffer_clear(ring_buffer_t * rb)
 {
-    rb->start = 0;
-    rb->count = 0;
+    atomic_store_explicit(&rb->tail,
+                          atomic_load_explicit(&rb->head,
+                                               memory_order_acquire),
+                          memory_order_release);
 }
 
 #endif // __RING_BUFFER_H__
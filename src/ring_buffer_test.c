@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#include <inttypes.h>           // PRIu64
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ring_buffer.h"
+
+/*
+ * Stress test and benchmark of the SPSC ring buffer.
+ *
+ * The stress test runs a producer and a consumer thread on a small buffer
+ * so that it is full or empty most of the time. The producer writes a
+ * byte sequence in chunks of varying length, alternating between the copy
+ * and the peek/commit functions; the consumer checks every byte it reads
+ * the same two ways. Build with 'make TSAN=1 ring_buffer_test' to run it
+ * under ThreadSanitizer.
+ *
+ * The benchmark measures the throughput of the copy and peek/commit
+ * functions for a few chunk sizes, again with two threads.
+ */
+
+#define TEST_SIZE       4096    /* buffer for the stress test */
+#define BENCH_SIZE      65536   /* buffer for the benchmark */
+#define MAX_CHUNK       3000    /* longest chunk in the stress test */
+
+/**
+ * Test run.
+ *
+ * @rb       The ring buffer.
+ * @total    Number of bytes to pass through the buffer.
+ * @chunk    Chunk size; 0 for varying chunks and checked data.
+ * @peek     Use the peek/commit functions; -1 to alternate.
+ * @errors   Bytes the consumer found wrong.
+ * @full     Times the producer found no space.
+ * @empty    Times the consumer found no data.
+ */
+struct run {
+    ring_buffer_t   rb;
+    uint64_t        total;
+    uint32_t        chunk;
+    int             peek;
+    uint64_t        errors;
+    uint64_t        full;
+    uint64_t        empty;
+};
+
+static uint64_t time_ns(void)
+{
+    struct timespec tspec;
+
+    clock_gettime(CLOCK_MONOTONIC, &tspec);
+
+    return 1000000000ULL * tspec.tv_sec + tspec.tv_nsec;
+}
+
+/* Simple generator for the chunk lengths; each thread has its own */
+static uint32_t next_rand(uint32_t * state)
+{
+    *state = *state * 1103515245 + 12345;
+
+    return *state >> 8;
+}
+
+static int use_peek(const struct run *r, uint64_t n)
+{
+    return r->peek == -1 ? (int)(n & 1) : r->peek;
+}
+
+static void    *producer(void *arg)
+{
+    struct run     *r = (struct run *)arg;
+    unsigned char   chunk[BENCH_SIZE];
+    unsigned char  *dst;
+    uint_fast32_t   avail;
+    uint64_t        pos = 0;
+    uint64_t        n = 0;
+    uint32_t        seed = 1;
+    uint32_t        len, i;
+
+    for (i = 0; i < sizeof(chunk); i++)
+        chunk[i] = i;
+
+    while (pos < r->total)
+    {
+        len = r->chunk ? r->chunk : 1 + next_rand(&seed) % MAX_CHUNK;
+        if (len > r->total - pos)
+            len = r->total - pos;
+
+        if (use_peek(r, n++))
+        {
+            dst = ring_buffer_write_peek(&r->rb, &avail);
+            if (len > avail)
+                len = avail;
+            for (i = 0; r->chunk == 0 && i < len; i++)
+                dst[i] = (pos + i) & 0xFF;
+            if (r->chunk)
+                memcpy(dst, chunk, len);
+            ring_buffer_write_commit(&r->rb, len);
+        }
+        else
+        {
+            for (i = 0; r->chunk == 0 && i < len; i++)
+                chunk[i] = (pos + i) & 0xFF;
+            len = ring_buffer_write(&r->rb, chunk, len);
+        }
+
+        if (len == 0)
+        {
+            r->full++;
+            sched_yield();
+        }
+
+        pos += len;
+    }
+
+    return NULL;
+}
+
+static void    *consumer(void *arg)
+{
+    struct run     *r = (struct run *)arg;
+    unsigned char   chunk[BENCH_SIZE];
+    unsigned char  *src;
+    uint_fast32_t   avail;
+    uint64_t        pos = 0;
+    uint64_t        n = 0;
+    uint32_t        seed = 2;
+    uint32_t        len, i;
+
+    while (pos < r->total)
+    {
+        len = r->chunk ? r->chunk : 1 + next_rand(&seed) % MAX_CHUNK;
+
+        if (use_peek(r, n++))
+        {
+            src = ring_buffer_read_peek(&r->rb, &avail);
+            if (len > avail)
+                len = avail;
+            for (i = 0; r->chunk == 0 && i < len; i++)
+                r->errors += src[i] != ((pos + i) & 0xFF);
+            if (r->chunk)
+                memcpy(chunk, src, len);
+            ring_buffer_read_commit(&r->rb, len);
+        }
+        else
+        {
+            len = ring_buffer_read(&r->rb, chunk, len);
+            for (i = 0; r->chunk == 0 && i < len; i++)
+                r->errors += chunk[i] != ((pos + i) & 0xFF);
+        }
+
+        if (len == 0)
+        {
+            r->empty++;
+            sched_yield();
+        }
+
+        pos += len;
+    }
+
+    return NULL;
+}
+
+/* Run producer and consumer; returns the time in ns */
+static uint64_t run_threads(struct run *r)
+{
+    pthread_t       prod, cons;
+    uint64_t        start;
+
+    r->errors = 0;
+    r->full = 0;
+    r->empty = 0;
+
+    start = time_ns();
+    if (pthread_create(&cons, NULL, consumer, r) ||
+        pthread_create(&prod, NULL, producer, r))
+    {
+        fprintf(stderr, "Error starting threads\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_join(prod, NULL);
+    pthread_join(cons, NULL);
+
+    return time_ns() - start;
+}
+
+static int init_buffer(ring_buffer_t * rb, uint32_t size, int mirrored)
+{
+    if (!mirrored)
+    {
+        ring_buffer_init(rb, size);
+        return 0;
+    }
+
+    if (ring_buffer_init_mirrored(rb, size) == -1)
+    {
+        fprintf(stderr, "Mirrored buffer not available\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int stress_test(uint64_t total, int mirrored)
+{
+    struct run      r;
+    uint64_t        ns;
+
+    if (init_buffer(&r.rb, TEST_SIZE, mirrored) == -1)
+        return 0;
+
+    r.total = total;
+    r.chunk = 0;
+    r.peek = -1;
+
+    ns = run_threads(&r);
+    fprintf(stderr, "Stress test, %s buffer: %" PRIu64 " bytes in %.2f s, "
+            "%" PRIu64 " errors, full / empty %" PRIu64 " / %" PRIu64 "\n",
+            mirrored ? "mirrored" : "plain", total, 1.e-9 * ns, r.errors,
+            r.full, r.empty);
+
+    ring_buffer_free(&r.rb);
+
+    return r.errors != 0;
+}
+
+static void benchmark(uint64_t total, int mirrored)
+{
+    static const uint32_t chunks[] = { 64, 960, 4096 };
+    struct run      r;
+    uint64_t        ns;
+    unsigned int    i;
+    int             peek;
+
+    if (init_buffer(&r.rb, BENCH_SIZE, mirrored) == -1)
+        return;
+
+    for (peek = 0; peek <= 1; peek++)
+    {
+        for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+        {
+            r.total = total;
+            r.chunk = chunks[i];
+            r.peek = peek;
+
+            ns = run_threads(&r);
+            fprintf(stderr, "  %-8s %-10s %5" PRIu32 " %9.1f %9.1f\n",
+                    mirrored ? "mirrored" : "plain",
+                    peek ? "peek" : "copy", r.chunk,
+                    1.e3 * total / ns, 1.e9 * total / r.chunk / ns / 1.e6);
+        }
+    }
+
+    ring_buffer_free(&r.rb);
+}
+
+static void help(void)
+{
+    static const char help_string[] =
+        "\n Usage: ring_buffer_test [options]\n"
+        "\n Possible options are:\n\n"
+        "  -n    Megabytes passed through the buffer in the stress test\n"
+        "        (default is 64).\n"
+        "  -b    Megabytes per benchmark run; 0 skips the benchmark\n"
+        "        (default is 256).\n"
+        "  -h    This help message.\n\n";
+
+    fprintf(stderr, "%s", help_string);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t        test_mb = 64;
+    uint64_t        bench_mb = 256;
+    int             failed = 0;
+    int             option;
+
+    while ((option = getopt(argc, argv, "n:b:h")) != -1)
+    {
+        switch (option)
+        {
+        case 'n':
+            test_mb = atoi(optarg);
+            break;
+
+        case 'b':
+            bench_mb = atoi(optarg);
+            break;
+
+        case 'h':
+            help();
+            exit(EXIT_SUCCESS);
+
+        default:
+            help();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    failed |= stress_test(test_mb << 20, 0);
+    failed |= stress_test(test_mb << 20, 1);
+
+    if (bench_mb)
+    {
+        fprintf(stderr, "\n  Buffer   Functions  Chunk    MB/s  Mchunks/s\n");
+        benchmark(bench_mb << 20, 0);
+        benchmark(bench_mb << 20, 1);
+    }
+
+    exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
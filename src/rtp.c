@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "rtp.h"
+
+static void put_u16(uint8_t * out, uint16_t value)
+{
+    out[0] = value >> 8;
+    out[1] = value & 0xFF;
+}
+
+static void put_u32(uint8_t * out, uint32_t value)
+{
+    put_u16(out, value >> 16);
+    put_u16(&out[2], value & 0xFFFF);
+}
+
+static uint16_t get_u16(const uint8_t * in)
+{
+    return (in[0] << 8) | in[1];
+}
+
+static uint32_t get_u32(const uint8_t * in)
+{
+    return ((uint32_t) get_u16(in) << 16) | get_u16(&in[2]);
+}
+
+void rtp_sender_init(struct rtp_sender *tx, uint32_t sample_rate)
+{
+    uint64_t        seed = time_us() ^ ((uint64_t) getpid() << 16);
+
+    tx->ssrc = seed * 2654435761u;
+    tx->seq = seed >> 8;
+    tx->timestamp = seed * 40503u;
+    tx->sample_rate = sample_rate;
+    tx->marker = 0;
+}
+
+int rtp_write_header(struct rtp_sender *tx, uint8_t * out, uint32_t samples)
+{
+    out[0] = 0x80;              /* version 2, no padding/extension/CSRC */
+    out[1] = RTP_PT_OPUS | (tx->marker ? 0x80 : 0);
+    put_u16(&out[2], tx->seq);
+    put_u32(&out[4], tx->timestamp);
+    put_u32(&out[8], tx->ssrc);
+
+    tx->seq++;
+    tx->timestamp += (uint64_t) samples * RTP_CLOCK_RATE / tx->sample_rate;
+    tx->marker = 0;
+
+    return RTP_HDR_LEN;
+}
+
+void rtp_skip(struct rtp_sender *tx, uint32_t samples)
+{
+    tx->timestamp += (uint64_t) samples * RTP_CLOCK_RATE / tx->sample_rate;
+    tx->marker = 1;
+}
+
+int rtp_parse(const uint8_t * pkt, int len, struct rtp_header *hdr)
+{
+    int             offset = RTP_HDR_LEN;
+
+    if (len < RTP_HDR_LEN || (pkt[0] & 0xC0) != 0x80)
+        return -1;
+
+    hdr->pt = pkt[1] & 0x7F;
+    hdr->marker = pkt[1] >> 7;
+    hdr->seq = get_u16(&pkt[2]);
+    hdr->timestamp = get_u32(&pkt[4]);
+    hdr->ssrc = get_u32(&pkt[8]);
+
+    /* skip CSRC list and header extension */
+    offset += 4 * (pkt[0] & 0x0F);
+    if ((pkt[0] & 0x10) && offset + 4 <= len)
+        offset += 4 + 4 * get_u16(&pkt[offset + 2]);
+
+    /* remove padding */
+    if ((pkt[0] & 0x20) && len > offset)
+        len -= pkt[len - 1];
+
+    if (offset > len)
+        return -1;
+
+    hdr->payload = &pkt[offset];
+    hdr->payload_len = len - offset;
+
+    return 0;
+}
+
+void rtp_receiver_init(struct rtp_receiver *rx)
+{
+    memset(rx, 0, sizeof(struct rtp_receiver));
+}
+
+/* Start over from the given packet */
+static void restart(struct rtp_receiver *rx, const struct rtp_header *hdr)
+{
+    uint32_t        late = rx->late;
+
+    rtp_receiver_init(rx);
+    rx->have_seq = 1;
+    rx->ssrc = hdr->ssrc;
+    rx->base_seq = hdr->seq;
+    rx->max_seq = hdr->seq;
+    rx->received = 1;
+    rx->late = late;
+}
+
+int rtp_receive(struct rtp_receiver *rx, const struct rtp_header *hdr)
+{
+    int16_t         delta = hdr->seq - rx->max_seq;
+
+    if (!rx->have_seq || hdr->ssrc != rx->ssrc || delta > RTP_MAX_DROPOUT)
+    {
+        restart(rx, hdr);
+        return 0;
+    }
+
+    if (delta <= 0)
+    {
+        rx->late++;
+        return -1;
+    }
+
+    if (hdr->seq < rx->max_seq)
+        rx->cycles += 0x10000;
+
+    rx->max_seq = hdr->seq;
+    rx->received++;
+
+    return delta - 1;
+}
+
+/* Number of packets expected so far */
+static uint32_t expected(const struct rtp_receiver *rx)
+{
+    return rx->cycles + rx->max_seq - rx->base_seq + 1;
+}
+
+uint32_t rtp_lost(const struct rtp_receiver *rx)
+{
+    if (!rx->have_seq)
+        return 0;
+
+    return expected(rx) - rx->received;
+}
+
+int rtcp_write_rr(struct rtp_receiver *rx, uint32_t ssrc, uint8_t * out)
+{
+    uint32_t        exp = rx->have_seq ? expected(rx) : 0;
+    uint32_t        exp_interval = exp - rx->expected_prior;
+    uint32_t        rcv_interval = rx->received - rx->received_prior;
+    uint32_t        lost = rtp_lost(rx);
+    uint8_t         fraction = 0;
+
+    rx->expected_prior = exp;
+    rx->received_prior = rx->received;
+
+    if (exp_interval > rcv_interval)
+        fraction = ((exp_interval - rcv_interval) << 8) / exp_interval;
+
+    if (lost > 0x7FFFFF)
+        lost = 0x7FFFFF;
+
+    memset(out, 0, RTCP_RR_LEN);
+    out[0] = 0x81;              /* version 2, one report block */
+    out[1] = RTCP_PT_RR;
+    put_u16(&out[2], RTCP_RR_LEN / 4 - 1);
+    put_u32(&out[4], ssrc);
+    put_u32(&out[8], rx->ssrc);
+    put_u32(&out[12], lost);
+    out[12] = fraction;
+    put_u32(&out[16], rx->cycles + rx->max_seq);
+
+    /* jitter, LSR and DLSR are not used */
+
+    return RTCP_RR_LEN;
+}
+
+int rtcp_parse_rr(const uint8_t * pkt, int len, uint8_t * fraction)
+{
+    if (len < RTCP_RR_LEN || (pkt[0] & 0xC0) != 0x80 ||
+        pkt[1] != RTCP_PT_RR || (pkt[0] & 0x1F) == 0)
+        return -1;
+
+    *fraction = pkt[12];
+
+    return 0;
+}
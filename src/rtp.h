@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#ifndef __RTP_H__
+#define __RTP_H__
+
+#include <stdint.h>
+
+/**
+ * @file
+ * Minimal RTP (RFC 3550) for the Opus audio stream over UDP.
+ *
+ * The server sends one Opus packet per RTP packet with payload type
+ * RTP_PT_OPUS. As required by RFC 7587 the timestamp runs at 48 kHz
+ * regardless of the actual sample rate.
+ *
+ * The client sends an RTCP receiver report every RTCP_INTERVAL_MS. The
+ * reports tell the server the fraction of packets lost, which controls the
+ * Opus in-band FEC, and they keep the stream alive: the server stops
+ * sending when it has not received anything for RTP_TIMEOUT_MS.
+ *
+ * During silence the server may send nothing at all. The timestamp keeps
+ * running, and the first packet after the silence has the marker bit set
+ * as for the start of a talkspurt.
+ */
+
+#define RTP_HDR_LEN         12
+#define RTP_PT_OPUS         96  /* dynamic payload type */
+#define RTP_CLOCK_RATE      48000
+
+#define RTCP_PT_RR          201
+#define RTCP_RR_LEN         32  /* receiver report with one report block */
+
+#define RTCP_INTERVAL_MS    1000
+#define RTP_TIMEOUT_MS      5000
+
+/* A sequence number this far ahead of the previous one means that the
+ * sender has restarted */
+#define RTP_MAX_DROPOUT     3000
+
+/**
+ * Received RTP header.
+ *
+ * @pt          Payload type.
+ * @marker      Marker bit; set on the first packet after silence.
+ * @seq         Sequence number.
+ * @timestamp   Timestamp.
+ * @ssrc        Synchronization source of the sender.
+ * @payload     Pointer to the payload inside the packet.
+ * @payload_len Length of the payload.
+ */
+struct rtp_header {
+    uint8_t         pt;
+    uint8_t         marker;
+    uint16_t        seq;
+    uint32_t        timestamp;
+    uint32_t        ssrc;
+    const uint8_t  *payload;
+    int             payload_len;
+};
+
+/**
+ * RTP sender state.
+ *
+ * @ssrc         Our synchronization source.
+ * @seq          Sequence number of the next packet.
+ * @timestamp    Timestamp of the next packet.
+ * @sample_rate  Audio sample rate.
+ * @marker       Set the marker bit in the next packet.
+ */
+struct rtp_sender {
+    uint32_t        ssrc;
+    uint16_t        seq;
+    uint32_t        timestamp;
+    uint32_t        sample_rate;
+    int             marker;
+};
+
+/**
+ * RTP receiver state and statistics.
+ *
+ * @have_seq        Set once a packet has been received.
+ * @ssrc            Synchronization source of the sender.
+ * @base_seq        First sequence number received.
+ * @max_seq         Highest sequence number received.
+ * @cycles          Sequence number wrap arounds, shifted left by 16.
+ * @received        Packets received.
+ * @expected_prior  Packets expected at the last receiver report.
+ * @received_prior  Packets received at the last receiver report.
+ * @late            Packets dropped because they were late or duplicated.
+ */
+struct rtp_receiver {
+    int             have_seq;
+    uint32_t        ssrc;
+    uint32_t        base_seq;
+    uint16_t        max_seq;
+    uint32_t        cycles;
+    uint32_t        received;
+    uint32_t        expected_prior;
+    uint32_t        received_prior;
+    uint32_t        late;
+};
+
+/** Initialize sender with a random SSRC, sequence number and timestamp. */
+void            rtp_sender_init(struct rtp_sender *tx, uint32_t sample_rate);
+
+/**
+ * Write the RTP header of the next packet.
+ *
+ * @param  tx       The sender.
+ * @param  out      Buffer of at least RTP_HDR_LEN bytes.
+ * @param  samples  Number of samples in the packet at tx->sample_rate; the
+ *                  timestamp of the following packet is advanced by this.
+ * @return RTP_HDR_LEN
+ */
+int             rtp_write_header(struct rtp_sender *tx, uint8_t * out,
+                                 uint32_t samples);
+
+/**
+ * Skip samples that are not sent, e.g. during silence.
+ *
+ * @param  tx       The sender.
+ * @param  samples  Number of samples at tx->sample_rate.
+ *
+ * The timestamp is advanced and the next packet gets the marker bit.
+ */
+void            rtp_skip(struct rtp_sender *tx, uint32_t samples);
+
+/**
+ * Parse a received RTP packet.
+ *
+ * @param  pkt  The packet.
+ * @param  len  The length of the packet.
+ * @param  hdr  The parsed header.
+ * @retval  0   OK.
+ * @retval -1   Not a valid RTP packet.
+ */
+int             rtp_parse(const uint8_t * pkt, int len,
+                          struct rtp_header *hdr);
+
+/** Initialize receiver. */
+void            rtp_receiver_init(struct rtp_receiver *rx);
+
+/**
+ * Update the receiver with a received packet.
+ *
+ * @param  rx   The receiver.
+ * @param  hdr  The header of the packet.
+ * @return The number of packets lost just before this one, or -1 if the
+ *         packet is late or a duplicate and should be dropped.
+ */
+int             rtp_receive(struct rtp_receiver *rx,
+                            const struct rtp_header *hdr);
+
+/** Get the number of packets lost so far. */
+uint32_t        rtp_lost(const struct rtp_receiver *rx);
+
+/**
+ * Create an RTCP receiver report.
+ *
+ * @param  rx    The receiver.
+ * @param  ssrc  Our synchronization source.
+ * @param  out   Buffer of at least RTCP_RR_LEN bytes.
+ * @return RTCP_RR_LEN
+ *
+ * The fraction lost covers the packets since the previous report.
+ */
+int             rtcp_write_rr(struct rtp_receiver *rx, uint32_t ssrc,
+                              uint8_t * out);
+
+/**
+ * Parse an RTCP receiver report.
+ *
+ * @param  pkt       The packet.
+ * @param  len       The length of the packet.
+ * @param  fraction  The fraction lost, 0-255 for 0-100%.
+ * @retval  0   OK.
+ * @retval -1   Not a receiver report with a report block.
+ */
+int             rtcp_parse_rr(const uint8_t * pkt, int len,
+                              uint8_t * fraction);
+
+#endif
@@ -16,7 +16,7 @@
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 
 #include "common.h"
 
@@ -38,7 +38,9 @@ int transfer_data_local(int ifd, int ofd, struct xfr_buf *buffer)
 {
     int             pkt_type;
 
-    pkt_type = read_data(ifd, buffer);
+    (void)ifd;
+
+    pkt_type = next_packet(buffer);
     switch (pkt_type)
     {
     case PKT_TYPE_INCOMPLETE:
@@ -46,16 +48,13 @@ int transfer_data_local(int ifd, int ofd, struct xfr_buf *buffer)
 
     case PKT_TYPE_INVALID:
         buffer->invalid_pkts++;
-        buffer->wridx = 0;
         break;
 
     default:
-        /* we also "send" on EOF packet because buffer may not be empty */
 #if DEBUG
-        print_buffer(ifd, ofd, buffer->data, buffer->wridx);
+        print_buffer(ifd, ofd, buffer->pkt, buffer->pkt_len);
 #endif
-        write(ofd, buffer->data, buffer->wridx);
-        buffer->wridx = 0;
+        write(ofd, buffer->pkt, buffer->pkt_len);
         buffer->valid_pkts++;
     }
 
@@ -66,9 +65,7 @@ int transfer_data_local(int ifd, int ofd, struct xfr_buf *buffer)
 int main(int argc, char **argv)
 {
     struct xfr_buf  radio_buf, panel_buf;
-    struct timeval  timeout;
-    fd_set          readfs;     /* file descriptor set */
-    int             maxfd;      /* maximum file desciptor used */
+    struct evloop   loop;
     int             res;
     int             radio_fd;
     int             panel_fd;
@@ -106,39 +103,46 @@ int main(int argc, char **argv)
     /* 19200 bps, 8n1, blocking */
     set_serial_config(radio_fd, B19200, 0, 1);
 
-    /* maximum bit entry (fd) to test */
-    maxfd = (radio_fd > panel_fd ? radio_fd : panel_fd) + 1;
+    if (evloop_init(&loop) == -1)
+        goto closefds;
+
+    evloop_add(&loop, panel_fd, EPOLLIN);
+    evloop_add(&loop, radio_fd, EPOLLIN);
 
     radio_buf.wridx = 0;
+    radio_buf.rdidx = 0;
     radio_buf.valid_pkts = 0;
     radio_buf.invalid_pkts = 0;
     panel_buf.wridx = 0;
+    panel_buf.rdidx = 0;
     panel_buf.valid_pkts = 0;
     panel_buf.invalid_pkts = 0;
 
     while (keep_running)
     {
-        FD_SET(panel_fd, &readfs);      /* set testing for source 1 */
-        FD_SET(radio_fd, &readfs);      /* set testing for source 2 */
-
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-
-        /* block until input becomes available or timeout expires */
-        res = select(maxfd, &readfs, NULL, NULL, &timeout);
+        /* block until input becomes available */
+        res = evloop_wait(&loop, -1);
 
         if (res > 0)
         {
-            if (FD_ISSET(panel_fd, &readfs))
-                transfer_data_local(panel_fd, radio_fd, &panel_buf);
-
-            if (FD_ISSET(radio_fd, &readfs))
-                transfer_data_local(radio_fd, panel_fd, &radio_buf);
+            if (evloop_events(&loop, panel_fd) & EPOLLIN)
+            {
+                read_data(panel_fd, &panel_buf);
+                while (transfer_data_local(panel_fd, radio_fd, &panel_buf) !=
+                       PKT_TYPE_INCOMPLETE) ;
+            }
+
+            if (evloop_events(&loop, radio_fd) & EPOLLIN)
+            {
+                read_data(radio_fd, &radio_buf);
+                while (transfer_data_local(radio_fd, panel_fd, &radio_buf) !=
+                       PKT_TYPE_INCOMPLETE) ;
+            }
         }
-
-        usleep(LOOP_DELAY_US);
     }
 
+    evloop_close(&loop);
+
 
   closefds:
     close(panel_fd);
@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "pkt_queue.h"
+#include "udp_link.h"
+
+static void put_u16(uint8_t * out, uint16_t value)
+{
+    out[0] = value >> 8;
+    out[1] = value & 0xFF;
+}
+
+static uint16_t get_u16(const uint8_t * in)
+{
+    return (in[0] << 8) | in[1];
+}
+
+static void put_header(struct udp_link *link, uint8_t * dgram, int kind,
+                       uint16_t seq)
+{
+    dgram[0] = kind;
+    put_u16(&dgram[1], link->session >> 16);
+    put_u16(&dgram[3], link->session & 0xFFFF);
+    put_u16(&dgram[5], seq);
+    put_u16(&dgram[7], link->rx_next);
+
+    /* every datagram carries the acknowledgement */
+    link->ack_pending = 0;
+}
+
+/* Send datagram; a full socket buffer or an absent peer is not an error */
+static int send_dgram(struct udp_link *link, const uint8_t * dgram, int len)
+{
+    if (write(link->fd, dgram, len) != len &&
+        errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED)
+        return -1;
+
+    link->last_tx = time_ms();
+
+    return 0;
+}
+
+static int send_ack(struct udp_link *link)
+{
+    uint8_t         dgram[UDP_HDR_LEN];
+
+    put_header(link, dgram, UDP_KIND_ACK, 0);
+
+    return send_dgram(link, dgram, UDP_HDR_LEN);
+}
+
+static int retransmit(struct udp_link *link, struct udp_slot *slot)
+{
+    /* update the acknowledgement */
+    put_u16(&slot->data[7], link->rx_next);
+    link->ack_pending = 0;
+
+    slot->time = time_ms();
+    link->retransmits++;
+
+    return send_dgram(link, slot->data, slot->len);
+}
+
+/* Forget everything about the peer; used when it has restarted */
+static void reset_link(struct udp_link *link)
+{
+    int             i;
+
+    link->data_seq = 0;
+    link->tx_seq = 0;
+    link->tx_acked = 0;
+    link->have_rx_data = 0;
+    link->rx_next = 0;
+
+    for (i = 0; i < UDP_WINDOW; i++)
+    {
+        link->tx[i].len = 0;
+        link->rx[i].len = 0;
+    }
+}
+
+void udp_link_init(struct udp_link *link, int fd)
+{
+    memset(link, 0, sizeof(struct udp_link));
+
+    link->fd = fd;
+    if (getrandom(&link->session, sizeof(link->session), GRND_NONBLOCK) !=
+        sizeof(link->session))
+        link->session = time_us() ^ ((uint32_t) getpid() << 16);
+    link->last_rx = time_ms();
+    link->last_tx = link->last_rx;
+}
+
+int udp_link_reliable(int type)
+{
+    int             prio = pkt_queue_prio(type);
+
+    return prio == PKT_PRIO_PTT || prio == PKT_PRIO_CONTROL;
+}
+
+int udp_link_send(struct udp_link *link, int type, const uint8_t * pkt,
+                  int len)
+{
+    uint8_t         dgram[UDP_MAX_LEN];
+    struct udp_slot *slot;
+
+    if (len > PKT_QUEUE_PKT_LEN)
+    {
+        link->dropped++;
+        return -1;
+    }
+
+    link->sent++;
+
+    if (!udp_link_reliable(type))
+    {
+        put_header(link, dgram, UDP_KIND_DATA, link->data_seq++);
+        memcpy(&dgram[UDP_HDR_LEN], pkt, len);
+
+        return send_dgram(link, dgram, UDP_HDR_LEN + len);
+    }
+
+    if ((uint16_t) (link->tx_seq - link->tx_acked) >= UDP_WINDOW)
+    {
+        link->dropped++;
+        return -1;
+    }
+
+    slot = &link->tx[link->tx_seq % UDP_WINDOW];
+    slot->seq = link->tx_seq++;
+    slot->len = UDP_HDR_LEN + len;
+    slot->time = time_ms();
+    put_header(link, slot->data, UDP_KIND_REL, slot->seq);
+    memcpy(&slot->data[UDP_HDR_LEN], pkt, len);
+
+    return send_dgram(link, slot->data, slot->len);
+}
+
+/* Request reliable packets missing before seq */
+static void send_nack(struct udp_link *link, uint16_t seq)
+{
+    uint8_t         dgram[UDP_HDR_LEN + 2 * UDP_MAX_NACK];
+    int             len = UDP_HDR_LEN;
+    uint16_t        missing;
+
+    put_header(link, dgram, UDP_KIND_NACK, 0);
+
+    for (missing = link->rx_next;
+         missing != seq && len < (int)sizeof(dgram); missing++)
+    {
+        if (link->rx[missing % UDP_WINDOW].len == 0)
+        {
+            put_u16(&dgram[len], missing);
+            len += 2;
+        }
+    }
+
+    link->nacks++;
+    send_dgram(link, dgram, len);
+}
+
+static void receive_reliable(struct udp_link *link, struct xfr_buf *buffer,
+                             uint16_t seq, const uint8_t * pkt, int len)
+{
+    int16_t         ahead = seq - link->rx_next;
+    struct udp_slot *slot;
+
+    link->ack_pending = 1;
+
+    if (ahead < 0)
+    {
+        link->duplicates++;
+        return;
+    }
+
+    if (ahead >= UDP_WINDOW)
+    {
+        link->dropped++;
+        return;
+    }
+
+    if (ahead > 0)
+    {
+        /* keep it until the gap is filled */
+        slot = &link->rx[seq % UDP_WINDOW];
+        if (slot->len)
+        {
+            link->duplicates++;
+            return;
+        }
+
+        slot->seq = seq;
+        slot->len = len;
+        memcpy(slot->data, pkt, len);
+        send_nack(link, seq);
+        return;
+    }
+
+    append_data(buffer, pkt, len);
+    link->rx_next++;
+
+    /* deliver packets that were waiting for this one */
+    for (;;)
+    {
+        slot = &link->rx[link->rx_next % UDP_WINDOW];
+        if (slot->len == 0 || slot->seq != link->rx_next)
+            break;
+
+        append_data(buffer, slot->data, slot->len);
+        slot->len = 0;
+        link->rx_next++;
+    }
+}
+
+/* Process the acknowledgement and the NACK list of a datagram */
+static void receive_ack(struct udp_link *link, uint16_t ack,
+                        const uint8_t * nack, int nack_len)
+{
+    struct udp_slot *slot;
+    uint16_t        seq;
+    int             i;
+
+    if ((uint16_t) (ack - link->tx_acked) <=
+        (uint16_t) (link->tx_seq - link->tx_acked))
+    {
+        while (link->tx_acked != ack)
+            link->tx[link->tx_acked++ % UDP_WINDOW].len = 0;
+    }
+
+    for (i = 0; i + 1 < nack_len; i += 2)
+    {
+        seq = get_u16(&nack[i]);
+        slot = &link->tx[seq % UDP_WINDOW];
+        if (slot->len && slot->seq == seq)
+            retransmit(link, slot);
+    }
+}
+
+void udp_link_input(struct udp_link *link, struct xfr_buf *buffer,
+                    const uint8_t * dgram, int len)
+{
+    const uint8_t  *payload = &dgram[UDP_HDR_LEN];
+    int             payload_len = len - UDP_HDR_LEN;
+    uint32_t        session;
+    uint16_t        seq;
+
+    if (len < UDP_HDR_LEN)
+    {
+        buffer->invalid_pkts++;
+        return;
+    }
+
+    link->received++;
+    link->last_rx = time_ms();
+
+    session = ((uint32_t) get_u16(&dgram[1]) << 16) | get_u16(&dgram[3]);
+    if (!link->have_peer || session != link->peer_session)
+    {
+        if (link->have_peer)
+        {
+            fprintf(stderr, "UDP peer restarted (FD=%d)\n", link->fd);
+            reset_link(link);
+            link->restarts++;
+        }
+
+        link->peer_session = session;
+        link->have_peer = 1;
+    }
+
+    seq = get_u16(&dgram[5]);
+
+    switch (dgram[0])
+    {
+    case UDP_KIND_DATA:
+        receive_ack(link, get_u16(&dgram[7]), NULL, 0);
+        if (link->have_rx_data && (int16_t) (seq - link->rx_data_seq) <= 0)
+        {
+            link->stale++;
+            break;
+        }
+
+        link->rx_data_seq = seq;
+        link->have_rx_data = 1;
+        append_data(buffer, payload, payload_len);
+        break;
+
+    case UDP_KIND_REL:
+        receive_ack(link, get_u16(&dgram[7]), NULL, 0);
+        receive_reliable(link, buffer, seq, payload, payload_len);
+        break;
+
+    case UDP_KIND_ACK:
+        receive_ack(link, get_u16(&dgram[7]), NULL, 0);
+        break;
+
+    case UDP_KIND_NACK:
+        receive_ack(link, get_u16(&dgram[7]), payload, payload_len);
+        break;
+
+    default:
+        buffer->invalid_pkts++;
+    }
+}
+
+int udp_link_recv(struct udp_link *link, struct xfr_buf *buffer)
+{
+    uint8_t         dgram[UDP_MAX_LEN];
+    ssize_t         num;
+    int             count = 0;
+
+    for (;;)
+    {
+        num = read(link->fd, dgram, sizeof(dgram));
+        if (num >= 0)
+        {
+            udp_link_input(link, buffer, dgram, num);
+            count++;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            break;
+        }
+        else if (errno != ECONNREFUSED)
+        {
+            return -1;
+        }
+    }
+
+    if (link->ack_pending)
+        send_ack(link);
+
+    return count;
+}
+
+int udp_link_timer(struct udp_link *link)
+{
+    struct udp_slot *slot;
+    uint64_t        now = time_ms();
+    uint16_t        seq;
+
+    for (seq = link->tx_acked; seq != link->tx_seq; seq++)
+    {
+        slot = &link->tx[seq % UDP_WINDOW];
+        if (slot->len && now - slot->time >= UDP_RTO_MS)
+            retransmit(link, slot);
+    }
+
+    if (link->ack_pending || now - link->last_tx >= UDP_HEARTBEAT_MS)
+        send_ack(link);
+
+    return now - link->last_rx > UDP_TIMEOUT_MS ? -1 : 0;
+}
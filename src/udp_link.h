@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#ifndef __UDP_LINK_H__
+#define __UDP_LINK_H__
+
+#include <stdint.h>
+
+#include "common.h"
+#include "pkt_queue.h"
+
+/**
+ * @file
+ * UDP transport for the control link.
+ *
+ * Each datagram carries one queued packet (which may be a packet followed
+ * by its PKT_TYPE_TSTAMP) behind a 9 byte header:
+ *
+ *     <kind> <session:4> <seq:2> <ack:2>
+ *
+ * with session, seq and ack big endian. The kinds are:
+ *
+ *   UDP_KIND_DATA  Packet that is delivered latest-wins: LCD, keepalive,
+ *                  timestamps. Datagrams older than the newest one
+ *                  received are dropped; nothing is retransmitted.
+ *   UDP_KIND_REL   Packet that is delivered reliably and in order: PTT and
+ *                  the other control packets (buttons, tuning, PWK, ...).
+ *                  Tuning steps are not idempotent, so they are included.
+ *   UDP_KIND_ACK   No payload; sent to acknowledge and as heartbeat.
+ *   UDP_KIND_NACK  Payload is a list of missing reliable sequence numbers,
+ *                  sent as soon as a gap is detected.
+ *
+ * DATA and REL use separate sequence numbers. The ack field of every
+ * datagram is the next reliable sequence number the sender expects, which
+ * acknowledges everything before it. Reliable packets that are neither
+ * acknowledged nor requested by a NACK are retransmitted after UDP_RTO_MS.
+ *
+ * The session is chosen at random when the link is initialized. A new
+ * session from the peer means that it has restarted, so both directions
+ * start over from sequence number 0. It is 32 bits wide so that a restart
+ * practically never keeps the same session.
+ */
+
+#define UDP_HDR_LEN         9
+#define UDP_MAX_LEN         (UDP_HDR_LEN + PKT_QUEUE_PKT_LEN)
+
+#define UDP_KIND_DATA       0x01
+#define UDP_KIND_REL        0x02
+#define UDP_KIND_ACK        0x03
+#define UDP_KIND_NACK       0x04
+
+/* Maximum number of reliable packets in flight */
+#define UDP_WINDOW          32
+
+/* Maximum number of sequence numbers in a NACK */
+#define UDP_MAX_NACK        16
+
+/* udp_link_timer() should be called with this period */
+#define UDP_TICK_MS         50
+
+#define UDP_RTO_MS          200 /* retransmission timeout */
+#define UDP_HEARTBEAT_MS    1000        /* send ACK when idle this long */
+#define UDP_TIMEOUT_MS      5000        /* peer is gone after this long */
+
+struct udp_slot {
+    int             len;        /* 0 if the slot is empty */
+    uint16_t        seq;
+    uint64_t        time;       /* last transmission in ms */
+    uint8_t         data[UDP_MAX_LEN];
+};
+
+/**
+ * UDP link state.
+ *
+ * @fd            Connected UDP socket.
+ * @session       Our session.
+ * @peer_session  Session of the peer; valid if have_peer is set.
+ * @have_peer     Set once a datagram has been received.
+ * @data_seq      Sequence number of the next DATA datagram.
+ * @tx_seq        Sequence number of the next reliable packet.
+ * @tx_acked      Oldest reliable packet not yet acknowledged.
+ * @tx            Reliable packets in flight, indexed by seq % UDP_WINDOW.
+ * @rx_data_seq   Newest DATA sequence number received.
+ * @have_rx_data  Set once a DATA datagram has been received.
+ * @rx_next       Next reliable sequence number to deliver.
+ * @rx            Reliable packets received out of order.
+ * @ack_pending   Set when an ACK should be sent.
+ * @last_rx       Time of the last received datagram in ms.
+ * @last_tx       Time of the last sent datagram in ms.
+ */
+struct udp_link {
+    int             fd;
+    uint32_t        session;
+    uint32_t        peer_session;
+    int             have_peer;
+
+    uint16_t        data_seq;
+    uint16_t        tx_seq;
+    uint16_t        tx_acked;
+    struct udp_slot tx[UDP_WINDOW];
+
+    uint16_t        rx_data_seq;
+    int             have_rx_data;
+    uint16_t        rx_next;
+    struct udp_slot rx[UDP_WINDOW];
+
+    int             ack_pending;
+    uint64_t        last_rx;
+    uint64_t        last_tx;
+
+    /* statistics */
+    uint64_t        sent;       /* packets sent, excluding retransmits */
+    uint64_t        received;   /* datagrams received */
+    uint32_t        retransmits;
+    uint32_t        nacks;      /* NACKs sent */
+    uint32_t        stale;      /* DATA dropped because a newer one arrived */
+    uint32_t        duplicates; /* reliable packets received twice */
+    uint32_t        dropped;    /* packets dropped: window full, too long */
+    uint32_t        restarts;   /* peer session changes */
+};
+
+/** Initialize link on a connected UDP socket. */
+void            udp_link_init(struct udp_link *link, int fd);
+
+/** Check whether a packet type is sent reliably. */
+int             udp_link_reliable(int type);
+
+/**
+ * Send a packet.
+ *
+ * @param  link  The link.
+ * @param  type  The packet type; selects reliable or latest-wins delivery.
+ * @param  pkt   The packet.
+ * @param  len   The length of the packet.
+ * @retval  0    The packet was sent, or will be retransmitted, or was a
+ *               latest-wins packet lost to a full socket buffer.
+ * @retval -1    The packet was dropped or a socket error occurred.
+ */
+int             udp_link_send(struct udp_link *link, int type,
+                              const uint8_t * pkt, int len);
+
+/**
+ * Process a received datagram.
+ *
+ * Packets that can be delivered are appended to buffer, from where they can
+ * be processed with transfer_data() as if they had been read from a stream.
+ */
+void            udp_link_input(struct udp_link *link, struct xfr_buf *buffer,
+                               const uint8_t * dgram, int len);
+
+/**
+ * Read and process all available datagrams.
+ *
+ * @return The number of datagrams received or -1 on a socket error other
+ *         than EAGAIN (errno is set).
+ */
+int             udp_link_recv(struct udp_link *link, struct xfr_buf *buffer);
+
+/**
+ * Retransmit, acknowledge and send heartbeats; call every UDP_TICK_MS.
+ *
+ * @retval  0    OK.
+ * @retval -1    Nothing has been received for UDP_TIMEOUT_MS.
+ */
+int             udp_link_timer(struct udp_link *link);
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "wav.h"
+
+
+static uint16_t get_le16(const uint8_t * p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t * p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void put_le16(uint8_t * p, uint16_t val)
+{
+    p[0] = val & 0xFF;
+    p[1] = val >> 8;
+}
+
+static void put_le32(uint8_t * p, uint32_t val)
+{
+    put_le16(p, val & 0xFFFF);
+    put_le16(p + 2, val >> 16);
+}
+
+int wav_path(const char *path)
+{
+    size_t          len = strlen(path);
+
+    return len > 4 && strcasecmp(path + len - 4, ".wav") == 0;
+}
+
+int wav_read_header(FILE * fp, const char *path, uint32_t * rate,
+                           long *data_len)
+{
+    uint8_t         buf[16];
+    uint32_t        len;
+    int             have_fmt = 0;
+
+    if (fread(buf, 1, 12, fp) != 12 || memcmp(buf, "RIFF", 4) != 0 ||
+        memcmp(buf + 8, "WAVE", 4) != 0)
+    {
+        fprintf(stderr, "%s: Not a WAV file\n", path);
+        return -1;
+    }
+
+    while (fread(buf, 1, 8, fp) == 8)
+    {
+        len = get_le32(buf + 4);
+
+        if (memcmp(buf, "data", 4) == 0)
+        {
+            if (!have_fmt)
+                break;
+
+            /* 0 and 0xFFFFFFFF are used by writers that were not done */
+            if (len != 0 && len != UINT32_MAX)
+                *data_len = len;
+            return 0;
+        }
+
+        if (memcmp(buf, "fmt ", 4) == 0)
+        {
+            if (len < 16 || fread(buf, 1, 16, fp) != 16)
+                break;
+
+            /* PCM, 1 channel, 16 bits per sample */
+            if (get_le16(buf) != 1 || get_le16(buf + 2) != 1 ||
+                get_le16(buf + 14) != 16)
+            {
+                fprintf(stderr, "%s: Only 16 bit mono PCM is supported\n",
+                        path);
+                return -1;
+            }
+
+            *rate = get_le32(buf + 4);
+            have_fmt = 1;
+            len -= 16;
+        }
+
+        /* chunks are padded to an even length */
+        if (fseek(fp, len + (len & 1), SEEK_CUR) == -1)
+            break;
+    }
+
+    fprintf(stderr, "%s: Invalid WAV file\n", path);
+    return -1;
+}
+
+int wav_write_header(FILE * fp, uint32_t rate, uint32_t data_len)
+{
+    uint8_t         hdr[WAV_HEADER_LEN];
+
+    memcpy(hdr, "RIFF", 4);
+    put_le32(hdr + 4, WAV_HEADER_LEN - 8 + data_len);
+    memcpy(hdr + 8, "WAVEfmt ", 8);
+    put_le32(hdr + 16, 16);
+    put_le16(hdr + 20, 1);
+    put_le16(hdr + 22, 1);
+    put_le32(hdr + 24, rate);
+    put_le32(hdr + 28, rate * 2);
+    put_le16(hdr + 32, 2);
+    put_le16(hdr + 34, 16);
+    memcpy(hdr + 36, "data", 4);
+    put_le32(hdr + 40, data_len);
+
+    return fwrite(hdr, 1, WAV_HEADER_LEN, fp) == WAV_HEADER_LEN ? 0 : -1;
+}
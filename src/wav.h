@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2014, Alexandru Csete
+ * All rights reserved.
+ *
+ * This software is licensed under the terms and conditions of the
+ * Simplified BSD License. See license.txt for details.
+ *
+ */
+#ifndef __WAV_H__
+#define __WAV_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * @file
+ * WAV file headers for 16 bit mono PCM, the only format used here.
+ *
+ * Samples follow the header in little endian byte order, which is also the
+ * host byte order on all supported platforms.
+ */
+
+/* Length of the header written by wav_write_header() */
+#define WAV_HEADER_LEN  44
+
+/**
+ * Check whether a path names a WAV file.
+ *
+ * @return 1 if the path ends with .wav (any case), otherwise 0.
+ */
+int             wav_path(const char *path);
+
+/**
+ * Read a WAV header and skip to the samples.
+ *
+ * @param  fp        The file, positioned at the start.
+ * @param  path      File name for error messages.
+ * @param  rate      Set to the sample rate.
+ * @param  data_len  Set to the number of sample bytes; left unchanged if
+ *                   the header does not say, e.g. while it was recorded.
+ * @retval  0        OK; fp is at the first sample.
+ * @retval -1        Not a 16 bit mono PCM WAV file. An error has been
+ *                   printed.
+ */
+int             wav_read_header(FILE * fp, const char *path, uint32_t * rate,
+                                long *data_len);
+
+/**
+ * Write a WAV header.
+ *
+ * @param  fp        The file.
+ * @param  rate      Sample rate.
+ * @param  data_len  Number of sample bytes; use 0 if not known yet and
+ *                   write the header again when the file is complete.
+ * @retval  0        OK.
+ * @retval -1        Write error.
+ */
+int             wav_write_header(FILE * fp, uint32_t rate, uint32_t data_len);
+
+#endif